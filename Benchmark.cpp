@@ -0,0 +1,105 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "Benchmark.h"
+#include "StringFormatter.h"
+#include "DCCEXParser.h"
+#include "RingStream.h"
+#include "Turnouts.h"
+#include "DCC.h"
+
+#if defined(BENCHMARKS)
+// Replies of the commands under test end up here
+class NullPrint : public Print {
+  public:
+    size_t write(uint8_t b) { (void)b; return 1; }
+    size_t write(const uint8_t * buffer, size_t size) { (void)buffer; return size; }
+};
+
+void Benchmark::run(Print * stream) {
+  NullPrint sink;
+  DCCEXParser parser;
+  unsigned long start;
+
+  // A throw of a turnout that does not exist: split, lookup, <X> reply
+  start=micros();
+  for (unsigned int i=0; i<ITERATIONS; i++) {
+    byte command[]="T 32000 1";
+    parser.parse(&sink, command, NULL);
+  }
+  report(stream, F("parse <T>"), ITERATIONS, micros()-start, 0);
+
+  // Turnout lookup across every id in use and the gaps between them
+  int maxId=0;
+  int turnouts=0;
+  for (Turnout * tt=Turnout::firstTurnout; tt; tt=tt->nextTurnout) {
+    if (tt->data.id>maxId) maxId=tt->data.id;
+    turnouts++;
+  }
+  start=micros();
+  for (unsigned int i=0; i<ITERATIONS; i++) Turnout::get(i % (maxId+1));
+  report(stream, F("Turnout::get"), ITERATIONS, micros()-start, turnouts);
+
+  // Loco table lookup, hits for the remembered locos and misses otherwise.
+  // Asking does not add locos to the table.
+  start=micros();
+  for (unsigned int i=0; i<ITERATIONS; i++) DCC::getThrottleSpeed(1+(i % LOCO_TABLE_SIZE));
+  report(stream, F("DCC::getThrottleSpeed"), ITERATIONS, micros()-start, LOCO_TABLE_SIZE);
+
+  // A typical broadcast formatted into nothing
+  start=micros();
+  for (unsigned int i=0; i<ITERATIONS; i++)
+    StringFormatter::send(&sink, F("<l %d %d %d %l>\n"), 1234, 3, 127, 0x1234L);
+  report(stream, F("StringFormatter::send"), ITERATIONS, micros()-start, 0);
+
+  // Reply messages through a ring as the network interfaces use them
+  // RingStream never frees its buffer, so one ring serves every run
+  const int ringSize=256;
+  static RingStream * ring=new RingStream(ringSize);
+  {
+    byte message[24];
+    memset(message, 'x', sizeof(message));
+    start=micros();
+    for (unsigned int i=0; i<ITERATIONS; i++) {
+      ring->mark(1);
+      ring->write(message, sizeof(message));
+      ring->commit();
+      ring->read();  // the target mark
+      int length=ring->count();
+      while (length > 0) {
+        byte * span;
+        int bytes=ring->peekSpan(span);
+        if (bytes > length) bytes=length;
+        ring->consume(bytes);
+        length-=bytes;
+      }
+    }
+    report(stream, F("RingStream message"), ITERATIONS, micros()-start, ringSize);
+  }
+}
+
+void Benchmark::report(Print * stream, const __FlashStringHelper * name, unsigned int ops, unsigned long micros, unsigned int size) {
+  if (micros==0) micros=1;
+  StringFormatter::send(stream, F("<* BENCH %S size=%d ops/s=%l mean=%lus *>\n"),
+    name, size, (unsigned long)ops*1000000UL/micros, micros/ops);
+}
+#else
+void Benchmark::run(Print * stream) {
+  StringFormatter::send(stream, F("Benchmarks not built, define BENCHMARKS\n"));
+}
+#endif
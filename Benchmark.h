@@ -0,0 +1,37 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Benchmark_h
+#define Benchmark_h
+#include <Arduino.h>
+
+// <D BENCH> runs fixed workloads through the hot paths of the loop and
+// reports each as operations per second, so that a change can be measured
+// on the board rather than argued about. Only built with BENCHMARKS
+// defined. Nothing on the layout changes: the commands used only look
+// things up and their replies go to a sink that discards them. The host
+// build has the synthetic workloads and track latencies, host/HostBench.cpp.
+
+class Benchmark {
+  public:
+    static void run(Print * stream);
+  private:
+    static void report(Print * stream, const __FlashStringHelper * name, unsigned int ops, unsigned long micros, unsigned int size);
+    static const unsigned int ITERATIONS=500;
+};
+#endif
@@ -0,0 +1,155 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *  
+ *  This file is part of DCC-EX CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "BinaryProtocol.h"
+
+// Decode the params following the opcode, returns the number of params
+// or -1 if the payload is malformed or has too many.
+int BinaryProtocol::decodeParams(const byte * payload, byte length, int16_t p[], byte maxParams) {
+  byte count=0;
+  byte pos=0;
+  while (pos<length) {
+    if (count==maxParams) return -1;
+    byte b=payload[pos++];
+    if (b<0x80) p[count]=b;
+    else if (b<0xC0) {
+      if (pos+1>length) return -1;
+      p[count]=((b & 0x3F)<<8) | payload[pos++];
+    }
+    else if (b==0xC0) {
+      if (pos+2>length) return -1;
+      p[count]=(payload[pos]<<8) | payload[pos+1];
+      pos+=2;
+    }
+    else return -1;
+    count++;
+  }
+  return count;
+}
+
+// The check byte sent after the length byte and payload
+byte BinaryProtocol::check(const byte * frame, byte length) {
+  byte result=0;
+  for (byte i=0; i<length; i++) result^=frame[i];
+  return result;
+}
+
+byte BinaryProtocol::encodeParam(byte * out, int16_t value) {
+  if (value>=0 && value<=0x7F) {
+    out[0]=value;
+    return 1;
+  }
+  if (value>=0 && value<=0x3FFF) {
+    out[0]=0x80 | highByte(value);
+    out[1]=lowByte(value);
+    return 2;
+  }
+  out[0]=0xC0;
+  out[1]=highByte(value);
+  out[2]=lowByte(value);
+  return 3;
+}
+
+void BinaryReplyStream::begin(Print * stream) {
+  target=stream;
+  state=IDLE;
+  length=0;
+}
+
+void BinaryReplyStream::end() {
+  if (state==COLLECT) flushText();  // incomplete reply, send what we have
+  target=NULL;
+  state=IDLE;
+}
+
+size_t BinaryReplyStream::write(uint8_t b) {
+  if (!target) return 0;
+  switch (state) {
+    case AFTER_FRAME:
+      state=IDLE;
+      if (b=='\n') return 1; // framing makes the newline unnecessary
+      // fall through
+    case IDLE:
+      if (b=='<') {
+        state=COLLECT;
+        length=0;
+        return 1;
+      }
+      return target->write(b);
+    case COLLECT:
+      if (b=='>') {
+        if (sendFrame()) state=AFTER_FRAME;
+        else {
+          flushText();
+          target->write(b);
+          state=IDLE;
+        }
+        return 1;
+      }
+      if (length==MAX_REPLY) {
+        // too long for a frame, let it through as text
+        flushText();
+        state=PASS;
+        return target->write(b);
+      }
+      buffer[length++]=b;
+      return 1;
+    case PASS:
+      if (b=='>') state=IDLE;
+      return target->write(b);
+  }
+  return 0;
+}
+
+void BinaryReplyStream::flushText() {
+  target->write('<');
+  target->write(buffer,length);
+  length=0;
+}
+
+// Send the collected <opcode numbers...> reply as a frame,
+// false if it contains anything other than numbers. 
+bool BinaryReplyStream::sendFrame() {
+  if (length==0) return false;
+  byte frame[1+1+10*3+1];
+  byte frameLength=1;
+  frame[frameLength++]=buffer[0];
+  byte pos=1;
+  while (true) {
+    while (pos<length && (buffer[pos]==' ' || buffer[pos]=='|')) pos++;
+    if (pos==length) break;
+    if (frameLength+3+1 > (byte)sizeof(frame)) return false;
+    bool negative=(buffer[pos]=='-');
+    if (negative) pos++;
+    if (pos==length || buffer[pos]<'0' || buffer[pos]>'9') return false;
+    long value=0;
+    while (pos<length && buffer[pos]>='0' && buffer[pos]<='9') {
+      value=value*10+(buffer[pos++]-'0');
+      if (value>32768) return false;
+    }
+    if (pos<length && buffer[pos]!=' ' && buffer[pos]!='|') return false;
+    if (negative) value=-value;
+    if (value>32767) return false;
+    frameLength+=BinaryProtocol::encodeParam(frame+frameLength,(int16_t)value);
+  }
+  frame[0]=BinaryProtocol::FRAME_FLAG | (frameLength-1);
+  frame[frameLength]=BinaryProtocol::check(frame,frameLength);
+  target->write(frame,frameLength+1);
+  return true;
+}
@@ -0,0 +1,71 @@
+#ifndef BinaryProtocol_h
+#define BinaryProtocol_h
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *  
+ *  This file is part of DCC-EX CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+
+// Compact binary framing of the <...> commands for hosts that send
+// a lot of them. A frame is a length byte with the top bit set (so it can
+// never be confused with text) followed by that many payload bytes and a
+// check byte, the length and payload bytes XORed together:
+//     0x80|length  opcode  param  param ...  check
+// The opcode is the same character as the text command and the params are 
+// the same numbers in the same order, each encoded as
+//     0x00-0x7F              value 0..127
+//     0x80-0xBF  lo          value 0..16383  ((b & 0x3F) << 8 | lo)
+//     0xC0       hi  lo      any int16_t 
+// so <t 1234 64 1> becomes 0x85 't' 0x84 0xD2 0x40 0x01 0xE6.
+// On serial a wrong check byte, or a gap of more than FRAME_TIMEOUT_MS
+// inside a frame, drops it and the bytes after the length are read as
+// text, so a stray byte with the top bit set does not swallow commands.
+// Replies to binary commands are sent in the same format when they 
+// only contain numbers (| counts as a separator), otherwise as text.
+
+class BinaryProtocol {
+  public:
+    static const byte FRAME_FLAG=0x80;
+    static const byte MAX_PAYLOAD=0x7F;
+    static const byte FRAME_TIMEOUT_MS=50;
+    static bool isFrame(byte b) { return b & FRAME_FLAG; }
+    static byte payloadLength(byte b) { return b & MAX_PAYLOAD; }
+    static byte check(const byte * frame, byte length);
+    static int decodeParams(const byte * payload, byte length, int16_t p[], byte maxParams);
+    static byte encodeParam(byte * out, int16_t value);
+};
+
+// Print that turns the text replies written to it into binary frames
+class BinaryReplyStream : public Print {
+  public:
+    void begin(Print * stream);
+    void end();
+    Print * getTarget() { return target; }
+    virtual size_t write(uint8_t b);
+    using Print::write;
+  private:
+    enum REPLY_STATE : byte { IDLE, COLLECT, PASS, AFTER_FRAME };
+    void flushText();
+    bool sendFrame();
+    static const byte MAX_REPLY=32;
+    Print * target=NULL;
+    REPLY_STATE state=IDLE;
+    byte length=0;
+    byte buffer[MAX_REPLY];
+};
+#endif
@@ -0,0 +1,60 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "BoardProfile.h"
+#include "defines.h"
+#include "DCC.h"
+#include "DCCWaveform.h"
+#include "DCCEXParser.h"
+#include "CommandDistributor.h"
+#include "LCDDisplay.h"
+#include "Turnouts.h"
+#include "Sensors.h"
+#include "Outputs.h"
+#include "Consists.h"
+#include "WiThrottle.h"
+#include "StringFormatter.h"
+#include "freeMemory.h"
+
+void BoardProfile::showMemory(Print * stream) {
+  StringFormatter::send(stream, F("<* Memory profile %S free=%d\n"),
+    F(BOARD_PROFILE), minimumFreeMemory());
+  StringFormatter::send(stream, F("DCC locos=%d progQueue=%d accessoryQueue=%d tables=%d\n"),
+    LOCO_TABLE_SIZE, PROG_QUEUE_LENGTH, ACCESSORY_QUEUE_LENGTH, DCC::memoryUsed());
+  StringFormatter::send(stream, F("Waveform packetQueue=%d tracks=%d\n"),
+    PACKET_QUEUE_LENGTH, (int)(2*sizeof(DCCWaveform)));
+  StringFormatter::send(stream, F("Parser buffer=%d serialRing=%d each=%d shared=%d\n"),
+    PARSER_BUFFER_SIZE, SERIAL_RX_RING_SIZE, (int)sizeof(DCCEXParser), DCCEXParser::memoryUsed());
+  StringFormatter::send(stream, F("Distributor=%d\n"), CommandDistributor::memoryUsed());
+  StringFormatter::send(stream, F("Consists=%d each=%d\n"), CONSIST_TABLE_SIZE, (int)sizeof(ConsistData));
+  Turnout::showPool(stream);
+  Sensor::showPool(stream);
+  Output::showPool(stream);
+#if WIFI_ON || ETHERNET_ON
+  WiThrottle::showPool(stream);
+#endif
+  if (DisplayInterface::lcdDisplay)
+    StringFormatter::send(stream, F("LCD rows=%d display=%d\n"), LCD_ROWS, (int)sizeof(LCDDisplay));
+#if WIFI_ON
+  StringFormatter::send(stream, F("Wifi rings=%d+%d\n"), WIFI_INBOUND_RING, WIFI_OUTBOUND_RING);
+#endif
+#if ETHERNET_ON
+  StringFormatter::send(stream, F("Ethernet buffer=%d ring per client=%d\n"), MAX_ETH_BUFFER, OUTBOUND_RING_SIZE);
+#endif
+  StringFormatter::send(stream, F("*>\n"));
+}
@@ -0,0 +1,256 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef BoardProfile_h
+#define BoardProfile_h
+#include <Arduino.h>
+#if __has_include ( "config.h")
+  #include "config.h"
+#endif
+
+// The fixed tables and buffers are sized here together for each board, so
+// that they add up to what the board's RAM can take while leaving room for
+// the turnouts, sensors and outputs created at run time.
+// Any of the settings below may be defined in config.h instead.
+//
+//  LOCO_TABLE_SIZE      locos remembered and reminded (about 24 bytes each)
+//  LOCO_PACKET_CACHE    1 to keep each loco's encoded speed packet (9 more bytes each)
+//  PROG_QUEUE_LENGTH    prog track requests that may wait
+//  PACKET_QUEUE_LENGTH  packets per priority class per track, a power of 2
+//  ACCESSORY_QUEUE_LENGTH accessory commands waiting to be sent (9 bytes each)
+//  SIGNAL_CACHE_LENGTH  signal addresses whose last aspect is kept (3 bytes each)
+//  PARSER_BUFFER_SIZE   longest command accepted by a DCCEXParser
+//  SERIAL_RX_RING_SIZE  bytes of serial input held for the parser, a power of 2,
+//                       or 0 to leave it in the core's serial buffer
+//  LCD_ROWS             rows of text the display engine keeps, at least 8 for a 128x64 OLED
+//  WIFI_INBOUND_RING    bytes of received Wifi data
+//  WIFI_OUTBOUND_RING   bytes of replies waiting for the ES
+//  MAX_ETH_BUFFER       bytes read from an Ethernet client at once
+//  OUTBOUND_RING_SIZE   bytes of replies waiting per Ethernet client
+//  CONSIST_TABLE_SIZE   advanced consists (20 bytes each)
+//  WARM_RESTART_LOCOS   locos kept in EEPROM for a warm restart (8 bytes of EEPROM each)
+//  WITHROTTLE_LOCOS     locos one WiThrottle client may hold (3 bytes each)
+//  TURNOUT_POOL, SENSOR_POOL, OUTPUT_POOL, WITHROTTLE_POOL
+//                       objects in the first chunk of each object pool,
+//                       taken from the heap when the first one is created
+//
+// The Wifi and Ethernet sizes only matter where defines.h allows WIFI_ON
+// and ETHERNET_ON: the Mega, SAMD Zero, Teensy and RP2040. The Uno, Nano 
+// and Uno WiFi Rev2 can't run either interface, so their values are unused.
+// The Mega keeps the Wifi rings it had before the profiles (512+2048). The
+// Ethernet replies used to share one 2048 byte ring and now each client 
+// socket has its own OUTBOUND_RING_SIZE ring, made when the socket is first
+// used. At 512 that is 2048 again for the four sockets of a W5100, less 
+// per client but one busy client can no longer hold up the others.
+
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+  #define BOARD_PROFILE "328 2KB"
+  #define PROFILE_LOCOS 20
+  #define PROFILE_PACKET_CACHE 0
+  #define PROFILE_PROG_QUEUE 2
+  #define PROFILE_PACKET_QUEUE 2
+  #define PROFILE_ACCESSORY_QUEUE 4
+  #define PROFILE_SIGNAL_CACHE 8
+  #define PROFILE_PARSER_BUFFER 50
+  #define PROFILE_SERIAL_RX 0     // no ring, the core's 64 byte buffer is bigger than one it could spare
+  #define PROFILE_LCD_ROWS 8
+  #define PROFILE_WIFI_INBOUND 256
+  #define PROFILE_WIFI_OUTBOUND 512
+  #define PROFILE_ETH_BUFFER 256
+  #define PROFILE_ETH_RING 256
+  #define PROFILE_CONSISTS 2
+  #define PROFILE_WARM_RESTART 0
+  #define PROFILE_WITHROTTLE_LOCOS 4
+  #define PROFILE_TURNOUT_POOL 4
+  #define PROFILE_SENSOR_POOL 8
+  #define PROFILE_OUTPUT_POOL 4
+  #define PROFILE_WITHROTTLE_POOL 1
+#elif defined(ARDUINO_ARCH_SAMD)
+  #define BOARD_PROFILE "SAMD 32KB"
+  #define PROFILE_LOCOS 120
+  #define PROFILE_PACKET_CACHE 1
+  #define PROFILE_PROG_QUEUE 8
+  #define PROFILE_PACKET_QUEUE 8
+  #define PROFILE_ACCESSORY_QUEUE 32
+  #define PROFILE_SIGNAL_CACHE 128
+  #define PROFILE_PARSER_BUFFER 100
+  #define PROFILE_SERIAL_RX 512
+  #define PROFILE_LCD_ROWS 8
+  #define PROFILE_WIFI_INBOUND 1024
+  #define PROFILE_WIFI_OUTBOUND 4096
+  #define PROFILE_ETH_BUFFER 1024
+  #define PROFILE_ETH_RING 1024
+  #define PROFILE_CONSISTS 16
+  #define PROFILE_WARM_RESTART 32
+  #define PROFILE_WITHROTTLE_LOCOS 20
+  #define PROFILE_TURNOUT_POOL 32
+  #define PROFILE_SENSOR_POOL 32
+  #define PROFILE_OUTPUT_POOL 16
+  #define PROFILE_WITHROTTLE_POOL 8
+#elif defined(ARDUINO_ARCH_RP2040)
+  #define BOARD_PROFILE "RP2040 264KB"
+  #define PROFILE_LOCOS 250
+  #define PROFILE_PACKET_CACHE 1
+  #define PROFILE_PROG_QUEUE 8
+  #define PROFILE_PACKET_QUEUE 8
+  #define PROFILE_ACCESSORY_QUEUE 32
+  #define PROFILE_SIGNAL_CACHE 128
+  #define PROFILE_PARSER_BUFFER 100
+  #define PROFILE_SERIAL_RX 1024
+  #define PROFILE_LCD_ROWS 8
+  #define PROFILE_WIFI_INBOUND 2048
+  #define PROFILE_WIFI_OUTBOUND 8192
+  #define PROFILE_ETH_BUFFER 1024
+  #define PROFILE_ETH_RING 2048
+  #define PROFILE_CONSISTS 16
+  #define PROFILE_WARM_RESTART 32
+  #define PROFILE_WITHROTTLE_LOCOS 20
+  #define PROFILE_TURNOUT_POOL 32
+  #define PROFILE_SENSOR_POOL 32
+  #define PROFILE_OUTPUT_POOL 16
+  #define PROFILE_WITHROTTLE_POOL 8
+#elif defined(TEENSYDUINO)
+  #define BOARD_PROFILE "Teensy"
+  #define PROFILE_LOCOS 250
+  #define PROFILE_PACKET_CACHE 1
+  #define PROFILE_PROG_QUEUE 8
+  #define PROFILE_PACKET_QUEUE 8
+  #define PROFILE_ACCESSORY_QUEUE 32
+  #define PROFILE_SIGNAL_CACHE 128
+  #define PROFILE_PARSER_BUFFER 100
+  #define PROFILE_SERIAL_RX 1024
+  #define PROFILE_LCD_ROWS 8
+  #define PROFILE_WIFI_INBOUND 2048
+  #define PROFILE_WIFI_OUTBOUND 8192
+  #define PROFILE_ETH_BUFFER 1024
+  #define PROFILE_ETH_RING 2048
+  #define PROFILE_CONSISTS 16
+  #define PROFILE_WARM_RESTART 32
+  #define PROFILE_WITHROTTLE_LOCOS 20
+  #define PROFILE_TURNOUT_POOL 32
+  #define PROFILE_SENSOR_POOL 32
+  #define PROFILE_OUTPUT_POOL 16
+  #define PROFILE_WITHROTTLE_POOL 8
+#else
+  // Mega 1280/2560 (8KB) and the 6KB megaAVR boards
+  #define BOARD_PROFILE "AVR 6-8KB"
+  #define PROFILE_LOCOS 50
+  #define PROFILE_PACKET_CACHE 1
+  #define PROFILE_PROG_QUEUE 8
+  #define PROFILE_PACKET_QUEUE 4
+  #define PROFILE_ACCESSORY_QUEUE 16
+  #define PROFILE_SIGNAL_CACHE 64
+  #define PROFILE_PARSER_BUFFER 50
+  #define PROFILE_SERIAL_RX 256
+  #define PROFILE_LCD_ROWS 8
+  #define PROFILE_WIFI_INBOUND 512
+  #define PROFILE_WIFI_OUTBOUND 2048
+  #define PROFILE_ETH_BUFFER 512
+  #define PROFILE_ETH_RING 512
+  #define PROFILE_CONSISTS 8
+  #define PROFILE_WARM_RESTART 16
+  #define PROFILE_WITHROTTLE_LOCOS 10
+  #define PROFILE_TURNOUT_POOL 16
+  #define PROFILE_SENSOR_POOL 16
+  #define PROFILE_OUTPUT_POOL 8
+  #define PROFILE_WITHROTTLE_POOL 4
+#endif
+
+#ifndef LOCO_TABLE_SIZE
+  #define LOCO_TABLE_SIZE PROFILE_LOCOS
+#endif
+#ifndef LOCO_PACKET_CACHE
+  #define LOCO_PACKET_CACHE PROFILE_PACKET_CACHE
+#endif
+#ifndef PROG_QUEUE_LENGTH
+  #define PROG_QUEUE_LENGTH PROFILE_PROG_QUEUE
+#endif
+#ifndef PACKET_QUEUE_LENGTH
+  #define PACKET_QUEUE_LENGTH PROFILE_PACKET_QUEUE
+#endif
+#ifndef ACCESSORY_QUEUE_LENGTH
+  #define ACCESSORY_QUEUE_LENGTH PROFILE_ACCESSORY_QUEUE
+#endif
+#ifndef SIGNAL_CACHE_LENGTH
+  #define SIGNAL_CACHE_LENGTH PROFILE_SIGNAL_CACHE
+#endif
+#ifndef PARSER_BUFFER_SIZE
+  #define PARSER_BUFFER_SIZE PROFILE_PARSER_BUFFER
+#endif
+#ifndef SERIAL_RX_RING_SIZE
+  #define SERIAL_RX_RING_SIZE PROFILE_SERIAL_RX
+#endif
+#ifndef LCD_ROWS
+  #define LCD_ROWS PROFILE_LCD_ROWS
+#endif
+#ifndef WIFI_INBOUND_RING
+  #define WIFI_INBOUND_RING PROFILE_WIFI_INBOUND
+#endif
+#ifndef WIFI_OUTBOUND_RING
+  #define WIFI_OUTBOUND_RING PROFILE_WIFI_OUTBOUND
+#endif
+#ifndef MAX_ETH_BUFFER
+  #define MAX_ETH_BUFFER PROFILE_ETH_BUFFER
+#endif
+#ifndef OUTBOUND_RING_SIZE
+  #define OUTBOUND_RING_SIZE PROFILE_ETH_RING
+#endif
+
+#ifndef CONSIST_TABLE_SIZE
+  #define CONSIST_TABLE_SIZE PROFILE_CONSISTS
+#endif
+
+#ifndef WARM_RESTART_LOCOS
+  #define WARM_RESTART_LOCOS PROFILE_WARM_RESTART
+#endif
+
+#ifndef TURNOUT_POOL
+  #define TURNOUT_POOL PROFILE_TURNOUT_POOL
+#endif
+#ifndef SENSOR_POOL
+  #define SENSOR_POOL PROFILE_SENSOR_POOL
+#endif
+#ifndef OUTPUT_POOL
+  #define OUTPUT_POOL PROFILE_OUTPUT_POOL
+#endif
+#ifndef WITHROTTLE_LOCOS
+  #define WITHROTTLE_LOCOS PROFILE_WITHROTTLE_LOCOS
+#endif
+#ifndef WITHROTTLE_POOL
+  #define WITHROTTLE_POOL PROFILE_WITHROTTLE_POOL
+#endif
+
+#if (PACKET_QUEUE_LENGTH & (PACKET_QUEUE_LENGTH-1)) != 0 || PACKET_QUEUE_LENGTH > 128
+  #error PACKET_QUEUE_LENGTH must be a power of 2 up to 128
+#endif
+#if PROG_QUEUE_LENGTH < 1 || PROG_QUEUE_LENGTH > 64
+  #error PROG_QUEUE_LENGTH must be between 1 and 64
+#endif
+#if (SERIAL_RX_RING_SIZE & (SERIAL_RX_RING_SIZE-1)) != 0
+  #error SERIAL_RX_RING_SIZE must be a power of 2
+#endif
+#if PARSER_BUFFER_SIZE > 250
+  #error PARSER_BUFFER_SIZE can not be more than 250
+#endif
+
+class BoardProfile {
+  public:
+    // <D MEMORY>, also printed at startup: the fixed allocations by subsystem
+    static void showMemory(Print * stream);
+};
+#endif
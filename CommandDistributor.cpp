@@ -19,13 +19,373 @@
 #include <Arduino.h>
 #include "CommandDistributor.h"
 #include "WiThrottle.h"
+#include "DCC.h"
+#include "Sensors.h"
+#include "StringFormatter.h"
+#include "DIAG.h"
 
 DCCEXParser * CommandDistributor::parser=0; 
+CommandDistributor::CLIENT CommandDistributor::clients[MAX_CLIENTS];
+byte CommandDistributor::clientCount=0;
+CommandDistributor::EVENT CommandDistributor::events[EVENT_QUEUE_SIZE];
+byte CommandDistributor::eventCount=0;
+byte CommandDistributor::origin=NO_CLIENT;
+BinaryReplyStream CommandDistributor::binaryEvents;
+unsigned long CommandDistributor::lastRecord=0;
+uint16_t CommandDistributor::telemetryWindow=0;
+unsigned long CommandDistributor::windowStart=0;
+#if defined(CORE_SPLIT)
+RingStream * volatile CommandDistributor::inbound=NULL;
+byte CommandDistributor::queuedCommand[QUEUED_COMMAND_MAX+1];
+#endif
 
-void  CommandDistributor::parse(byte clientId,byte * buffer, RingStream * streamer) {
+void  CommandDistributor::parse(byte clientId,byte * buffer, int length, RingStream * streamer) {
+ unsigned long started=micros();
  if (buffer[0] == '<')  {
     if (!parser) parser = new DCCEXParser();
+    addClient(streamer, clientId, CLIENT_DCCEX);
     parser->parse(streamer, buffer, streamer); 
   }
-  else WiThrottle::getThrottle(clientId)->parse(streamer, buffer);
+  else if (BinaryProtocol::isFrame(buffer[0])) {
+    if (!parser) parser = new DCCEXParser();
+    addClient(streamer, clientId, CLIENT_BINARY);
+    parser->parseBinary(streamer, buffer, length, streamer); 
+  }
+  else {
+    addClient(streamer, clientId, CLIENT_WITHROTTLE);
+    WiThrottle * throttle=WiThrottle::getThrottle(clientId);
+    if (throttle) throttle->parse(streamer, buffer);
+  }
+  origin=NO_CLIENT;
+  if (Diag::RECORD) record(clientId, buffer, length, started);
+}
+
+bool CommandDistributor::receive(byte clientId, byte * buffer, int length, RingStream * ring) {
+#if defined(CORE_SPLIT)
+  return queue(QUEUED_COMMAND, clientId, ring, buffer, length);
+#else
+  ring->mark(clientId);
+  parse(clientId, buffer, length, ring);
+  // either writes the length bytes, or rolls back to the mark when the 
+  // reply is empty or did not fit
+  return ring->commit();
+#endif
+}
+
+#if defined(CORE_SPLIT)
+// Network core. The queue has no other writer, so no lock is needed.
+bool CommandDistributor::queue(QUEUED kind, byte clientId, RingStream * ring, const byte * buffer, int length) {
+  if (length>QUEUED_COMMAND_MAX) return false;
+  if (!inbound) inbound=new RingStream(QUEUE_SIZE);
+  if (inbound->freeSpace() < 1+(int)sizeof(ring)+length) return false;
+  inbound->mark(clientId);
+  inbound->write((byte)kind);
+  inbound->write((const byte *)&ring, sizeof(ring));
+  if (length) inbound->write(buffer, length);
+  return inbound->commit();
+}
+
+// Command station core, one queued command or disconnect each loop
+void CommandDistributor::queueLoop() {
+  if (!inbound) return;
+  RingStream * ring;
+  if (inbound->peek(3)==QUEUED_FENCE) {
+    // left queued until the ring has room, the reader is emptying it
+    for (byte i=0; i<sizeof(ring); i++) ((byte *)&ring)[i]=inbound->peek(4+i);
+    if (ring->freeSpace()<2) return;
+  }
+  int clientId=inbound->read();
+  if (clientId<0) return;
+  int length=inbound->count()-1-(int)sizeof(ring);
+  QUEUED kind=(QUEUED)inbound->read();
+  for (byte i=0; i<sizeof(ring); i++) ((byte *)&ring)[i]=inbound->read();
+  for (int i=0; i<length; i++) queuedCommand[i]=inbound->read();
+  queuedCommand[length]='\0';
+  if (kind==QUEUED_FORGET_ALL) forgetClient(ring, -1);
+  else if (kind==QUEUED_FORGET) forgetClient(ring, clientId);
+  else if (kind==QUEUED_FENCE) {
+    ring->mark(FENCE_MARK);
+    ring->write(FENCE_MARK);
+    ring->commit();
+  }
+  else {
+    ring->mark(clientId);
+    parse(clientId, queuedCommand, length, ring);
+    if (!ring->commit()) DIAG(F("CommandDistributor reply to %d dropped"), clientId);
+  }
+}
+#endif
+
+// <* R +ms source us command *> where ms is the time since the previous
+// command, source the client id or S for serial and us how long the
+// command took to handle. Text is escaped, binary frames are in hex.
+// Enough to feed the same traffic back at the same pace and compare,
+// host/HostReplay.cpp does that with the host build.
+void CommandDistributor::record(int source, const byte * buffer, int length, unsigned long started) {
+  Print * stream=StringFormatter::diagSerial;
+  if (!stream) return;
+  unsigned long duration=micros()-started;
+  unsigned long now=millis();
+  StringFormatter::send(stream, F("<* R +%l "), lastRecord ? now-lastRecord : 0L);
+  lastRecord=now;
+  if (source<0) stream->write('S');
+  else StringFormatter::send(stream, F("%d"), source);
+  StringFormatter::send(stream, F(" %lus "), duration);
+  if (BinaryProtocol::isFrame(buffer[0])) {
+    for (int i=0; i<length; i++) StringFormatter::send(stream, F("%x "), buffer[i]);
+  }
+  else {
+    if (source<0) stream->write('<');  // serial commands arrive unwrapped
+    for (int i=0; i<length && buffer[i]; i++) StringFormatter::printEscape(stream, buffer[i]);
+    if (source<0) stream->write('>');
+  }
+  StringFormatter::send(stream, F(" *>\n"));
+}
+
+// A client joins the broadcasts with its first command, and as the 
+// origin of that command it is not sent the changes it caused itself.
+void CommandDistributor::addClient(Print * stream, byte clientId, CLIENT_TYPE type) {
+  origin=findClient(stream, clientId);
+  if (origin==NO_CLIENT) {
+    if (clientCount==MAX_CLIENTS) {
+      DIAG(F("CommandDistributor client %d not subscribed, too many clients"),clientId);
+      return;
+    }
+    origin=clientCount++;
+    clients[origin].stream=stream;
+    clients[origin].clientId=clientId;
+    clients[origin].sensorBitmap=false;
+    clients[origin].telemetryMs=0;
+  }
+  clients[origin].type=type;
+}
+
+void CommandDistributor::subscribe(Print * stream) {
+  if (findClient(stream, 0)==NO_CLIENT) addClient(stream, 0, CLIENT_STREAM);
+  origin=NO_CLIENT;
+}
+
+void CommandDistributor::setOrigin(Print * stream, byte clientId) {
+  origin= stream ? findClient(stream, clientId) : NO_CLIENT;
+}
+
+bool CommandDistributor::getOrigin(Print * & stream, byte & clientId) {
+  if (origin==NO_CLIENT) return false;
+  stream=clients[origin].stream;
+  clientId=clients[origin].clientId;
+  return true;
+}
+
+// A client that has gone since is no longer found, so everyone is told
+void CommandDistributor::broadcastFrom(Print * stream, byte clientId, CHANGE_EVENT type, int16_t id, int16_t value) {
+  byte current=origin;
+  setOrigin(stream, clientId);
+  broadcast(type, id, value);
+  origin=current;
+}
+
+byte CommandDistributor::findClient(Print * stream, byte clientId) {
+  for (byte c=0; c<clientCount; c++) 
+    if (clients[c].stream==stream && clients[c].clientId==clientId) return c;
+  return NO_CLIENT;
+}
+
+void CommandDistributor::forget(RingStream * ring, int clientId) {
+#if defined(CORE_SPLIT)
+  // from a network interface, the client table is on the other core
+  if (!queue(clientId<0 ? QUEUED_FORGET_ALL : QUEUED_FORGET, clientId<0 ? 0 : clientId, ring, NULL, 0))
+    DIAG(F("CommandDistributor disconnect of %d lost"), clientId);
+#else
+  forgetClient(ring, clientId);
+#endif
+}
+
+bool CommandDistributor::fence(RingStream * ring) {
+#if defined(CORE_SPLIT)
+  if (queue(QUEUED_FENCE, 0, ring, NULL, 0)) return true;
+  DIAG(F("CommandDistributor fence lost"));
+#else
+  (void)ring;
+#endif
+  return false;
+}
+
+void CommandDistributor::forgetClient(RingStream * ring, int clientId) {
+  byte c=0;
+  while (c<clientCount) {
+    if (clients[c].stream!=ring || (clientId>=0 && clients[c].clientId!=clientId)) {
+      c++;
+      continue;
+    }
+    // move the last client into the gap, queued events may no longer
+    // refer to either by index so they lose their origin.
+    clients[c]=clients[--clientCount];
+    for (byte e=0; e<eventCount; e++) 
+      if (events[e].origin==c || events[e].origin==clientCount) events[e].origin=NO_CLIENT;
+  }
+  updateTelemetryWindow();
+}
+
+void CommandDistributor::broadcast(CHANGE_EVENT type, int16_t id, int16_t value) {
+  // A later change to the same thing replaces the one still queued,
+  // except for sensors where a client may count every transition. 
+  if (type!=EVENT_SENSOR) {
+    for (byte e=0; e<eventCount; e++) {
+      EVENT * event=&events[e];
+      if (event->type!=type || event->id!=id) continue;
+      if (type==EVENT_FUNCTION && event->value!=value) continue;
+      event->value=value;
+      if (event->origin!=origin) event->origin=NO_CLIENT;
+      return;
+    }
+  }
+  if (eventCount==EVENT_QUEUE_SIZE) {
+    DIAG(F("CommandDistributor event %d %d dropped"),type,id);
+    return;
+  }
+  EVENT * event=&events[eventCount++];
+  event->type=type;
+  event->id=id;
+  event->value=value;
+  event->origin=(type==EVENT_TURNOUT_LIST || type==EVENT_SENSOR_SET) ? NO_CLIENT : origin;
+}
+
+// Push all queued events, one reply per client so Wifi clients
+// get them in a single CIPSEND
+void CommandDistributor::loop() {
+#if defined(CORE_SPLIT)
+  queueLoop();
+#endif
+  WiThrottle::loop(NULL);  // heartbeats and turnout lists still being written
+  telemetryLoop();
+  if (eventCount==0) return;
+  for (byte c=0; c<clientCount; c++) {
+    CLIENT * client=&clients[c];
+    Print * stream=beginSend(client);
+    for (byte e=0; e<eventCount; e++) {
+      if (events[e].origin==c) continue;
+      if (client->type==CLIENT_WITHROTTLE) 
+        WiThrottle::sendEvent(stream, client->clientId, events[e].type, events[e].id, events[e].value);
+      else sendEvent(stream, &events[e], client->sensorBitmap);
+    }
+    endSend(client);
+  }
+  eventCount=0;
+  Sensor::clearChanges();
+}
+
+// Where to write a push to a client, in a message of its ring if it has one
+Print * CommandDistributor::beginSend(CLIENT * client) {
+  Print * stream=client->stream;
+  if (client->type!=CLIENT_STREAM) ((RingStream *)stream)->mark(client->clientId);
+  if (client->type==CLIENT_BINARY) {
+    binaryEvents.begin(stream);
+    stream=&binaryEvents;
+  }
+  return stream;
+}
+
+void CommandDistributor::endSend(CLIENT * client) {
+  if (client->type==CLIENT_BINARY) binaryEvents.end();
+  if (client->type!=CLIENT_STREAM) ((RingStream *)client->stream)->commit();
+}
+
+bool CommandDistributor::setSensorBitmap(bool on) {
+  if (origin==NO_CLIENT) return false;
+  clients[origin].sensorBitmap=on;
+  return true;
+}
+
+bool CommandDistributor::setTelemetry(uint16_t ms) {
+  if (origin==NO_CLIENT || clients[origin].type==CLIENT_WITHROTTLE) return false;
+  if (ms!=0 && ms<TELEMETRY_MIN_MS) ms=TELEMETRY_MIN_MS;
+  clients[origin].telemetryMs=ms;
+  clients[origin].telemetryDue=millis()+ms;
+  updateTelemetryWindow();
+  return true;
+}
+
+void CommandDistributor::updateTelemetryWindow() {
+  uint16_t window=0;
+  for (byte c=0; c<clientCount; c++) {
+    uint16_t ms=clients[c].telemetryMs;
+    if (ms && (window==0 || ms<window)) window=ms;
+  }
+  if (window && !telemetryWindow) windowStart=millis();
+  telemetryWindow=window;
+}
+
+// While anyone is subscribed every loop adds a current sample to each
+// track's window. At the end of each window of the fastest rate, the
+// clients that are due are sent that window. A slower client gets the
+// window that ends after its time, so each record is guaranteed to be
+// no older than the fastest rate, but does not cover all of a slow
+// client's interval.
+void CommandDistributor::telemetryLoop() {
+  if (telemetryWindow==0) return;
+  byte districts=DCCWaveform::getDistrictCount();
+  DCCWaveform::mainTrack.sampleTelemetry();
+  DCCWaveform::progTrack.sampleTelemetry();
+  for (byte d=0; d<districts; d++) DCCWaveform::getDistrict(d)->sampleTelemetry();
+  unsigned long now=millis();
+  if (now-windowStart < telemetryWindow) return;
+  windowStart=now;
+  DCCWaveform::mainTrack.closeTelemetry();
+  DCCWaveform::progTrack.closeTelemetry();
+  for (byte d=0; d<districts; d++) DCCWaveform::getDistrict(d)->closeTelemetry();
+  for (byte c=0; c<clientCount; c++) {
+    CLIENT * client=&clients[c];
+    if (client->telemetryMs==0 || (long)(now-client->telemetryDue) < 0) continue;
+    client->telemetryDue=now+client->telemetryMs;
+    sendTelemetry(beginSend(client), telemetryWindow);
+    endSend(client);
+  }
+}
+
+void CommandDistributor::sendTelemetry(Print * stream, uint16_t ms) {
+  StringFormatter::send(stream, F("<j %d %d %d %d %d %d %d"), ms,
+    DCCWaveform::mainTrack.telemetryMin, DCCWaveform::mainTrack.telemetryAvg, DCCWaveform::mainTrack.telemetryMax,
+    DCCWaveform::progTrack.telemetryMin, DCCWaveform::progTrack.telemetryAvg, DCCWaveform::progTrack.telemetryMax);
+  for (byte d=0; d<DCCWaveform::getDistrictCount(); d++) {
+    DCCDistrict * district=DCCWaveform::getDistrict(d);
+    StringFormatter::send(stream, F(" %d %d %d"), district->telemetryMin, district->telemetryAvg, district->telemetryMax);
+  }
+  StringFormatter::send(stream, F(">\n"));
+}
+
+// DCC-EX format of an event
+void CommandDistributor::sendEvent(Print * stream, EVENT * event, bool sensorBitmap) {
+  switch (event->type) {
+    case EVENT_SPEED:
+    case EVENT_FUNCTION:
+      {
+        int32_t functions=DCC::getFunctionMap(event->id);
+        if (functions<0) break; // loco has been forgotten
+        StringFormatter::send(stream, F("<l %d 0 %d %l>\n"), event->id,
+                              DCC::getThrottleSpeed(event->id) + (DCC::getThrottleDirection(event->id) ? 128 : 0),
+                              functions);
+      }
+      break;
+    case EVENT_TURNOUT:
+      StringFormatter::send(stream, F("<H %d %d>\n"), event->id, event->value);
+      break;
+    case EVENT_SENSOR:
+      StringFormatter::send(stream, F("<%c %d>\n"), event->value ? 'Q' : 'q', event->id);
+      break;
+    case EVENT_SENSOR_SET:
+      Sensor::printChanges(stream, sensorBitmap);
+      break;
+    case EVENT_OUTPUT:
+      StringFormatter::send(stream, F("<Y %d %d>\n"), event->id, event->value);
+      break;
+    case EVENT_POWER:
+      StringFormatter::send(stream, F("<p%d>\n"), event->value);
+      break;
+    case EVENT_TURNOUT_LIST: // DCC-EX clients ask with <T>
+      break;
+  }
+}
+
+int CommandDistributor::memoryUsed() {
+  return sizeof(clients) + sizeof(events);
 }
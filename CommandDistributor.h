@@ -20,13 +20,118 @@
 #define CommandDistributor_h
 #include "DCCEXParser.h"
 #include "RingStream.h"
+#include "BinaryProtocol.h"
+
+// CORE_SPLIT: dual core boards run the network interfaces in loop() on 
+// core 0 and the rest of the command station in loop1() on core 1, with 
+// the DCC waveform interrupt. Commands and disconnects from the network
+// wait in a queue for core 1, replies go back through the interface 
+// rings. Each of those rings is written on one core and read on the 
+// other, which RingStream allows without locks.
+#if defined(ARDUINO_ARCH_RP2040)
+#define CORE_SPLIT
+#endif
+
+// State changes published by DCC, Turnout, Sensor and Output.
+// They are queued and pushed to every subscribed client by loop(),
+// never from inside the publisher, so a client reply that is still
+// being written to a ring can not be interleaved with a broadcast.
+enum CHANGE_EVENT : byte {
+  EVENT_SPEED,     // id=cab
+  EVENT_FUNCTION,  // id=cab, value=function number
+  EVENT_TURNOUT,   // id=turnout, value=thrown
+  EVENT_SENSOR,    // id=sensor, value=active
+  EVENT_SENSOR_SET, // the sensors changed this loop, see Sensor::printChanges
+  EVENT_OUTPUT,    // id=output, value=active
+  EVENT_POWER,     // value=main track power on
+  EVENT_TURNOUT_LIST // turnouts created or removed, sent to the origin too
+};
 
 class CommandDistributor {
 
 public :
-  static void parse(byte clientId,byte* buffer, RingStream * streamer);
+  static void parse(byte clientId,byte* buffer, int length, RingStream * streamer);
+  // A network interface has a command from a client, whose reply goes to 
+  // the ring marked with the client id. False if it was dropped: the reply
+  // did not fit, or with CORE_SPLIT the queue to the other core is full.
+  static bool receive(byte clientId, byte * buffer, int length, RingStream * ring);
+  static void subscribe(Print * stream);   // Serial style stream, gets <...> pushes
+  static void forget(RingStream * ring, int clientId=-1); // client (or all on ring) disconnected
+  // With CORE_SPLIT, replies to commands still queued when a client with a
+  // ring of its own went are written after it has been forgotten. fence()
+  // queues a FENCE_MARK message behind them, the ring's reader drops 
+  // everything up to it. False if none will come, always without CORE_SPLIT.
+  static bool fence(RingStream * ring);
+  static const byte FENCE_MARK=0xFE;
+  static void broadcast(CHANGE_EVENT type, int16_t id, int16_t value=0);
+  static void setOrigin(Print * stream, byte clientId=0); // NULL when command complete 
+  // The client of the command being run, false if none. A change that 
+  // completes later is broadcast from it, so that it is still left out.
+  static bool getOrigin(Print * & stream, byte & clientId);
+  static void broadcastFrom(Print * stream, byte clientId, CHANGE_EVENT type, int16_t id, int16_t value=0);
+  static void loop();
+  // <c MS> current telemetry: the client that sent it gets <j MS min avg max ...>
+  // in mA for main, prog and each district every MS (0 stops, at least 
+  // TELEMETRY_MIN_MS), sent in binary to binary clients like any reply.
+  // Serial (any stream given to subscribe) may subscribe as well. False
+  // for WiThrottle clients, which can't parse the records, and for
+  // streams that are not clients.
+  static bool setTelemetry(uint16_t ms);
+  static bool setSensorBitmap(bool on);  // <Q BITMAP ON/OFF> for the client that sent it
+  static int memoryUsed();  // bytes in the client table and event queue
+  // <D RECORD ON> traffic log, one line per inbound command. source is the
+  // network client id or -1 for serial, started the micros() before parsing.
+  static void record(int source, const byte * buffer, int length, unsigned long started);
 private:
-   static DCCEXParser * parser;
+  enum CLIENT_TYPE : byte { CLIENT_STREAM, CLIENT_DCCEX, CLIENT_BINARY, CLIENT_WITHROTTLE };
+  struct CLIENT {
+    Print * stream;
+    byte clientId;
+    CLIENT_TYPE type;
+    bool sensorBitmap;
+    uint16_t telemetryMs;
+    unsigned long telemetryDue;
+  };
+  struct EVENT {
+    CHANGE_EVENT type;
+    byte origin;     // client index that caused the change, not told again
+    int16_t id;
+    int16_t value;
+  };
+  static const byte MAX_CLIENTS=10;
+  static const byte EVENT_QUEUE_SIZE=8;
+  static const byte NO_CLIENT=0xFF;
+  static byte findClient(Print * stream, byte clientId);
+  static void forgetClient(RingStream * ring, int clientId);
+  static void addClient(Print * stream, byte clientId, CLIENT_TYPE type);
+  static void sendEvent(Print * stream, EVENT * event, bool sensorBitmap);
+  static Print * beginSend(CLIENT * client);
+  static void endSend(CLIENT * client);
+  static void telemetryLoop();
+  static void sendTelemetry(Print * stream, uint16_t ms);
+  static void updateTelemetryWindow();
+  static const uint16_t TELEMETRY_MIN_MS=50;
+  static uint16_t telemetryWindow;   // fastest rate asked for, 0 if none
+  static unsigned long windowStart;
+  static DCCEXParser * parser;
+  static CLIENT clients[MAX_CLIENTS];
+  static byte clientCount;
+  static EVENT events[EVENT_QUEUE_SIZE];
+  static byte eventCount;
+  static byte origin;
+  static BinaryReplyStream binaryEvents;
+  static unsigned long lastRecord;  // millis of the previous recorded command
+#if defined(CORE_SPLIT)
+  // Queued from core 0: the client id as the mark, the kind, the ring for
+  // the reply and the command. One is handled each loop on core 1.
+  enum QUEUED : byte { QUEUED_COMMAND, QUEUED_FORGET, QUEUED_FORGET_ALL, QUEUED_FENCE };
+  static const int QUEUE_SIZE=4096;
+  static const int QUEUED_COMMAND_MAX=1024;
+  static bool queue(QUEUED kind, byte clientId, RingStream * ring, const byte * buffer, int length);
+  static void queueLoop();
+  static RingStream * volatile inbound;  // made by the first network command
+  static byte queuedCommand[QUEUED_COMMAND_MAX+1];
+#endif
 };
 
 #endif
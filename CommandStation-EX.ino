@@ -51,6 +51,11 @@
 // to be issued from the USB serial console.
 DCCEXParser serialParser;
 
+#if defined(CORE_SPLIT)
+// loop1() on core 1 waits for setup() on core 0 to finish
+static volatile bool setupDone=false;
+#endif
+
 void setup()
 {
   // The main sketch has responsibilities during setup()
@@ -58,7 +63,31 @@ void setup()
   // Responsibility 1: Start the usb connection for diagnostics
   // This is normally Serial but uses SerialUSB on a SAMD processor
   Serial.begin(115200);
+  CommandDistributor::subscribe(&Serial); // USB gets state changes from the other clients
    
+  // Responsibility 2: Start the DCC engine.
+  // This comes before the display and the network, whose start up has long
+  // waits, so the track has a signal within milliseconds of a brownout.
+  // Note: this provides DCC with two motor drivers, main and prog, which handle the motor shield(s)
+  // Standard supported devices have pre-configured macros but custome hardware installations require
+  //  detailed pin mappings and may also require modified subclasses of the MotorDriver to implement specialist logic.
+
+  // STANDARD_MOTOR_SHIELD, POLOLU_MOTOR_SHIELD, FIREBOX_MK1, FIREBOX_MK1S are pre defined in MotorShields.h
+
+ 
+  // Optional booster districts driven with the main track signal, see config.example.h.
+  // These must be added before DCC::begin.
+  #if defined(DISTRICT_DRIVERS)
+  {
+    MotorDriver * districtDrivers[]={DISTRICT_DRIVERS};
+    for (MotorDriver * driver : districtDrivers) DCCWaveform::addDistrict(driver);
+  }
+  #endif
+
+  DCC::begin(MOTOR_SHIELD_TYPE); 
+
+  // Responsibility 3: Start the display and the network interfaces.
+  // The waveform runs in interrupt time meanwhile.
   CONDITIONAL_LCD_START {
     // This block is still executed for DIAGS if LCD not in use 
     LCD(0,F("DCC++ EX v%S"),F(VERSION));
@@ -74,19 +103,11 @@ void setup()
 #if ETHERNET_ON
   EthernetInterface::setup();
 #endif // ETHERNET_ON
-
-  // Responsibility 3: Start the DCC engine.
-  // Note: this provides DCC with two motor drivers, main and prog, which handle the motor shield(s)
-  // Standard supported devices have pre-configured macros but custome hardware installations require
-  //  detailed pin mappings and may also require modified subclasses of the MotorDriver to implement specialist logic.
-
-  // STANDARD_MOTOR_SHIELD, POLOLU_MOTOR_SHIELD, FIREBOX_MK1, FIREBOX_MK1S are pre defined in MotorShields.h
-
- 
-  DCC::begin(MOTOR_SHIELD_TYPE); 
          
   #if defined(RMFT_ACTIVE) 
       RMFT::begin();
+  #else
+      Routes::begin();  // myRoutes.h, if there is one
   #endif
 
   #if __has_include ( "mySetup.h")
@@ -101,36 +122,78 @@ void setup()
   #endif
 
   LCD(1,F("Ready")); 
+  BoardProfile::showMemory(&Serial);
+  Watchdog::begin();  // reports a stall that reset the board last time
+#if defined(CORE_SPLIT)
+  setupDone=true;
+#endif
 }
 
+#if defined(CORE_SPLIT)
+// Core 0 only runs the network interfaces. The commands they receive are 
+// queued for loop1() on core 1, which does the rest with the DCC waveform.
 void loop()
 {
+#if WIFI_ON
+  WifiInterface::loop();
+#endif
+#if ETHERNET_ON
+  EthernetInterface::loop();
+#endif
+}
+
+void loop1()
+#else
+void loop()
+#endif
+{
+#if defined(CORE_SPLIT)
+  if (!setupDone) return;
+#endif
   // The main sketch has responsibilities during loop()
+  Watchdog::kick();
+  Profiler::startLoop();
 
   // Responsibility 1: Handle DCC background processes
   //                   (loco reminders and power checks)
   DCC::loop();
+  Profiler::mark(PROFILE_DCC);
 
   // Responsibility 2: handle any incoming commands on USB connection
   serialParser.loop(Serial);
+  Profiler::mark(PROFILE_SERIAL);
 
 // Responsibility 3: Optionally handle any incoming WiFi traffic
-#if WIFI_ON
+// (with CORE_SPLIT on the other core, the commands by CommandDistributor::loop)
+#if WIFI_ON && !defined(CORE_SPLIT)
   WifiInterface::loop();
+  Profiler::mark(PROFILE_WIFI);
 #endif
-#if ETHERNET_ON
+#if ETHERNET_ON && !defined(CORE_SPLIT)
   EthernetInterface::loop();
+  Profiler::mark(PROFILE_ETHERNET);
 #endif
 
 #if defined(RMFT_ACTIVE) 
   RMFT::loop();
+#else
+  Routes::loop();
 #endif
+  Profiler::mark(PROFILE_RMFT);
 
   #if defined(LCN_SERIAL) 
       LCN::loop();
+      Profiler::mark(PROFILE_LCN);
   #endif
 
+  CommandDistributor::loop();
+  Profiler::mark(PROFILE_DISTRIBUTOR);
+
   LCDDisplay::loop();  // ignored if LCD not in use 
+  Profiler::mark(PROFILE_LCD);
+  PWMServoDriver::loop();  // step servos that are moving
+  I2CManager.loop();   // send any queued I2C writes (servos)
+  Profiler::mark(PROFILE_I2C);
   
   // Report any decrease in memory (will automatically trigger on first call)
   static int ramLowWatermark = __INT_MAX__; // replaced on first loop 
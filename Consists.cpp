@@ -0,0 +1,154 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**********************************************************************
+
+Advanced consists are set up with the <C> command:
+
+  <C ID LOCO1 LOCO2 ...>:  makes consist ID (1-127) of up to 8 locos, a negative
+                           loco number means that loco runs reversed.
+                           CV19 of each loco is written on the main track and
+                           any loco no longer in the consist has CV19 cleared.
+                           returns: <O> if successful and <X> if unsuccessful
+  <C ID>:                  deletes consist ID and clears CV19 of its locos
+  <C>:                     lists consists as <C ID LOCO1 LOCO2 ...>
+
+After that <t ID SPEED DIR>, or a throttle for any member loco, drives the
+whole consist. Use <E> to keep the consists in EEPROM. CV19 may also be
+written on the prog track with <W 19 VALUE> before the loco goes on the layout.
+
+**********************************************************************/
+
+#include "Consists.h"
+#include "DCC.h"
+#include "EEStore.h"
+#include "StringFormatter.h"
+
+ConsistData Consist::consists[CONSIST_TABLE_SIZE];
+
+ConsistData * Consist::get(byte id) {
+  if (id==0) return NULL;
+  for (byte i=0; i<CONSIST_TABLE_SIZE; i++)
+    if (consists[i].id==id) return &consists[i];
+  return NULL;
+}
+
+byte Consist::consistOf(int loco, bool & reversed) {
+  for (byte i=0; i<CONSIST_TABLE_SIZE; i++) {
+    ConsistData * c=&consists[i];
+    if (c->id==0) continue;
+    for (byte m=0; m<c->count; m++) {
+      if (abs(c->locos[m])!=loco) continue;
+      reversed= c->locos[m]<0;
+      return c->id;
+    }
+  }
+  return 0;
+}
+
+// Take a loco out of whichever consist it is in, without touching its CV19
+void Consist::detach(int loco) {
+  for (byte i=0; i<CONSIST_TABLE_SIZE; i++) {
+    ConsistData * c=&consists[i];
+    for (byte m=0; m<c->count; m++) {
+      if (abs(c->locos[m])!=loco) continue;
+      c->count--;
+      memmove(c->locos+m, c->locos+m+1, (c->count-m)*sizeof(int16_t));
+      if (c->count==0) c->id=0;
+      return;
+    }
+  }
+}
+
+bool Consist::create(byte id, byte count, const int16_t locos[]) {
+  if (id<1 || id>127 || count==0 || count>MAX_CONSIST_LOCOS) return false;
+  for (byte m=0; m<count; m++) 
+    if (locos[m]==0 || abs(locos[m])>10239 || abs(locos[m])==id) return false;
+
+  ConsistData * c=get(id);
+  if (c) {
+    // members being dropped go back to their own address
+    for (byte m=0; m<c->count; m++) {
+      bool kept=false;
+      for (byte k=0; k<count; k++) kept |= abs(locos[k])==abs(c->locos[m]);
+      if (!kept) DCC::writeCVByteMain(abs(c->locos[m]), 19, 0);
+    }
+    c->id=0;
+  }
+  else {
+    for (c=consists; c<consists+CONSIST_TABLE_SIZE && c->id!=0; c++);
+    if (c==consists+CONSIST_TABLE_SIZE) return false; // table full
+  }
+
+  c->count=0;
+  for (byte m=0; m<count; m++) {
+    int loco=abs(locos[m]);
+    detach(loco); // a loco can only be in one consist
+    // Stop it and drop its own speed reminders, the consist address has them now
+    DCC::forgetLoco(loco);
+    DCC::writeCVByteMain(loco, 19, id | (locos[m]<0 ? 0x80 : 0));
+    c->locos[c->count++]=locos[m];
+  }
+  c->id=id;
+  return true;
+}
+
+bool Consist::remove(byte id) {
+  ConsistData * c=get(id);
+  if (!c) return false;
+  DCC::forgetLoco(id);  // stops the train
+  for (byte m=0; m<c->count; m++) DCC::writeCVByteMain(abs(c->locos[m]), 19, 0);
+  c->id=0;
+  c->count=0;
+  return true;
+}
+
+void Consist::printAll(Print * stream) {
+  for (byte i=0; i<CONSIST_TABLE_SIZE; i++) {
+    ConsistData * c=&consists[i];
+    if (c->id==0) continue;
+    StringFormatter::send(stream, F("<C %d"), c->id);
+    for (byte m=0; m<c->count; m++) StringFormatter::send(stream, F(" %d"), c->locos[m]);
+    StringFormatter::send(stream, F(">\n"));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The decoders keep their own CV19, so loading only restores the table.
+
+void Consist::load() {
+  byte slot=0;
+  for (int i=0; i<EEStore::eeStore->data.nConsists; i++) {
+    ConsistData data;
+    EEPROM.get(EEStore::pointer(), data);
+    EEStore::advance(sizeof(data));
+    if (slot==CONSIST_TABLE_SIZE || data.id==0 || data.count>MAX_CONSIST_LOCOS) continue;
+    consists[slot++]=data;
+  }
+}
+
+void Consist::store() {
+  EEStore::eeStore->data.nConsists=0;
+  for (byte i=0; i<CONSIST_TABLE_SIZE; i++) {
+    if (consists[i].id==0) continue;
+    EEPROM.put(EEStore::pointer(), consists[i]);
+    EEStore::advance(sizeof(consists[i]));
+    EEStore::eeStore->data.nConsists++;
+  }
+}
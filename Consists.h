@@ -0,0 +1,54 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Consists_h
+#define Consists_h
+#include <Arduino.h>
+#include "BoardProfile.h"
+
+// NMRA advanced consists. Each member loco has CV19 set (on the main by POM)
+// to the consist address, with bit 7 set if it runs reversed in the consist.
+// The decoders then take speed and direction from packets to the consist
+// address, so one speed reminder drives every unit in the same packet.
+// Functions still go to each loco's own address.
+//
+// The consist address is a short address (1-127) and has its own entry in
+// the DCC loco table. It must not be the address of a loco on the layout.
+
+struct ConsistData {
+  byte id;         // consist address, 0 when the slot is free
+  byte count;
+  int16_t locos[8];  // negative if the loco is reversed in the consist
+};
+
+class Consist {
+  public:
+    static const byte MAX_CONSIST_LOCOS=sizeof(ConsistData::locos)/sizeof(int16_t);
+    static bool create(byte id, byte count, const int16_t locos[]);
+    static bool remove(byte id);
+    static ConsistData * get(byte id);
+    // Consist address the loco runs in, or 0. reversed is set if it faces backwards.
+    static byte consistOf(int loco, bool & reversed);
+    static void load();
+    static void store();
+    static void printAll(Print * stream);
+  private:
+    static ConsistData consists[CONSIST_TABLE_SIZE];
+    static void detach(int loco);
+};
+#endif
@@ -24,6 +24,8 @@
 #include "GITHUB_SHA.h"
 #include "version.h"
 #include "FSH.h"
+#include "CommandDistributor.h"
+#include "Consists.h"
 
 // This module is responsible for converting API calls into
 // messages to be sent to the waveform generator.
@@ -38,11 +40,17 @@
 //   Obtaining ACKs from the prog track using a function
 //   There are no volatiles here.
 
-const byte FN_GROUP_1=0x01;         
-const byte FN_GROUP_2=0x02;         
-const byte FN_GROUP_3=0x04;         
-const byte FN_GROUP_4=0x08;         
-const byte FN_GROUP_5=0x10;         
+// Function groups 1-5 are F0-F4, F5-F8, F9-F12, F13-F20 and F21-F28,
+// groups 6-10 are F29-F36 ... F61-F68. Group n is bit n-1 of LOCO.groupFlags
+// and LOCO.dirty.
+const byte FN_GROUPS=10;
+const int16_t MAX_STORED_FUNCTION=68;
+const uint16_t SPEED_DIRTY=0x8000;  // with the group bits in LOCO.dirty
+
+// Changed state is sent with this many extra repeats before falling back to background reminders
+const byte DIRTY_REPEATS=2;
+// An emergency stop broadcast is sent this many extra times
+const byte ESTOP_REPEATS=4;
 
 FSH* DCC::shieldName=NULL;
 byte DCC::joinRelay=UNUSED_PIN;
@@ -52,11 +60,12 @@ void DCC::begin(const FSH * motorShieldName, MotorDriver * mainDriver, MotorDriv
   shieldName=(FSH *)motorShieldName;
   StringFormatter::send(Serial,F("<iDCC-EX V-%S / %S / %S G-%S>\n"), F(VERSION), F(ARDUINO_TYPE), shieldName, F(GITHUB_SHA));
 
+  // Signal first, the definitions in EEPROM are not needed to send idles
+  DCCWaveform::begin(mainDriver,progDriver); 
+
   // Load stuff from EEprom
   (void)EEPROM; // tell compiler not to warn this is unused
   EEStore::init();
-
-  DCCWaveform::begin(mainDriver,progDriver); 
 }
 
 void DCC::setJoinRelayPin(byte joinRelayPin) {
@@ -68,18 +77,76 @@ void DCC::setJoinRelayPin(byte joinRelayPin) {
 }
 
 void DCC::setThrottle( uint16_t cab, uint8_t tSpeed, bool tDirection)  {
+  if (cab==0 && (tSpeed & 0x7F)==1) {
+    estopAll();
+    return;
+  }
+  // A loco in an advanced consist only listens to the consist address for speed
+  bool reversed=false;
+  byte consist=Consist::consistOf(cab, reversed);
+  if (consist) {
+    cab=consist;
+    tDirection ^= reversed;
+  }
   byte speedCode = (tSpeed & 0x7F)  + tDirection * 128; 
-  setThrottle2(cab, speedCode);
-  // retain speed for loco reminders
-  updateLocoReminder(cab, speedCode );
+  // A loco with momentum is only given a new target, momentumLoop ramps to it
+  if (cab!=0 && (speedCode & 0x7F)!=1) {
+    int reg=lookupSpeedTable(cab);
+    if (reg>=0 && (speedTable[reg].accel || speedTable[reg].decel)) {
+      speedTable[reg].targetSpeed=speedCode;
+      CommandDistributor::broadcast(EVENT_SPEED, cab);
+      return;
+    }
+  }
+  // retain speed for loco reminders, this also marks it as changed 
+  // Estops, broadcasts and locos not in the table go out at once,
+  // otherwise the reminder scheduler sends the latest speed as soon as the track is free.
+  if (!updateLocoReminder(cab, speedCode ) || (speedCode & 0x7F) == 1) setThrottle2(cab, speedCode);
+  issueReminders();
+  CommandDistributor::broadcast(EVENT_SPEED, cab);
 }
 
-void DCC::setThrottle2( uint16_t cab, byte speedCode)  {
+void DCC::setThrottle2( uint16_t cab, byte speedCode, byte repeats)  {
 
   uint8_t b[4];
-  uint8_t nB = 0;
   // DIAG(F("setSpeedInternal %d %x"),cab,speedCode);
-  
+  uint8_t nB = speedPacket(b, cab, speedCode);
+
+  if ((speedCode & 0x7F) == 1) {
+    // Emergency stop overtakes queued speed packets for this loco (or all of them if broadcast)
+    // so that none of those can restart it afterwards.        
+    DCCWaveform::mainTrack.purgePackets(PRIORITY_SPEED, b, cab==0 ? 0 : (cab > 127 ? 2 : 1));
+    DCCWaveform::mainTrack.schedulePacketWaiting(b, nB, repeats, PRIORITY_ESTOP);
+    return;
+  }
+  // If the queue is full this speed is dropped, the next reminder will carry it. 
+  DCCWaveform::mainTrack.schedulePacket(b, nB, repeats, PRIORITY_SPEED);
+}
+
+// The speed of a loco in the table, as a dirty change or a reminder. It is
+// the same packet every time until the speed changes, so with 
+// LOCO_PACKET_CACHE the encoded bits are kept in the loco's entry.
+void DCC::sendSpeed(int reg, byte repeats) {
+#if LOCO_PACKET_CACHE
+  LOCO & loco = speedTable[reg];
+  if ((loco.speedCode & 0x7F) != 1) {
+    if (loco.cachedSpeed != loco.speedCode) {
+      byte b[4];
+      byte nB = speedPacket(b, loco.loco, loco.speedCode);
+      loco.cachedBitCount = DCCWaveform::encodePacket(loco.cachedBits, b, nB);
+      loco.cachedSpeed = loco.speedCode;
+    }
+    // If the queue is full this speed is dropped, the next reminder will carry it. 
+    DCCWaveform::mainTrack.scheduleEncoded(loco.cachedBits, loco.cachedBitCount, repeats, PRIORITY_SPEED);
+    return;
+  }
+#endif
+  setThrottle2(speedTable[reg].loco, speedTable[reg].speedCode, repeats);
+}
+
+// Builds the speed packet for a speedCode, returns its length
+byte DCC::speedPacket(byte b[4], uint16_t cab, byte speedCode) {
+  byte nB = 0;
   if (cab > 127)
     b[nB++] = highByte(cab) | 0xC0;    // convert train number into a two-byte address
   b[nB++] = lowByte(cab);
@@ -111,11 +178,99 @@ void DCC::setThrottle2( uint16_t cab, byte speedCode)  {
     b[nB++] = speedCode; // for encoding see setThrottle
 
   }
+  return nB;
+}
+
+// The cached speed packets are in the old mode until thrown away
+void DCC::setGlobalSpeedsteps(byte s) {
+  globalSpeedsteps = s;
+#if LOCO_PACKET_CACHE
+  for (int reg = 0; reg < locoCount; reg++) speedTable[reg].cachedSpeed = 1;
+#endif
+}
+
+bool DCC::setMomentum(int cab, byte accel, byte decel, byte vmax) {
+  int reg=lookupSpeedTable(cab);
+  if (reg<0 || vmax<2 || vmax>127) return false;
+  speedTable[reg].accel=accel;
+  speedTable[reg].decel=decel;
+  speedTable[reg].vmax= vmax==127 ? 0 : vmax;
+  return true;
+}
+
+// The speedCode sent for a throttle speedCode, with full throttle at VMAX
+byte DCC::scaledSpeed(const LOCO & loco, byte speedCode) {
+  byte speed128 = speedCode & 0x7F;
+  if (!loco.vmax || speed128 < 2) return speedCode;
+  return (speedCode & 0x80) | (2+(int)(speed128-2)*(loco.vmax-2)/125);
+}
+
+// The speed step a speedCode is sent as, so that a ramp in 28 step mode
+// only makes a packet when the decoder would see a change
+byte DCC::sentStep(byte speedCode) {
+  byte speed128 = speedCode & 0x7F;
+  if (globalSpeedsteps > 28 || speed128 < 2) return speedCode;
+  return (speedCode & 0x80) | ((speed128*10+36)/46);
+}
+
+// Every MOMENTUM_MS each loco not at its target moves one step of its ramp
+void DCC::momentumLoop() {
+  if (millis() - lastMomentum < MOMENTUM_MS) return;
+  lastMomentum = millis();
+  for (int reg = 0; reg < locoCount; reg++)
+    if (speedTable[reg].speedCode != scaledSpeed(speedTable[reg], speedTable[reg].targetSpeed)) rampSpeed(reg);
+}
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 0);
+void DCC::rampSpeed(int reg) {
+  LOCO & loco = speedTable[reg];
+  byte current = loco.speedCode & 0x7F;
+  if (current == 1) current = 0;  // estop released by a new target
+  byte target = scaledSpeed(loco, loco.targetSpeed) & 0x7F;
+  byte direction = loco.speedCode & 0x80;
+  if ((loco.speedCode ^ loco.targetSpeed) & 0x80) {
+    if (current == 0) direction = loco.targetSpeed & 0x80;
+    else target = 0;              // stop before changing direction
+  }
+  bool up = target > current;
+  byte rate = up ? loco.accel : loco.decel;
+  byte next = target;
+  if (rate) {
+    // rate/10 seconds for 126 steps, the part step left over is carried to the next tick
+    unsigned int msPerRamp = rate * 100U;
+    unsigned long credit = loco.momentumCredit + MOMENTUM_MS * 126UL;
+    byte step = credit / msPerRamp > 126 ? 126 : credit / msPerRamp;
+    loco.momentumCredit = credit % msPerRamp;
+    if (step == 0) return;
+    if (up) {
+      if (current < 1) current = 1;  // the first step up is speed 2
+      next = (target - current > step) ? current + step : target;
+    }
+    else {
+      next = (current - target > step) ? current - step : target;
+      if (next < 2) next = 0;
+    }
+  }
+  byte speedCode = direction | next;
+  bool changed = sentStep(speedCode) != sentStep(loco.speedCode);
+  loco.speedCode = speedCode;
+  if (changed) {
+    loco.dirty |= SPEED_DIRTY;
+    anyDirty = true;
+  }
 }
 
-void DCC::setFunctionInternal(int cab, byte byte1, byte byte2) {
+// Emergency stop all locos. The broadcast goes ahead of everything queued 
+// and of the repeats of the packet being sent, and is itself sent ESTOP_REPEATS 
+// more times. Queued speeds and reminders are dropped so that none of them can
+// restart a loco, and every reminder now carries the estop.
+void DCC::estopAll() {
+  updateLocoReminder(0, 1);
+  DCCWaveform::mainTrack.purgePackets(PRIORITY_REMINDER, NULL, 0);
+  setThrottle2(0, 1, ESTOP_REPEATS);  // also purges queued speeds
+  CommandDistributor::broadcast(EVENT_SPEED, 0);
+}
+
+void DCC::setFunctionInternal(int cab, byte byte1, byte byte2, byte repeats, PACKET_PRIORITY priority) {
   // DIAG(F("setFunctionInternal %d %x %x"),cab,byte1,byte2);
   byte b[4];
   byte nB = 0;
@@ -126,26 +281,33 @@ void DCC::setFunctionInternal(int cab, byte byte1, byte byte2) {
   if (byte1!=0) b[nB++] = byte1;
   b[nB++] = byte2;
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 0);
+  DCCWaveform::mainTrack.schedulePacket(b, nB, repeats, priority);
 }
 
+// The speed the throttle set, which a loco with momentum may still be ramping to
 uint8_t DCC::getThrottleSpeed(int cab) {
-  int reg=lookupSpeedTable(cab);
-  if (reg<0) return -1;
-  return speedTable[reg].speedCode & 0x7F;
+  bool reversed;
+  byte consist=Consist::consistOf(cab, reversed);
+  if (consist) cab=consist;
+  int reg=findSpeedTable(cab);
+  if (reg<0) return 0;  // as a new entry would be
+  return speedTable[reg].targetSpeed & 0x7F;
 }
 
 bool DCC::getThrottleDirection(int cab) {
-  int reg=lookupSpeedTable(cab);
-  if (reg<0) return false ;
-  return (speedTable[reg].speedCode & 0x80) !=0;
+  bool reversed=false;
+  byte consist=Consist::consistOf(cab, reversed);
+  if (consist) cab=consist;
+  int reg=findSpeedTable(cab);
+  if (reg<0) return !reversed;  // forward, as a new entry would be
+  return ((speedTable[reg].targetSpeed & 0x80) !=0) ^ reversed;
 }
 
 // Set function to value on or off
 void DCC::setFn( int cab, int16_t functionNumber, bool on) {
-  if (cab<=0 ) return;
+  if (cab<=0 || functionNumber<0) return;
   
-  if (functionNumber>28) { 
+  if (functionNumber>MAX_STORED_FUNCTION) { 
     //non reminding advanced binary bit set 
     byte b[5];
     byte nB = 0;
@@ -161,22 +323,23 @@ void DCC::setFn( int cab, int16_t functionNumber, bool on) {
        b[nB++] = (functionNumber & 0x7F) | (on ? 0x80 : 0);  // low order bits and state flag
        b[nB++] = functionNumber >>7 ;  // high order bits
     }
-    DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+    schedule(b, nB, 4);
     return;
   }
   
   int reg = lookupSpeedTable(cab);
   if (reg<0) return;  
 
-  // Take care of functions:
-  // Set state of function
-  unsigned long funcmask = (1UL<<functionNumber);
-  if (on) {
-      speedTable[reg].functions |= funcmask;
-  } else {
-      speedTable[reg].functions &= ~funcmask;
-  }
+  // A throttle repeating a function that is already in that state costs no packet,
+  // unless the group has never been sent
+  uint16_t groupMask = 1 << (functionGroup(functionNumber)-1);
+  if ((speedTable[reg].groupFlags & groupMask) && getFunctionBit(reg, functionNumber)==on) return;
+  setFunctionBit(reg, functionNumber, on);
   updateGroupflags(speedTable[reg].groupFlags, functionNumber);
+  updateGroupflags(speedTable[reg].dirty, functionNumber);
+  anyDirty=true;
+  issueReminders();
+  CommandDistributor::broadcast(EVENT_FUNCTION, cab, functionNumber);
   return;
 }
 
@@ -185,67 +348,235 @@ void DCC::setFn( int cab, int16_t functionNumber, bool on) {
 // Returns new state or -1 if nothing was changed.
 int DCC::changeFn( int cab, int16_t functionNumber, bool pressed) {
   int funcstate = -1;
-  if (cab<=0 || functionNumber>28) return funcstate;
+  if (cab<=0 || functionNumber<0 || functionNumber>MAX_STORED_FUNCTION) return funcstate;
   int reg = lookupSpeedTable(cab);
   if (reg<0) return funcstate;  
 
   // Take care of functions:
   // Imitate how many command stations do it: Button press is
   // toggle but for F2 where it is momentary
-  unsigned long funcmask = (1UL<<functionNumber);
   if (functionNumber == 2) {
       // turn on F2 on press and off again at release of button
-      if (pressed) {
-	  speedTable[reg].functions |= funcmask;
-	  funcstate = 1;
-      } else {
-	  speedTable[reg].functions &= ~funcmask;
-	  funcstate = 0;
-      }
+      funcstate = pressed;
   } else {
       // toggle function on press, ignore release
-      if (pressed) {
-        speedTable[reg].functions ^= funcmask;
-      }
-      funcstate = (speedTable[reg].functions & funcmask)? 1 : 0;
+      funcstate = getFunctionBit(reg, functionNumber) ^ pressed;
   }
+  setFunctionBit(reg, functionNumber, funcstate);
   updateGroupflags(speedTable[reg].groupFlags, functionNumber);
+  if (pressed || functionNumber == 2) {
+    updateGroupflags(speedTable[reg].dirty, functionNumber);
+    anyDirty=true;
+    issueReminders();
+    CommandDistributor::broadcast(EVENT_FUNCTION, cab, functionNumber);
+  }
   return funcstate;
 }
 
 int DCC::getFn( int cab, int16_t functionNumber) {
-  if (cab<=0 || functionNumber>28) return -1;  // unknown
-  int reg = lookupSpeedTable(cab);
-  if (reg<0) return -1;  
+  if (cab<=0 || functionNumber<0 || functionNumber>MAX_STORED_FUNCTION) return -1;  // unknown
+  int reg = findSpeedTable(cab);
+  if (reg<0) return 0;  // all off for a loco not in the table
+
+  return getFunctionBit(reg, functionNumber);
+}
 
-  unsigned long funcmask = (1UL<<functionNumber);
-  return  (speedTable[reg].functions & funcmask)? 1 : 0;
+bool DCC::getFunctionBit(int reg, int16_t functionNumber) {
+  if (functionNumber<=28) return bitRead(speedTable[reg].functions, functionNumber);
+  functionNumber-=29;
+  return bitRead(speedTable[reg].extFunctions[functionNumber/8], functionNumber%8);
+}
+
+void DCC::setFunctionBit(int reg, int16_t functionNumber, bool on) {
+  if (functionNumber<=28) {
+    unsigned long funcmask = (1UL<<functionNumber);
+    if (on) speedTable[reg].functions |= funcmask;
+    else speedTable[reg].functions &= ~funcmask;
+    return;
+  }
+  functionNumber-=29;
+  byte funcmask = 1 << (functionNumber%8);
+  if (on) speedTable[reg].extFunctions[functionNumber/8] |= funcmask;
+  else speedTable[reg].extFunctions[functionNumber/8] &= ~funcmask;
+}
+
+// Returns the F0-F28 function bits of a loco or -1 if it is not in the table
+int32_t DCC::getFunctionMap(int cab) {
+  int reg = findSpeedTable(cab);
+  if (reg<0) return -1;
+  return speedTable[reg].functions;
 }
 
 // Set the group flag to say we have touched the particular group.
 // A group will be reminded only if it has been touched.  
-void DCC::updateGroupflags(byte & flags, int16_t functionNumber) {
-  byte groupMask;
-  if (functionNumber<=4)       groupMask=FN_GROUP_1;
-  else if (functionNumber<=8)  groupMask=FN_GROUP_2;
-  else if (functionNumber<=12) groupMask=FN_GROUP_3;
-  else if (functionNumber<=20) groupMask=FN_GROUP_4;
-  else                         groupMask=FN_GROUP_5;
-  flags |= groupMask; 
+void DCC::updateGroupflags(uint16_t & flags, int16_t functionNumber) {
+  flags |= 1 << (functionGroup(functionNumber)-1); 
 }
 
+byte DCC::functionGroup(int16_t functionNumber) {
+  if (functionNumber<=4)  return 1;
+  if (functionNumber<=8)  return 2;
+  if (functionNumber<=12) return 3;
+  if (functionNumber<=20) return 4;
+  if (functionNumber<=28) return 5;
+  return 6 + (functionNumber-29)/8;
+}
+
+// Accessory commands wait in accessoryQueue and are sent from the loop, one at 
+// a time when no other function class packet is waiting, so a burst of them 
+// interleaves with loco traffic instead of filling the track queue. A command
+// for an address and number still waiting replaces the earlier one.
+// With ACCESSORY_PULSE_MS set each output is switched off again after that time.
 void DCC::setAccessory(int address, byte number, bool activate) {
   // use masks to detect wrong values and do nothing
   if(address != (address & 511))
     return;
   if(number != (number & 3))
     return;
-  byte b[2];
 
+  ACCESSORY_COMMAND * free=NULL;
+  for (byte i=0; i<ACCESSORY_QUEUE_SIZE; i++) {
+    ACCESSORY_COMMAND * a=&accessoryQueue[i];
+    if ((a->flags & (ACCESSORY_ON | ACCESSORY_OFF))==0) {
+      if (!free) free=a;
+      continue;
+    }
+    if (a->address==address && a->number==number && (a->flags & ACCESSORY_EXTENDED)==0) {
+      a->output=activate;
+      a->flags |= ACCESSORY_ON;
+      return;
+    }
+  }
+  if (!free) {
+#if ACCESSORY_PULSE_MS > 0
+    // queue full, make room by switching off the output due off first
+    for (byte i=0; i<ACCESSORY_QUEUE_SIZE; i++) {
+      ACCESSORY_COMMAND * a=&accessoryQueue[i];
+      if ((a->flags & (ACCESSORY_ON | ACCESSORY_OFF))!=ACCESSORY_OFF) continue;
+      if (!free || (long)(a->offTime - free->offTime) < 0) free=a;
+    }
+    if (free) sendAccessory(free->address, free->number, (free->flags & ACCESSORY_OFF_OUTPUT)!=0, false);
+    else {
+      // every entry is still to be sent, so this one goes the old way with 
+      // its off straight after rather than never
+      sendAccessory(address, number, activate, true);
+      sendAccessory(address, number, activate, false);
+      return;
+    }
+#else
+    // queue full, send it the old way
+    sendAccessory(address, number, activate, true);
+    return;
+#endif
+  }
+  free->address=address;
+  free->number=number;
+  free->output=activate;
+  free->flags=ACCESSORY_ON;
+}
+
+// Extended accessory (signal) aspect for a linear output address 1-2044,
+// numbered as <a LINEARADDRESS>. The last aspect of each address is cached
+// and an aspect the signal already shows is not sent again.
+// Returns false for an invalid address.
+bool DCC::setExtendedAccessory(int address, byte aspect) {
+  if (address<1 || address>2044) return false;
+  SIGNAL_ASPECT * cached=NULL;
+  for (byte i=0; i<aspectCount; i++) 
+    if (aspectCache[i].address==address) cached=&aspectCache[i];
+  if (cached) {
+    if (cached->aspect==aspect) return true;
+  }
+  else if (aspectCount<SIGNAL_CACHE_SIZE) cached=&aspectCache[aspectCount++];
+  else {
+    // full, take over the entries in turn
+    cached=&aspectCache[nextAspect];
+    nextAspect=(nextAspect+1) % SIGNAL_CACHE_SIZE;
+  }
+  cached->address=address;
+  cached->aspect=aspect;
+  queueExtendedAccessory(address, aspect);
+  return true;
+}
+
+// Send all cached aspects again, as after the track power was off
+void DCC::resendAspects() {
+  for (byte i=0; i<aspectCount; i++) 
+    queueExtendedAccessory(aspectCache[i].address, aspectCache[i].aspect);
+}
+
+void DCC::queueExtendedAccessory(int address, byte aspect) {
+  ACCESSORY_COMMAND * free=NULL;
+  for (byte i=0; i<ACCESSORY_QUEUE_SIZE; i++) {
+    ACCESSORY_COMMAND * a=&accessoryQueue[i];
+    if ((a->flags & (ACCESSORY_ON | ACCESSORY_OFF))==0) {
+      if (!free) free=a;
+      continue;
+    }
+    if (a->address==address && (a->flags & ACCESSORY_EXTENDED)) {
+      a->output=aspect;  // not sent yet, only the latest aspect matters
+      return;
+    }
+  }
+  if (!free) {
+    sendExtendedAccessory(address, aspect);
+    return;
+  }
+  free->address=address;
+  free->number=0;
+  free->output=aspect;
+  free->flags=ACCESSORY_ON | ACCESSORY_EXTENDED;
+}
+
+void DCC::sendExtendedAccessory(int address, byte aspect) {
+  address+=3;  // linear address 1 is output address 4, as for basic accessories
+  byte b[3];
+  b[0] = 0x80 | ((address >> 2) & 0x3F);                                  // 10AAAAAA, address bits 7-2
+  b[1] = 0x01 | (((~address >> 8) & 0x07) << 4) | ((address & 0x03) << 1); // 0AAA0AA1, bits 10-8 inverted, bits 1-0
+  b[2] = aspect;
+  schedule(b, 3, 4);
+}
+
+void DCC::sendAccessory(int address, byte number, bool output, bool on) {
+  byte b[2];
   b[0] = address % 64 + 128;                                     // first byte is of the form 10AAAAAA, where AAAAAA represent 6 least signifcant bits of accessory address
-  b[1] = ((((address / 64) % 8) << 4) + (number % 4 << 1) + activate % 2) ^ 0xF8; // second byte is of the form 1AAACDDD, where C should be 1, and the least significant D represent activate/deactivate
+  b[1] = ((((address / 64) % 8) << 4) + (on << 3) + (number % 4 << 1) + output % 2) ^ 0xF0; // second byte is of the form 1AAACDDD, where C is 1 to activate, 0 to deactivate, and the least significant D selects the output
+  schedule(b, 2, 4);      // Repeat the packet four times
+}
 
-  DCCWaveform::mainTrack.schedulePacket(b, 2, 4);      // Repeat the packet four times
+// Send one waiting accessory packet, offs that are due before new commands
+void DCC::accessoryLoop() {
+  if (!DCCWaveform::mainTrack.isQueueEmpty(PRIORITY_FUNCTION)) return;
+  ACCESSORY_COMMAND * next=NULL;
+  for (byte n=0; n<ACCESSORY_QUEUE_SIZE; n++) {
+    ACCESSORY_COMMAND * a=&accessoryQueue[(nextAccessory+n) % ACCESSORY_QUEUE_SIZE];
+    if ((a->flags & ACCESSORY_OFF) && (long)(millis() - a->offTime) >= 0) {
+      a->flags &= ~ACCESSORY_OFF;
+      sendAccessory(a->address, a->number, (a->flags & ACCESSORY_OFF_OUTPUT)!=0, false);
+      return;
+    }
+    if (!next && (a->flags & ACCESSORY_ON)) next=a;
+  }
+  if (!next) return;
+  if (next->flags & ACCESSORY_EXTENDED) {
+    next->flags=0;
+    sendExtendedAccessory(next->address, next->output);
+    nextAccessory=(next-accessoryQueue+1) % ACCESSORY_QUEUE_SIZE;
+    return;
+  }
+  // An output of the same pair still on is switched off first
+  if ((next->flags & ACCESSORY_OFF) && ((next->flags & ACCESSORY_OFF_OUTPUT)!=0) != next->output) {
+    next->flags &= ~ACCESSORY_OFF;
+    sendAccessory(next->address, next->number, !next->output, false);
+    return;
+  }
+  next->flags &= ~(ACCESSORY_ON | ACCESSORY_OFF | ACCESSORY_OFF_OUTPUT);
+  sendAccessory(next->address, next->number, next->output, true);
+#if ACCESSORY_PULSE_MS > 0
+  next->offTime=millis()+ACCESSORY_PULSE_MS;
+  next->flags |= ACCESSORY_OFF | (next->output ? ACCESSORY_OFF_OUTPUT : 0);
+#endif
+  nextAccessory=(next-accessoryQueue+1) % ACCESSORY_QUEUE_SIZE;  // round robin
 }
 
 //
@@ -263,7 +594,7 @@ void DCC::writeCVByteMain(int cab, int cv, byte bValue)  {
   b[nB++] = cv2(cv);
   b[nB++] = bValue;
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+  schedule(b, nB, 4);
 }
 
 //
@@ -284,7 +615,13 @@ void DCC::writeCVBitMain(int cab, int cv, byte bNum, bool bValue)  {
   b[nB++] = cv2(cv);
   b[nB++] = WRITE_BIT | (bValue ? BIT_ON : BIT_OFF) | bNum;
 
-  DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+  schedule(b, nB, 4);
+}
+
+// Packets without a reminder behind them must not be lost, so 
+// these wait for a slot. That only happens when a burst has filled the queue.
+void DCC::schedule(const byte b[], byte nB, byte repeats) {
+  DCCWaveform::mainTrack.schedulePacketWaiting(b, nB, repeats, PRIORITY_FUNCTION);
 }
 
 void DCC::setProgTrackSyncMain(bool on) {
@@ -299,6 +636,12 @@ FSH* DCC::getMotorShieldName() {
   return shieldName;
 }
   
+// Used for requests which fail validation, so that their callback
+// still comes in queue order.
+const ackOp FLASH FAIL_PROG[] = {
+     FAIL
+};
+
 const ackOp FLASH WRITE_BIT0_PROG[] = {
      BASELINE,
      W0,WACK,
@@ -356,19 +699,20 @@ const ackOp FLASH VERIFY_BYTE_PROG[] = {
       // each bit is validated against 0 and the result inverted in MERGE
       // this is because there tend to be more zeros in cv values than ones.  
       // There is no need for one validation as entire byte is validated at the end
-      V0, WACK, MERGE,        // read and merge first tested bit (7)
+      // HINTSKIP takes the bit from the expected value if the caller said it was known.
+      HINTSKIP, V0, WACK, MERGE,        // read and merge first tested bit (7)
       ITSKIP,                 // do small excursion if there was no ack
         SETBIT,(ackOp)7,
         V1, WACK, NAKFAIL,    // test if there is an ack on the inverse of this bit (7)
         SETBIT,(ackOp)6,      // and abort whole test if not else continue with bit (6)
       SKIPTARGET,
-      V0, WACK, MERGE,        // read and merge second tested bit (6)
-      V0, WACK, MERGE,        // read and merge third  tested bit (5) ...
-      V0, WACK, MERGE,
-      V0, WACK, MERGE,
-      V0, WACK, MERGE,
-      V0, WACK, MERGE,
-      V0, WACK, MERGE,
+      HINTSKIP, V0, WACK, MERGE,        // read and merge second tested bit (6)
+      HINTSKIP, V0, WACK, MERGE,        // read and merge third  tested bit (5) ...
+      HINTSKIP, V0, WACK, MERGE,
+      HINTSKIP, V0, WACK, MERGE,
+      HINTSKIP, V0, WACK, MERGE,
+      HINTSKIP, V0, WACK, MERGE,
+      HINTSKIP, V0, WACK, MERGE,
       VB, WACK, ITCB,  // verify merged byte and return it if acked ok 
       FAIL };
       
@@ -505,56 +849,129 @@ const ackOp FLASH LONG_LOCO_ID_PROG[] = {
 
 void  DCC::writeCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback)  {
   ackManagerSetup(cv, byteValue,  WRITE_BYTE_PROG, callback);
+  updateCvCache(cv, byteValue);  // only a guess for the next read, which verifies it
 }
 
 void DCC::writeCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback)  {
-  if (bitNum >= 8) callback(-1);
-  else ackManagerSetup(cv, bitNum, bitValue?WRITE_BIT1_PROG:WRITE_BIT0_PROG, callback);
+  if (bitNum >= 8) ackManagerSetup(cv, 0, FAIL_PROG, callback);
+  else {
+    ackManagerSetup(cv, bitNum, bitValue?WRITE_BIT1_PROG:WRITE_BIT0_PROG, callback);
+    updateCvCacheBit(cv, bitNum, bitValue);
+  }
 }
 
-void  DCC::verifyCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback)  {
-  ackManagerSetup(cv, byteValue,  VERIFY_BYTE_PROG, callback);
+// Verify the expected value first, only if that fails read the CV bit by bit.
+// Bits set in knownBits are taken from byteValue without being read.
+// The merged result is always verified as a whole.
+void  DCC::verifyCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback, byte knownBits)  {
+  ackManagerSetup(cv, byteValue,  VERIFY_BYTE_PROG, callback, knownBits);
 }
 
 void DCC::verifyCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback)  {
-  if (bitNum >= 8) callback(-1);
+  if (bitNum >= 8) ackManagerSetup(cv, 0, FAIL_PROG, callback);
   else ackManagerSetup(cv, bitNum, bitValue?VERIFY_BIT1_PROG:VERIFY_BIT0_PROG, callback);
 }
 
 
 void DCC::readCVBit(int16_t cv, byte bitNum, ACK_CALLBACK callback)  {
-  if (bitNum >= 8) callback(-1);
+  if (bitNum >= 8) ackManagerSetup(cv, 0, FAIL_PROG, callback);
   else ackManagerSetup(cv, bitNum,READ_BIT_PROG, callback);
 }
 
+// If we have seen this CV recently try that value first, 
+// a wrong guess costs one verify before the normal read.
 void DCC::readCV(int16_t cv, ACK_CALLBACK callback)  {
+  for (byte i=0; i<CV_CACHE_SIZE; i++) {
+    if (cvCache[i].cv==cv) {
+      if (Diag::ACK) DIAG(F("CV%d expecting %d"),cv,cvCache[i].value);
+      verifyCVByte(cv, cvCache[i].value, callback);
+      return;
+    }
+  }
   ackManagerSetup(cv, 0,READ_CV_PROG, callback);
 }
 
+// Remember values read or written on the prog track, oldest entry is replaced.
+void DCC::updateCvCache(int16_t cv, byte value) {
+  static byte nextEntry=0;
+  for (byte i=0; i<CV_CACHE_SIZE; i++) {
+    if (cvCache[i].cv==cv) {
+      cvCache[i].value=value;
+      return;
+    }
+  }
+  cvCache[nextEntry].cv=cv;
+  cvCache[nextEntry].value=value;
+  nextEntry=(nextEntry+1) % CV_CACHE_SIZE;
+}
+
+// A written bit changes a remembered value, it says nothing of the other bits of one that is not
+void DCC::updateCvCacheBit(int16_t cv, byte bitNum, bool bitValue) {
+  for (byte i=0; i<CV_CACHE_SIZE; i++) {
+    if (cvCache[i].cv==cv) {
+      if (bitValue) cvCache[i].value |= 1<<bitNum;
+      else cvCache[i].value &= ~(1<<bitNum);
+      return;
+    }
+  }
+}
+
 void DCC::getLocoId(ACK_CALLBACK callback) {
   ackManagerSetup(0,0, LOCO_ID_PROG, callback);
 }
 
 void DCC::setLocoId(int id,ACK_CALLBACK callback) {
   if (id<1 || id>10239) { //0x27FF according to standard
-    callback(-1);
+    ackManagerSetup(0, 0, FAIL_PROG, callback);
     return;
   }
-  if (id<=127)
+  // The CVs these write, for the next read
+  updateCvCache(19, 0);
+  updateCvCacheBit(29, 5, id>127);
+  if (id<=127) {
       ackManagerSetup(id, SHORT_LOCO_ID_PROG, callback);
-  else
+      updateCvCache(1, id);
+  }
+  else {
       ackManagerSetup(id | 0xc000,LONG_LOCO_ID_PROG, callback);
+      updateCvCache(17, (id | 0xc000) >> 8);
+      updateCvCache(18, id & 0xff);
+  }
 }
 
 void DCC::forgetLoco(int cab) {  // removes any speed reminders for this loco
   setThrottle2(cab,1); // ESTOP this loco if still on track  
-  int reg=lookupSpeedTable(cab);
-  if (reg>=0) speedTable[reg].loco=0;
+  removeLoco(cab);
   setThrottle2(cab,1); // ESTOP if this loco still on track
 }
 void DCC::forgetAllLocos() {  // removes all speed reminders
   setThrottle2(0,1); // ESTOP all locos still on track      
-  for (int i=0;i<MAX_LOCOS;i++) speedTable[i].loco=0;
+  locoCount=0;
+  memset(locoIndex,0,sizeof(locoIndex));
+}
+
+void DCC::getSnapshot(byte reg, byte record[LOCO_SNAPSHOT_SIZE]) {
+  memset(record, 0, LOCO_SNAPSHOT_SIZE);
+  if (reg >= locoCount) return;
+  LOCO & loco = speedTable[reg];
+  record[0] = lowByte(loco.loco);
+  record[1] = highByte(loco.loco);
+  record[2] = loco.targetSpeed & 0x80;
+  memcpy(record+3, &loco.functions, 4);
+}
+
+void DCC::restoreSnapshot(const byte record[LOCO_SNAPSHOT_SIZE]) {
+  int reg = lookupSpeedTable(record[0] | (record[1] << 8));
+  if (reg < 0) return;
+  LOCO & loco = speedTable[reg];
+  loco.speedCode = loco.targetSpeed = record[2] & 0x80;
+  memcpy(&loco.functions, record+3, 4);
+  // F0-F28 are all reminded, and sent soon as if just changed
+  for (int16_t fn = 0; fn <= 28; fn++) {
+    updateGroupflags(loco.groupFlags, fn);
+    updateGroupflags(loco.dirty, fn);
+  }
+  anyDirty = true;
 }
 
 byte DCC::loopStatus=0;  
@@ -562,67 +979,104 @@ byte DCC::loopStatus=0;
 void DCC::loop()  {
   DCCWaveform::loop(ackManagerProg!=NULL); // power overload checks
   ackManagerLoop();    // maintain prog track ack manager
+  momentumLoop();      // ramp locos with momentum, before the reminders send them
   issueReminders();
+  accessoryLoop();     // after the reminders so that changed loco state goes first
+  EEStore::loop();     // write cached turnout and output states
 }
 
+// Reminders are change driven. Any loco with changed speed or functions is sent first,
+// with DIRTY_REPEATS, round robin between the changed locos.
+// When nothing has changed, all locos are refreshed in the background,
+// one packet every BACKGROUND_REMINDER_MS.
 void DCC::issueReminders() {
-  // if the main track transmitter still has a pending packet, skip this time around.
-  if ( DCCWaveform::mainTrack.packetPending) return;
-
-  // This loop searches for a loco in the speed table starting at nextLoco and cycling back around
-  for (int reg=0;reg<MAX_LOCOS;reg++) {
-       int slot=reg+nextLoco;
-       if (slot>=MAX_LOCOS) slot-=MAX_LOCOS; 
-       if (speedTable[slot].loco > 0) {
-          // have found the next loco to remind 
-          // issueReminder will return true if this loco is completed (ie speed and functions)
-          if (issueReminder(slot)) nextLoco=slot+1; 
-          return;
-        }
+  // if the main track transmitter still has pending packets, skip this time around.
+  if ( DCCWaveform::mainTrack.isPacketPending()) return;
+  if (locoCount==0) return;
+  if (issueDirty()) return;
+
+#if BACKGROUND_REMINDER_MS > 0
+  if (millis() - lastBackgroundReminder < BACKGROUND_REMINDER_MS) return;
+  lastBackgroundReminder = millis();
+#endif
+  // The speed table is kept dense so nextLoco is always a loco to remind, cycling back around
+  if (nextLoco>=locoCount) nextLoco=0;
+  // issueReminder will return true if this loco is completed (ie speed and functions)
+  if (issueReminder(nextLoco)) nextLoco++; 
+}
+
+// Send one packet of changed state, speed before functions.
+// Returns false if there was nothing to send. 
+bool DCC::issueDirty() {
+  if (!anyDirty) return false;
+  for (int i=0;i<locoCount;i++) {
+    int reg=nextDirty+i;
+    if (reg>=locoCount) reg-=locoCount;
+    uint16_t dirty=speedTable[reg].dirty;
+    if (dirty==0) continue;
+    if (dirty & SPEED_DIRTY) {
+      sendSpeed(reg, DIRTY_REPEATS);
+      speedTable[reg].dirty &= ~SPEED_DIRTY;
+    }
+    else {
+      byte group=1;
+      while ((dirty & 0x01) == 0) { // lowest dirty group first
+        dirty >>= 1;
+        group++;
+      }
+      setFunctionGroup(reg, group, DIRTY_REPEATS, PRIORITY_FUNCTION);
+      speedTable[reg].dirty &= ~(1 << (group-1));
+    }
+    nextDirty=reg+1;  // so that one busy loco does not hold up the others
+    return true;
   }
+  anyDirty=false;
+  return false;
 }
  
 bool DCC::issueReminder(int reg) {
+  uint16_t groupFlags=speedTable[reg].groupFlags;
+  if (loopStatus==0) {
+    //   DIAG(F("Reminder %d speed %d"),speedTable[reg].loco,speedTable[reg].speedCode);
+    sendSpeed(reg, 0);
+  }
+  else if (groupFlags & (1 << (loopStatus-1))) { 
+    // remind function group only if it has been touched
+    setFunctionGroup(reg, loopStatus, 0, PRIORITY_REMINDER);
+  }
+  // Skip the groups never touched, so each call sends a packet.
+  // Past the last group this loco is done so reset status to 0 for 
+  // the next loco and return true so caller moves on to next loco. 
+  do loopStatus++; 
+  while (loopStatus<=FN_GROUPS && (groupFlags & (1 << (loopStatus-1)))==0);
+  if (loopStatus>FN_GROUPS) loopStatus=0;
+  return loopStatus==0;
+}
+
+void DCC::setFunctionGroup(int reg, byte group, byte repeats, PACKET_PRIORITY priority) {
   unsigned long functions=speedTable[reg].functions;
   int loco=speedTable[reg].loco;
-  byte flags=speedTable[reg].groupFlags;
-  
-  switch (loopStatus) {
-        case 0:
-      //   DIAG(F("Reminder %d speed %d"),loco,speedTable[reg].speedCode);
-         setThrottle2(loco, speedTable[reg].speedCode);
-         break;
-       case 1: // remind function group 1 (F0-F4)
-          if (flags & FN_GROUP_1) 
-              setFunctionInternal(loco,0, 128 | ((functions>>1)& 0x0F) | ((functions & 0x01)<<4)); // 100D DDDD
+  switch (group) {
+       case 1: // function group 1 (F0-F4)
+          setFunctionInternal(loco,0, 128 | ((functions>>1)& 0x0F) | ((functions & 0x01)<<4), repeats, priority); // 100D DDDD
           break;     
-       case 2: // remind function group 2 F5-F8
-          if (flags & FN_GROUP_2) 
-              setFunctionInternal(loco,0, 176 | ((functions>>5)& 0x0F));                           // 1011 DDDD
+       case 2: // function group 2 F5-F8
+          setFunctionInternal(loco,0, 176 | ((functions>>5)& 0x0F), repeats, priority);                           // 1011 DDDD
           break;     
-       case 3: // remind function group 3 F9-F12
-          if (flags & FN_GROUP_3) 
-              setFunctionInternal(loco,0, 160 | ((functions>>9)& 0x0F));                           // 1010 DDDD
+       case 3: // function group 3 F9-F12
+          setFunctionInternal(loco,0, 160 | ((functions>>9)& 0x0F), repeats, priority);                           // 1010 DDDD
           break;   
-       case 4: // remind function group 4 F13-F20
-          if (flags & FN_GROUP_4) 
-              setFunctionInternal(loco,222, ((functions>>13)& 0xFF)); 
-          flags&= ~FN_GROUP_4;  // dont send them again
+       case 4: // function group 4 F13-F20
+          setFunctionInternal(loco,222, ((functions>>13)& 0xFF), repeats, priority); 
           break;  
-       case 5: // remind function group 5 F21-F28
-          if (flags & FN_GROUP_5)
-              setFunctionInternal(loco,223, ((functions>>21)& 0xFF)); 
-          flags&= ~FN_GROUP_5;  // dont send them again
+       case 5: // function group 5 F21-F28
+          setFunctionInternal(loco,223, ((functions>>21)& 0xFF), repeats, priority); 
+          break; 
+       default: // F29-F36 to F61-F68, 1101 1000 to 1101 1100
+          setFunctionInternal(loco,0xD8 + group-6, speedTable[reg].extFunctions[group-6], repeats, priority); 
           break; 
       }
-      loopStatus++;
-      // if we reach status 6 then this loco is done so
-      // reset status to 0 for next loco and return true so caller 
-      // moves on to next loco. 
-      if (loopStatus>5) loopStatus=0;
-      return loopStatus==0;
-    }
- 
+}
  
 
 
@@ -637,45 +1091,118 @@ byte DCC::cv2(int cv)  {
   return lowByte(cv);
 }
 
+// Find the locoIndex entry for a loco, or the empty entry where it belongs.
+// Linear probing from the home position, the index is never full so this terminates.
+int DCC::locoIndexPosition(int locoId) {
+  int pos = locoId & (LOCO_INDEX_SIZE-1);
+  while (locoIndex[pos] != 0 && speedTable[locoIndex[pos]-1].loco != locoId)
+    pos = (pos+1) & (LOCO_INDEX_SIZE-1);
+  return pos;
+}
+
+// The speed table slot of a loco, -1 if it is not in the table.
+// Asking about a loco does not use up a slot, only changing it does.
+int DCC::findSpeedTable(int locoId) {
+  if (locoId <= 0) return -1;
+  int pos = locoIndexPosition(locoId);
+  return locoIndex[pos] ? locoIndex[pos]-1 : -1;
+}
+
 int DCC::lookupSpeedTable(int locoId) {
   // determine speed reg for this loco
-  int firstEmpty = MAX_LOCOS;
-  int reg;
-  for (reg = 0; reg < MAX_LOCOS; reg++) {
-    if (speedTable[reg].loco == locoId) break;
-    if (speedTable[reg].loco == 0 && firstEmpty == MAX_LOCOS) firstEmpty = reg;
-  }
-  if (reg == MAX_LOCOS) reg = firstEmpty;
-  if (reg >= MAX_LOCOS) {
+  if (locoId <= 0) return -1;
+  int pos = locoIndexPosition(locoId);
+  if (locoIndex[pos] != 0) return locoIndex[pos]-1;
+  if (locoCount >= MAX_LOCOS) {
     DIAG(F("Too many locos"));
     return -1;
   }
-  if (reg==firstEmpty){
-        speedTable[reg].loco = locoId;
-        speedTable[reg].speedCode=128;  // default direction forward
-        speedTable[reg].groupFlags=0;
-        speedTable[reg].functions=0;
-  }
+  int reg = locoCount++;
+  locoIndex[pos] = reg+1;
+  speedTable[reg].loco = locoId;
+  speedTable[reg].speedCode=128;  // default direction forward
+  speedTable[reg].targetSpeed=128;
+  speedTable[reg].accel=0;
+  speedTable[reg].decel=0;
+  speedTable[reg].vmax=0;
+  speedTable[reg].momentumCredit=0;
+#if LOCO_PACKET_CACHE
+  speedTable[reg].cachedSpeed=1;  // an estop, which is never cached
+#endif
+  speedTable[reg].groupFlags=0;
+  speedTable[reg].dirty=0;
+  speedTable[reg].functions=0;
+  memset(speedTable[reg].extFunctions,0,sizeof(speedTable[reg].extFunctions));
   return reg;
 }
+
+void DCC::removeLoco(int locoId) {
+  if (locoId <= 0) return;
+  int pos = locoIndexPosition(locoId);
+  if (locoIndex[pos] == 0) return;
+  byte reg = locoIndex[pos]-1;
+
+  // Close the gap in the index by shifting back any entries that probed past it.
+  // This avoids the need for deleted markers.
+  const int mask = LOCO_INDEX_SIZE-1;
+  int gap = pos;
+  for (int next = (gap+1) & mask; locoIndex[next] != 0; next = (next+1) & mask) {
+    int home = speedTable[locoIndex[next]-1].loco & mask;
+    if (((next-home) & mask) >= ((next-gap) & mask)) {
+      locoIndex[gap] = locoIndex[next];
+      gap = next;
+    }
+  }
+  locoIndex[gap] = 0;
+
+  // Keep the table dense by moving the last loco into the free slot
+  locoCount--;
+  if (reg != locoCount) {
+    speedTable[reg] = speedTable[locoCount];
+    locoIndex[locoIndexPosition(speedTable[reg].loco)] = reg+1;
+  }
+}
   
-void  DCC::updateLocoReminder(int loco, byte speedCode) {
+// Returns true if the loco is in the table, so that reminders will send this speed,
+// scaled to the loco's VMAX.
+bool  DCC::updateLocoReminder(int loco, byte speedCode) {
  
   if (loco==0) {
      // broadcast stop/estop but dont change direction
-     for (int reg = 0; reg < MAX_LOCOS; reg++) {
+     for (int reg = 0; reg < locoCount; reg++) {
        speedTable[reg].speedCode = (speedTable[reg].speedCode & 0x80) |  (speedCode & 0x7f);
+       speedTable[reg].targetSpeed = speedTable[reg].speedCode;
+       // The repeated estop broadcast does the job of sending each loco its speed
+       if ((speedCode & 0x7F) == 1) speedTable[reg].dirty &= ~SPEED_DIRTY;
+       else speedTable[reg].dirty |= SPEED_DIRTY;
      }
-     return; 
+     anyDirty=true;
+     return false; 
   }
   
   // determine speed reg for this loco
   int reg=lookupSpeedTable(loco);       
-  if (reg>=0) speedTable[reg].speedCode = speedCode;
+  if (reg<0) return false;
+  speedTable[reg].speedCode = scaledSpeed(speedTable[reg], speedCode);
+  speedTable[reg].targetSpeed = speedCode;
+  speedTable[reg].dirty |= SPEED_DIRTY;
+  anyDirty=true;
+  return true;
 }
 
 DCC::LOCO DCC::speedTable[MAX_LOCOS];
+unsigned long DCC::lastMomentum = 0;
+byte DCC::locoCount = 0;
+byte DCC::locoIndex[LOCO_INDEX_SIZE];
 int DCC::nextLoco = 0;
+int DCC::nextDirty = 0;
+bool DCC::anyDirty = false;
+unsigned long DCC::lastBackgroundReminder = 0;
+DCC::ACCESSORY_COMMAND DCC::accessoryQueue[ACCESSORY_QUEUE_SIZE];
+byte DCC::nextAccessory = 0;
+DCC::SIGNAL_ASPECT DCC::aspectCache[SIGNAL_CACHE_SIZE];
+byte DCC::aspectCount = 0;
+byte DCC::nextAspect = 0;
 
 //ACK MANAGER
 ackOp  const *  DCC::ackManagerProg;
@@ -685,20 +1212,54 @@ int    DCC::ackManagerWord;
 int    DCC::ackManagerCv;
 byte   DCC::ackManagerBitNum;
 bool   DCC::ackReceived;
+byte   DCC::ackManagerHint;
+byte   DCC::ackManagerHintMask;
+DCC::CV_CACHE DCC::cvCache[CV_CACHE_SIZE];
 bool   DCC::ackManagerRejoin;
 
 CALLBACK_STATE DCC::callbackState=READY;
 
 ACK_CALLBACK DCC::ackManagerCallback;
 
-void  DCC::ackManagerSetup(int cv, byte byteValueOrBitnum, ackOp const program[], ACK_CALLBACK callback) {
+DCC::ACK_JOB DCC::ackQueue[PROG_QUEUE_SIZE];
+byte DCC::ackQueueHead=0;
+byte DCC::ackQueueCount=0;
+
+// Prog track requests are queued and run one after the other.
+// The job at the head of the queue is the one running.
+void  DCC::ackManagerSetup(int cv, byte byteValueOrBitnum, ackOp const program[], ACK_CALLBACK callback, byte knownBits, int wordval) {
   if (!DCCWaveform::progTrack.canMeasureCurrent()) {
     callback(-2);
     return;
   }
+  if (ackQueueCount >= PROG_QUEUE_SIZE) {
+    DIAG(F("Prog queue full"));  
+    callback(-1);
+    return;
+  }
+  ACK_JOB & job = ackQueue[(ackQueueHead + ackQueueCount) % PROG_QUEUE_SIZE];
+  job.program = program;
+  job.cv = cv;
+  job.byteValueOrBitnum = byteValueOrBitnum;
+  job.word = wordval;
+  job.hintMask = knownBits;
+  job.callback = callback;
+  ackQueueCount++;
+  if (ackManagerProg == NULL) ackManagerStart(false); 
+}
+
+void  DCC::ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback) {
+  ackManagerSetup(0, 0, program, callback, 0, wordval);
+  }
 
-  ackManagerRejoin=DCCWaveform::progTrackSyncMain;     
-  if (ackManagerRejoin ) {
+// Start the job at the head of the queue. 
+// A chained job follows straight on from the previous one: the prog track is already 
+// powered and unjoined and the ack baseline is still valid, so BASELINE is skipped.
+void DCC::ackManagerStart(bool chained) {
+  ACK_JOB & job = ackQueue[ackQueueHead];
+  if (!chained) {
+    ackManagerRejoin=DCCWaveform::progTrackSyncMain;     
+    if (ackManagerRejoin ) {
         // Change from JOIN must zero resets packet.
         setProgTrackSyncMain(false);
         DCCWaveform::progTrack.sentResetsSincePacket = 0;      
@@ -711,18 +1272,25 @@ void  DCC::ackManagerSetup(int cv, byte byteValueOrBitnum, ackOp const program[]
         DCCWaveform::progTrack.setPowerMode(POWERMODE::ON);
         DCCWaveform::progTrack.sentResetsSincePacket = 0;      
     }
+  }
 
-  ackManagerCv = cv;
-  ackManagerProg = program;
-  ackManagerByte = byteValueOrBitnum;
-  ackManagerBitNum=byteValueOrBitnum;
-  ackManagerCallback = callback;
+  ackManagerCv = job.cv;
+  ackManagerWord = job.word;
+  ackManagerHint = job.byteValueOrBitnum;
+  ackManagerHintMask = job.hintMask;
+  ackManagerProg = job.program;
+  ackManagerByte = job.byteValueOrBitnum;
+  ackManagerBitNum = job.byteValueOrBitnum;
+  ackManagerCallback = job.callback;
+  if (chained && GETFLASH(ackManagerProg) == BASELINE) {
+    callbackState=READY;
+    ackManagerProg++;
+  }
 }
 
-void  DCC::ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback) {
-  ackManagerWord=wordval;
-  ackManagerSetup(0, 0, program, callback);
-  }
+bool DCC::isProgQueueFull() {
+  return ackQueueCount >= PROG_QUEUE_SIZE;
+}
 
 const byte RESET_MIN=8;  // tuning of reset counter before sending message
 
@@ -751,7 +1319,7 @@ void DCC::ackManagerLoop() {
               if (Diag::ACK) DIAG(F("W%d cv=%d bit=%d"),opcode==W1, ackManagerCv,ackManagerBitNum); 
               byte instruction = WRITE_BIT | (opcode==W1 ? BIT_ON : BIT_OFF) | ackManagerBitNum;
               byte message[] = {cv1(BIT_MANIPULATE, ackManagerCv), cv2(ackManagerCv), instruction };
-              DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+              if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;
               DCCWaveform::progTrack.setAckPending(); 
              callbackState=AFTER_WRITE;
          }
@@ -762,7 +1330,7 @@ void DCC::ackManagerLoop() {
 	      if (checkResets( RESET_MIN)) return;
               if (Diag::ACK) DIAG(F("WB cv=%d value=%d"),ackManagerCv,ackManagerByte);
               byte message[] = {cv1(WRITE_BYTE, ackManagerCv), cv2(ackManagerCv), ackManagerByte};
-              DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+              if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;
               DCCWaveform::progTrack.setAckPending(); 
               callbackState=AFTER_WRITE;
             }
@@ -773,7 +1341,7 @@ void DCC::ackManagerLoop() {
 	  if (checkResets( RESET_MIN)) return; 
           if (Diag::ACK) DIAG(F("VB cv=%d value=%d"),ackManagerCv,ackManagerByte);
           byte message[] = { cv1(VERIFY_BYTE, ackManagerCv), cv2(ackManagerCv), ackManagerByte};
-          DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+          if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;
           DCCWaveform::progTrack.setAckPending(); 
         }
         break;
@@ -785,7 +1353,7 @@ void DCC::ackManagerLoop() {
           if (Diag::ACK) DIAG(F("V%d cv=%d bit=%d"),opcode==V1, ackManagerCv,ackManagerBitNum); 
           byte instruction = VERIFY_BIT | (opcode==V0?BIT_OFF:BIT_ON) | ackManagerBitNum;
           byte message[] = {cv1(BIT_MANIPULATE, ackManagerCv), cv2(ackManagerCv), instruction };
-          DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS);
+          if (!DCCWaveform::progTrack.schedulePacket(message, sizeof(message), PROG_REPEATS)) return;
           DCCWaveform::progTrack.setAckPending(); 
         }
         break;
@@ -809,6 +1377,7 @@ void DCC::ackManagerLoop() {
         
       case ITCB:   // If True callback(byte)
           if (ackReceived) {
+            updateCvCache(ackManagerCv, ackManagerByte);
             callback(ackManagerByte);
             return;
           }
@@ -844,6 +1413,15 @@ void DCC::ackManagerLoop() {
           ackManagerBitNum--;
           break;
 
+      case HINTSKIP:  // If this bit is known, merge it from the hint and skip the V0,WACK,MERGE that follow
+          if (!bitRead(ackManagerHintMask, ackManagerBitNum)) break;
+          ackManagerByte <<= 1;
+          if (bitRead(ackManagerHint, ackManagerBitNum)) ackManagerByte |= 1;
+          ackReceived = true;  // so a following ITSKIP does not check for a missing ack
+          ackManagerBitNum--;
+          ackManagerProg += 3;
+          break;
+
       case SETBIT:
           ackManagerProg++; 
           ackManagerBitNum=GETFLASH(ackManagerProg);
@@ -904,7 +1482,8 @@ void DCC::callback(int value) {
 
     switch (callbackState) {    
        case AFTER_WRITE:  // first attempt to callback after a write operation
-	    if (!ackManagerRejoin && !DCCWaveform::progTrack.autoPowerOff) {
+	    // No need to wait if we stay in programming mode for the next job 
+	    if (ackQueueCount > 1 || (!ackManagerRejoin && !DCCWaveform::progTrack.autoPowerOff)) {
                callbackState=READY;
                break;
             }                              // lines 906-910 added. avoid wait after write. use 1 PROG
@@ -936,33 +1515,44 @@ void DCC::callback(int value) {
             break;
      
        case READY:  // ready after read, or write after power delay and off period.
+         {
+          ACK_CALLBACK finishedCallback=ackManagerCallback;
+          ackQueueHead = (ackQueueHead + 1) % PROG_QUEUE_SIZE;
+          ackQueueCount--;
+          if (ackQueueCount > 0) {
+            // Stay in programming mode and go straight on to the next job
+            ackManagerStart(true);
+          }
+          else {
             // power off if we powered it on
            if (DCCWaveform::progTrack.autoPowerOff) {
               if (Diag::ACK) DIAG(F("Auto Prog power off"));
               DCCWaveform::progTrack.doAutoPowerOff();
            }
-          // Restore <1 JOIN> to state before BASELINE
-          if (ackManagerRejoin) {
+           // Restore <1 JOIN> to state before BASELINE
+           if (ackManagerRejoin) {
               setProgTrackSyncMain(true);
               if (Diag::ACK) DIAG(F("Auto JOIN"));
-          }  
+           }  
     
-          ackManagerProg=NULL;  // no more steps to execute
+           ackManagerProg=NULL;  // no more steps to execute
+          }
           if (Diag::ACK) DIAG(F("Callback(%d)"),value);
-          (ackManagerCallback)( value);
+          (finishedCallback)( value);
+         }
     }
 }
 
 void DCC::displayCabList(Print * stream) {
 
-    int used=0;
-    for (int reg = 0; reg < MAX_LOCOS; reg++) {
-       if (speedTable[reg].loco>0) {
-        used ++;
+    for (int reg = 0; reg < locoCount; reg++) {
         StringFormatter::send(stream,F("cab=%d, speed=%d, dir=%c \n"),       
            speedTable[reg].loco,  speedTable[reg].speedCode & 0x7f,(speedTable[reg].speedCode & 0x80) ? 'F':'R');
-       }
      }
-     StringFormatter::send(stream,F("Used=%d, max=%d\n"),used,MAX_LOCOS);
+     StringFormatter::send(stream,F("Used=%d, max=%d\n"),locoCount,MAX_LOCOS);
      
 }
+
+int DCC::memoryUsed() {
+  return sizeof(speedTable) + sizeof(locoIndex) + sizeof(ackQueue) + sizeof(cvCache) + sizeof(accessoryQueue) + sizeof(aspectCache);
+}
@@ -18,9 +18,17 @@
  */
 #ifndef DCC_h
 #define DCC_h
+#if __has_include ( "config.h")
+  #include "config.h"
+#else
+  #warning config.h not found. Using defaults from config.example.h 
+  #include "config.example.h"
+#endif
 #include <Arduino.h>
+#include "BoardProfile.h"
 #include "MotorDriver.h"
 #include "MotorDrivers.h"
+#include "DCCWaveform.h"
 #include "FSH.h"
 
 typedef void (*ACK_CALLBACK)(int16_t result);
@@ -51,6 +59,7 @@ enum ackOp : byte
   STASHLOCOID,      // keeps current byte value for later
   COMBINELOCOID,    // combines current value with stashed value and returns it
   ITSKIP,           // skip to SKIPTARGET if ack true
+  HINTSKIP,         // if current bit is a known bit, merge it and skip the following V0,WACK,MERGE
   SKIPTARGET = 0xFF // jump to target
 };
 
@@ -63,11 +72,49 @@ enum   CALLBACK_STATE : byte {
 
 
 // Allocations with memory implications..!
-// Base system takes approx 900 bytes + 8 per loco. Turnouts, Sensors etc are dynamically created
-#ifdef ARDUINO_AVR_UNO
-const byte MAX_LOCOS = 20;
+// Base system takes approx 900 bytes + 11 per loco. Turnouts, Sensors etc are dynamically created
+// LOCO_TABLE_SIZE comes from BoardProfile.h and may be set in config.h to change the default.
+#if LOCO_TABLE_SIZE > 250
+  #error LOCO_TABLE_SIZE can not be more than 250
+#endif
+#if LOCO_TABLE_SIZE > 50 && (defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO))
+  #error LOCO_TABLE_SIZE above 50 needs a Mega or Teensy
+#endif
+const byte MAX_LOCOS = LOCO_TABLE_SIZE;
+
+// Number of prog track requests which may be waiting, including the one running.
+const byte PROG_QUEUE_SIZE = PROG_QUEUE_LENGTH;
+
+// Time between background reminder packets once changed state has been sent.
+// 0 sends them whenever the track is otherwise idle. May be set in config.h.
+#ifndef BACKGROUND_REMINDER_MS
+  #define BACKGROUND_REMINDER_MS 0
+#endif
+
+// Accessory decoder outputs are switched off again this long after they are
+// switched on, 0 leaves them to the decoder. May be set in config.h.
+#ifndef ACCESSORY_PULSE_MS
+  #define ACCESSORY_PULSE_MS 0
+#endif
+// Locos with momentum move one ramp step towards their target speed this often
+#ifndef MOMENTUM_MS
+  #define MOMENTUM_MS 50
+#endif
+const byte ACCESSORY_QUEUE_SIZE = ACCESSORY_QUEUE_LENGTH;
+const byte SIGNAL_CACHE_SIZE = SIGNAL_CACHE_LENGTH;
+
+// The loco index is an open addressing hash table which must be a power of 2
+// and is kept at most about 2/3 full so that lookups rarely probe more than twice.
+#if LOCO_TABLE_SIZE*3/2 <= 32
+const int LOCO_INDEX_SIZE = 32;
+#elif LOCO_TABLE_SIZE*3/2 <= 64
+const int LOCO_INDEX_SIZE = 64;
+#elif LOCO_TABLE_SIZE*3/2 <= 128
+const int LOCO_INDEX_SIZE = 128;
+#elif LOCO_TABLE_SIZE*3/2 <= 256
+const int LOCO_INDEX_SIZE = 256;
 #else
-const byte MAX_LOCOS = 50;
+const int LOCO_INDEX_SIZE = 512;
 #endif
 
 class DCC
@@ -79,16 +126,23 @@ public:
 
   // Public DCC API functions
   static void setThrottle(uint16_t cab, uint8_t tSpeed, bool tDirection);
+  // Momentum: accel and decel are the tenths of a second from stop to full speed
+  // and back, 0 for none. vmax is the 128 step speed sent for full throttle.
+  static bool setMomentum(int cab, byte accel, byte decel, byte vmax=127);
   static uint8_t getThrottleSpeed(int cab);
   static bool getThrottleDirection(int cab);
   static void writeCVByteMain(int cab, int cv, byte bValue);
   static void writeCVBitMain(int cab, int cv, byte bNum, bool bValue);
   static void setFunction(int cab, byte fByte, byte eByte);
+  static void estopAll();
   static void setFn(int cab, int16_t functionNumber, bool on);
   static int changeFn(int cab, int16_t functionNumber, bool pressed);
   static int  getFn(int cab, int16_t functionNumber);
-  static void updateGroupflags(byte &flags, int16_t functionNumber);
+  static int32_t getFunctionMap(int cab);
+  static void updateGroupflags(uint16_t &flags, int16_t functionNumber);
   static void setAccessory(int aAdd, byte aNum, bool activate);
+  static bool setExtendedAccessory(int address, byte aspect);
+  static void resendAspects();
   static bool writeTextPacket(byte *b, int nBytes);
   static void setProgTrackSyncMain(bool on); // when true, prog track becomes driveable
   static void setProgTrackBoost(bool on);    // when true, special prog track current limit does not apply
@@ -98,47 +152,126 @@ public:
   static void readCVBit(int16_t cv, byte bitNum, ACK_CALLBACK callback); // -1 for error
   static void writeCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback);
   static void writeCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback);
-  static void verifyCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback);
+  static void verifyCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback, byte knownBits=0);
   static void verifyCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback);
 
   static void getLocoId(ACK_CALLBACK callback);
   static void setLocoId(int id,ACK_CALLBACK callback);
+  static bool isProgQueueFull();  // true if another prog track request would be rejected
 
   // Enhanced API functions
   static void forgetLoco(int cab); // removes any speed reminders for this loco
   static void forgetAllLocos();    // removes all speed reminders
+  // Warm restart: a loco table entry as LOCO_SNAPSHOT_SIZE bytes for EEStore 
+  // to keep, address, direction and F0-F28. Speeds are not kept, a loco comes
+  // back stopped but with its direction and functions as they were.
+  static const byte LOCO_SNAPSHOT_SIZE=7;
+  static void getSnapshot(byte reg, byte record[LOCO_SNAPSHOT_SIZE]);  // zeros for an unused entry
+  static void restoreSnapshot(const byte record[LOCO_SNAPSHOT_SIZE]);
   static void displayCabList(Print *stream);
+  static int memoryUsed();  // bytes in the fixed loco, ack and CV tables
 
   static FSH *getMotorShieldName();
-  static inline void setGlobalSpeedsteps(byte s) {
-    globalSpeedsteps = s;
-  };
+  static void setGlobalSpeedsteps(byte s);
 
 private:
   struct LOCO
   {
     int loco;
     byte speedCode;
-    byte groupFlags;
-    unsigned long functions;
+    uint16_t groupFlags;  // function groups which have been touched, so are reminded
+    uint16_t dirty;       // changes not yet sent, group bits and SPEED_DIRTY
+    unsigned long functions;  // F0-F28
+    byte extFunctions[5];     // F29-F68
+    byte targetSpeed;         // speedCode the throttle asked for, before VMAX scaling,
+                              // speedCode (as sent) ramps to the scaled target
+    byte accel;               // momentum, see setMomentum
+    byte decel;
+    byte vmax;                // 0 for 127
+    uint16_t momentumCredit;  // ms*steps towards the next ramp step
+#if LOCO_PACKET_CACHE
+    byte cachedSpeed;         // speedCode encoded in cachedBits, 1 if none
+    byte cachedBitCount;
+    byte cachedBits[MAX_ENCODED_SIZE];
+#endif
   };
+  static byte functionGroup(int16_t functionNumber);
+  static bool getFunctionBit(int reg, int16_t functionNumber);
+  static void setFunctionBit(int reg, int16_t functionNumber, bool on);
   static byte joinRelay;
   static byte loopStatus;
-  static void setThrottle2(uint16_t cab, uint8_t speedCode);
-  static void updateLocoReminder(int loco, byte speedCode);
-  static void setFunctionInternal(int cab, byte fByte, byte eByte);
+  static void setThrottle2(uint16_t cab, uint8_t speedCode, byte repeats=0);
+  static void sendSpeed(int reg, byte repeats);
+  static byte speedPacket(byte b[4], uint16_t cab, byte speedCode);
+  static bool updateLocoReminder(int loco, byte speedCode);
+  static void momentumLoop();
+  static void rampSpeed(int reg);
+  static byte scaledSpeed(const LOCO & loco, byte speedCode);
+  static byte sentStep(byte speedCode);
+  static unsigned long lastMomentum;
+  static void setFunctionInternal(int cab, byte fByte, byte eByte, byte repeats, PACKET_PRIORITY priority);
+  static void setFunctionGroup(int reg, byte group, byte repeats, PACKET_PRIORITY priority);
+  static void schedule(const byte b[], byte nB, byte repeats);
   static bool issueReminder(int reg);
+  static bool issueDirty();
   static int nextLoco;
+  static int nextDirty;
+  static bool anyDirty;
+  static unsigned long lastBackgroundReminder;
   static FSH *shieldName;
   static byte globalSpeedsteps;
 
+  // speedTable[0..locoCount-1] are in use, so the free slots are always at the end.
+  // locoIndex maps a loco address to its speedTable slot+1 (0 is an empty index entry).
   static LOCO speedTable[MAX_LOCOS];
+  static byte locoCount;
+  static byte locoIndex[LOCO_INDEX_SIZE];
+  static int locoIndexPosition(int locoId);
+  static void removeLoco(int locoId);
   static byte cv1(byte opcode, int cv);
   static byte cv2(int cv);
+  static int findSpeedTable(int locoId);
   static int lookupSpeedTable(int locoId);
   static void issueReminders();
   static void callback(int value);
 
+  // Accessory commands waiting to be sent, see setAccessory
+  static const byte ACCESSORY_ON=0x01;          // on packet to send
+  static const byte ACCESSORY_OFF=0x02;         // off packet to send at offTime
+  static const byte ACCESSORY_OFF_OUTPUT=0x04;  // output the off packet is for
+  static const byte ACCESSORY_EXTENDED=0x08;    // extended accessory, output is the aspect
+  struct ACCESSORY_COMMAND {
+    int address;
+    byte number;
+    byte output;
+    byte flags;  // 0 when the entry is free
+    unsigned long offTime;
+  };
+  static ACCESSORY_COMMAND accessoryQueue[ACCESSORY_QUEUE_SIZE];
+  static byte nextAccessory;
+  static void sendAccessory(int address, byte number, bool output, bool on);
+  static void accessoryLoop();
+  static void queueExtendedAccessory(int address, byte aspect);
+  static void sendExtendedAccessory(int address, byte aspect);
+  // Last aspect sent to each signal address
+  struct SIGNAL_ASPECT {
+    int address;
+    byte aspect;
+  };
+  static SIGNAL_ASPECT aspectCache[SIGNAL_CACHE_SIZE];
+  static byte aspectCount;
+  static byte nextAspect;  // entry to take over when the cache is full
+
+  // Recently read or written prog track CVs, tried first by readCV
+  struct CV_CACHE {
+    int16_t cv;
+    byte value;
+  };
+  static const byte CV_CACHE_SIZE = 8;
+  static CV_CACHE cvCache[CV_CACHE_SIZE];
+  static void updateCvCache(int16_t cv, byte value);
+  static void updateCvCacheBit(int16_t cv, byte bitNum, bool bitValue);
+
   // ACK MANAGER
   static ackOp const *ackManagerProg;
   static byte ackManagerByte;
@@ -147,11 +280,25 @@ private:
   static int ackManagerWord;
   static byte ackManagerStash;
   static bool ackReceived;
+  static byte ackManagerHint;      // expected value used for known bits
+  static byte ackManagerHintMask;  // bits which need not be read
   static bool ackManagerRejoin;
   static ACK_CALLBACK ackManagerCallback;
   static CALLBACK_STATE callbackState;
-  static void ackManagerSetup(int cv, byte bitNumOrbyteValue, ackOp const program[], ACK_CALLBACK callback);
+  static void ackManagerSetup(int cv, byte bitNumOrbyteValue, ackOp const program[], ACK_CALLBACK callback, byte knownBits=0, int wordval=0);
   static void ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback);
+  static void ackManagerStart(bool chained);
+  struct ACK_JOB {
+    ackOp const * program;
+    int16_t cv;
+    int word;
+    byte byteValueOrBitnum;
+    byte hintMask;
+    ACK_CALLBACK callback;
+  };
+  static ACK_JOB ackQueue[PROG_QUEUE_SIZE];
+  static byte ackQueueHead;
+  static byte ackQueueCount;
   static void ackManagerLoop();
   static bool checkResets( uint8_t numResets);
   static const int PROG_REPEATS = 8; // repeats of programming commands (some decoders need at least 8 to be reliable)
@@ -191,6 +338,10 @@ private:
 #define ARDUINO_TYPE "TEENSY40"
 #elif defined(ARDUINO_TEENSY41)
 #define ARDUINO_TYPE "TEENSY41"
+#elif defined(ARDUINO_ARCH_RP2040)
+#define ARDUINO_TYPE "RP2040"
+#elif defined(HOST_BUILD)
+#define ARDUINO_TYPE "HOST"
 #else
 #error CANNOT COMPILE - DCC++ EX ONLY WORKS WITH AN ARDUINO UNO, NANO 328, OR ARDUINO MEGA 1280/2560
 #endif
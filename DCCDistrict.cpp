@@ -0,0 +1,160 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <Arduino.h>
+#include "DCCDistrict.h"
+#include "DIAG.h"
+
+DCCDistrict::DCCDistrict(const FSH * districtName, MotorDriver * driver) {
+  name=districtName;
+  motorDriver=driver;
+  powerMode=POWERMODE::OFF;
+  lastCurrent=0;
+  maxmA=0;
+  tripmA=0;
+  sampleDelay=0;
+  lastSampleTaken=millis();
+}
+
+POWERMODE DCCDistrict::getPowerMode() {
+  return powerMode;
+}
+
+void DCCDistrict::setPowerMode(POWERMODE mode) {
+  powerMode = mode;
+  bool ison = (mode == POWERMODE::ON);
+  motorDriver->setPower( ison);
+  hardTripCount=0;
+  hardTripped=false;  // power has been explicitly set, forget any fast trip
+}
+
+// Called in interrupt time. Uses the background current sample only (no analogRead)
+// so drivers without background sampling rely on checkOverload alone.
+// The count goes up for samples above the driver trip current and down for
+// samples below so a few noisy samples do not trip, but a dead short does in ~1ms.
+// Power is cut here, the OVERLOAD state and retry backoff are left to the loop.
+void DCCDistrict::checkHardTrip() {
+  if (powerMode != POWERMODE::ON || hardTripped) return;
+  int current=motorDriver->getCurrentSampled();
+  if (current < 0) return;
+  if (current > motorDriver->getRawCurrentTripValue()) {
+    if (++hardTripCount < HARD_TRIP_COUNT) return;
+    motorDriver->setPower(false);
+    hardTripCurrent=current;
+    hardTripped=true;
+  }
+  else if (hardTripCount) hardTripCount--;
+}
+
+// Called in interrupt time to open or close a RailCom cutout.
+// A district that was switched off or tripped while the cutout was
+// open is left alone, closing it might turn the power back on.
+void DCCDistrict::setCutout(bool on) {
+  if (on || (powerMode==POWERMODE::ON && !hardTripped)) motorDriver->setCutout(on);
+}
+
+// The background sample when the driver has one, otherwise the one
+// checkOverload took last. Power off reads as 0.
+void DCCDistrict::sampleTelemetry() {
+  int current=0;
+  if (powerMode == POWERMODE::ON) {
+    current=motorDriver->getCurrentSampled();
+    if (current < 0) current=lastCurrent;
+  }
+  if (current < windowMin) windowMin=current;
+  if (current > windowMax) windowMax=current;
+  windowSum+=current;
+  windowCount++;
+}
+
+void DCCDistrict::closeTelemetry() {
+  if (windowCount == 0) sampleTelemetry();
+  telemetryMin=motorDriver->raw2mA(windowMin);
+  telemetryAvg=motorDriver->raw2mA(windowSum/windowCount);
+  telemetryMax=motorDriver->raw2mA(windowMax);
+  windowMin=0x7FFF;
+  windowMax=0;
+  windowSum=0;
+  windowCount=0;
+}
+
+void DCCDistrict::checkOverload(int tripValue) {
+  if (millis() - lastSampleTaken  < sampleDelay && !hardTripped) return;
+  lastSampleTaken = millis();
+  
+  switch (powerMode) {
+    case POWERMODE::OFF:
+      sampleDelay = POWER_SAMPLE_OFF_WAIT;
+      break;
+    case POWERMODE::ON:
+      // Check current
+      if (hardTripped) {
+        // power already cut in interrupt time, treat as an overload
+        lastCurrent=max(hardTripCurrent,tripValue);
+        hardTripCount=0;
+        hardTripped=false;
+      }
+      else lastCurrent=motorDriver->getCurrentRaw();
+      if (lastCurrent < 0) {
+	  // We have a fault pin condition to take care of
+	  lastCurrent = -lastCurrent;
+	  setPowerMode(POWERMODE::OVERLOAD); // Turn off, decide later how fast to turn on again
+	  if (MotorDriver::commonFaultPin) {
+	      if (lastCurrent <= tripValue) {
+		setPowerMode(POWERMODE::ON); // maybe other track
+	      }
+	      // Write this after the fact as we want to turn on as fast as possible
+	      // because we don't know which output actually triggered the fault pin
+	      DIAG(F("*** COMMON FAULT PIN ACTIVE - TOGGLED POWER on %S ***"), name);
+	  } else {
+	      DIAG(F("*** %S FAULT PIN ACTIVE - OVERLOAD ***"), name);
+	      if (lastCurrent < tripValue) {
+		  lastCurrent = tripValue; // exaggerate
+	      }
+	  }
+      }
+      if (lastCurrent < tripValue) {
+        sampleDelay = POWER_SAMPLE_ON_WAIT;
+	if(power_good_counter<100)
+	  power_good_counter++;
+	else
+	  if (power_sample_overload_wait>POWER_SAMPLE_OVERLOAD_WAIT) power_sample_overload_wait=POWER_SAMPLE_OVERLOAD_WAIT;
+      } else {
+        setPowerMode(POWERMODE::OVERLOAD);
+        unsigned int mA=motorDriver->raw2mA(lastCurrent);
+        unsigned int maxmA=motorDriver->raw2mA(tripValue);
+	power_good_counter=0;
+        sampleDelay = power_sample_overload_wait;
+        DIAG(F("*** %S TRACK POWER OVERLOAD current=%d max=%d  offtime=%d ***"), name, mA, maxmA, sampleDelay);
+	if (power_sample_overload_wait >= 10000)
+	    power_sample_overload_wait = 10000;
+	else
+	    power_sample_overload_wait *= 2;
+      }
+      break;
+    case POWERMODE::OVERLOAD:
+      // Try setting it back on after the OVERLOAD_WAIT
+      setPowerMode(POWERMODE::ON);
+      sampleDelay = POWER_SAMPLE_ON_WAIT;
+      // Debug code....
+      DIAG(F("*** %S TRACK POWER RESET delay=%d ***"), name, sampleDelay);
+      break;
+    default:
+      sampleDelay = 999; // cant get here..meaningless statement to avoid compiler warning.
+  }
+}
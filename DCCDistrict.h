@@ -0,0 +1,109 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef DCCDistrict_h
+#define DCCDistrict_h
+#include <Arduino.h>
+#include "FSH.h"
+#include "MotorDriver.h"
+
+// Wait times for power management. Unit: milliseconds
+const int  POWER_SAMPLE_ON_WAIT = 100;
+const int  POWER_SAMPLE_OFF_WAIT = 1000;
+const int  POWER_SAMPLE_OVERLOAD_WAIT = 20;
+// Fast trip in interrupt time: each output is checked in turn every 58uS tick
+// and is cut when the over-trip score reaches this (about 1ms of short).
+const byte HARD_TRIP_COUNT = 8;
+
+enum class POWERMODE : byte { OFF, ON, OVERLOAD };
+
+// Power management for one motor driver output: power mode, overload
+// detection with its retry backoff, and current reporting.
+// The main and prog tracks are districts with their own waveform
+// (see DCCWaveform), further districts are boosters that share the
+// main track signal but trip and recover on their own.
+
+class DCCDistrict {
+  public:
+    DCCDistrict(const FSH * name, MotorDriver * driver);
+    void setPowerMode(POWERMODE);
+    POWERMODE getPowerMode();
+    void checkHardTrip();   // interrupt time
+    void setCutout(bool on);  // interrupt time
+    inline int get1024Current() {
+	  if (powerMode == POWERMODE::ON)
+	      return (int)(lastCurrent*(long int)1024/motorDriver->getRawCurrentTripValue());
+	  return 0;
+    }
+    inline int getCurrentmA() {
+      if (powerMode == POWERMODE::ON)
+        return motorDriver->raw2mA(lastCurrent);
+      return 0;
+    }
+    inline int getMaxmA() {
+      if (maxmA == 0) { //only calculate this for first request, it doesn't change
+        maxmA = motorDriver->raw2mA(motorDriver->getRawCurrentTripValue()); //TODO: replace with actual max value or calc
+      }
+      return maxmA;        
+    }
+    inline int getTripmA() { 
+      if (tripmA == 0) { //only calculate this for first request, it doesn't change
+        tripmA = motorDriver->raw2mA(motorDriver->getRawCurrentTripValue());
+      }
+      return tripmA;        
+    }
+    inline bool canMeasureCurrent() {
+      return motorDriver->canMeasureCurrent();
+    };
+    inline const FSH * getName() {
+      return name;
+    }
+    // Current telemetry: sampleTelemetry adds the latest current reading 
+    // to a window, closeTelemetry turns the window into min/avg/max mA
+    // for the last record and starts the next one.
+    void sampleTelemetry();
+    void closeTelemetry();
+    int telemetryMin, telemetryAvg, telemetryMax;  // mA, last closed window
+
+  protected:
+    friend class DCCWaveform;
+    void checkOverload(int tripValue);
+
+    const FSH * name;
+    MotorDriver*  motorDriver;
+    POWERMODE powerMode;
+    int  lastCurrent;
+    int maxmA;
+    int tripmA;
+
+    // current sampling
+    unsigned long lastSampleTaken;
+    unsigned int sampleDelay;
+    unsigned long power_sample_overload_wait = POWER_SAMPLE_OVERLOAD_WAIT;
+    unsigned int power_good_counter = 0;
+    // fast overload trip, set in interrupt time and handled by checkOverload
+    volatile bool hardTripped = false;
+    volatile int hardTripCurrent;
+    byte hardTripCount = 0;      // leaky bucket of samples above trip
+    // open telemetry window, raw current
+    int windowMin = 0x7FFF;
+    int windowMax = 0;
+    unsigned long windowSum = 0;
+    unsigned int windowCount = 0;
+};
+#endif
@@ -8,6 +8,7 @@
 #include "DCC.h"
 #include "DIAG.h"
 #include "DCCEXParser.h"
+#include "CommandDistributor.h"
 #include "version.h"
 #include "WifiInterface.h"
 #if ETHERNET_ON == true
@@ -16,6 +17,11 @@
 #include "LCD_Implementation.h"
 #include "LCN.h"
 #include "freeMemory.h"
+#include "I2CManager.h"
+#include "PWMServoDriver.h"
+#include "Profiler.h"
+#include "Watchdog.h"
+#include "Routes.h"
 
 #if __has_include ( "myAutomation.h")
   #include "RMFT.h"
@@ -23,14 +23,20 @@
 #include "DCCWaveform.h"
 #include "Turnouts.h"
 #include "Outputs.h"
+#include "Consists.h"
 #include "Sensors.h"
 #include "freeMemory.h"
 #include "GITHUB_SHA.h"
 #include "version.h"
 
 #include "EEStore.h"
+#include "CommandDistributor.h"
+#include "Profiler.h"
+#include "Benchmark.h"
 #include "DIAG.h"
+#if !defined(ARDUINO_ARCH_RP2040)
 #include <avr/wdt.h>
+#endif
 
 // These keywords are used in the <1> command. The number is what you get if you use the keyword as a parameter.
 // To discover new keyword numbers , use the <$ YOURKEYWORD> command
@@ -56,13 +62,69 @@ const int16_t HASH_KEYWORD_LCN = 15137;
 const int16_t HASH_KEYWORD_RESET = 26133;
 const int16_t HASH_KEYWORD_SPEED28 = -17064;
 const int16_t HASH_KEYWORD_SPEED128 = 25816;
+const int16_t HASH_KEYWORD_PROFILE = 19083;
+const int16_t HASH_KEYWORD_ISR = 12328;
+const int16_t HASH_KEYWORD_STATS = 23041;
+const int16_t HASH_KEYWORD_MEMORY = 16385;
+const int16_t HASH_KEYWORD_RAILCOM = -29097;
+const int16_t HASH_KEYWORD_TRACE = 12385;
+const int16_t HASH_KEYWORD_BENCH = 18626;
+const int16_t HASH_KEYWORD_RECORD = 9389;
+const int16_t HASH_KEYWORD_AUTO = -5457;
+const int16_t HASH_KEYWORD_BITMAP = 13859;
+const int16_t HASH_KEYWORD_GROUP = -16897;
+
+// Number of parameters each opcode accepts, packed as min<<4 | max.
+// The table is built at compile time into flash, one byte per printable opcode.
+// Opcodes not listed (including those only known to filters) accept anything
+// up to MAX_COMMAND_PARAMS and check for themselves. 
+static constexpr byte ARITY(byte minParams, byte maxParams) { return (minParams << 4) | maxParams; }
+static constexpr byte ANY_PARAMS = ARITY(0, DCCEXParser::MAX_COMMAND_PARAMS);
+static constexpr byte opcodeArity(byte opcode) {
+  return opcode == 't' ? ARITY(3, 4) :  // <t [REGISTER] CAB SPEED DIRECTION>
+         opcode == 'F' ? ARITY(3, 3) :  // <F CAB FUNC 1|0>
+         opcode == 'm' ? ARITY(3, 4) :  // <m CAB ACCEL DECEL [VMAX]>
+         opcode == 'f' ? ARITY(2, 3) :  // <f CAB BYTE1 [BYTE2]>
+         opcode == 'a' ? ARITY(2, 3) :  // <a ADDRESS [SUBADDRESS] ACTIVATE>
+         opcode == 'A' ? ARITY(0, 2) :  // <A> <A LINEARADDRESS ASPECT>
+         opcode == 'w' ? ARITY(3, 3) :  // <w CAB CV VALUE>
+         opcode == 'b' ? ARITY(4, 4) :  // <b CAB CV BIT VALUE>
+         opcode == 'W' ? ARITY(1, 4) :  // <W id> <W CV VALUE [CALLBACKNUM CALLBACKSUB]>
+         opcode == 'V' ? ARITY(2, 3) :  // <V CV VALUE> <V CV BIT 0|1>
+         opcode == 'B' ? ARITY(3, 5) :  // <B CV BIT VALUE [CALLBACKNUM CALLBACKSUB]>
+         opcode == 'R' ? ARITY(0, 3) :  // <R> <R CV CALLBACKNUM CALLBACKSUB>
+         opcode == '1' ? ARITY(0, 1) :  // <1 [MAIN|PROG|JOIN]>
+         opcode == '0' ? ARITY(0, 1) :  // <0 [MAIN|PROG]>
+         opcode == '-' ? ARITY(0, 1) :  // <- [cab]>
+         opcode == 'C' ? ARITY(0, 9) :  // <C [ID [LOCO1 ... LOCO8]]>
+         opcode == '!' ? ARITY(0, 0) :
+         opcode == 'c' ? ARITY(0, 1) :  // <c> <c TELEMETRYMS>
+         opcode == 'Q' ? ARITY(0, 2) :  // <Q> <Q BITMAP ON/OFF>
+         opcode == 's' ? ARITY(0, 0) :
+         opcode == 'E' ? ARITY(0, 0) :
+         opcode == 'e' ? ARITY(0, 0) :
+         opcode == '#' ? ARITY(0, 0) :
+         ANY_PARAMS;
+}
+#define ARITY4(o)  opcodeArity(o), opcodeArity(o+1), opcodeArity(o+2), opcodeArity(o+3)
+#define ARITY16(o) ARITY4(o), ARITY4(o+4), ARITY4(o+8), ARITY4(o+12)
+static const byte FIRST_TABLE_OPCODE = 0x20;
+static const byte OPCODE_ARITY[] PROGMEM = {
+  ARITY16(0x20), ARITY16(0x30), ARITY16(0x40), ARITY16(0x50), ARITY16(0x60), ARITY16(0x70)
+};
+#undef ARITY16
+#undef ARITY4
+
+static byte getArity(byte opcode) {
+  if (opcode < FIRST_TABLE_OPCODE || opcode >= FIRST_TABLE_OPCODE + sizeof(OPCODE_ARITY)) return ANY_PARAMS;
+  return GETFLASH(OPCODE_ARITY + opcode - FIRST_TABLE_OPCODE);
+}
 
-int16_t DCCEXParser::stashP[MAX_COMMAND_PARAMS];
-bool DCCEXParser::stashBusy;
+BinaryReplyStream DCCEXParser::binaryReply;
+DCCEXParser::STASH DCCEXParser::stash[PROG_QUEUE_SIZE];
+byte DCCEXParser::stashHead=0;
+byte DCCEXParser::stashCount=0;
 
-Print *DCCEXParser::stashStream = NULL;
-RingStream *DCCEXParser::stashRingStream = NULL;
-byte DCCEXParser::stashTarget=0;
 
 // This is a JMRI command parser, one instance per incoming stream
 // It doesnt know how the string got here, nor how it gets back.
@@ -71,6 +133,14 @@ byte DCCEXParser::stashTarget=0;
 // Non-DCC things like turnouts, pins and sensors are handled in additional JMRI interface classes.
 
 DCCEXParser::DCCEXParser() {}
+
+int DCCEXParser::memoryUsed() {
+#if SERIAL_RX_RING_SIZE > 0
+  return sizeof(stash)+sizeof(rxRing);
+#else
+  return sizeof(stash);
+#endif
+}
 void DCCEXParser::flush()
 {
     if (Diag::CMD)
@@ -79,16 +149,118 @@ void DCCEXParser::flush()
     inCommandPayload = false;
 }
 
+// The first stream to call loop, normally Serial, is copied into rxRing
+// whenever pullInput runs, which includes the waits for a free packet slot.
+// A burst from JMRI then only has to fit the core buffer for the time
+// between two pulls, rather than for however long the loop is busy.
+// With a SERIAL_RX_RING_SIZE of 0 the core buffer is read directly.
+Stream * DCCEXParser::rxStream=NULL;
+#if SERIAL_RX_RING_SIZE > 0
+byte DCCEXParser::rxRing[SERIAL_RX_RING_SIZE];
+uint16_t DCCEXParser::rxHead=0;
+uint16_t DCCEXParser::rxTail=0;
+#endif
+
+void DCCEXParser::pullInput() {
+#if SERIAL_RX_RING_SIZE > 0
+    if (rxStream == NULL) return;
+    uint16_t head = rxHead;
+    // Bytes that do not fit stay in the core buffer until the next pull
+    while ((uint16_t)(head - rxTail) < SERIAL_RX_RING_SIZE && rxStream->available())
+    {
+        rxRing[head & (SERIAL_RX_RING_SIZE - 1)] = rxStream->read();
+        head++;
+    }
+    rxHead = head;
+#endif
+}
+
+int DCCEXParser::nextByte(Stream &stream)
+{
+    if (replayPos < replayEnd)
+        return buffer[replayPos++];
+#if SERIAL_RX_RING_SIZE > 0
+    if (&stream == rxStream) {
+        if (rxHead == rxTail)
+            pullInput();
+        if (rxHead == rxTail)
+            return -1;
+        return rxRing[rxTail++ & (SERIAL_RX_RING_SIZE - 1)];
+    }
+#endif
+    return stream.available() ? stream.read() : -1;
+}
+
+// A byte with the top bit set that is noise rather than the start of a
+// frame shows up as a wrong check byte or a stall part way through. The
+// bytes taken after it are then read again as text from the buffer, ahead
+// of anything left over from an earlier drop. Each byte read again adds
+// at most one to bufferLength, so the text never overwrites the bytes
+// still to be read.
+void DCCEXParser::dropFrame()
+{
+    if (Diag::CMD)
+        DIAG(F("Binary frame dropped"));
+    byte stored = bufferLength <= MAX_BUFFER ? bufferLength : MAX_BUFFER + 1;
+    byte left = replayEnd - replayPos;
+    memmove(buffer + stored, buffer + replayPos, left);
+    replayPos = 1;
+    replayEnd = stored + left;
+    binaryRemaining = 0;
+    bufferLength = 0;
+}
+
 void DCCEXParser::loop(Stream &stream)
 {
-    while (stream.available())
+    if (rxStream == NULL)
+        rxStream = &stream;
+    if (&stream == rxStream)
+        pullInput();
+    // Every complete command waiting is parsed, up to MAX_BATCH so
+    // a long burst still lets the rest of the loop run in between.
+    byte parsed = 0;
+    int next;
+    while (parsed < MAX_BATCH && (next = nextByte(stream)) >= 0)
     {
+        if (binaryRemaining)
+        {
+            // collecting a binary frame, the length byte is in buffer[0]
+            byte b = next;
+            if (bufferLength <= MAX_BUFFER) buffer[bufferLength] = b;
+            bufferLength++;
+            binaryLastByte = millis();
+            if (--binaryRemaining) {
+                binaryCheck ^= b;
+                continue;
+            }
+            if (b != binaryCheck) {
+                dropFrame();
+                continue;
+            }
+            unsigned long started = micros();
+            CommandDistributor::setOrigin(&stream);
+            if (bufferLength <= MAX_BUFFER) parseBinary(&stream, buffer, bufferLength, NULL);
+            else if (Diag::CMD) DIAG(F("Binary frame too long"));
+            CommandDistributor::setOrigin(NULL);
+            if (Diag::RECORD && bufferLength <= MAX_BUFFER) CommandDistributor::record(-1, buffer, bufferLength, started);
+            bufferLength = 0;
+            parsed++;
+            continue;
+        }
         if (bufferLength == MAX_BUFFER)
         {
             flush();
         }
-        char ch = stream.read();
-        if (ch == '<')
+        char ch = next;
+        if (!inCommandPayload && BinaryProtocol::isFrame(ch))
+        {
+            binaryRemaining = BinaryProtocol::payloadLength(ch) + 1;
+            binaryCheck = ch;
+            binaryLastByte = millis();
+            buffer[0] = ch;
+            bufferLength = 1;
+        }
+        else if (ch == '<')
         {
             inCommandPayload = true;
             bufferLength = 0;
@@ -97,19 +269,25 @@ void DCCEXParser::loop(Stream &stream)
         else if (ch == '>')
         {
             buffer[bufferLength] = '\0';
+            unsigned long started = micros();
+            CommandDistributor::setOrigin(&stream);
             parse(&stream, buffer, NULL); // Parse this (No ringStream for serial)
+            CommandDistributor::setOrigin(NULL);
+            if (Diag::RECORD) CommandDistributor::record(-1, buffer, bufferLength, started);
             inCommandPayload = false;
-            break;
+            parsed++;
         }
         else if (inCommandPayload)
         {
             buffer[bufferLength++] = ch;
         }
     }
-    Sensor::checkAll(&stream); // Update and print changes
+    if (next < 0 && binaryRemaining && millis() - binaryLastByte > BinaryProtocol::FRAME_TIMEOUT_MS)
+        dropFrame();
+    Sensor::checkAll(); // Update and broadcast changes
 }
 
-int16_t DCCEXParser::splitValues(int16_t result[MAX_COMMAND_PARAMS], const byte *cmd)
+int16_t DCCEXParser::splitValues(int16_t result[MAX_COMMAND_PARAMS], const byte *cmd, byte maxParams)
 {
     byte state = 1;
     byte parameterCount = 0;
@@ -121,7 +299,7 @@ int16_t DCCEXParser::splitValues(int16_t result[MAX_COMMAND_PARAMS], const byte
     for (int16_t i = 0; i < MAX_COMMAND_PARAMS; i++)
         result[i] = 0;
 
-    while (parameterCount < MAX_COMMAND_PARAMS)
+    while (parameterCount < maxParams)
     {
         byte hot = *remainingCmd;
 
@@ -261,14 +439,53 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
     int16_t p[MAX_COMMAND_PARAMS];
     while (com[0] == '<' || com[0] == ' ')
         com++; // strip off any number of < or spaces
-    byte params = splitValues(p, com);
     byte opcode = com[0];
+    // Only split as many parameters as the opcode can use, plus one to detect extras.
+    byte maxParams = (getArity(opcode) & 0x0F) + 1;
+    byte params = splitValues(p, com, maxParams > MAX_COMMAND_PARAMS ? MAX_COMMAND_PARAMS : maxParams);
+    execute(stream, com, opcode, params, p, ringStream);
+}
+
+// A binary frame (see BinaryProtocol.h) carries the same opcode and parameters 
+// as the text command. The replies are converted to binary frames on the way out.
+void DCCEXParser::parseBinary(Print *stream, const byte *frame, int length, RingStream * ringStream)
+{
+    byte payload = BinaryProtocol::payloadLength(frame[0]);
+    if (payload == 0 || length < payload + 2 || BinaryProtocol::check(frame, payload + 1) != frame[payload + 1])
+        return; // empty, truncated or corrupt frame
+    int16_t p[MAX_COMMAND_PARAMS];
+    for (byte i = 0; i < MAX_COMMAND_PARAMS; i++)
+        p[i] = 0;
+    byte opcode = frame[1];
+    int params = BinaryProtocol::decodeParams(frame + 2, payload - 1, p, MAX_COMMAND_PARAMS);
+    if (Diag::CMD)
+        DIAG(F("PARSING BINARY:%c params=%d"), opcode, params);
+    binaryReply.begin(stream);
+    if (params < 0)
+        StringFormatter::send(&binaryReply, F("<X>\n"));
+    else
+        execute(&binaryReply, NULL, opcode, params, p, ringStream);
+    binaryReply.end();
+}
 
+// Execute a command from either the text or the binary protocol.
+// com is the text command, NULL if the command arrived as binary.
+void DCCEXParser::execute(Print *stream, byte *com, byte opcode, byte params, int16_t p[], RingStream * ringStream)
+{
     if (filterCallback)
         filterCallback(stream, opcode, params, p);
     if (filterRMFTCallback && opcode!='\0')
         filterRMFTCallback(stream, opcode, params, p);
 
+    // Wrong number of parameters for a known opcode is an <X> 
+    if (opcode != '\0') {
+        byte arity = getArity(opcode);
+        if (params < (arity >> 4) || params > (arity & 0x0F)) {
+            StringFormatter::send(stream, F("<X>\n"));
+            return; 
+        }
+    }
+
     // Functions return from this switch if complete, break from switch implies error <X> to send
     switch (opcode)
     {
@@ -349,6 +566,11 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
         }
         return;
      
+    case 'A': // EXTENDED ACCESSORY <A LINEARADDRESS ASPECT> or resend all aspects <A>
+        if (params==0) DCC::resendAspects();
+        else if (params!=2 || (p[1] & 0xFF) != p[1] || !DCC::setExtendedAccessory(p[0], p[1])) break;
+        return;
+
     case 'T': // TURNOUT  <T ...>
         if (parseT(stream, params, p))
             return;
@@ -359,11 +581,22 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
             return;
         break;
 
+    case 'C': // CONSIST <C ...>
+        if (parseC(stream, params, p))
+            return;
+        break;
+
     case 'S': // SENSOR <S ...>
         if (parseS(stream, params, p))
             return;
         break;
 
+    case 'm': // MOMENTUM <m CAB ACCEL DECEL [VMAX]>
+        if ((p[1] & 0xFF) != p[1] || (p[2] & 0xFF) != p[2]) break;
+        if (!DCC::setMomentum(p[0], p[1], p[2], params==4 ? p[3] : 127)) break;
+        StringFormatter::send(stream, F("<O>\n"));
+        return;
+
     case 'w': // WRITE CV on MAIN <w CAB CV VALUE>
         DCC::writeCVByteMain(p[0], p[1], p[2]);
         return;
@@ -374,16 +607,17 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
 
     case 'M': // WRITE TRANSPARENT DCC PACKET MAIN <M REG X1 ... X9>
     case 'P': // WRITE TRANSPARENT DCC PACKET PROG <P REG X1 ... X9>
-        // Re-parse the command using a hex-only splitter
-        params=splitHexValues(p,com)-1; // drop REG
-        if (params<1) break;  
+        // Re-parse the command using a hex-only splitter (binary params are bytes already)
+        if (com) params=splitHexValues(p,com);
+        if (params<2) break; // need REG and at least one byte 
+        params--;  // drop REG
         {
           byte packet[params];
           for (int i=0;i<params;i++) {
             packet[i]=(byte)p[i+1];
             if (Diag::CMD) DIAG(F("packet[%d]=%d (0x%x)"), i, packet[i], packet[i]);
           }
-          (opcode=='M'?DCCWaveform::mainTrack:DCCWaveform::progTrack).schedulePacket(packet,params,3);  
+          if (!(opcode=='M'?DCCWaveform::mainTrack:DCCWaveform::progTrack).schedulePacket(packet,params,3)) break;  
         }
         return;
         
@@ -483,18 +717,34 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
         return;
 
     case '!': // ESTOP ALL  <!>
-        DCC::setThrottle(0,1,1); // this broadcasts speed 1(estop) and sets all reminders to speed 1. 
+        DCC::estopAll(); // broadcasts speed 1(estop) at once and sets all reminders to speed 1. 
         return;
 
-    case 'c': // SEND METER RESPONSES <c>
+    case 'c': // SEND METER RESPONSES <c>, CURRENT TELEMETRY <c MS>
+        if (params==1) {
+          if (p[0]<0 || !CommandDistributor::setTelemetry(p[0])) break;
+          StringFormatter::send(stream, F("<O>\n"));
+          return;
+        }
         //                               <c MeterName value C/V unit min max res warn>
         StringFormatter::send(stream, F("<c CurrentMAIN %d C Milli 0 %d 1 %d>\n"), DCCWaveform::mainTrack.getCurrentmA(), 
             DCCWaveform::mainTrack.getMaxmA(), DCCWaveform::mainTrack.getTripmA());
+        for (byte d=0; d<DCCWaveform::getDistrictCount(); d++) {
+          DCCDistrict * district=DCCWaveform::getDistrict(d);
+          StringFormatter::send(stream, F("<c Current%S %d C Milli 0 %d 1 %d>\n"), district->getName(),
+              district->getCurrentmA(), district->getMaxmA(), district->getTripmA());
+        }
         StringFormatter::send(stream, F("<a %d>\n"), DCCWaveform::mainTrack.get1024Current()); //'a' message deprecated, remove once JMRI 4.22 is available
         return;
 
-    case 'Q': // SENSORS <Q>
-        Sensor::printAll(stream);
+    case 'Q': // SENSORS <Q>, CHANGES AS BITMAPS <Q BITMAP ON/OFF>
+        if (params==0) {
+          Sensor::printAll(stream);
+          return;
+        }
+        if (params!=2 || p[0]!=HASH_KEYWORD_BITMAP) break;
+        if (!CommandDistributor::setSensorBitmap(p[1]==1 || p[1]==HASH_KEYWORD_ON)) break;
+        StringFormatter::send(stream, F("<O>\n"));
         return;
 
     case 's': // <s>
@@ -542,7 +792,7 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
         return;
 
     case '+': // Complex Wifi interface command (not usual parse)
-        if (atCommandCallback) {
+        if (atCommandCallback && com) {
           DCCWaveform::mainTrack.setPowerMode(POWERMODE::OFF);
           DCCWaveform::progTrack.setPowerMode(POWERMODE::OFF);
           atCommandCallback(com);
@@ -565,6 +815,15 @@ void DCCEXParser::parse(Print *stream, byte *com, RingStream * ringStream)
 bool DCCEXParser::parseZ(Print *stream, int16_t params, int16_t p[])
 {
 
+    if (params>=3 && (params & 1) && p[0]==HASH_KEYWORD_GROUP) // <Z GROUP ID ACTIVATE ...>
+    {
+        if (!Output::activateGroup(p+1, params/2))
+            return false;
+        for (int i=1; i<params; i+=2)
+            StringFormatter::send(stream, F("<Y %d %d>\n"), p[i], p[i+1]);
+        return true;
+    }
+
     switch (params)
     {
     
@@ -605,6 +864,29 @@ bool DCCEXParser::parseZ(Print *stream, int16_t params, int16_t p[])
     }
 }
 
+//===================================
+bool DCCEXParser::parseC(Print *stream, int16_t params, int16_t p[])
+{
+    switch (params)
+    {
+    case 0: // <C> list consists
+        Consist::printAll(stream);
+        return true;
+
+    case 1: // <C ID> delete consist
+        if (p[0] < 1 || p[0] > 127 || !Consist::remove(p[0]))
+            return false;
+        break;
+
+    default: // <C ID LOCO1 LOCO2 ...>
+        if (p[0] < 1 || p[0] > 127 || !Consist::create(p[0], params - 1, p + 1))
+            return false;
+        break;
+    }
+    StringFormatter::send(stream, F("<O>\n"));
+    return true;
+}
+
 //===================================
 bool DCCEXParser::parsef(Print *stream, int16_t params, int16_t p[])
 {
@@ -675,7 +957,7 @@ bool DCCEXParser::parseT(Print *stream, int16_t params, int16_t p[])
         Turnout *tt = Turnout::get(p[0]);
         if (!tt)
             return false;
-        tt->activate(p[1]);
+        Turnout::activate(p[0], p[1]); // tells the other clients too
         StringFormatter::send(stream, F("<H %d %d>\n"), tt->data.id, (tt->data.tStatus & STATUS_ACTIVE)!=0);
     }
         return true;
@@ -697,7 +979,8 @@ bool DCCEXParser::parseS(Print *stream, int16_t params, int16_t p[])
     switch (params)
     {
     case 3: // <S id pin pullup>  create sensor. pullUp indicator (0=LOW/1=HIGH)
-        if (!Sensor::create(p[0], p[1], p[2]))
+    case 4: // <S id pin pullup debounce> debounce in ms
+        if (!Sensor::create(p[0], p[1], p[2], params==4 ? p[3] : 0))
           return false;
         StringFormatter::send(stream, F("<O>\n"));
         return true;
@@ -713,7 +996,10 @@ bool DCCEXParser::parseS(Print *stream, int16_t params, int16_t p[])
 	    return false;
         for (Sensor *tt = Sensor::firstSensor; tt != NULL; tt = tt->nextSensor)
         {
-            StringFormatter::send(stream, F("<Q %d %d %d>\n"), tt->data.snum, tt->data.pin, tt->data.pullUp);
+            if (tt->data.debounce) 
+                StringFormatter::send(stream, F("<Q %d %d %d %d>\n"), tt->data.snum, tt->data.pin, tt->data.pullUp, tt->data.debounce);
+            else
+                StringFormatter::send(stream, F("<Q %d %d %d>\n"), tt->data.snum, tt->data.pin, tt->data.pullUp);
         }
         return true;
 
@@ -738,9 +1024,51 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
         StringFormatter::send(stream, F("Free memory=%d\n"), minimumFreeMemory());
         break;
 
-    case HASH_KEYWORD_ACK: // <D ACK ON/OFF> <D ACK [LIMIT|MIN|MAX] Value>
+    case HASH_KEYWORD_STATS: // <D STATS> <D STATS RESET>
+        if (params >= 2 && p[1] == HASH_KEYWORD_RESET) {
+          DCCWaveform::mainTrack.resetStats();
+          DCCWaveform::progTrack.resetStats();
+        } else {
+          DCCWaveform::mainTrack.showStats(stream);
+          DCCWaveform::progTrack.showStats(stream);
+        }
+        return true;
+
+    case HASH_KEYWORD_ISR: // <D ISR> <D ISR RESET>
+        if (params >= 2 && p[1] == HASH_KEYWORD_RESET) DCCWaveform::resetIsrTiming();
+        else DCCWaveform::showIsrTiming(stream);
+        return true;
+
+    case HASH_KEYWORD_TRACE: // <D TRACE>
+        DCCWaveform::mainTrack.showTrace(stream);
+        DCCWaveform::progTrack.showTrace(stream);
+        return true;
+
+    case HASH_KEYWORD_BENCH: // <D BENCH>
+        Benchmark::run(stream);
+        return true;
+
+    case HASH_KEYWORD_MEMORY: // <D MEMORY>
+        BoardProfile::showMemory(stream);
+        return true;
+
+    case HASH_KEYWORD_RAILCOM: // <D RAILCOM ON/OFF>
+        if (!DCCWaveform::setRailcom(onOff))
+          StringFormatter::send(stream, F("RailCom not built, define RAILCOM_CUTOUT\n"));
+        return true;
+
+    case HASH_KEYWORD_PROFILE: // <D PROFILE> <D PROFILE RESET>
+        if (params >= 2 && p[1] == HASH_KEYWORD_RESET) Profiler::reset();
+        else Profiler::show(stream);
+        return true;
+
+    case HASH_KEYWORD_ACK: // <D ACK ON/OFF> <D ACK [LIMIT|MIN|MAX] Value> <D ACK AUTO ON/OFF>
 	if (params >= 3) {
-	    if (p[1] == HASH_KEYWORD_LIMIT) {
+	    if (p[1] == HASH_KEYWORD_AUTO) {
+	      bool autoOn = p[2] == 1 || p[2] == HASH_KEYWORD_ON;
+	      DCCWaveform::progTrack.setAckAuto(autoOn);
+	      StringFormatter::send(stream, F("Ack auto %S\n"), autoOn ? F("on") : F("off"));
+	    } else if (p[1] == HASH_KEYWORD_LIMIT) {
 	      DCCWaveform::progTrack.setAckLimit(p[2]);
 	      StringFormatter::send(stream, F("Ack limit=%dmA\n"), p[2]);
 	    } else if (p[1] == HASH_KEYWORD_MIN) {
@@ -760,6 +1088,10 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
         Diag::CMD = onOff;
         return true;
 
+    case HASH_KEYWORD_RECORD: // <D RECORD ON/OFF>
+        Diag::RECORD = onOff;
+        return true;
+
     case HASH_KEYWORD_WIFI: // <D WIFI ON/OFF>
         Diag::WIFI = onOff;
         return true;
@@ -782,8 +1114,12 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
 
     case HASH_KEYWORD_RESET:
         {
+#if defined(ARDUINO_ARCH_RP2040)
+          rp2040.reboot();
+#else
           wdt_enable( WDTO_15MS); // set Arduino watchdog timer for 15ms 
           delay(50);            // wait for the prescaller time to expire          
+#endif
           break; // and <X> if we didnt restart 
         }
         
@@ -809,33 +1145,47 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
 }
 
 // CALLBACKS must be static
+// Prog track requests are queued by DCC and complete in the order they were made, 
+// so each stash is kept in a queue of the same size and the callback uses the oldest.
 bool DCCEXParser::stashCallback(Print *stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream)
 {
-    if (stashBusy )
+    if (stashCount >= PROG_QUEUE_SIZE || DCC::isProgQueueFull())
         return false;
-    stashBusy = true;
-    stashStream = stream;
-    stashRingStream=ringStream;
-    if (ringStream) stashTarget= ringStream->peekTargetMark();
-    memcpy(stashP, p, MAX_COMMAND_PARAMS * sizeof(p[0]));
+    STASH & entry = stash[(stashHead + stashCount) % PROG_QUEUE_SIZE];
+    stashCount++;
+    entry.binary = (stream == &binaryReply);
+    entry.stream = entry.binary ? binaryReply.getTarget() : stream;
+    entry.ringStream=ringStream;
+    if (ringStream) entry.target= ringStream->peekTargetMark();
+    memcpy(entry.p, p, STASH_PARAMS * sizeof(p[0]));
     return true;
 }
 
 Print * DCCEXParser::getAsyncReplyStream() {
-       if (stashRingStream) {
-           stashRingStream->mark(stashTarget);
-           return stashRingStream;
+       STASH & entry = stash[stashHead];
+       Print * reply = entry.stream;
+       if (entry.ringStream) {
+           entry.ringStream->mark(entry.target);
+           reply = entry.ringStream;
+       }
+       if (entry.binary) {
+           binaryReply.begin(reply);
+           reply = &binaryReply;
        }
-       return stashStream;
+       return reply;
 }
 
 void DCCEXParser::commitAsyncReplyStream() {
-     if (stashRingStream) stashRingStream->commit();
-     stashBusy = false;
+     STASH & entry = stash[stashHead];
+     if (entry.binary) binaryReply.end();
+     if (entry.ringStream) entry.ringStream->commit();
+     stashHead = (stashHead + 1) % PROG_QUEUE_SIZE;
+     stashCount--;
 }
 
 void DCCEXParser::callback_W(int16_t result)
 {
+    int16_t * stashP = stash[stashHead].p;
     StringFormatter::send(getAsyncReplyStream(),
           F("<r%d|%d|%d %d>\n"), stashP[2], stashP[3], stashP[0], result == 1 ? stashP[1] : -1);
     commitAsyncReplyStream();
@@ -843,23 +1193,27 @@ void DCCEXParser::callback_W(int16_t result)
 
 void DCCEXParser::callback_B(int16_t result)
 {
+    int16_t * stashP = stash[stashHead].p;
     StringFormatter::send(getAsyncReplyStream(), 
           F("<r%d|%d|%d %d %d>\n"), stashP[3], stashP[4], stashP[0], stashP[1], result == 1 ? stashP[2] : -1);
     commitAsyncReplyStream();
 }
 void DCCEXParser::callback_Vbit(int16_t result)
 {
+    int16_t * stashP = stash[stashHead].p;
     StringFormatter::send(getAsyncReplyStream(), F("<v %d %d %d>\n"), stashP[0], stashP[1], result);
     commitAsyncReplyStream();
 }
 void DCCEXParser::callback_Vbyte(int16_t result)
 {
+    int16_t * stashP = stash[stashHead].p;
     StringFormatter::send(getAsyncReplyStream(), F("<v %d %d>\n"), stashP[0], result);
     commitAsyncReplyStream();
 }
 
 void DCCEXParser::callback_R(int16_t result)
 {
+    int16_t * stashP = stash[stashHead].p;
     StringFormatter::send(getAsyncReplyStream(), F("<r%d|%d|%d %d>\n"), stashP[1], stashP[2], stashP[0], result);
     commitAsyncReplyStream();
 }
@@ -872,6 +1226,7 @@ void DCCEXParser::callback_Rloco(int16_t result)
 
 void DCCEXParser::callback_Wloco(int16_t result)
 {
+    int16_t * stashP = stash[stashHead].p;
     if (result==1) result=stashP[0]; // pick up original requested id from command
     StringFormatter::send(getAsyncReplyStream(), F("<w %d>\n"), result);
     commitAsyncReplyStream();
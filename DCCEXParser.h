@@ -21,6 +21,8 @@
 #include <Arduino.h>
 #include "FSH.h"
 #include "RingStream.h"
+#include "BinaryProtocol.h"
+#include "DCC.h"
 
 typedef void (*FILTER_CALLBACK)(Print * stream, byte & opcode, byte & paramCount, int16_t p[]);
 typedef void (*AT_COMMAND_CALLBACK)(const byte * command);
@@ -31,23 +33,42 @@ struct DCCEXParser
    void loop(Stream & stream);
    void parse(Print * stream,  byte * command,  RingStream * ringStream);
    void parse(const FSH * cmd);
+   void parseBinary(Print * stream, const byte * frame, int length, RingStream * ringStream);
    void flush();
    static void setFilter(FILTER_CALLBACK filter);
    static void setRMFTFilter(FILTER_CALLBACK filter);
    static void setAtCommandCallback(AT_COMMAND_CALLBACK filter);
    static const int MAX_COMMAND_PARAMS=10;  // Must not exceed this
+   static int memoryUsed();  // bytes in the shared prog track stash and serial ring
+   static void pullInput();  // copy waiting serial input into the ring, safe from any wait
  
    private:
   
-    static const int16_t MAX_BUFFER=50;  // longest command sent in
+    static const int16_t MAX_BUFFER=PARSER_BUFFER_SIZE;  // longest command sent in
      byte  bufferLength=0;
      bool  inCommandPayload=false;
+     byte  binaryRemaining=0;   // payload and check bytes still to come of a binary frame
+     byte  binaryCheck=0;       // the frame's bytes so far XORed together
+     unsigned long binaryLastByte=0;  // millis() of the frame's latest byte
+     byte  replayPos=0;         // bytes of a dropped frame, read again as text
+     byte  replayEnd=0;
      byte  buffer[MAX_BUFFER+2]; 
-    int16_t splitValues( int16_t result[MAX_COMMAND_PARAMS], const byte * command);
+    static const byte MAX_BATCH=8;   // commands parsed in one loop call
+    static Stream * rxStream;
+#if SERIAL_RX_RING_SIZE > 0
+    static byte rxRing[SERIAL_RX_RING_SIZE];
+    static uint16_t rxHead;
+    static uint16_t rxTail;
+#endif
+    int nextByte(Stream & stream);
+    void dropFrame();
+    int16_t splitValues( int16_t result[MAX_COMMAND_PARAMS], const byte * command, byte maxParams=MAX_COMMAND_PARAMS);
     int16_t splitHexValues( int16_t result[MAX_COMMAND_PARAMS], const byte * command);
      
+     void execute(Print * stream, byte * com, byte opcode, byte params, int16_t p[], RingStream * ringStream);
      bool parseT(Print * stream, int16_t params, int16_t p[]);
      bool parseZ(Print * stream, int16_t params, int16_t p[]);
+     bool parseC(Print * stream, int16_t params, int16_t p[]);
      bool parseS(Print * stream,  int16_t params, int16_t p[]);
      bool parsef(Print * stream,  int16_t params, int16_t p[]);
      bool parseD(Print * stream,  int16_t params, int16_t p[]);
@@ -55,12 +76,17 @@ struct DCCEXParser
      static Print * getAsyncReplyStream();
      static void commitAsyncReplyStream();
 
-    static bool stashBusy;
-    static byte stashTarget;
-    static Print * stashStream;
-    static RingStream * stashRingStream;
-    
-    static int16_t stashP[MAX_COMMAND_PARAMS];
+    static const byte STASH_PARAMS=5;  // enough for the longest prog track command
+    struct STASH {
+      Print * stream;
+      RingStream * ringStream;
+      byte target;
+      bool binary;     // reply in binary frames
+      int16_t p[STASH_PARAMS];
+    };
+    static STASH stash[PROG_QUEUE_SIZE];
+    static byte stashHead;
+    static byte stashCount;
     bool stashCallback(Print * stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream);
     static void callback_W(int16_t result);
     static void callback_B(int16_t result);        
@@ -72,6 +98,7 @@ struct DCCEXParser
     static FILTER_CALLBACK  filterCallback;
     static FILTER_CALLBACK  filterRMFTCallback;
     static AT_COMMAND_CALLBACK  atCommandCallback;
+    static BinaryReplyStream binaryReply;
     static void funcmap(int16_t cab, byte value, byte fstart, byte fstop);
 
 };
@@ -43,7 +43,9 @@
  */
 
 #include "DCCTimer.h"
-const int DCC_SIGNAL_TIME=58;  // this is the 58uS DCC 1-bit waveform half-cycle 
+#ifndef UNUSED_PIN     // sync define with the one in MotorDriver.h
+#define UNUSED_PIN 127 // inside int8_t
+#endif
 const long CLOCK_CYCLES=(F_CPU / 1000000 * DCC_SIGNAL_TIME) >>1;
 
 INTERRUPT_CALLBACK interruptHandler=0;
@@ -71,6 +73,16 @@ INTERRUPT_CALLBACK interruptHandler=0;
     interruptHandler();
   }
 
+#if defined(ISR_TIMING)
+  // TCB0 restarts from 0 at each tick, a raised flag means the next tick is due
+  void DCCTimer::isrTimingStart() {}
+  unsigned int DCCTimer::isrMicros() {
+    unsigned int ticks=TCB0.CNT;
+    if (TCB0.INTFLAGS & TCB_CAPT_bm) return DCC_SIGNAL_TIME;
+    return ticks / (F_CPU / 2000000);
+  }
+#endif
+
   bool DCCTimer::isPWMPin(byte pin) {
        (void) pin; 
        return false;  // TODO what are the relevant pins? 
@@ -82,6 +94,22 @@ INTERRUPT_CALLBACK interruptHandler=0;
     // TODO what are the relevant pins?
  }
 
+  bool DCCTimer::beginBits(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+    return false;
+  }
+
+  void DCCTimer::setPWMPeriod(byte pin, DCC_PERIOD period) {
+    (void) pin;
+    (void) period;
+  }
+
+  bool DCCTimer::beginStream(STREAM_CALLBACK callback, volatile void * outRegister) {
+    (void) callback;
+    (void) outRegister;
+    return false;
+  }
+
   void   DCCTimer::getSimulatedMacAddress(byte mac[6]) {
     memcpy(mac,(void *) &SIGROW.SERNUM0,6);  // serial number
     mac[0] &= 0xFE;
@@ -93,11 +121,31 @@ INTERRUPT_CALLBACK interruptHandler=0;
 
   void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
     interruptHandler=callback;
+#if defined(ISR_TIMING)
+    // Make sure the cycle counter is running
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
 
   myDCCTimer.begin(interruptHandler, DCC_SIGNAL_TIME);
 
   }
 
+#if defined(ISR_TIMING)
+  // The DWT cycle counter runs free, so measure from entry to the handler
+  static uint32_t isrStartCycles;
+  void DCCTimer::isrTimingStart() {
+    isrStartCycles=ARM_DWT_CYCCNT;
+  }
+  unsigned int DCCTimer::isrMicros() {
+  #if defined(F_CPU_ACTUAL)
+    return (ARM_DWT_CYCCNT-isrStartCycles) / (F_CPU_ACTUAL / 1000000);
+  #else
+    return (ARM_DWT_CYCCNT-isrStartCycles) / (F_CPU / 1000000);
+  #endif
+  }
+#endif
+
   bool DCCTimer::isPWMPin(byte pin) {
        //Teensy: digitalPinHasPWM, todo
       (void) pin;
@@ -110,6 +158,22 @@ INTERRUPT_CALLBACK interruptHandler=0;
     (void) high;
 }
 
+  bool DCCTimer::beginBits(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+    return false;
+  }
+
+  void DCCTimer::setPWMPeriod(byte pin, DCC_PERIOD period) {
+    (void) pin;
+    (void) period;
+  }
+
+  bool DCCTimer::beginStream(STREAM_CALLBACK callback, volatile void * outRegister) {
+    (void) callback;
+    (void) outRegister;
+    return false;
+  }
+
   void   DCCTimer::getSimulatedMacAddress(byte mac[6]) {
 #if defined(__IMXRT1062__)  //Teensy 4.0 and Teensy 4.1
     uint32_t m1 = HW_OCOTP_MAC1;
@@ -146,21 +210,293 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
 }
 #endif
 
+#elif defined(ARDUINO_ARCH_RP2040)
+// Raspberry Pi Pico class boards (arduino-pico core). The waveform interrupt
+// runs on core 1 with the DCC engine in the sketch's loop1(), so the network
+// interfaces on core 0 can not delay a tick, see CORE_SPLIT. begin() is 
+// called from setup() on core 0 while core 1 waits in setup1() to claim the
+// alarm, as an alarm interrupts the core that created its pool.
+  #include <pico/time.h>
+  #include <pico/unique_id.h>
+
+  static volatile bool core1Start=false;
+  static repeating_timer_t dccTimer;
+
+  static bool dccTick(repeating_timer_t * timer) {
+    (void) timer;
+    interruptHandler();
+    return true;  // keep repeating
+  }
+
+  void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
+    interruptHandler=callback;
+    core1Start=true;
+  }
+
+  void setup1() {
+    while (!core1Start) tight_loop_contents();
+    alarm_pool_t * pool=alarm_pool_create(2, 4);  // hardware alarm 2, the default pool has 3
+    // a negative delay times each tick from the start of the previous one
+    alarm_pool_add_repeating_timer_us(pool, -DCC_SIGNAL_TIME, dccTick, NULL, &dccTimer);
+  }
+
+#if defined(ISR_TIMING)
+  static uint32_t isrStartMicros;
+  void DCCTimer::isrTimingStart() {
+    isrStartMicros=time_us_32();
+  }
+  unsigned int DCCTimer::isrMicros() {
+    return time_us_32()-isrStartMicros;
+  }
+#endif
+
+  bool DCCTimer::isPWMPin(byte pin) {
+    (void) pin;
+    return false;
+  }
+
+  void DCCTimer::setPWM(byte pin, bool high) {
+    (void) pin;
+    (void) high;
+  }
+
+  bool DCCTimer::beginBits(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+    return false;
+  }
+
+  void DCCTimer::setPWMPeriod(byte pin, DCC_PERIOD period) {
+    (void) pin;
+    (void) period;
+  }
+
+  bool DCCTimer::beginStream(STREAM_CALLBACK callback, volatile void * outRegister) {
+    (void) callback;
+    (void) outRegister;
+    return false;
+  }
+
+  void DCCTimer::getSimulatedMacAddress(byte mac[6]) {
+    // last 6 bytes of the 64 bit flash id
+    pico_unique_board_id_t id;
+    pico_get_unique_board_id(&id);
+    for (byte i=0; i<6; i++) mac[i]=id.id[i+2];
+    mac[0] &= 0xFE;
+    mac[0] |= 0x02;
+  }
+
+#elif defined(ARDUINO_ARCH_SAMD)
+  // SAMD21: TCC0 counts the 48MHz clock and overflows every 58uS. The overflow
+  // either interrupts to run the handler as on the other boards, or in stream
+  // mode triggers a DMA beat that writes the next toggle mask to the port.
+  const unsigned int TICK_CYCLES=F_CPU / 1000000 * DCC_SIGNAL_TIME;
+
+  static void startTCC0(bool interrupt) {
+    PM->APBCMASK.reg |= PM_APBCMASK_TCC0;
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID(TCC0_GCLK_ID);
+    while (GCLK->STATUS.bit.SYNCBUSY);
+    TCC0->CTRLA.reg = TCC_CTRLA_SWRST;
+    while (TCC0->SYNCBUSY.bit.SWRST);
+    TCC0->WAVE.reg = TCC_WAVE_WAVEGEN_NFRQ;
+    while (TCC0->SYNCBUSY.bit.WAVE);
+    TCC0->PER.reg = TICK_CYCLES-1;
+    while (TCC0->SYNCBUSY.bit.PER);
+    if (interrupt) {
+      TCC0->INTENSET.reg = TCC_INTENSET_OVF;
+      NVIC_SetPriority(TCC0_IRQn, 0);
+      NVIC_EnableIRQ(TCC0_IRQn);
+    }
+    TCC0->CTRLA.reg = TCC_CTRLA_PRESCALER_DIV1 | TCC_CTRLA_ENABLE;
+    while (TCC0->SYNCBUSY.bit.ENABLE);
+  }
+
+  void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
+    interruptHandler=callback;
+    noInterrupts();
+    startTCC0(true);
+    interrupts();
+  }
+
+  // ISR called by timer interrupt every 58uS
+  extern "C" void TCC0_Handler(void) {
+    TCC0->INTFLAG.reg = TCC_INTFLAG_OVF;
+    interruptHandler();
+  }
+
+#if defined(ISR_TIMING)
+  // TCC0 restarts from 0 at each tick, a raised flag means the next tick is due
+  void DCCTimer::isrTimingStart() {}
+  unsigned int DCCTimer::isrMicros() {
+    TCC0->CTRLBSET.reg = TCC_CTRLBSET_CMD_READSYNC;
+    while (TCC0->SYNCBUSY.bit.CTRLB || TCC0->SYNCBUSY.bit.COUNT);
+    unsigned int ticks=TCC0->COUNT.reg;
+    if (TCC0->INTFLAG.bit.OVF) return DCC_SIGNAL_TIME;
+    return ticks / (F_CPU / 1000000);
+  }
+#endif
+
+// Stream mode: DMA channel 0 walks a ring of two linked descriptors, one per
+// buffer, writing a word to the port OUTTGL register on each TCC0 overflow.
+// The block complete interrupt refills the buffer that has just been sent
+// while the other one plays, so the CPU is only needed every DCC_STREAM_TICKS.
+// Not started if anything else has already enabled the DMA controller.
+  const byte STREAM_CHANNEL=0;
+  static DmacDescriptor dmaDescriptors[STREAM_CHANNEL+1] __attribute__ ((aligned (16)));
+  static DmacDescriptor dmaWriteback[STREAM_CHANNEL+1] __attribute__ ((aligned (16)));
+  static DmacDescriptor dmaSecond __attribute__ ((aligned (16)));
+  static uint32_t streamBuffers[2][DCC_STREAM_TICKS];
+  static volatile byte streamNext;   // buffer to refill at the next block end
+  static STREAM_CALLBACK streamCallback;
+
+  bool DCCTimer::beginStream(STREAM_CALLBACK callback, volatile void * outRegister) {
+    byte group;
+    for (group=0; group<PORT_GROUPS && outRegister!=&PORT->Group[group].OUT.reg; group++);
+    if (group==PORT_GROUPS || (DMAC->CTRL.reg & DMAC_CTRL_DMAENABLE)) return false;
+    streamCallback=callback;
+    for (byte b=0; b<2; b++) {
+      callback(streamBuffers[b]);
+      DmacDescriptor & descriptor= b==0 ? dmaDescriptors[STREAM_CHANNEL] : dmaSecond;
+      descriptor.BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_WORD | DMAC_BTCTRL_SRCINC;
+      descriptor.BTCNT.reg = DCC_STREAM_TICKS;
+      descriptor.SRCADDR.reg = (uint32_t)&streamBuffers[b][DCC_STREAM_TICKS]; // end address as the source increments
+      descriptor.DSTADDR.reg = (uint32_t)&PORT->Group[group].OUTTGL.reg;
+      descriptor.DESCADDR.reg = (uint32_t)(b==0 ? &dmaSecond : &dmaDescriptors[STREAM_CHANNEL]);
+    }
+    streamNext=0;
+    noInterrupts();
+    PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+    PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+    DMAC->BASEADDR.reg = (uint32_t)dmaDescriptors;
+    DMAC->WRBADDR.reg = (uint32_t)dmaWriteback;
+    DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xF);
+    DMAC->CHID.reg = DMAC_CHID_ID(STREAM_CHANNEL);
+    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+    while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST);
+    DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(TCC0_DMAC_ID_OVF) | DMAC_CHCTRLB_TRIGACT_BEAT;
+    DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL;
+    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+    NVIC_SetPriority(DMAC_IRQn, 0);
+    NVIC_EnableIRQ(DMAC_IRQn);
+    startTCC0(false);
+    interrupts();
+    return true;
+  }
+
+  extern "C" void DMAC_Handler(void) {
+    DMAC->CHID.reg = DMAC_CHID_ID(STREAM_CHANNEL);
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL;
+    byte buffer=streamNext;
+    streamNext=buffer^1;
+    streamCallback(streamBuffers[buffer]);
+  }
+
+  bool DCCTimer::isPWMPin(byte pin) {
+    (void) pin;
+    return false;
+  }
+
+  void DCCTimer::setPWM(byte pin, bool high) {
+    (void) pin;
+    (void) high;
+  }
+
+  bool DCCTimer::beginBits(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+    return false;
+  }
+
+  void DCCTimer::setPWMPeriod(byte pin, DCC_PERIOD period) {
+    (void) pin;
+    (void) period;
+  }
+
+  void DCCTimer::getSimulatedMacAddress(byte mac[6]) {
+    // first and last words of the 128 bit serial number
+    uint32_t m1 = *(volatile uint32_t *)0x0080A00C;
+    uint32_t m2 = *(volatile uint32_t *)0x0080A048;
+    mac[0] = m1 >> 8;
+    mac[1] = m1 >> 0;
+    mac[2] = m2 >> 24;
+    mac[3] = m2 >> 16;
+    mac[4] = m2 >> 8;
+    mac[5] = m2 >> 0;
+    mac[0] &= 0xFE;
+    mac[0] |= 0x02;
+  }
+
+#elif defined(HOST_BUILD)
+  // Host build (see host/build.sh): the simulated clock in host/Arduino.cpp
+  // calls the handler each time it passes a 58uS tick. 
+  void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
+    interruptHandler=callback;
+    hostSetTick(callback, DCC_SIGNAL_TIME);
+  }
+
+#if defined(ISR_TIMING)
+  // Simulated time stands still in an interrupt, so this is the real
+  // time the host took, a measure of the work done rather than AVR time
+  #include <time.h>
+  static struct timespec isrStarted;
+  void DCCTimer::isrTimingStart() {
+    clock_gettime(CLOCK_MONOTONIC, &isrStarted);
+  }
+  unsigned int DCCTimer::isrMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec-isrStarted.tv_sec)*1000000 + (now.tv_nsec-isrStarted.tv_nsec)/1000;
+  }
+#endif
+
+  bool DCCTimer::isPWMPin(byte pin) {
+    (void) pin;
+    return false;
+  }
+
+  void DCCTimer::setPWM(byte pin, bool high) {
+    (void) pin;
+    (void) high;
+  }
+
+  bool DCCTimer::beginBits(INTERRUPT_CALLBACK callback) {
+    (void) callback;
+    return false;
+  }
+
+  void DCCTimer::setPWMPeriod(byte pin, DCC_PERIOD period) {
+    (void) pin;
+    (void) period;
+  }
+
+  bool DCCTimer::beginStream(STREAM_CALLBACK callback, volatile void * outRegister) {
+    (void) callback;
+    (void) outRegister;
+    return false;
+  }
+
+  void DCCTimer::getSimulatedMacAddress(byte mac[6]) {
+    const byte host[6]={0x02, 0xDC, 0xCE, 0x00, 0x00, 0x01};
+    memcpy(mac, host, 6);
+  }
+
 #else 
   // Arduino nano, uno, mega etc
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
     #define TIMER1_A_PIN   11
     #define TIMER1_B_PIN   12
     #define TIMER1_C_PIN   13
+    #define TIMER1_A_BIT   PB5
+    #define TIMER1_B_BIT   PB6
+    #define TIMER1_C_BIT   PB7
 #else
    #define TIMER1_A_PIN   9
    #define TIMER1_B_PIN   10
+   #define TIMER1_A_BIT   PB1
+   #define TIMER1_B_BIT   PB2
 #endif
 
   void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
     interruptHandler=callback;
     noInterrupts();          
-    ADCSRA = (ADCSRA & 0b11111000) | 0b00000100;   // speed up analogRead sample time 
     TCCR1A = 0;
     ICR1 = CLOCK_CYCLES;
     TCNT1 = 0;   
@@ -169,9 +505,48 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
     interrupts();
   }
 
-// ISR called by timer interrupt every 58uS
+// Bit mode uses Timer1 in fast PWM (mode 14) with a 116uS period. A pin is
+// set at the bottom and cleared on compare match, so a compare value of half
+// the period makes a 1-bit and the two ends hold the pin for half a 0-bit.
+// The compare registers are buffered so, as in the 58uS PWM mode, what is
+// set now is generated in the following period.
+  const unsigned int BIT_CYCLES=F_CPU / 1000000 * DCC_BIT_TIME;
+  static bool bitMode=false;
+
+  bool DCCTimer::beginBits(INTERRUPT_CALLBACK callback) {
+    interruptHandler=callback;
+    noInterrupts();          
+    TCCR1A = _BV(WGM11);
+    ICR1 = BIT_CYCLES-1;
+    TCNT1 = 0;   
+    TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS10);     // Mode 14, clock select 1
+    TIMSK1 = _BV(TOIE1); // Enable Software interrupt
+    bitMode=true;
+    interrupts();
+    return true;
+  }
+
+// ISR called by timer interrupt every 58uS (116uS in bit mode)
   ISR(TIMER1_OVF_vect){ interruptHandler(); }
 
+#if defined(ISR_TIMING)
+  // Timer1 counts up to ICR1 and back down again and the interrupt is at
+  // the bottom. ICF1 is raised at the top, so once it is set the time
+  // used is the way up plus the way back, and a raised TOV1 means the
+  // next tick is already due. In bit mode the count only goes up and
+  // both flags are raised together at the top.
+  void DCCTimer::isrTimingStart() {
+    TIFR1 = _BV(ICF1);
+  }
+  unsigned int DCCTimer::isrMicros() {
+    unsigned int ticks=TCNT1;
+    byte flags=TIFR1;
+    if (flags & _BV(TOV1)) return bitMode ? DCC_BIT_TIME : DCC_SIGNAL_TIME;
+    if (flags & _BV(ICF1)) ticks = 2*CLOCK_CYCLES - ticks;
+    return ticks / (F_CPU / 1000000);
+  }
+#endif
+
 // Alternative pin manipulation via PWM control.
   bool DCCTimer::isPWMPin(byte pin) {
        return pin==TIMER1_A_PIN 
@@ -199,6 +574,114 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
  #endif       
  }
 
+ // A compare value of 0 does not hold the pin low in mode 14, it is still set
+ // at the bottom and cleared a clock later. After the high half of a 0-bit
+ // that only stretches it by a clock, but a low period after a low one would
+ // be a spike, so there the pin is disconnected from the timer and held low
+ // by its PORT bit. Connecting takes effect at once rather than at the
+ // bottom, so it is only changed while the current period is low all through.
+  static bool lowPeriod[3]={false,false,false};
+
+  static void setPeriodChannel(byte channel, byte comBit, byte portBit, volatile uint16_t & ocr, DCC_PERIOD period) {
+    bool wasLow=lowPeriod[channel];
+    lowPeriod[channel]= period==DCC_PERIOD_LOW;
+    if (period==DCC_PERIOD_LOW && wasLow) {
+      PORTB &= ~_BV(portBit);
+      TCCR1A &= ~_BV(comBit);
+      return;
+    }
+    TCCR1A |= _BV(comBit);
+    ocr= period==DCC_PERIOD_HIGH ? BIT_CYCLES-1 : period==DCC_PERIOD_ONE ? BIT_CYCLES/2  : 0;
+  }
+
+ void DCCTimer::setPWMPeriod(byte pin, DCC_PERIOD period) {
+    if (pin==TIMER1_A_PIN) setPeriodChannel(0, COM1A1, TIMER1_A_BIT, OCR1A, period);
+    else if (pin==TIMER1_B_PIN) setPeriodChannel(1, COM1B1, TIMER1_B_BIT, OCR1B, period);
+ #ifdef TIMER1_C_PIN 
+    else if (pin==TIMER1_C_PIN) setPeriodChannel(2, COM1C1, TIMER1_C_BIT, OCR1C, period);
+ #endif       
+ }
+
+  bool DCCTimer::beginStream(STREAM_CALLBACK callback, volatile void * outRegister) {
+    (void) callback;
+    (void) outRegister;
+    return false;
+  }
+
+
+// Background ADC sampling. Each conversion complete interrupt stores the
+// result and starts the next conversion on the next pin, so each pin is
+// refreshed every ~55uS times the number of pins without any caller
+// waiting on the ADC.
+// Once started, analogRead must not be used as it would steal the ADC.
+  static byte adcPin[MAX_ADC_PINS];
+  static byte adcMux[MAX_ADC_PINS];
+  static volatile int adcValue[MAX_ADC_PINS];
+  static byte adcCount=0;
+  static volatile byte adcSlot=0;
+  static bool adcRunning=false;
+  static volatile bool adcSkip=false;
+  // prescaler 64 (52uS conversion), conversion off the critical path so no need to rush.
+  // Always written whole, never read back, so a pending ADIF is not cleared by accident.
+  static const byte ADC_CONTROL=_BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1);
+
+  static void selectADC(byte slot) {
+    byte channel=adcMux[slot];
+  #if defined(ADCSRB) && defined(MUX5)
+    if (channel & 0x08) ADCSRB |= _BV(MUX5);
+    else ADCSRB &= ~_BV(MUX5);
+  #endif
+    ADMUX = _BV(REFS0) | (channel & 0x07);  // AVcc reference as analogRead DEFAULT
+  }
+
+  void DCCTimer::startADC(const byte pins[], byte count) {
+    adcCount=0;
+    for (byte p=0; p<count && adcCount<MAX_ADC_PINS; p++) {
+      byte pin=pins[p];
+      if (pin==UNUSED_PIN) continue;
+      byte slot;
+      for (slot=0; slot<adcCount && adcPin[slot]!=pin; slot++);
+      if (slot<adcCount) continue;  // shared pin
+      adcPin[slot]=pin;
+      adcMux[slot]=pin >= A0 ? pin-A0 : pin;
+      adcValue[slot]=analogRead(pin);  // seed before interrupts take over
+      adcCount++;
+    }
+    if (adcCount==0) return;   // nothing to measure
+    noInterrupts();
+    adcSlot=0;
+    selectADC(0);
+    // The last analogRead may have left ADIF set, which interrupts as soon as
+    // ADIE is on with a result for the wrong pin, so the first one is dropped.
+    adcSkip=true;
+    ADCSRA = ADC_CONTROL | _BV(ADSC);
+    adcRunning=true;
+    interrupts();
+  }
+
+  int DCCTimer::getADC(byte pin) {
+    if (!adcRunning) return -1;
+    byte slot;
+    for (slot=0; slot<adcCount && adcPin[slot]!=pin; slot++);
+    if (slot==adcCount) return -1;
+    byte sreg=SREG;   // may be called from loop or from the timer ISR
+    noInterrupts();
+    int value=adcValue[slot];
+    SREG=sreg;
+    return value;
+  }
+
+  ISR(ADC_vect) {
+    byte slot=adcSlot;
+    if (adcSkip) adcSkip=false;
+    else {
+      adcValue[slot]=ADC;
+      if (++slot>=adcCount) slot=0;
+      adcSlot=slot;
+      selectADC(slot);
+    }
+    ADCSRA = ADC_CONTROL | _BV(ADSC);  // ADIF was cleared on entry
+  }
 
   #include <avr/boot.h> 
   void DCCTimer::getSimulatedMacAddress(byte mac[6]) {
@@ -211,3 +694,15 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
   }
 
 #endif
+
+#if defined(ARDUINO_ARCH_MEGAAVR) || defined(TEENSYDUINO) || defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_RP2040) || defined(HOST_BUILD)
+// Background ADC sampling not implemented on this architecture,
+// getCurrentRaw falls back to analogRead.
+  void DCCTimer::startADC(const byte pins[], byte count) {
+    (void)pins; (void)count;
+  }
+  int DCCTimer::getADC(byte pin) {
+    (void)pin;
+    return -1;
+  }
+#endif
@@ -1,8 +1,25 @@
 #ifndef DCCTimer_h
 #define DCCTimer_h
 #include "Arduino.h"
+#if __has_include ( "config.h")
+  #include "config.h"
+#endif
+
+const byte MAX_ADC_PINS=6;
+const int DCC_SIGNAL_TIME=58;  // this is the 58uS DCC 1-bit waveform half-cycle 
+const int DCC_BIT_TIME=116;    // a whole 1-bit, the period of the timer in bit mode
+
+// What the timer generates on a PWM pin in one DCC_BIT_TIME period (bit mode)
+enum DCC_PERIOD : byte {
+  DCC_PERIOD_LOW=0,   // second half of a 0-bit
+  DCC_PERIOD_ONE=1,   // a whole 1-bit, high then low
+  DCC_PERIOD_HIGH=2   // first half of a 0-bit
+};
+
+const byte DCC_STREAM_TICKS=16;  // ticks per buffer in stream mode
 
 typedef void (*INTERRUPT_CALLBACK)();
+typedef void (*STREAM_CALLBACK)(uint32_t toggles[]);
 
 class DCCTimer {
   public:
@@ -10,6 +27,32 @@ class DCCTimer {
   static void getSimulatedMacAddress(byte mac[6]);
   static bool isPWMPin(byte pin);
   static void setPWM(byte pin, bool high);
+  // Bit mode: the timer interrupts every DCC_BIT_TIME instead of every
+  // DCC_SIGNAL_TIME and the PWM pins make the edges within each period.
+  // Returns false if the architecture has no bit mode, begin must then be used.
+  static bool beginBits(INTERRUPT_CALLBACK interrupt);
+  static void setPWMPeriod(byte pin, DCC_PERIOD period);
+  // Stream mode: DMA writes one word from a buffer to the toggle register of
+  // the port whose output register is given at every 58uS tick. The callback
+  // is called in interrupt time to fill each buffer of DCC_STREAM_TICKS
+  // toggle masks (the first two before streaming starts).
+  // Returns false if the architecture has no stream mode.
+  static bool beginStream(STREAM_CALLBACK callback, volatile void * outRegister);
+  // Background current sensing: the ADC converts the pins in turn
+  // under its own interrupt so readers never wait for a conversion.
+  // getADC returns the latest sample for a registered pin or -1 if
+  // the pin is not being sampled (caller must then use analogRead).
+  // UNUSED_PIN entries are skipped, at most MAX_ADC_PINS are sampled.
+  static void startADC(const byte pins[], byte count);
+  static int getADC(byte pin);
+#if defined(ISR_TIMING)
+  // Interrupt duration measurement, only built with ISR_TIMING defined
+  // (in config.h or the build flags). isrTimingStart is called on entry
+  // to the interrupt handler and isrMicros at its end returns the time
+  // used since the tick began (the tick time or more for an overrun).
+  static void isrTimingStart();
+  static unsigned int isrMicros();
+#endif
 #if (defined(TEENSYDUINO) && !defined(__IMXRT1062__))
   static void read_mac(byte mac[6]);
   static void read(uint8_t word, uint8_t *mac, uint8_t offset);
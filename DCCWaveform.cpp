@@ -23,6 +23,8 @@
 #include "DCCWaveform.h"
 #include "DCCTimer.h"
 #include "DIAG.h"
+#include "CommandDistributor.h"
+#include "DCCEXParser.h"
 #include "freeMemory.h"
 
 DCCWaveform  DCCWaveform::mainTrack(PREAMBLE_BITS_MAIN, true);
@@ -34,6 +36,27 @@ int  DCCWaveform::progTripValue=0;
 volatile uint8_t DCCWaveform::numAckGaps=0;
 volatile uint8_t DCCWaveform::numAckSamples=0;
 uint8_t DCCWaveform::trailingEdgeCounter=0;
+byte DCCWaveform::hardTripSelect=0;
+bool DCCWaveform::bitMode=false;
+portreg_t DCCWaveform::streamBits=0;
+DCCDistrict * DCCWaveform::districts[MAX_DISTRICTS];
+volatile byte DCCWaveform::districtCount=0;
+
+#if defined(RAILCOM_CUTOUT)
+volatile bool DCCWaveform::railcom=true;
+volatile RAILCOM_CALLBACK DCCWaveform::railcomCallback=NULL;
+bool DCCWaveform::cutoutProg=false;
+#endif
+
+#if defined(ISR_TIMING)
+volatile byte DCCWaveform::isrPath=ISR_PATH_EDGE;
+volatile unsigned long DCCWaveform::isrHistogram[ISR_PATHS][ISR_BUCKETS];
+volatile unsigned int DCCWaveform::isrMaximum[ISR_PATHS];
+volatile unsigned long DCCWaveform::isrOverruns=0;
+#define ISR_PATH(path) if (isrPath<path) isrPath=path
+#else
+#define ISR_PATH(path)
+#endif
 
 void DCCWaveform::begin(MotorDriver * mainDriver, MotorDriver * progDriver) {
   mainTrack.motorDriver=mainDriver;
@@ -50,23 +73,85 @@ void DCCWaveform::begin(MotorDriver * mainDriver, MotorDriver * progDriver) {
     DIAG(F("Signal pin config: high accuracy waveform"));
   else
     DIAG(F("Signal pin config: normal accuracy waveform"));
+  MotorDriver * mainDrivers[1+MAX_DISTRICTS];
+  mainDrivers[0]=mainDriver;
+  for (byte d=0; d<districtCount; d++) mainDrivers[1+d]=districts[d]->motorDriver;
+  if (MotorDriver::buildSignalPorts(mainDrivers, 1+districtCount, progDriver))
+    DIAG(F("Signal pins written by port"));
+  byte currentPins[2+MAX_DISTRICTS];
+  currentPins[0]=mainDriver->getCurrentPin();
+  currentPins[1]=progDriver->getCurrentPin();
+  for (byte d=0; d<districtCount; d++) currentPins[2+d]=districts[d]->motorDriver->getCurrentPin();
+  DCCTimer::startADC(currentPins, 2+districtCount);
+#if defined(DCC_TIMER_DMA) && !defined(RAILCOM_CUTOUT)
+  // DMA stream mode needs all the signal pins on one port
+  volatile portreg_t * signalPort=MotorDriver::getSignalPort();
+  if (signalPort) {
+    MotorDriver::setSignalPorts(LOW, LOW);
+    streamBits=MotorDriver::getSignalPortBits(LOW, LOW);
+    if (DCCTimer::beginStream(DCCWaveform::streamHandler, signalPort)) {
+      DIAG(F("Signal streamed by DMA"));
+      return;
+    }
+  }
+#endif
+#if defined(DCC_TIMER_BITS) && !defined(RAILCOM_CUTOUT)
+  // Hardware bit mode needs both tracks on PWM pins and nothing else to drive
+  if (MotorDriver::usePWM && districtCount==0 && DCCTimer::beginBits(DCCWaveform::bitInterruptHandler)) {
+    DIAG(F("Signal generated by timer per bit"));
+    bitMode=true;
+    return;
+  }
+#endif
   DCCTimer::begin(DCCWaveform::interruptHandler);     
 }
 
+// Each district is a booster output driven with the main track signal.
+// Returns false if there are already MAX_DISTRICTS.
+bool DCCWaveform::addDistrict(MotorDriver * driver) {
+  static const char districtNames[MAX_DISTRICTS][10] PROGMEM = {"DISTRICT1", "DISTRICT2", "DISTRICT3", "DISTRICT4"};
+  if (districtCount>=MAX_DISTRICTS) return false;
+  districts[districtCount]=new DCCDistrict((const FSH *)districtNames[districtCount], driver);
+  districtCount++;
+  return true;
+}
+
 void DCCWaveform::loop(bool ackManagerActive) {
   mainTrack.checkPowerOverload(false);
   progTrack.checkPowerOverload(ackManagerActive);
+  for (byte d=0; d<districtCount; d++)
+    districts[d]->checkOverload(districts[d]->motorDriver->getRawCurrentTripValue());
 }
 
 void DCCWaveform::interruptHandler() {
   // call the timer edge sensitive actions for progtrack and maintrack
   // member functions would be cleaner but have more overhead
+#if defined(ISR_TIMING)
+  DCCTimer::isrTimingStart();
+  isrPath=ISR_PATH_EDGE;
+#endif
   byte sigMain=signalTransform[mainTrack.state];
   byte sigProg=progTrackSyncMain? sigMain : signalTransform[progTrack.state];
   
-  // Set the signal state for both tracks
-  mainTrack.motorDriver->setSignal(sigMain);
-  progTrack.motorDriver->setSignal(sigProg);
+  // Set the signal state for both tracks and the districts following main
+  bool setMain=true;
+  bool setProg=true;
+#if defined(RAILCOM_CUTOUT)
+  // the drivers are left alone during a cutout until it ends with a start edge,
+  // the prog track too if the cutout was opened while it was joined to main
+  if (mainTrack.state==WAVE_CUTOUT) {
+    setMain=mainTrack.railcomTick();
+    setProg=!cutoutProg;
+  }
+#endif
+  if (setMain && setProg && MotorDriver::hasSignalPorts()) MotorDriver::setSignalPorts(sigMain, sigProg);
+  else {
+    if (setMain) {
+      mainTrack.motorDriver->setSignal(sigMain);
+      for (byte d=0; d<districtCount; d++) districts[d]->motorDriver->setSignal(sigMain);
+    }
+    if (setProg) progTrack.motorDriver->setSignal(sigProg);
+  }
   
   // Move on in the state engine
   mainTrack.state=stateTransform[mainTrack.state];    
@@ -78,107 +163,251 @@ void DCCWaveform::interruptHandler() {
   if (progTrack.state==WAVE_PENDING) progTrack.interrupt2();
   else if (progTrack.ackPending) progTrack.checkAck();
 
+  checkHardTrips();
+#if defined(ISR_TIMING)
+  recordIsrTiming();
+#endif
+}
+
+// Bit mode interrupt, every 116uS. The timer makes the edges so each track
+// only has to say whether the next period is a 1-bit or a half of a 0-bit.
+void DCCWaveform::bitInterruptHandler() {
+#if defined(ISR_TIMING)
+  DCCTimer::isrTimingStart();
+  isrPath=ISR_PATH_EDGE;
+#endif
+  DCC_PERIOD periodMain=mainTrack.nextPeriod();
+  DCC_PERIOD periodProg=progTrack.nextPeriod();
+  if (progTrackSyncMain) periodProg=periodMain;
+  mainTrack.motorDriver->setSignalPeriod(periodMain);
+  progTrack.motorDriver->setSignalPeriod(periodProg);
+
+  if (progTrack.ackPending) progTrack.checkAck();
+  checkHardTrips();
+#if defined(ISR_TIMING)
+  recordIsrTiming();
+#endif
+}
+
+// Stream mode buffer refill, every DCC_STREAM_TICKS ticks. Runs the state
+// engine as the 58uS interrupt would, recording which signal pins change on
+// each tick. The ACK and fast trip checks are done once per buffer.
+void DCCWaveform::streamHandler(uint32_t toggles[]) {
+  for (byte tick=0; tick<DCC_STREAM_TICKS; tick++) {
+    byte sigMain=signalTransform[mainTrack.state];
+    byte sigProg=progTrackSyncMain? sigMain : signalTransform[progTrack.state];
+    portreg_t bits=MotorDriver::getSignalPortBits(sigMain, sigProg);
+    toggles[tick]=bits ^ streamBits;
+    streamBits=bits;
+    mainTrack.state=stateTransform[mainTrack.state];    
+    progTrack.state=stateTransform[progTrack.state];    
+    if (mainTrack.state==WAVE_PENDING) mainTrack.interrupt2();  
+    if (progTrack.state==WAVE_PENDING) progTrack.interrupt2();
+  }
+  if (progTrack.ackPending) progTrack.checkAck();
+  for (byte output=0; output<2+districtCount; output++) checkHardTrips();
+}
+
+// Steps the state engine a whole bit period. WAVE_LOW_0 marks the
+// second half of a 0-bit still to come, otherwise the next bit is needed.
+DCC_PERIOD DCCWaveform::nextPeriod() {
+  if (state==WAVE_LOW_0) {
+    state=WAVE_START;
+    return DCC_PERIOD_LOW;
+  }
+  interrupt2();
+  if (state==WAVE_HIGH_0) {
+    state=WAVE_LOW_0;
+    return DCC_PERIOD_HIGH;
+  }
+  state=WAVE_START;
+  return DCC_PERIOD_ONE;
+}
+
+// Fast short circuit detection, one output per interrupt
+void DCCWaveform::checkHardTrips() {
+  byte select=hardTripSelect+1;
+  if (select>=2+districtCount) select=0;
+  hardTripSelect=select;
+  if (select==0) mainTrack.checkHardTrip();
+  else if (select==1) progTrack.checkHardTrip();
+  else districts[select-2]->checkHardTrip();
+}
+
+#if defined(ISR_TIMING)
+void DCCWaveform::recordIsrTiming() {
+  unsigned int duration=DCCTimer::isrMicros();
+  byte path=isrPath;
+  byte bucket=duration/ISR_BUCKET_MICROS;
+  if (bucket>=ISR_BUCKETS) bucket=ISR_BUCKETS-1;
+  isrHistogram[path][bucket]++;
+  if (duration>isrMaximum[path]) isrMaximum[path]=duration;
+  if (duration>=(unsigned int)(bitMode ? DCC_BIT_TIME : DCC_SIGNAL_TIME)) isrOverruns++;
+}
+#endif
+
+void DCCWaveform::showIsrTiming(Print * stream) {
+#if defined(ISR_TIMING)
+  static const char pathNames[ISR_PATHS][9] PROGMEM = {"edge", "preamble", "bit", "packet", "ack"};
+  unsigned long counts[ISR_BUCKETS];
+  unsigned int maximum;
+  for (byte path=0; path<ISR_PATHS; path++) {
+    noInterrupts();
+    for (byte b=0; b<ISR_BUCKETS; b++) counts[b]=isrHistogram[path][b];
+    maximum=isrMaximum[path];
+    interrupts();
+    StringFormatter::send(stream, F("ISR %S max=%dus"), (const FSH *)pathNames[path], maximum);
+    for (byte b=0; b<ISR_BUCKETS; b++) 
+      StringFormatter::send(stream, F(" %d:%l"), b*ISR_BUCKET_MICROS, counts[b]);
+    StringFormatter::send(stream, F("\n"));
+  }
+  noInterrupts();
+  unsigned long overruns=isrOverruns;
+  interrupts();
+  StringFormatter::send(stream, F("ISR overruns=%l (over %dus)\n"), overruns, bitMode ? DCC_BIT_TIME : DCC_SIGNAL_TIME);
+#else
+  StringFormatter::send(stream, F("ISR timing not built, define ISR_TIMING\n"));
+#endif
+}
+
+// Decode the traced bit stream again, one line per packet oldest first.
+// Each byte must follow a 0 start bit and the bytes must XOR to 0, so a
+// mistake in the encoder or a queue slot overwritten while being sent
+// shows up as "bad" here rather than as a decoder ignoring it.
+void DCCWaveform::showTrace(Print * stream) {
+#if defined(PACKET_TRACE)
+  TRACED_PACKET copy[TRACE_PACKETS];
+  noInterrupts();
+  byte next=traceNext;
+  memcpy(copy, trace, sizeof(trace));
+  interrupts();
+  byte count=next<TRACE_PACKETS ? next : TRACE_PACKETS;
+  for (byte i=0; i<count; i++) {
+    TRACED_PACKET & traced = copy[(byte)(next-count+i) & (TRACE_PACKETS-1)];
+    StringFormatter::send(stream, F("%S trace"), name);
+    byte checksum=0;
+    bool good=(traced.bitCount % 9)==0;
+    for (byte bit=0; bit+9<=traced.bitCount; bit+=9) {
+      if (traced.bits[bit >> 3] & (0x80 >> (bit & 7))) good=false;  // start bit
+      byte value=0;
+      for (byte b=bit+1; b<bit+9; b++) value=(value<<1) | ((traced.bits[b >> 3] >> (7-(b & 7))) & 1);
+      checksum^=value;
+      StringFormatter::send(stream, F(" %x"), value);
+    }
+    StringFormatter::send(stream, (good && checksum==0) ? F(" ok\n") : F(" bad\n"));
+  }
+#else
+  StringFormatter::send(stream, F("%S trace not built, define PACKET_TRACE\n"), name);
+#endif
+}
+
+#if defined(RAILCOM_CUTOUT)
+// Called in interrupt time for each tick of a main track cutout. The end
+// bit has finished at tick 0. Returns true at the end of the cutout with the
+// state set to start the next preamble bit.
+bool DCCWaveform::railcomTick() {
+  byte tick=cutoutTicks++;
+  RAILCOM_CALLBACK callback=railcomCallback;
+  if (tick==0) {
+    setCutout(true);
+    for (byte d=0; d<districtCount; d++) districts[d]->setCutout(true);
+    // A joined prog track carries the main signal, so it has the cutout too
+    cutoutProg=progTrackSyncMain;
+    if (cutoutProg) progTrack.setCutout(true);
+  }
+  else if (tick==RAILCOM_CHANNEL_1_TICK) {
+    if (callback) callback(RAILCOM_CHANNEL_1);
+  }
+  else if (tick==RAILCOM_CHANNEL_2_TICK) {
+    if (callback) callback(RAILCOM_CHANNEL_2);
+  }
+  else if (tick>=RAILCOM_CUTOUT_TICKS) {
+    setCutout(false);
+    for (byte d=0; d<districtCount; d++) districts[d]->setCutout(false);
+    if (cutoutProg) progTrack.setCutout(false);
+    cutoutProg=false;
+    if (callback) callback(RAILCOM_CLOSED);
+    state=WAVE_START;
+    return true;
+  }
+  return false;
+}
+#endif
+
+bool DCCWaveform::setRailcom(bool on) {
+#if defined(RAILCOM_CUTOUT)
+  railcom=on;
+  return true;
+#else
+  (void)on;
+  return false;
+#endif
+}
+
+void DCCWaveform::setRailcomCallback(RAILCOM_CALLBACK callback) {
+#if defined(RAILCOM_CUTOUT)
+  railcomCallback=callback;
+#else
+  (void)callback;
+#endif
+}
+
+void DCCWaveform::resetIsrTiming() {
+#if defined(ISR_TIMING)
+  noInterrupts();
+  memset((void *)isrHistogram, 0, sizeof(isrHistogram));
+  memset((void *)isrMaximum, 0, sizeof(isrMaximum));
+  isrOverruns=0;
+  interrupts();
+#endif
 }
 
 
 // An instance of this class handles the DCC transmissions for one track. (main or prog)
 // Interrupts are marshalled via the statics.
-// A track has a current transmit buffer, and a pending buffer.
-// When the current buffer is exhausted, either the pending buffer (if there is one waiting) or an idle buffer.
-
+// A track has a current transmit buffer, and a queue of pending packets.
+// When the current buffer is exhausted, either the most urgent pending packet (if there is one waiting) or an idle buffer.
 
-// This bitmask has 9 entries as each byte is trasmitted as a zero + 8 bits.
-const byte bitMask[] = {0x00, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
 
 
-DCCWaveform::DCCWaveform( byte preambleBits, bool isMain) {
+DCCWaveform::DCCWaveform( byte preambleBits, bool isMain) : DCCDistrict(NULL, NULL) {
   isMainTrack = isMain;
-  packetPending = false;
-  memcpy(transmitPacket, idlePacket, sizeof(idlePacket));
+  name = isMain ? F("MAIN") : F("PROG");
+  for (byte p = 0; p < PACKET_PRIORITIES; p++) packetQueue[p].head = packetQueue[p].tail = 0;
+  idleBitCount = encodePacket(idleBits, isMain ? idlePacket : resetPacket, sizeof(idlePacket)-1); // without checksum
+  memcpy(transmitBits, idleBits, sizeof(idleBits));
+  transmitBitCount = idleBitCount;
+  transmitByte = transmitBits[0];
+  transmitRepeats = 0;
   state = WAVE_START;
   // The +1 below is to allow the preamble generator to create the stop bit
   // for the previous packet. 
   requiredPreambles = preambleBits+1;  
-  bytes_sent = 0;
   bits_sent = 0;
-  sampleDelay = 0;
-  lastSampleTaken = millis();
   ackPending=false;
+  resetStats();
 }
 
-POWERMODE DCCWaveform::getPowerMode() {
-  return powerMode;
-}
-
+// Main track power commands apply to all the districts, overloads do not.
+// Only switching the main track on or off is worth telling the clients.
 void DCCWaveform::setPowerMode(POWERMODE mode) {
-  powerMode = mode;
-  bool ison = (mode == POWERMODE::ON);
-  motorDriver->setPower( ison);
+  if (this==&mainTrack) {
+    if ((mode==POWERMODE::OFF) != (powerMode==POWERMODE::OFF))
+      CommandDistributor::broadcast(EVENT_POWER, 0, mode!=POWERMODE::OFF);
+    for (byte d=0; d<districtCount; d++) districts[d]->setPowerMode(mode);
+  }
+  // Switching the prog track off by hand may mean another decoder is coming
+  else if (mode==POWERMODE::OFF && !autoPowerOff) resetAckLearning();
+  DCCDistrict::setPowerMode(mode);
 }
 
-
 void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
-  if (millis() - lastSampleTaken  < sampleDelay) return;
-  lastSampleTaken = millis();
   int tripValue= motorDriver->getRawCurrentTripValue();
   if (!isMainTrack && !ackManagerActive && !progTrackSyncMain && !progTrackBoosted)
     tripValue=progTripValue;
-  
-  switch (powerMode) {
-    case POWERMODE::OFF:
-      sampleDelay = POWER_SAMPLE_OFF_WAIT;
-      break;
-    case POWERMODE::ON:
-      // Check current
-      lastCurrent=motorDriver->getCurrentRaw();
-      if (lastCurrent < 0) {
-	  // We have a fault pin condition to take care of
-	  lastCurrent = -lastCurrent;
-	  setPowerMode(POWERMODE::OVERLOAD); // Turn off, decide later how fast to turn on again
-	  if (MotorDriver::commonFaultPin) {
-	      if (lastCurrent <= tripValue) {
-		setPowerMode(POWERMODE::ON); // maybe other track
-	      }
-	      // Write this after the fact as we want to turn on as fast as possible
-	      // because we don't know which output actually triggered the fault pin
-	      DIAG(F("*** COMMON FAULT PIN ACTIVE - TOGGLED POWER on %S ***"), isMainTrack ? F("MAIN") : F("PROG"));
-	  } else {
-	      DIAG(F("*** %S FAULT PIN ACTIVE - OVERLOAD ***"), isMainTrack ? F("MAIN") : F("PROG"));
-	      if (lastCurrent < tripValue) {
-		  lastCurrent = tripValue; // exaggerate
-	      }
-	  }
-      }
-      if (lastCurrent < tripValue) {
-        sampleDelay = POWER_SAMPLE_ON_WAIT;
-	if(power_good_counter<100)
-	  power_good_counter++;
-	else
-	  if (power_sample_overload_wait>POWER_SAMPLE_OVERLOAD_WAIT) power_sample_overload_wait=POWER_SAMPLE_OVERLOAD_WAIT;
-      } else {
-        setPowerMode(POWERMODE::OVERLOAD);
-        unsigned int mA=motorDriver->raw2mA(lastCurrent);
-        unsigned int maxmA=motorDriver->raw2mA(tripValue);
-	power_good_counter=0;
-        sampleDelay = power_sample_overload_wait;
-        DIAG(F("*** %S TRACK POWER OVERLOAD current=%d max=%d  offtime=%d ***"), isMainTrack ? F("MAIN") : F("PROG"), mA, maxmA, sampleDelay);
-	if (power_sample_overload_wait >= 10000)
-	    power_sample_overload_wait = 10000;
-	else
-	    power_sample_overload_wait *= 2;
-      }
-      break;
-    case POWERMODE::OVERLOAD:
-      // Try setting it back on after the OVERLOAD_WAIT
-      setPowerMode(POWERMODE::ON);
-      sampleDelay = POWER_SAMPLE_ON_WAIT;
-      // Debug code....
-      DIAG(F("*** %S TRACK POWER RESET delay=%d ***"), isMainTrack ? F("MAIN") : F("PROG"), sampleDelay);
-      break;
-    default:
-      sampleDelay = 999; // cant get here..meaningless statement to avoid compiler warning.
-  }
+  checkOverload(tripValue);
 }
+
 // For each state of the wave  nextState=stateTransform[currentState] 
 const WAVE_STATE DCCWaveform::stateTransform[]={
    /* WAVE_START   -> */ WAVE_PENDING,
@@ -186,7 +415,9 @@ const WAVE_STATE DCCWaveform::stateTransform[]={
    /* WAVE_HIGH_0  -> */ WAVE_MID_0,
    /* WAVE_MID_0   -> */ WAVE_LOW_0,
    /* WAVE_LOW_0   -> */ WAVE_START,
-   /* WAVE_PENDING (should not happen) -> */ WAVE_PENDING};
+   /* WAVE_PENDING (should not happen) -> */ WAVE_PENDING,
+   /* WAVE_END_1   -> */ WAVE_CUTOUT,
+   /* WAVE_CUTOUT (left by railcomTick) -> */ WAVE_CUTOUT};
 
 // For each state of the wave, signal pin is HIGH or LOW   
 const bool DCCWaveform::signalTransform[]={
@@ -195,7 +426,9 @@ const bool DCCWaveform::signalTransform[]={
    /* WAVE_HIGH_0  -> */ HIGH,
    /* WAVE_MID_0   -> */ LOW,
    /* WAVE_LOW_0   -> */ LOW,
-   /* WAVE_PENDING (should not happen) -> */ LOW};
+   /* WAVE_PENDING (should not happen) -> */ LOW,
+   /* WAVE_END_1   -> */ LOW,
+   /* WAVE_CUTOUT (only used as it ends) -> */ HIGH};
         
 void DCCWaveform::interrupt2() {
   // calculate the next bit to be sent:
@@ -204,82 +437,262 @@ void DCCWaveform::interrupt2() {
 
   if (remainingPreambles > 0 ) {
     state=WAVE_MID_1;  // switch state to trigger LOW on next interrupt
+#if defined(RAILCOM_CUTOUT)
+    // The first preamble bit is the end bit of the previous packet
+    if (remainingPreambles==requiredPreambles && isMainTrack && railcom) {
+      state=WAVE_END_1;
+      cutoutTicks=0;
+    }
+#endif
     remainingPreambles--;
+    ISR_PATH(ISR_PATH_PREAMBLE);
     // Update free memory diagnostic as we don't have anything else to do this time.
     // Allow for checkAck and its called functions using 22 bytes more.
     updateMinimumFreeMemory(22); 
     return;
   }
 
-  // Wave has gone HIGH but what happens next depends on the bit to be transmitted
-  // beware OF 9-BIT MASK  generating a zero to start each byte
-  state=(transmitPacket[bytes_sent] & bitMask[bits_sent])? WAVE_MID_1 : WAVE_HIGH_0; 
+  // Wave has gone HIGH but what happens next depends on the bit to be transmitted.
+  // The packet was encoded by schedulePacket so start bits are already in the stream. 
+  state=(transmitByte & 0x80)? WAVE_MID_1 : WAVE_HIGH_0; 
+  transmitByte <<= 1;
   bits_sent++;
 
-  // If this is the last bit of a byte, prepare for the next byte
+  if (bits_sent < transmitBitCount) {
+    if ((bits_sent & 7) == 0) transmitByte = transmitBits[bits_sent >> 3];
+    ISR_PATH(ISR_PATH_BIT);
+    return;
+  }
+  ISR_PATH(ISR_PATH_PACKET);
 
-  if (bits_sent == 9) { // zero followed by 8 bits of a byte
-    //end of Byte
-    bits_sent = 0;
-    bytes_sent++;
-    // if this is the last byte, prepere for next packet
-    if (bytes_sent >= transmitLength) {
-      // end of transmission buffer... repeat or switch to next message
-      bytes_sent = 0;
-      remainingPreambles = requiredPreambles;
+  // end of transmission buffer... repeat or switch to next message
+  bits_sent = 0;
+  remainingPreambles = requiredPreambles;
 
-      if (transmitRepeats > 0) {
-        transmitRepeats--;
-      }
-      else if (packetPending) {
-        // Copy pending packet to transmit packet
-        // a fixed length memcpy is faster than a variable length loop for these small lengths
-        // for (int b = 0; b < pendingLength; b++) transmitPacket[b] = pendingPacket[b];
-        memcpy( transmitPacket, pendingPacket, sizeof(pendingPacket));
-        
-        transmitLength = pendingLength;
-        transmitRepeats = pendingRepeats;
-        packetPending = false;
-        sentResetsSincePacket=0;
-      }
-      else {
-        // Fortunately reset and idle packets are the same length
-        memcpy( transmitPacket, isMainTrack ? idlePacket : resetPacket, sizeof(idlePacket));
-        transmitLength = sizeof(idlePacket);
-        transmitRepeats = 0;
-        if (sentResetsSincePacket<250) sentResetsSincePacket++;
+  // A waiting emergency stop cuts short the repeats of the packet just sent
+  if (transmitRepeats > 0 && packetQueue[PRIORITY_ESTOP].tail == packetQueue[PRIORITY_ESTOP].head) {
+    transmitRepeats--;
+    packetStats[STAT_REPEAT]++;
+  }
+  else if (nextPacket()) {
+    sentResetsSincePacket=0;
+  }
+  else {
+    // a fixed length memcpy is faster than a variable length loop for these small lengths
+    memcpy( transmitBits, idleBits, sizeof(idleBits));
+    transmitBitCount = idleBitCount;
+    transmitRepeats = 0;
+    if (sentResetsSincePacket<250) sentResetsSincePacket++;
+    packetStats[STAT_IDLE]++;
+  }
+  transmitByte = transmitBits[0];
+}
+
+// Called by interrupt2 at the end of a packet.
+// Moves the oldest packet of the most urgent priority class into the transmit buffer.
+// Purged slots are dropped on the way. Returns false if nothing is waiting.
+bool DCCWaveform::nextPacket() {
+  for (byte p = 0; p < PACKET_PRIORITIES; p++) {
+    PACKET_QUEUE & queue = packetQueue[p];
+    while (queue.tail != queue.head) {
+      PACKET_SLOT & slot = queue.slots[queue.tail & (PACKET_QUEUE_SIZE-1)];
+      queue.tail++;
+      if (slot.bitCount == 0) continue; // purged
+      memcpy( transmitBits, slot.bits, sizeof(slot.bits));
+      transmitBitCount = slot.bitCount;
+      transmitRepeats = slot.repeats;
+#if defined(PACKET_TRACE)
+      TRACED_PACKET & traced = trace[traceNext & (TRACE_PACKETS-1)];
+      memcpy(traced.bits, slot.bits, sizeof(slot.bits));
+      traced.bitCount = slot.bitCount;
+      traceNext++;
+#endif
+      // Accessory addresses are 10xxxxxx, encoded behind the 0 start bit
+      if (p == PRIORITY_FUNCTION && (slot.bits[0] & 0xE0) == 0x40) packetStats[STAT_ACCESSORY]++;
+      else packetStats[p]++;
+      if (p == PRIORITY_ESTOP && estopQueued != 0) {
+        unsigned long latency = micros() - estopQueued;
+        estopQueued = 0;
+        estopLatency = latency;
+        if (latency > estopMaxLatency) estopMaxLatency = latency;
       }
+      return true;
     }
-  }  
+  }
+  return false;
 }
 
+// Encode a packet, appending its checksum, as the bit stream sent by interrupt2.
+// Each byte gets a 0 start bit. The packet end bit is the first bit of the next preamble.
+// Returns the number of bits.
+byte DCCWaveform::encodePacket(byte bits[], const byte buffer[], byte byteCount) {
+  memset(bits, 0, MAX_ENCODED_SIZE);
+  byte checksum = 0;
+  byte bitCount = 0;
+  for (byte b = 0; b <= byteCount; b++) {
+    byte value;
+    if (b < byteCount) {
+      value = buffer[b];
+      checksum ^= value;
+    }
+    else value = checksum;
+    bitCount++; // start bit is already 0
+    // The 8 data bits straddle at most two bytes of the stream
+    byte shift = bitCount & 7;
+    bits[bitCount >> 3] |= value >> shift;
+    if (shift) bits[(bitCount >> 3) + 1] |= value << (8 - shift);
+    bitCount += 8;
+  }
+  return bitCount;
+}
 
+// Add a packet to the queue for its priority class without waiting.
+// Returns false if that class is full (or the packet is too long), the caller decides what to do about it.
+bool DCCWaveform::schedulePacket(const byte buffer[], byte byteCount, byte repeats, PACKET_PRIORITY priority) {
+  if (byteCount > MAX_PACKET_SIZE) return false; // allow for chksum
+  if (isQueueFull(priority)) {
+    queueFull++;
+    return false;
+  }
 
-// Wait until there is no packet pending, then make this pending
-void DCCWaveform::schedulePacket(const byte buffer[], byte byteCount, byte repeats) {
-  if (byteCount > MAX_PACKET_SIZE) return; // allow for chksum
-  while (packetPending);
+  PACKET_QUEUE & queue = packetQueue[priority];
+  PACKET_SLOT & slot = queue.slots[queue.head & (PACKET_QUEUE_SIZE-1)];
+  slot.bitCount = encodePacket(slot.bits, buffer, byteCount);
+  slot.repeats = repeats;
+  queueSlot(priority);
+  return true;
+}
 
-  byte checksum = 0;
-  for (byte b = 0; b < byteCount; b++) {
-    checksum ^= buffer[b];
-    pendingPacket[b] = buffer[b];
+// As schedulePacket, with the bits encoded before
+bool DCCWaveform::scheduleEncoded(const byte bits[], byte bitCount, byte repeats, PACKET_PRIORITY priority) {
+  if (isQueueFull(priority)) {
+    queueFull++;
+    return false;
   }
-  // buffer is MAX_PACKET_SIZE but pendingPacket is one bigger
-  pendingPacket[byteCount] = checksum;
-  pendingLength = byteCount + 1;
-  pendingRepeats = repeats;
-  packetPending = true;
+
+  PACKET_QUEUE & queue = packetQueue[priority];
+  PACKET_SLOT & slot = queue.slots[queue.head & (PACKET_QUEUE_SIZE-1)];
+  memcpy(slot.bits, bits, MAX_ENCODED_SIZE);
+  slot.bitCount = bitCount;
+  slot.repeats = repeats;
+  queueSlot(priority);
+  return true;
+}
+
+// The slot at head has been filled in. Moving head with the interrupt held
+// off also stops the compiler leaving any of the slot's bits until after.
+void DCCWaveform::queueSlot(PACKET_PRIORITY priority) {
+  PACKET_QUEUE & queue = packetQueue[priority];
+  noInterrupts();
+  // Time the first waiting estop to its transmission, see showStats
+  if (priority == PRIORITY_ESTOP && estopQueued == 0) estopQueued = micros() | 1;
+  queue.head++;   // interrupt may now take this slot
+  interrupts();
   sentResetsSincePacket=0;
 }
 
+// For packets that must not be lost, spin until the class has a free slot.
+// Only a burst that has filled the queue makes this wait.
+void DCCWaveform::schedulePacketWaiting(const byte buffer[], byte byteCount, byte repeats, PACKET_PRIORITY priority) {
+  if (schedulePacket(buffer, byteCount, repeats, priority)) return;
+  unsigned long startWait=micros();
+  // Keep taking serial input meanwhile so a burst can't overrun the core buffer
+  while (!schedulePacket(buffer, byteCount, repeats, priority)) DCCEXParser::pullInput();
+  waitMicros+=micros()-startWait;
+}
+
+// Cancel queued packets in a priority class whose address bytes match.
+// An addressLength of 0 cancels the whole class.
+// Each slot is checked with the interrupt held off, and skipped if the
+// interrupt has taken it since, so a slot is either sent whole or purged.
+void DCCWaveform::purgePackets(PACKET_PRIORITY priority, const byte address[], byte addressLength) {
+  // Compare the encoded address bits, ignoring the checksum the encoder appends.
+  byte match[MAX_ENCODED_SIZE];
+  byte matchBits = addressLength * 9;
+  if (addressLength > 0) encodePacket(match, address, addressLength);
+  byte lastMask = (byte)(0xFF << (8 - (matchBits & 7)));
+
+  PACKET_QUEUE & queue = packetQueue[priority];
+  byte head = queue.head;
+  for (byte s = queue.tail; s != head; s++) {
+    PACKET_SLOT & slot = queue.slots[s & (PACKET_QUEUE_SIZE-1)];
+    noInterrupts();
+    byte tail = queue.tail;
+    if ((byte)(s - tail) < (byte)(head - tail)
+        && (addressLength == 0
+            || (memcmp(slot.bits, match, matchBits >> 3) == 0
+                && ((matchBits & 7) == 0 || ((slot.bits[matchBits >> 3] ^ match[matchBits >> 3]) & lastMask) == 0))))
+      slot.bitCount = 0;
+    interrupts();
+  }
+}
+
+bool DCCWaveform::isPacketPending() {
+  for (byte p = 0; p < PACKET_PRIORITIES; p++)
+    if (packetQueue[p].tail != packetQueue[p].head) return true;
+  return false;
+}
+
+// Packet counts since the last reset, as readable lines followed by
+// <D STATS MAIN|PROG estop speed function accessory reminder idle repeat full waitus seconds>
+// for programs to parse. Busy is the percentage of packets that were not idle.
+void DCCWaveform::showStats(Print * stream) {
+  unsigned long counts[PACKET_STATS];
+  noInterrupts();
+  for (byte i=0; i<PACKET_STATS; i++) counts[i]=packetStats[i];
+  interrupts();
+  unsigned long total=0;
+  for (byte i=0; i<PACKET_STATS; i++) total+=counts[i];
+  unsigned long seconds=(millis()-statsStart)/1000;
+  const FSH * track=name;
+  StringFormatter::send(stream, F("%S packets=%l busy=%l%% over %ls, repeats=%l queue full=%l wait=%lus\n"),
+    track, total, total ? 100-(counts[STAT_IDLE]*100/total) : 0L, seconds,
+    counts[STAT_REPEAT], queueFull, waitMicros);
+  StringFormatter::send(stream, F("%S estop=%l speed=%l %S=%l accessory=%l reminder=%l %S=%l\n"),
+    track, counts[STAT_ESTOP], counts[STAT_SPEED], isMainTrack ? F("function") : F("service"),
+    counts[STAT_FUNCTION], counts[STAT_ACCESSORY], counts[STAT_REMINDER],
+    isMainTrack ? F("idle") : F("reset"), counts[STAT_IDLE]);
+  noInterrupts();
+  unsigned long latency=estopLatency;
+  unsigned long maxLatency=estopMaxLatency;
+  interrupts();
+  if (counts[STAT_ESTOP]) 
+    StringFormatter::send(stream, F("%S estop sent %lus after queueing (worst %lus)\n"), track, latency, maxLatency);
+  StringFormatter::send(stream, F("<D STATS %S"), track);
+  for (byte i=0; i<PACKET_STATS; i++) StringFormatter::send(stream, F(" %l"), counts[i]);
+  StringFormatter::send(stream, F(" %l %l %l>\n"), queueFull, waitMicros, seconds);
+}
+
+void DCCWaveform::resetStats() {
+  noInterrupts();
+  for (byte i=0; i<PACKET_STATS; i++) packetStats[i]=0;
+  estopLatency=0;
+  estopMaxLatency=0;
+  interrupts();
+  queueFull=0;
+  waitMicros=0;
+  statsStart=millis();
+}
+
 // Operations applicable to PROG track ONLY.
 // (yes I know I could have subclassed the main track but...) 
 
 void DCCWaveform::setAckBaseline() {
       if (isMainTrack) return;
       int baseline=motorDriver->getCurrentRaw();
-      ackThreshold= baseline + motorDriver->mA2raw(ackLimitmA);
+      int step=motorDriver->mA2raw(ackLimitmA);
+      if (ackAuto && ackNoise>=0) {
+        // Half way between the noise and the recent ACKs, or twice the noise
+        // until an ACK has been seen, but always half as much again as the
+        // noise and never above the configured limit
+        int minimum=motorDriver->mA2raw(ACK_AUTO_MIN_MA);
+        int learned=ackPulseHeight>ackNoise ? (ackNoise+ackPulseHeight)/2 : 2*ackNoise;
+        if (learned<ackNoise+ackNoise/2) learned=ackNoise+ackNoise/2;
+        if (learned<minimum) learned=minimum;
+        if (learned<step) step=learned;
+      }
+      ackBaseline=baseline;
+      ackThreshold= baseline + step;
       if (Diag::ACK) DIAG(F("ACK baseline=%d/%dmA Threshold=%d/%dmA Duration between %dus and %dus"),
 			  baseline,motorDriver->raw2mA(baseline),
 			  ackThreshold,motorDriver->raw2mA(ackThreshold),
@@ -295,6 +708,9 @@ void DCCWaveform::setAckPending() {
       ackCheckStart=millis();
       numAckSamples=0;
       numAckGaps=0;
+      ackTimeoutResets=ACK_TIMEOUT_RESETS;
+      if (ackAuto && ackSeen>=ACK_LEARN_ACKS && ackLatency+ACK_MARGIN_RESETS<ACK_TIMEOUT_RESETS)
+        ackTimeoutResets=ackLatency+ACK_MARGIN_RESETS;
       ackPending=true;  // interrupt routines will now take note
 }
 
@@ -302,13 +718,46 @@ byte DCCWaveform::getAck() {
       if (ackPending) return (2);  // still waiting
       if (Diag::ACK) DIAG(F("%S after %dmS max=%d/%dmA pulse=%duS samples=%d gaps=%d"),ackDetected?F("ACK"):F("NO-ACK"), ackCheckDuration,
 			  ackMaxCurrent,motorDriver->raw2mA(ackMaxCurrent), ackPulseDuration, numAckSamples, numAckGaps);
+      if (ackAuto) {
+        int peak=ackMaxCurrent-ackBaseline;
+        if (peak<0) peak=0;
+        // The ACK height and the noise are each the highest peak of their
+        // windows, decaying by an eighth each window so that one spike is
+        // forgotten. A soft ACK only pulls the height down by an eighth. 
+        if (ackDetected) {
+          ackPulseHeight=decayingMaximum(ackPulseHeight, peak);
+          if (ackPulseResets>ackLatency) ackLatency=ackPulseResets;
+          if (ackSeen<255) ackSeen++;
+        }
+        else ackNoise=decayingMaximum(ackNoise, peak);
+      }
       if (ackDetected) return (1); // Yes we had an ack
       return(0);  // pending set off but not detected means no ACK.   
 }
 
+int DCCWaveform::decayingMaximum(int learned, int peak) {
+  if (learned<0 || peak>learned-learned/8) return peak;
+  return learned-learned/8;
+}
+
+void DCCWaveform::setAckAuto(bool on) {
+  ackAuto=on;
+  resetAckLearning();
+}
+
+void DCCWaveform::resetAckLearning() {
+  ackNoise=-1;
+  ackPulseHeight=-1;
+  ackSeen=0;
+  ackLatency=0;
+}
+
 void DCCWaveform::checkAck() {
     // This function operates in interrupt() time so must be fast and can't DIAG 
-    if (sentResetsSincePacket > 6) {  //ACK timeout
+    ISR_PATH(ISR_PATH_ACK);
+    // ACK timeout, or sooner once the decoder's ACKs are known and no pulse is under way
+    byte resets=sentResetsSincePacket;
+    if (resets > ACK_TIMEOUT_RESETS || (resets > ackTimeoutResets && ackPulseStart==0)) {
         ackCheckDuration=millis()-ackCheckStart;
         ackPending = false;
         return; 
@@ -324,7 +773,10 @@ void DCCWaveform::checkAck() {
 	 numAckGaps++;
 	 trailingEdgeCounter = 0;
        }
-       if (ackPulseStart==0) ackPulseStart=micros();    // leading edge of pulse detected
+       if (ackPulseStart==0) {    // leading edge of pulse detected
+         ackPulseStart=micros();
+         ackPulseResets=resets;
+       }
        return;
     }
     
@@ -20,68 +20,120 @@
 #ifndef DCCWaveform_h
 #define DCCWaveform_h
 
+#include "BoardProfile.h"
 #include "MotorDriver.h"
-
-// Wait times for power management. Unit: milliseconds
-const int  POWER_SAMPLE_ON_WAIT = 100;
-const int  POWER_SAMPLE_OFF_WAIT = 1000;
-const int  POWER_SAMPLE_OVERLOAD_WAIT = 20;
+#include "DCCDistrict.h"
+#include "DCCTimer.h"
 
 // Number of preamble bits.
 const int   PREAMBLE_BITS_MAIN = 16;
 const int   PREAMBLE_BITS_PROG = 22;
 const byte   MAX_PACKET_SIZE = 5;  // NMRA standard extended packets, payload size WITHOUT checksum.
+// Packets are queued already encoded as a bit stream, a start bit then 8 data bits per byte (checksum included).
+const byte   MAX_ENCODED_SIZE = ((MAX_PACKET_SIZE+1)*9+7)/8;
+
+// Packets waiting for the transmitter are queued by priority class.
+// The interrupt always takes the oldest packet of the most urgent non-empty class.
+// Each class is a lock-free ring with the loop as the only producer and
+// the interrupt as the only consumer.
+enum PACKET_PRIORITY : byte {
+  PRIORITY_ESTOP=0,     // emergency stops, these overtake everything else
+  PRIORITY_SPEED=1,     // speed and direction changes (and speed reminders to keep them in order)
+  PRIORITY_FUNCTION=2,  // functions, accessories, POM and raw packets
+  PRIORITY_REMINDER=3   // background function refresh
+};
+const byte PACKET_PRIORITIES=4;
+// Slots per priority class, MUST be a power of 2 (set in BoardProfile.h)
+const byte PACKET_QUEUE_SIZE=PACKET_QUEUE_LENGTH;
 
 // The WAVE_STATE enum is deliberately numbered because a change of order would be catastrophic
 // to the transform array.
-enum  WAVE_STATE : byte {WAVE_START=0,WAVE_MID_1=1,WAVE_HIGH_0=2,WAVE_MID_0=3,WAVE_LOW_0=4,WAVE_PENDING=5};
+enum  WAVE_STATE : byte {WAVE_START=0,WAVE_MID_1=1,WAVE_HIGH_0=2,WAVE_MID_0=3,WAVE_LOW_0=4,WAVE_PENDING=5,
+                        WAVE_END_1=6,WAVE_CUTOUT=7};
+const byte WAVE_STATES=8;
 
+// RailCom cutout on the main track, only built with RAILCOM_CUTOUT defined.
+// The cutout follows the end bit of every packet for RAILCOM_CUTOUT_TICKS
+// ticks (464uS). The end bit is the first bit of the preamble, so 15 of the
+// 16 preamble bits follow the cutout. It opens at the end bit edge rather
+// than 26-32uS after it because that is the tick we have. The prog track
+// has the cutout too while it is joined to main.
+// The callback is called in interrupt time as each detector window
+// opens so a UART can be started, and again when the cutout closes.
+const byte RAILCOM_CUTOUT_TICKS=8;
+const byte RAILCOM_CHANNEL_1_TICK=1;  // 58uS, channel 1 data from 80uS to 177uS
+const byte RAILCOM_CHANNEL_2_TICK=3;  // 174uS, channel 2 data from 193uS to 454uS
+enum RAILCOM_WINDOW : byte {RAILCOM_CLOSED=0, RAILCOM_CHANNEL_1=1, RAILCOM_CHANNEL_2=2};
+typedef void (*RAILCOM_CALLBACK)(RAILCOM_WINDOW window);
 
-// NOTE: static functions are used for the overall controller, then
-// one instance is created for each track.
 
+// Packet counters per track, see showStats. The priority classes come first
+// so a class can index the counters directly.
+enum PACKET_STAT : byte {
+  STAT_ESTOP=PRIORITY_ESTOP,
+  STAT_SPEED=PRIORITY_SPEED,
+  STAT_FUNCTION=PRIORITY_FUNCTION,  // also POM and prog track (service mode) packets
+  STAT_REMINDER=PRIORITY_REMINDER,
+  STAT_ACCESSORY,   // function class packets with an accessory address
+  STAT_IDLE,        // idle (main) or reset (prog) packets sent because nothing was queued
+  STAT_REPEAT       // repeat transmissions of any packet
+};
+const byte PACKET_STATS=7;
 
-enum class POWERMODE : byte { OFF, ON, OVERLOAD };
+// Interrupt timing by path, only collected when built with ISR_TIMING defined.
+// Each tick is classed by the most expensive work done in it.
+enum ISR_PATH : byte {
+  ISR_PATH_EDGE=0,      // signal change only
+  ISR_PATH_PREAMBLE=1,  // next bit is a preamble bit
+  ISR_PATH_BIT=2,       // next bit taken from the packet
+  ISR_PATH_PACKET=3,    // end of packet, repeat or next packet chosen
+  ISR_PATH_ACK=4        // prog track ack check
+};
+const byte ISR_PATHS=5;
+const byte ISR_BUCKETS=8;        // histogram buckets, the last one is open ended
+const byte ISR_BUCKET_MICROS=8;  // width of each bucket
+
+// Extra main track districts (boosters) added by addDistrict
+const byte MAX_DISTRICTS=4;
+
+// NOTE: static functions are used for the overall controller, then
+// one instance is created for each track.
 
 const byte idlePacket[] = {0xFF, 0x00, 0xFF};
 const byte resetPacket[] = {0x00, 0x00, 0x00};
 
-class DCCWaveform {
+class DCCWaveform : public DCCDistrict {
   public:
     DCCWaveform( byte preambleBits, bool isMain);
     static void begin(MotorDriver * mainDriver, MotorDriver * progDriver);
     static void loop(bool ackManagerActive);
     static DCCWaveform  mainTrack;
     static DCCWaveform  progTrack;
+    // Districts must be added before begin, they follow the main track power commands
+    static bool addDistrict(MotorDriver * driver);
+    static inline byte getDistrictCount() {
+      return districtCount;
+    }
+    static inline DCCDistrict * getDistrict(byte district) {
+      return district<districtCount ? districts[district] : NULL;
+    }
 
     void beginTrack();
     void setPowerMode(POWERMODE);
-    POWERMODE getPowerMode();
     void checkPowerOverload(bool ackManagerActive);
-    inline int get1024Current() {
-	  if (powerMode == POWERMODE::ON)
-	      return (int)(lastCurrent*(long int)1024/motorDriver->getRawCurrentTripValue());
-	  return 0;
+    bool schedulePacket(const byte buffer[], byte byteCount, byte repeats, PACKET_PRIORITY priority=PRIORITY_FUNCTION);
+    void schedulePacketWaiting(const byte buffer[], byte byteCount, byte repeats, PACKET_PRIORITY priority);
+    // A packet already encoded by encodePacket, for callers that keep them
+    bool scheduleEncoded(const byte bits[], byte bitCount, byte repeats, PACKET_PRIORITY priority);
+    static byte encodePacket(byte bits[], const byte buffer[], byte byteCount);
+    void purgePackets(PACKET_PRIORITY priority, const byte address[], byte addressLength);
+    bool isPacketPending(); 
+    inline bool isQueueEmpty(PACKET_PRIORITY priority) {
+      return packetQueue[priority].head == packetQueue[priority].tail;
     }
-    inline int getCurrentmA() {
-      if (powerMode == POWERMODE::ON)
-        return motorDriver->raw2mA(lastCurrent);
-      return 0;
+    inline bool isQueueFull(PACKET_PRIORITY priority) {
+      return (byte)(packetQueue[priority].head - packetQueue[priority].tail) >= PACKET_QUEUE_SIZE;
     }
-    inline int getMaxmA() {
-      if (maxmA == 0) { //only calculate this for first request, it doesn't change
-        maxmA = motorDriver->raw2mA(motorDriver->getRawCurrentTripValue()); //TODO: replace with actual max value or calc
-      }
-      return maxmA;        
-    }
-    inline int getTripmA() { 
-      if (tripmA == 0) { //only calculate this for first request, it doesn't change
-        tripmA = motorDriver->raw2mA(motorDriver->getRawCurrentTripValue());
-      }
-      return tripmA;        
-    }
-    void schedulePacket(const byte buffer[], byte byteCount, byte repeats);
-    volatile bool packetPending;
     volatile byte sentResetsSincePacket;
     volatile bool autoPowerOff=false;
     void setAckBaseline();  //prog track only
@@ -95,9 +147,6 @@ class DCCWaveform {
 	    autoPowerOff=false;
 	}
     };
-    inline bool canMeasureCurrent() {
-      return motorDriver->canMeasureCurrent();
-    };
     inline void setAckLimit(int mA) {
 	ackLimitmA = mA;
     }
@@ -107,47 +156,83 @@ class DCCWaveform {
     inline void setMaxAckPulseDuration(unsigned int i) {
 	maxAckPulseDuration = i;
     }
+    // Adaptive ACK: learn the noise and ACK pulse height of the decoder on
+    // the prog track and set the threshold from them. Once it has ACKed a
+    // few times, a wait with no pulse under way ends a couple of resets
+    // after the latest its ACKs have started. The pulse duration window is
+    // still the one set by <D ACK MIN/MAX>.
+    // What was learned is forgotten when the prog track is switched off.
+    void setAckAuto(bool on);
+    void showStats(Print * stream);
+    void resetStats();
+    static void showIsrTiming(Print * stream);
+    void showTrace(Print * stream);  // packets as sent, only built with PACKET_TRACE
+    static void resetIsrTiming();
+    static bool setRailcom(bool on);   // false if not built with RAILCOM_CUTOUT
+    static void setRailcomCallback(RAILCOM_CALLBACK callback);
 
   private:
     
 // For each state of the wave  nextState=stateTransform[currentState] 
-   static const WAVE_STATE stateTransform[6];
+   static const WAVE_STATE stateTransform[WAVE_STATES];
 
 // For each state of the wave, signal pin is HIGH or LOW   
-   static const bool signalTransform[6];
+   static const bool signalTransform[WAVE_STATES];
   
     static void interruptHandler();
+    static void bitInterruptHandler();
+    static void streamHandler(uint32_t toggles[]);
+    static void checkHardTrips();
     void interrupt2();
+    DCC_PERIOD nextPeriod();
+    bool nextPacket();
+    void queueSlot(PACKET_PRIORITY priority);
     void checkAck();
+    bool railcomTick();
     
     bool isMainTrack;
-    MotorDriver*  motorDriver;
     // Transmission controller
-    byte transmitPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
-    byte transmitLength;
+    byte transmitBits[MAX_ENCODED_SIZE]; // encoded packet being sent
+    byte transmitBitCount;     // bits in transmitBits
+    byte transmitByte;         // shift register, next bit to send is the top bit
     byte transmitRepeats;      // remaining repeats of transmission
     byte remainingPreambles;
     byte requiredPreambles;
-    byte bits_sent;           // 0-8 (yes 9 bits) sent for current byte
-    byte bytes_sent;          // number of bytes sent from transmitPacket
+    byte bits_sent;           // number of bits sent from transmitBits
+    byte idleBits[MAX_ENCODED_SIZE]; // encoded idle (main) or reset (prog) packet
+    byte idleBitCount;
     WAVE_STATE state;         // wave generator state machine
-    byte pendingPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
-    byte pendingLength;
-    byte pendingRepeats;
-    int  lastCurrent;
+    struct PACKET_SLOT {
+      byte bits[MAX_ENCODED_SIZE];
+      volatile byte bitCount;         // 0 if purged before transmission
+      volatile byte repeats;
+    };
+    struct PACKET_QUEUE {
+      volatile byte head;   // free running, only written by schedulePacket 
+      volatile byte tail;   // free running, only written by interrupt
+      PACKET_SLOT slots[PACKET_QUEUE_SIZE];
+    };
+    PACKET_QUEUE packetQueue[PACKET_PRIORITIES];
+    // Statistics, packetStats is counted in interrupt time, the others in the loop
+    volatile unsigned long packetStats[PACKET_STATS];
+    unsigned long queueFull;    // schedulePacket calls refused
+    unsigned long waitMicros;   // time spent in schedulePacketWaiting for a free slot
+    unsigned long statsStart;   // millis
+    // Emergency stop latency, from queueing the first waiting estop to the 
+    // interrupt taking it (up to one packet of about 6ms on the wire before that)
+    volatile unsigned long estopQueued;   // micros, 0 if no estop is waiting
+    volatile unsigned long estopLatency;  // micros, last estop
+    volatile unsigned long estopMaxLatency;
     static int progTripValue;
-    int maxmA;
-    int tripmA;
+    static DCCDistrict * districts[MAX_DISTRICTS];
+    static volatile byte districtCount;
     
-    // current sampling
-    POWERMODE powerMode;
-    unsigned long lastSampleTaken;
-    unsigned int sampleDelay;
     // Trip current for programming track, 250mA. Change only if you really
     // need to be non-NMRA-compliant because of decoders that are not either.
     static const int TRIP_CURRENT_PROG=250;
-    unsigned long power_sample_overload_wait = POWER_SAMPLE_OVERLOAD_WAIT;
-    unsigned int power_good_counter = 0;
+    static byte hardTripSelect;  // output checked for a fast trip this interrupt
+    static bool bitMode;         // timer generates whole bits, see DCCTimer::beginBits
+    static portreg_t streamBits; // signal pin states at the end of the last stream buffer
 
     // ACK management (Prog track only)  
     volatile bool ackPending;
@@ -164,6 +249,51 @@ class DCCWaveform {
     unsigned int minAckPulseDuration = 4000; // micros
     unsigned int maxAckPulseDuration = 8500; // micros
 
+    // Adaptive ACK, all in raw current above the baseline
+    static const int ACK_AUTO_MIN_MA=15;  // threshold never lower than this
+    static const byte ACK_TIMEOUT_RESETS=6;
+    // Once ACK_LEARN_ACKS ACKs have shown when the decoder answers, a wait
+    // with no pulse under way ends ACK_MARGIN_RESETS after the latest start seen
+    static const byte ACK_LEARN_ACKS=4;
+    static const byte ACK_MARGIN_RESETS=2;
+    bool ackAuto = false;
+    int ackBaseline;
+    int ackNoise;          // decaying highest peak of waits without an ACK, -1 unknown
+    int ackPulseHeight;    // decaying highest peak of detected ACKs, -1 unknown
+    byte ackSeen;          // ACKs detected, up to 255
+    byte ackLatency;       // latest resets after the packet that an ACK started
+    volatile byte ackPulseResets;   // resets after the packet when this pulse started
+    byte ackTimeoutResets; // resets after which this wait is a NO-ACK
+    void resetAckLearning();
+    static int decayingMaximum(int learned, int peak);
+
+#if defined(RAILCOM_CUTOUT)
+    static volatile bool railcom;
+    static volatile RAILCOM_CALLBACK railcomCallback;
+    static bool cutoutProg;  // the cutout open now was opened on the joined prog track too
+    byte cutoutTicks;
+#endif
+
+#if defined(PACKET_TRACE)
+    // The last TRACE_PACKETS packets taken by the interrupt, in the
+    // encoded form that was shifted out to the pins
+    static const byte TRACE_PACKETS=16;
+    struct TRACED_PACKET {
+      byte bits[MAX_ENCODED_SIZE];
+      byte bitCount;
+    };
+    TRACED_PACKET trace[TRACE_PACKETS];
+    volatile byte traceNext;   // free running
+#endif
+
+#if defined(ISR_TIMING)
+    static void recordIsrTiming();
+    static volatile byte isrPath;
+    static volatile unsigned long isrHistogram[ISR_PATHS][ISR_BUCKETS];
+    static volatile unsigned int isrMaximum[ISR_PATHS];
+    static volatile unsigned long isrOverruns;
+#endif
+
     volatile static uint8_t numAckGaps;
     volatile static uint8_t numAckSamples;
     static uint8_t trailingEdgeCounter;
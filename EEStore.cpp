@@ -22,33 +22,103 @@
 #include "Turnouts.h"
 #include "Sensors.h"
 #include "Outputs.h"
+#include "Consists.h"
+#include "DCCWaveform.h"
+#include "Watchdog.h"
 #include "DIAG.h"
 
 #if defined(ARDUINO_ARCH_SAMD)
 ExternalEEPROM EEPROM;
 #endif
 
+// Header of the "DCC++" layout, whose sensors have no debounce time
+struct EEStoreDataDCCPP{
+  char id[sizeof("DCC++")];
+  int nTurnouts;
+  int nSensors;
+  int nOutputs;
+};
+
+// Header of the "DCC++1" layout, which has no consists
+struct EEStoreDataDCCPP1{
+  char id[sizeof("DCC++1")];
+  int nTurnouts;
+  int nSensors;
+  int nOutputs;
+  byte journalEpoch;
+};
+
 void EEStore::init(){
 #if defined(ARDUINO_ARCH_SAMD)
     EEPROM.begin(0x50);     // Address for Microchip 24-series EEPROM with all three A pins grounded (0b1010000 = 0x50)
+#elif defined(ARDUINO_ARCH_RP2040)
+    EEPROM.begin(4096);     // a copy in RAM of the last flash sector
 #endif
 
     eeStore=(EEStore *)calloc(1,sizeof(EEStore));
     
     EEPROM.get(0,eeStore->data);                                       // get eeStore data
+    layout=LAYOUT_CURRENT;
+    reset();            // set memory pointer to first free EEPROM space
 
-    if(strncmp(eeStore->data.id,EESTORE_ID,sizeof(EESTORE_ID))!=0){    // check to see that eeStore contains valid DCC++ ID
+    if(strncmp(eeStore->data.id,EESTORE_ID,sizeof(EESTORE_ID))!=0 && !oldLayout()){    // check to see that eeStore contains valid DCC++ ID
+        if (strncmp(eeStore->data.id,"DCC++",5)==0) 
+          DIAG(F("EEPROM layout not known, turnouts, sensors, outputs and consists must be defined again"));
         sprintf(eeStore->data.id,EESTORE_ID);                           // if not, create blank eeStore structure (no turnouts, no sensors) and save it back to EEPROM
         eeStore->data.nTurnouts=0;
         eeStore->data.nSensors=0;
         eeStore->data.nOutputs=0;
+        eeStore->data.nConsists=0;
+        eeStore->data.journalEpoch=0;
         EEPROM.put(0,eeStore->data);
     }
 
-    reset();            // set memory pointer to first free EEPROM space
     Turnout::load();    // load turnout definitions
     Sensor::load();     // load sensor definitions
     Output::load();     // load output definitions
+    Consist::load();    // load consist members
+    resetJournal(false);
+    if (layout!=LAYOUT_DCCPP) replayJournal();    // apply state changes made since
+    if (layout!=LAYOUT_CURRENT) {
+        DIAG(F("EEPROM definitions stored again as layout %s"),EESTORE_ID);
+        layout=LAYOUT_CURRENT;
+        sprintf(eeStore->data.id,EESTORE_ID);
+        store();
+    }
+    restoreSnapshot();  // locos as they were, before any throttle reconnects
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Reads the header of an earlier layout into the current one, and points
+// at its first definition. The load() functions read the records in it.
+bool EEStore::oldLayout(){
+    struct EEStoreDataDCCPP1 old1;
+    EEPROM.get(0,old1);
+    if (strncmp(old1.id,"DCC++1",sizeof(old1.id))==0) {
+      layout=LAYOUT_DCCPP1;
+      eeStore->data.nTurnouts=old1.nTurnouts;
+      eeStore->data.nSensors=old1.nSensors;
+      eeStore->data.nOutputs=old1.nOutputs;
+      eeStore->data.nConsists=0;
+      eeStore->data.journalEpoch=old1.journalEpoch;  // its journal is replayed
+      eeAddress=sizeof(old1);
+      DIAG(F("EEPROM layout %s found"),old1.id);
+      return true;
+    }
+    struct EEStoreDataDCCPP old;
+    EEPROM.get(0,old);
+    if (strncmp(old.id,"DCC++",sizeof(old.id))!=0) return false;
+    layout=LAYOUT_DCCPP;
+    eeStore->data.nTurnouts=old.nTurnouts;
+    eeStore->data.nSensors=old.nSensors;
+    eeStore->data.nOutputs=old.nOutputs;
+    eeStore->data.nConsists=0;
+    eeStore->data.journalEpoch=0;
+    eeAddress=sizeof(old);
+    DIAG(F("EEPROM layout %s found"),old.id);
+    return true;
 
 }
 
@@ -60,7 +130,13 @@ void EEStore::clear(){
     eeStore->data.nTurnouts=0;
     eeStore->data.nSensors=0;
     eeStore->data.nOutputs=0;
+    eeStore->data.nConsists=0;
+    reset();
+    resetJournal(true);
     EEPROM.put(0,eeStore->data);
+#if defined(ARDUINO_ARCH_RP2040)
+    EEPROM.commit();
+#endif
 
 }
 
@@ -71,13 +147,20 @@ void EEStore::store(){
     Turnout::store();
     Sensor::store();
     Output::store();
+    Consist::store();
+    resetJournal(true);  // the definitions now hold the current states
     EEPROM.put(0,eeStore->data);
+#if defined(ARDUINO_ARCH_RP2040)
+    EEPROM.commit();
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Storing a full EEPROM takes longer than LOOP_STALL_MS
 void EEStore::advance(int n){
     eeAddress+=n;
+    Watchdog::kick();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -102,5 +185,227 @@ void EEStore::dump(int num) {
 }
 ///////////////////////////////////////////////////////////////////////////////
 
+// Journal in a fixed area just below the snapshot, none if the
+// definitions have grown into it
+void EEStore::resetJournal(bool newEpoch){
+    snapshotLayout();
+    int records=EEPROM.length()/8/JOURNAL_RECORD;
+    if (records>JOURNAL_RECORDS) records=JOURNAL_RECORDS;
+    journalStart=snapshotStart-records*JOURNAL_RECORD;
+    journalSize=(journalStart<pointer()) ? 0 : records;
+    journalHead=0;
+    journalStep=0;
+    compactPhase=COMPACT_NONE;
+    if (newEpoch) {
+      stateCount=0;     // anything cached is about to be stored with the definitions
+      if (journalSize>0) EEPROM.put(journalStart+JOURNAL_EPOCH,NO_EPOCH);
+      nextEpoch();
+    }
+}
+
+// 0xFF is skipped as that is what an erased record reads as
+void EEStore::nextEpoch(){
+    eeStore->data.journalEpoch++;
+    if (eeStore->data.journalEpoch==NO_EPOCH) eeStore->data.journalEpoch=0;
+}
+
+byte EEStore::journalCheck(const byte record[]){
+    return 0xA5 ^ record[0] ^ record[1] ^ record[2] ^ record[3];
+}
+
+void EEStore::replayJournal(){
+    byte r[JOURNAL_RECORD];
+    for (journalHead=0; journalHead<journalSize; journalHead++) {
+      int record=journalStart+journalHead*JOURNAL_RECORD;
+      for (byte i=0; i<JOURNAL_RECORD; i++) r[i]=EEPROM.read(record+i);
+      if (r[3]!=eeStore->data.journalEpoch || r[4]!=journalCheck(r)) break;
+      int address=r[0] | (r[1]<<8);
+      if (!Turnout::restoreState(address,r[2])) Output::restoreState(address,r[2]);
+    }
+}
+
+// At most a quarter of the EEPROM at its end, none if the definitions
+// have grown into it. The area stays where it is either way so that the
+// journal below it does not move.
+void EEStore::snapshotLayout(){
+    int length=EEPROM.length();
+    int slots=WARM_RESTART_LOCOS;
+    if (slots>length/4/SNAPSHOT_RECORD) slots=length/4/SNAPSHOT_RECORD;
+    snapshotStart=length-slots*SNAPSHOT_RECORD;
+    if (snapshotStart<pointer()) slots=0;
+    snapshotSlots=slots;
+    snapshotNext=-1;
+}
+
+byte EEStore::snapshotCheck(const byte record[]){
+    byte check=0x5A;
+    for (byte i=0; i<DCC::LOCO_SNAPSHOT_SIZE; i++) check^=record[i];
+    return check;
+}
+
+void EEStore::restoreSnapshot(){
+    byte record[SNAPSHOT_RECORD];
+    byte restored=0;
+    for (byte slot=0; slot<snapshotSlots; slot++) {
+      int address=snapshotStart+slot*SNAPSHOT_RECORD;
+      for (byte i=0; i<SNAPSHOT_RECORD; i++) record[i]=EEPROM.read(address+i);
+      int loco=record[0] | (record[1]<<8);
+      if (loco<=0 || loco>10239 || record[DCC::LOCO_SNAPSHOT_SIZE]!=snapshotCheck(record)) continue;
+      DCC::restoreSnapshot(record);
+      restored++;
+    }
+    if (restored) DIAG(F("Warm restart, %d locos restored"),restored);
+}
+
+void EEStore::snapshotStep(){
+    if (snapshotNext<0) {
+      if (snapshotSlots==0 || millis()-lastSnapshot < SNAPSHOT_MS) return;
+      lastSnapshot=millis();
+      snapshotNext=0;
+    }
+    byte record[SNAPSHOT_RECORD];
+    DCC::getSnapshot(snapshotNext, record);
+    record[DCC::LOCO_SNAPSHOT_SIZE]=snapshotCheck(record);
+    int address=snapshotStart+snapshotNext*SNAPSHOT_RECORD;
+    for (byte i=0; i<SNAPSHOT_RECORD; i++) {
+      if (EEPROM.read(address+i)!=record[i]) {
+        EEPROM.write(address+i,record[i]);
+        return;  // this record is compared again next time
+      }
+    }
+    if (++snapshotNext==snapshotSlots) snapshotNext=-1;
+}
+
+// Remember a state byte to write to EEPROM later. Changes to the same cell
+// are merged unless its journal record is already being written.
+void EEStore::writeState(int address, byte value){
+    lastStateChange=millis();
+    for (byte i=(journalStep>0); i<stateCount; i++) {
+      if (stateCache[i].address==address) {
+        stateCache[i].value=value;
+        return;
+      }
+    }
+    if (stateCount==STATE_CACHE_SIZE) {
+      // Full, rather than wait for room write every state to its own cell
+      // again, from the start in case this one was already passed.
+      compactPhase=COMPACT_TURNOUTS;
+      compactNext=0;
+      return;
+    }
+    stateCache[stateCount].address=address;
+    stateCache[stateCount].value=value;
+    stateCount++;
+}
+
+void EEStore::loop(){
+#if defined(ARDUINO_ARCH_RP2040)
+    // Writing the flash stops the waveform interrupt for some milliseconds,
+    // which no loco on a powered track should see. So the RAM copy is only
+    // written out by <E> and <e> or, for the states journalled since, once 
+    // both tracks are off. commit does nothing if nothing has changed.
+    if (stateCount==0 && compactPhase==COMPACT_NONE
+        && DCCWaveform::mainTrack.getPowerMode()!=POWERMODE::ON
+        && DCCWaveform::progTrack.getPowerMode()!=POWERMODE::ON) EEPROM.commit();
+#endif
+    bool idle=(stateCount==0 && compactPhase==COMPACT_NONE);
+#if defined(ARDUINO_ARCH_AVR)
+    if (idle && eeprom_is_ready()) snapshotStep();
+#else
+    if (idle) snapshotStep();
+#endif
+    if (idle) return;
+    if (compactPhase==COMPACT_NONE && stateCount < STATE_CACHE_SIZE/2 && millis()-lastStateChange < STATE_FLUSH_DELAY) return;
+#if defined(ARDUINO_ARCH_AVR)
+    if (!eeprom_is_ready()) return;  // previous byte still being written
+#endif
+    writeStateStep();
+}
+
+// Write one byte of the oldest cached state, or of compacting the journal
+void EEStore::writeStateStep(){
+    if (compactPhase!=COMPACT_NONE && journalStep==0) {
+      compactStep();
+      return;
+    }
+    STATE_WRITE * w=&stateCache[0];
+    if (journalSize==0) {  // no room for a journal, write the cell itself
+      EEPROM.put(w->address,w->value);
+    }
+    else {
+      if (journalHead==journalSize) {
+        // Journal full, put all states in their own cells and start again
+        // with a new epoch. The cache waits until that is done.
+        compactPhase=COMPACT_TURNOUTS;
+        compactNext=0;
+        return;
+      }
+      int record=journalStart+journalHead*JOURNAL_RECORD;
+      if (journalStep==0) {
+        journalStep=1;
+        int next=record+JOURNAL_RECORD+JOURNAL_EPOCH;
+        if (journalHead+1<journalSize && EEPROM.read(next)!=NO_EPOCH) {
+          EEPROM.put(next,NO_EPOCH);
+          return;
+        }
+      }
+      byte r[JOURNAL_RECORD]={lowByte(w->address), highByte(w->address), w->value, eeStore->data.journalEpoch, 0};
+      r[4]=journalCheck(r);
+      EEPROM.put(record+journalStep-1, r[journalStep-1]);
+      if (journalStep++ < JOURNAL_RECORD) return;
+      journalStep=0;
+      journalHead++;
+    }
+    stateCount--;
+    memmove(stateCache, stateCache+1, stateCount*sizeof(STATE_WRITE));
+}
+
+// One byte of compacting the journal. Until the new epoch is written a
+// restart still replays the old journal over the cells, so nothing is lost
+// if the power goes part way through. The cache always holds the latest
+// value of each cell in it, so it can be journaled afterwards.
+void EEStore::compactStep(){
+    switch (compactPhase) {
+      case COMPACT_TURNOUTS:
+        compactNext=Turnout::storeStateFrom(compactNext);
+        if (compactNext>=0) return;
+        compactPhase=COMPACT_OUTPUTS;
+        compactNext=0;
+        return;
+      case COMPACT_OUTPUTS:
+        compactNext=Output::storeStateFrom(compactNext);
+        if (compactNext>=0) return;
+        compactPhase=COMPACT_FIRST;
+        return;
+      case COMPACT_FIRST:
+        // The cells are up to date, so the old journal is no longer needed
+        if (journalSize>0) EEPROM.put(journalStart+JOURNAL_EPOCH,NO_EPOCH);
+        compactPhase=COMPACT_EPOCH;
+        return;
+      default:
+        nextEpoch();
+        EEPROM.put(offsetof(EEStoreData,journalEpoch),eeStore->data.journalEpoch);
+        compactPhase=COMPACT_NONE;
+        journalHead=0;
+        return;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 EEStore *EEStore::eeStore=NULL;
 int EEStore::eeAddress=0;
+EEStore::LAYOUT EEStore::layout=EEStore::LAYOUT_CURRENT;
+EEStore::STATE_WRITE EEStore::stateCache[EEStore::STATE_CACHE_SIZE];
+byte EEStore::stateCount=0;
+unsigned long EEStore::lastStateChange=0;
+int EEStore::journalStart=0;
+int EEStore::journalSize=0;
+int EEStore::journalHead=0;
+byte EEStore::journalStep=0;
+EEStore::COMPACT_PHASE EEStore::compactPhase=EEStore::COMPACT_NONE;
+int EEStore::compactNext=0;
+int EEStore::snapshotStart=0;
+byte EEStore::snapshotSlots=0;
+int EEStore::snapshotNext=-1;
+unsigned long EEStore::lastSnapshot=0;
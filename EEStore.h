@@ -2,6 +2,7 @@
 #define EEStore_h
 
 #include <Arduino.h>
+#include "DCC.h"
 
 #if defined(ARDUINO_ARCH_SAMD)
 #include <SparkFun_External_EEPROM.h>
@@ -10,13 +11,16 @@ extern ExternalEEPROM EEPROM;
 #include <EEPROM.h>
 #endif
 
-#define EESTORE_ID "DCC++"
+#define EESTORE_ID "DCC++2"   // bump when the layout of the stored data changes,
+                              // and read the old one in EEStore::oldLayout
 
 struct EEStoreData{
   char id[sizeof(EESTORE_ID)];
   int nTurnouts;
   int nSensors;  
   int nOutputs;
+  int nConsists;
+  byte journalEpoch;  // journal records of any other epoch are ignored
 };
 
 struct EEStore{
@@ -30,6 +34,71 @@ struct EEStore{
   static void store();
   static void clear();
   static void dump(int);
+  static void writeState(int address, byte value);
+  static void loop();
+
+  // The layout of the definitions being loaded. Those of an earlier
+  // version are read in its layout by init() and then stored again in 
+  // the current one, so an upgrade does not lose them.
+  enum LAYOUT : byte { LAYOUT_DCCPP, LAYOUT_DCCPP1, LAYOUT_CURRENT };
+  static LAYOUT layout;
+  static bool oldLayout();
+
+  // Turnout and output state changes are cached and appended to a journal
+  // in a fixed area below the snapshot, one byte write per loop() so a 
+  // burst of commands never waits for the EEPROM. Each record is address
+  // low, address high, value, epoch and a check byte over the other four. 
+  // The check is written last so a record only counts once complete, and
+  // the area does not move when definitions are added. When the journal is
+  // full the current states are written to their own cells, again a byte
+  // per loop(), and then the epoch moves on. If the definitions grow into
+  // the area the states are written straight to their own cells.
+  // The epoch byte wraps, so the record after the head is always marked
+  // as of no epoch before the head record is written. Replay then stops
+  // at the real head rather than run on into an older generation that
+  // had the same epoch number.
+  static const byte STATE_CACHE_SIZE=16;
+  static const int STATE_FLUSH_DELAY=500; // ms without changes before the cache is written
+  static const byte JOURNAL_RECORD=5;
+  static const int JOURNAL_RECORDS=64;    // at most, and at most an eighth of the EEPROM
+  static const byte JOURNAL_EPOCH=3;      // byte of a record
+  static const byte NO_EPOCH=0xFF;        // as an erased record reads, never used
+  struct STATE_WRITE {
+    int address;
+    byte value;
+  };
+  static STATE_WRITE stateCache[STATE_CACHE_SIZE];
+  static byte stateCount;
+  static unsigned long lastStateChange;
+  static int journalStart;
+  static int journalSize;  // records
+  static int journalHead;
+  static byte journalStep; // 0 to mark the next record, then 1 + the byte of the record at journalHead
+  enum COMPACT_PHASE : byte { COMPACT_NONE, COMPACT_TURNOUTS, COMPACT_OUTPUTS, COMPACT_FIRST, COMPACT_EPOCH };
+  static COMPACT_PHASE compactPhase;
+  static int compactNext;  // index position of the next turnout or output to compare
+  static void writeStateStep();
+  static void compactStep();
+  static void resetJournal(bool newEpoch);
+  static void replayJournal();
+  static void nextEpoch();
+  static byte journalCheck(const byte record[]);
+
+  // Warm restart snapshot of the loco table in the last WARM_RESTART_LOCOS
+  // records of the EEPROM, before the journal runs into it. Each record is 
+  // DCC::getSnapshot followed by a check byte so that old journal bytes are 
+  // never taken for a loco. A pass every SNAPSHOT_MS compares one record per 
+  // loop() and writes at most one changed byte, when no states are waiting.
+  static const byte SNAPSHOT_RECORD=DCC::LOCO_SNAPSHOT_SIZE+1;
+  static const unsigned int SNAPSHOT_MS=5000;
+  static int snapshotStart;
+  static byte snapshotSlots;
+  static int snapshotNext;  // next record of the pass, -1 between passes
+  static unsigned long lastSnapshot;
+  static void snapshotLayout();
+  static void snapshotStep();
+  static void restoreSnapshot();
+  static byte snapshotCheck(const byte record[]);
 };
 
 #endif
@@ -28,7 +28,9 @@
 #include "EthernetInterface.h"
 #include "DIAG.h"
 #include "CommandDistributor.h"
+#include "WiThrottle.h"
 #include "DCCTimer.h"
+#include "Watchdog.h"
 
 EthernetInterface * EthernetInterface::singleton=NULL;
 /**
@@ -38,62 +40,168 @@ EthernetInterface * EthernetInterface::singleton=NULL;
 void EthernetInterface::setup()
 {
     singleton=new EthernetInterface();
-    if (!singleton->connected) singleton=NULL; 
 };
 
 
 /**
- * @brief Aquire IP Address from DHCP and start server
+ * @brief Prepare the interface, the connection is made later by loop()
  * 
- * @return true 
- * @return false 
  */
 EthernetInterface::EthernetInterface()
 {
-    byte mac[6];
     DCCTimer::getSimulatedMacAddress(mac);
     connected=false;
-   
+    server=NULL;
+    serverStarted=false;
+    for (byte socket = 0; socket < MAX_SOCK_NUM; socket++) {
+      outboundRing[socket]=NULL;
+      outboundCount[socket]=0;
+      outboundDropped[socket]=0;
+      outboundStalled[socket]=0;
+      outboundFences[socket]=0;
+    }
+    nextSocketOut=0;
+    failures=0;
+    setState(ETH_START);
+}
+
+void EthernetInterface::setState(ETH_STATE newState) {
+    state=newState;
+    stateTime=millis();
+}
+
+/**
+ * @brief Aquire IP Address from DHCP (or use the static address)
+ * 
+ */
+void EthernetInterface::start()
+{
+    serverStarted=false;  // Ethernet.begin resets the chip and its sockets
     #ifdef IP_ADDRESS
     Ethernet.begin(mac, IP_ADDRESS);
     #else
-    if (Ethernet.begin(mac) == 0)
+    Watchdog::hold();  // DHCP can take longer than LOOP_STALL_MS
+    int started=Ethernet.begin(mac, ETHERNET_DHCP_TIMEOUT);
+    Watchdog::kick();
+    if (started == 0)
     {
-        DIAG(F("Ethernet.begin FAILED"));
+        if (Ethernet.hardwareStatus() == EthernetNoHardware) {
+          DIAG(F("Ethernet shield not found"));
+          setState(ETH_NO_HARDWARE);
+          return;
+        }
+        if (failures<ETHERNET_RETRY_BACKOFF) failures++;
+        DIAG(F("Ethernet.begin FAILED, retry in %ds"), (ETHERNET_RETRY_DELAY/1000)<<(failures-1));
+        setState(ETH_RETRY_WAIT);
         return;
     } 
     #endif
     DIAG(F("begin OK."));
+    failures=0;
      if (Ethernet.hardwareStatus() == EthernetNoHardware) {
       DIAG(F("Ethernet shield not found"));
+      setState(ETH_NO_HARDWARE);
       return;
     }
-  
-    unsigned long startmilli = millis();
-    while ((millis() - startmilli) < 5500) // Loop to give time to check for cable connection
+    if (Ethernet.linkStatus() == LinkOFF) DIAG(F("Ethernet waiting for link"));
+    setState(ETH_WAIT_LINK);
+}
+
+/**
+ * @brief Run the link state machine 
+ * 
+ * @return true if connected and traffic can be handled
+ */
+bool EthernetInterface::checkLink()
+{
+    switch (state) {
+    case ETH_START:
+        start();
+        return false;
+
+    case ETH_WAIT_LINK:
+        // Shields that cant tell return Unknown, treat that as connected
+        if (Ethernet.linkStatus() == LinkOFF) return false;
+        if (!serverStarted) {
+          if (!server) server = new EthernetServer(IP_PORT); // Ethernet Server listening on default port IP_PORT
+          server->begin();
+          serverStarted=true;
+        }
+        {
+          IPAddress ip = Ethernet.localIP(); // reassign the obtained ip address
+          LCD(4,F("IP: %d.%d.%d.%d"), ip[0], ip[1], ip[2], ip[3]);
+          LCD(5,F("Port:%d"), IP_PORT);
+        }
+        connected=true;
+        setState(ETH_CONNECTED);
+        return true;
+
+    case ETH_CONNECTED:
     {
-        if (Ethernet.linkStatus() == LinkON)
+        if (Ethernet.linkStatus() == LinkOFF) {
+          DIAG(F("Ethernet cable not connected"));
+          connected=false;
+          setState(ETH_WAIT_LINK);
+          return false;
+        }
+        Watchdog::hold();  // a lease renewal waits for the DHCP server
+        int renewal=Ethernet.maintain();
+        Watchdog::kick();  // on again for the rest of the loop
+        switch (renewal)
+        {
+        case 1:
+            //renewed fail
+            DIAG(F("Ethernet Error: renewed fail"));
+            break;
+
+        case 3:
+            //rebind fail
+            DIAG(F("Ethernet Error: rebind fail"));
             break;
-        DIAG(F("Ethernet waiting for link (1sec) "));
-        delay(1000);
+
+        default:
+            //nothing happened
+            return true;
+        }
+        // lost our address, start again after a while
+        stopClients();
+        connected=false;
+        setState(ETH_RETRY_WAIT);
+        return false;
     }
 
-    if (Ethernet.linkStatus() == LinkOFF) {
-      DIAG(F("Ethernet cable not connected"));
-      return;
+    case ETH_RETRY_WAIT:
+        // No point asking for a lease with the cable out, Ethernet.begin
+        // would block for the whole DHCP timeout. 
+        if (Ethernet.linkStatus() == LinkOFF) return false;
+        if (millis() - stateTime >= ((unsigned long)ETHERNET_RETRY_DELAY << (failures ? failures-1 : 0))) setState(ETH_START);
+        return false;
+
+    case ETH_NO_HARDWARE:
+    default:
+        return false;
     }
-    
-    connected=true;
-    
-    IPAddress ip = Ethernet.localIP(); // reassign the obtained ip address
+}
 
-    server = new EthernetServer(IP_PORT); // Ethernet Server listening on default port IP_PORT
-    server->begin();
-  
-    LCD(4,F("IP: %d.%d.%d.%d"), ip[0], ip[1], ip[2], ip[3]);
-    LCD(5,F("Port:%d"), IP_PORT);
+void EthernetInterface::stopClients()
+{
+    for (byte socket = 0; socket < MAX_SOCK_NUM; socket++) {
+      if (clients[socket]) clients[socket].stop();
+      forgetSocket(socket);
+    }
+}
 
-    outboundRing=new RingStream(OUTBOUND_RING_SIZE);     
+// Forget unsent replies so they dont go to the socket's next client. With
+// CORE_SPLIT more may still come from commands queued for the other core,
+// so sendReplies also throws away what arrives before the fence.
+void EthernetInterface::forgetSocket(byte socket)
+{
+    RingStream * ring=outboundRing[socket];
+    if (!ring) return;
+    while (ring->read()>=0) {}
+    outboundCount[socket]=0;
+    CommandDistributor::forget(ring);
+    if (CommandDistributor::fence(ring)) outboundFences[socket]++;
 }
 
 /**
@@ -103,28 +211,7 @@ EthernetInterface::EthernetInterface()
 void EthernetInterface::loop()
 {
     if (!singleton) return;
-    
-    switch (Ethernet.maintain())
-    {
-    case 1:
-        //renewed fail
-        DIAG(F("Ethernet Error: renewed fail"));
-        singleton=NULL;
-        return;
-
-    case 3:
-        //rebind fail
-        DIAG(F("Ethernet Error: rebind fail"));
-        singleton=NULL;
-        return;
-
-    default:
-        //nothing happened
-        break;
-    }
-
-   singleton->loop2();
-
+    if (singleton->checkLink()) singleton->loop2();
 }
 
  void EthernetInterface::loop2()
@@ -145,6 +232,7 @@ void EthernetInterface::loop()
                 // so we store it in our client array
                 if (Diag::ETHERNET) DIAG(F("Socket %d"),socket);
                 clients[socket] = client;
+                if (!outboundRing[socket]) outboundRing[socket]=new RingStream(OUTBOUND_RING_SIZE);
                 break;
             }
         }
@@ -164,9 +252,10 @@ void EthernetInterface::loop()
             buffer[count] = '\0'; // terminate the string properly
             if (Diag::ETHERNET) DIAG(F(",count=%d:%e"), socket,buffer);
             // execute with data going directly back
-            outboundRing->mark(socket); 
-            CommandDistributor::parse(socket,buffer,outboundRing);
-            outboundRing->commit();
+            if (!CommandDistributor::receive(socket,buffer,count,outboundRing[socket])) {
+              outboundDropped[socket]++;
+              DIAG(F("Ethernet socket %d reply dropped, total dropped=%d"), socket, outboundDropped[socket]);
+            }
             return; // limit the amount of processing that takes place within 1 loop() cycle. 
           }
         }
@@ -176,17 +265,62 @@ void EthernetInterface::loop()
    for (int socket = 0; socket<MAX_SOCK_NUM; socket++) {
      if (clients[socket] && !clients[socket].connected()) {
       clients[socket].stop();
+      forgetSocket(socket);
       if (Diag::ETHERNET)  DIAG(F("Ethernet: disconnect %d "), socket);             
      }
     }
     
-    // handle at most 1 outbound transmission 
-    int socketOut=outboundRing->read();
-    if (socketOut>=0) {
-      int count=outboundRing->count();
-      if (Diag::ETHERNET) DIAG(F("Ethernet reply socket=%d, count=:%d"), socketOut,count);
-      for(;count>0;count--)  clients[socketOut].write(outboundRing->read());
-      clients[socketOut].flush(); //maybe 
+    // handle at most 1 outbound transmission, taking the sockets in turn
+    // so one busy client cant hold up the replies to the others
+    for (byte i = 0; i < MAX_SOCK_NUM; i++) {
+      byte socket=nextSocketOut;
+      nextSocketOut = (nextSocketOut+1) % MAX_SOCK_NUM;
+      if (sendReplies(socket)) break;
+    }
+}
+
+/**
+ * @brief Send as much of the socket's queued replies as the client will take without blocking
+ * 
+ * @return true if something was sent
+ */
+bool EthernetInterface::sendReplies(byte socket)
+{
+    RingStream * ring=outboundRing[socket];
+    if (!ring) return false;
+    while (outboundCount[socket]==0) {
+      // start of the next reply
+      int mark=ring->read();
+      if (mark<0) return false;  // nothing queued
+      outboundCount[socket]=ring->count();
+      if (outboundFences[socket]) {
+        // for a client that has gone, up to its fence
+        if (mark==CommandDistributor::FENCE_MARK) outboundFences[socket]--;
+        for (;outboundCount[socket]>0;outboundCount[socket]--) ring->read();
+        continue;
+      }
+      if (Diag::ETHERNET) DIAG(F("Ethernet reply socket=%d, count=:%d"), socket,outboundCount[socket]);
+    }
+    if (!clients[socket]) {
+      // client has gone, throw the reply away
+      for (;outboundCount[socket]>0;outboundCount[socket]--) ring->read();
+      return false;
+    }
+    int count=clients[socket].availableForWrite();
+    if (count<=0) {
+      outboundStalled[socket]++;
+      if (Diag::ETHERNET) DIAG(F("Ethernet socket %d stalled, total stalls=%d"), socket, outboundStalled[socket]);
+      return false;
     }
+    if (count>outboundCount[socket]) count=outboundCount[socket];
+    if (count>MAX_ETH_BUFFER) count=MAX_ETH_BUFFER;
+    // straight from the ring, up to where it wraps
+    byte * span;
+    int length=ring->peekSpan(span);
+    if (count>length) count=length;
+    clients[socket].write(span,count);
+    ring->consume(count);
+    outboundCount[socket]-=count;
+    return true;
 }
 #endif
@@ -29,6 +29,7 @@
   #include "config.example.h"
 #endif
 #include "DCCEXParser.h"
+#include "BoardProfile.h"
 #include <Arduino.h>
 #include <avr/pgmspace.h>
 #if defined (ARDUINO_TEENSY41)
@@ -44,8 +45,11 @@
  * 
  */
 
-#define MAX_ETH_BUFFER 512
-#define OUTBOUND_RING_SIZE 2048
+// MAX_ETH_BUFFER and OUTBOUND_RING_SIZE (per client socket, allocated when
+// the socket is first used) come from BoardProfile.h
+#define ETHERNET_DHCP_TIMEOUT 5000    // ms to wait for a DHCP lease on each attempt
+#define ETHERNET_RETRY_DELAY 10000    // ms between attempts to start the interface
+#define ETHERNET_RETRY_BACKOFF 5      // the delay doubles after each failure, at most this many times
 
 class EthernetInterface {
 
@@ -55,14 +59,41 @@ class EthernetInterface {
      static void loop();
    
  private:
+     // The link is brought up and kept up by a state machine called
+     // from loop() so that startup and recovery never block DCC. 
+     enum ETH_STATE : byte {
+       ETH_START,       // (re)start the chip and get an address 
+       ETH_WAIT_LINK,   // waiting for the cable/switch
+       ETH_CONNECTED,   // server running
+       ETH_RETRY_WAIT,  // start failed, try again later
+       ETH_NO_HARDWARE  // no shield, nothing to do
+     };
      static EthernetInterface * singleton;
      bool connected;
      EthernetInterface();
+     bool checkLink();
+     void start();
+     void setState(ETH_STATE newState);
+     void stopClients();
+     void forgetSocket(byte socket);
      void loop2();
+     bool sendReplies(byte socket);
+    ETH_STATE state;
+    unsigned long stateTime;  // millis when state was entered
+    byte failures;            // consecutive failed starts, sets the retry delay
+    bool serverStarted;       // server listening since the last start
+    byte mac[6];
     EthernetServer * server;
     EthernetClient clients[MAX_SOCK_NUM];                // accept up to MAX_SOCK_NUM client connections at the same time; This depends on the chipset used on the Shield
     uint8_t buffer[MAX_ETH_BUFFER+1];                    // buffer used by TCP for the recv
-    RingStream * outboundRing;
+    // Each client socket has its own outbound queue so that one client with a
+    // lot of output cannot overflow the replies of the others.
+    RingStream * outboundRing[MAX_SOCK_NUM];
+    int outboundCount[MAX_SOCK_NUM];             // bytes left of the reply being sent
+    unsigned int outboundDropped[MAX_SOCK_NUM];  // replies lost because the queue was full
+    unsigned int outboundStalled[MAX_SOCK_NUM];  // sends deferred because the client buffer was full
+    byte outboundFences[MAX_SOCK_NUM];           // fences still to come, see forgetSocket
+    byte nextSocketOut;                          // round robin position 
   
 };
 
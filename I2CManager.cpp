@@ -126,4 +126,45 @@ uint8_t I2CManagerClass::read(uint8_t address, uint8_t readBuffer[], uint8_t rea
   return read(address, readBuffer, readSize, NULL, 0);
 }
 
+// Queue a write for loop() to send. If the queue is full the oldest 
+// write is sent now to make room.
+bool I2CManagerClass::queueWrite(uint8_t address, const uint8_t buffer[], uint8_t size, I2C_CALLBACK callback) {
+  if (size == 0 || size > MAX_QUEUED_BYTES) return false;
+  if (!_queue) {
+    _queue = (I2C_REQUEST *)calloc(QUEUE_SIZE, sizeof(I2C_REQUEST));
+    if (!_queue) return write(address, buffer, size) == 0;
+  }
+  I2C_REQUEST * request = NULL;
+  for (uint8_t i = 0; i < _queueCount; i++) {
+    I2C_REQUEST * r = &_queue[(_queueHead + i) % QUEUE_SIZE];
+    if (r->address == address && r->size == size && r->data[0] == buffer[0] && r->callback == callback) {
+      request = r;  // replace the earlier value, it has not been sent yet
+      break;
+    }
+  }
+  if (!request) {
+    if (_queueCount == QUEUE_SIZE) loop();
+    request = &_queue[(_queueHead + _queueCount) % QUEUE_SIZE];
+    _queueCount++;
+  }
+  request->address = address;
+  request->size = size;
+  memcpy(request->data, buffer, size);
+  request->callback = callback;
+  return true;
+}
+
+uint8_t I2CManagerClass::queueSpace() {
+  return QUEUE_SIZE - _queueCount;
+}
+
+void I2CManagerClass::loop() {
+  if (_queueCount == 0) return;
+  I2C_REQUEST * request = &_queue[_queueHead];
+  _queueHead = (_queueHead + 1) % QUEUE_SIZE;
+  _queueCount--;
+  uint8_t status = write(request->address, request->data, request->size);
+  if (request->callback) request->callback(status);
+}
+
 I2CManagerClass I2CManager = I2CManagerClass();
\ No newline at end of file
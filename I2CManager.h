@@ -33,8 +33,18 @@
  * 
  * Thirdly, it provides a convenient way to check whether there is a 
  * device on a particular I2C address.
+ *
+ * Finally, writes that nobody waits for (e.g. servo positions) can be
+ * queued and are then sent by loop(), one transaction per call, so a
+ * burst of them does not hold up the caller. The queue is polled from 
+ * the main loop rather than driven by the TWI interrupt, which belongs 
+ * to Wire on every supported core. A queued write holds up to 29 bytes,
+ * a register and seven 4 byte PCA9685 channels, within the 32 byte 
+ * Wire buffer. The queue is only allocated once something uses it.
  */
 
+typedef void (*I2C_CALLBACK)(uint8_t status);
+
 class I2CManagerClass {
 
 public:
@@ -64,8 +74,27 @@ public:
     uint8_t writeSize, ...);
   // Write a null command and read the response.
   uint8_t read(uint8_t address, uint8_t readBuffer[], uint8_t readSize);
+  // Queue a write to be sent by loop(). callback (may be NULL) gets the Wire status.
+  // A queued write to the same address and first byte (register) is replaced.
+  bool queueWrite(uint8_t address, const uint8_t buffer[], uint8_t size, I2C_CALLBACK callback=NULL);
+  // Writes that can be queued before the oldest would have to be sent at once
+  uint8_t queueSpace();
+  // Send the oldest queued write, if any
+  void loop();
 
 private:
+  static const uint8_t QUEUE_SIZE = 8;
+  static const uint8_t MAX_QUEUED_BYTES = 29;
+  struct I2C_REQUEST {
+    uint8_t address;
+    uint8_t size;
+    uint8_t data[MAX_QUEUED_BYTES];
+    I2C_CALLBACK callback;
+  };
+  I2C_REQUEST * _queue = NULL;  // allocated on first use
+  uint8_t _queueHead = 0;
+  uint8_t _queueCount = 0;
+
   bool _beginCompleted = false;
   bool _clockSpeedFixed = false;
   uint32_t _clockSpeed = 400000L;  // 400kHz max on Arduino.
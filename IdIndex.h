@@ -0,0 +1,83 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef IdIndex_h
+#define IdIndex_h
+#include <Arduino.h>
+
+// Array of pointers kept sorted by id so that Turnout, Sensor and Output
+// lookups are a binary search rather than a walk along their lists.
+// The owning class keeps its linked list in the same order, so the
+// list of item at pos continues with the item at pos+1.
+// T must provide int getId().
+
+template <class T> class IdIndex {
+  public:
+    // Position of id, or where it would be inserted if not present
+    int find(int id) {
+      int low=0;
+      int high=count;
+      while (low<high) {
+        int mid=(low+high)/2;
+        if (items[mid]->getId()<id) low=mid+1;
+        else high=mid;
+      }
+      return low;
+    }
+
+    T * get(int id) {
+      int pos=find(id);
+      return (pos<count && items[pos]->getId()==id) ? items[pos] : NULL;
+    }
+
+    T * at(int pos) {
+      return (pos>=0 && pos<count) ? items[pos] : NULL;
+    }
+
+    int size() { return count; }
+
+    // Make room for n items in one allocation, used before loading from EEPROM
+    bool reserve(int n) {
+      if (n<=capacity) return true;
+      T ** grown=(T **)realloc(items, n*sizeof(T *));
+      if (grown==NULL) return false;
+      items=grown;
+      capacity=n;
+      return true;
+    }
+
+    bool insert(int pos, T * item) {
+      if (count==capacity && !reserve(capacity+GROWTH)) return false;
+      memmove(items+pos+1, items+pos, (count-pos)*sizeof(T *));
+      items[pos]=item;
+      count++;
+      return true;
+    }
+
+    void removeAt(int pos) {
+      count--;
+      memmove(items+pos, items+pos+1, (count-pos)*sizeof(T *));
+    }
+
+  private:
+    static const byte GROWTH=8;
+    T ** items=NULL;
+    int count=0;
+    int capacity=0;
+};
+#endif
@@ -29,14 +29,21 @@
  *  4) If there are fewer non-blank rows than screen lines,
  *     then a scrolling strategy is adopted so that, on each screen
  *     refresh, a different subset of the rows is presented.
- *  5) On each entry into loop2(), a single operation is sent to the 
- *     screen; this may be a position command or a character for
- *     display.  This spreads the onerous work of updating the screen
- *     and ensures that other loop() functions in the application are
- *     not held up significantly.  The exception to this is when 
- *     the loop2() function is called with force=true, where 
- *     a screen update is executed to completion.  This is normally
- *     only done during start-up.
+ *  5) On each entry into loop2(), at most LCD_LOOP_OPS operations
+ *     are sent to the screen, stopping early once LCD_LOOP_MICROS
+ *     have elapsed; an operation may be a position command or a
+ *     character for display.  The next entry carries on from where
+ *     the last one stopped.  This spreads the onerous work of
+ *     updating the screen and bounds the time that other loop()
+ *     functions in the application are held up, however many rows
+ *     there are.  The exception to this is when the loop2() function
+ *     is called with force=true, where a screen update is executed
+ *     to completion.  This is normally only done during start-up.
+ *  6) A copy of what is currently on the screen is kept, and only
+ *     the characters that differ from it are sent.  The cursor is
+ *     positioned at the start of each changed run, so an update that
+ *     changes a few characters on a row costs a few bytes of I2C
+ *     traffic rather than a rewrite of the whole row.
  *  The scroll mode is selected by defining SCROLLMODE as 0, 1 or 2
  *  in the config.h.
  *  #define SCROLLMODE 0 is scroll continuous (fill screen if poss),
@@ -49,7 +56,10 @@
 
 void LCDDisplay::clear() {
   clearNative();
-  for (byte row = 0; row < MAX_LCD_ROWS; row++) rowBuffer[row][0] = '\0';
+  for (byte row = 0; row < MAX_LCD_ROWS; row++) {
+    rowBuffer[row][0] = '\0';
+    memset(screenBuffer[row], ' ', MAX_LCD_COLS);  // Screen is now blank
+  }
   topRow = -1;  // loop2 will fill from row 0
 }
 
@@ -75,6 +85,8 @@ LCDDisplay *LCDDisplay::loop2(bool force) {
   if (!lcdDisplay) return NULL;
 
   unsigned long currentMillis = millis();
+  unsigned long startMicros = micros();
+  byte ops = 0;
 
   if (!force) {
     // See if we're in the time between updates
@@ -84,47 +96,56 @@ LCDDisplay *LCDDisplay::loop2(bool force) {
     // force full screen update from the beginning.
     rowFirst = -1;
     rowNext = 0;
-    bufferPointer = 0;
+    charIndex = -1;
     done = false;
     slot = 0;
   }
 
   do {
-    if (bufferPointer == 0) {
+    if (charIndex < 0) {
       // Find a line of data to write to the screen.
       if (rowFirst < 0) rowFirst = rowNext;
       skipBlankRows();
-      if (!done) {
-        // Non-blank line found, so copy it.
-        for (uint8_t i = 0; i < sizeof(buffer); i++)
-          buffer[i] = rowBuffer[rowNext][i];
-      } else
-        buffer[0] = '\0';  // Empty line
-      setRowNative(slot);  // Set position for display
+      // Copy the line, padded with spaces to erase the rest of the slot.
+      char *src = done ? (char *)"" : rowBuffer[rowNext];
+      for (uint8_t i = 0; i < MAX_LCD_COLS; i++) {
+        buffer[i] = *src ? *src++ : ' ';
+      }
       charIndex = 0;
-      bufferPointer = &buffer[0];
-
-    } else {
+      cursorCol = -1;
+    }
 
-      // Write next character, or a space to erase current position.
-      char ch = *bufferPointer;
-      if (ch) {
+    // Skip over characters that are already on the screen.
+    char *onScreen = screenBuffer[slot];
+    while (charIndex < MAX_LCD_COLS && buffer[charIndex] == onScreen[charIndex])
+      charIndex++;
+
+    if (charIndex < MAX_LCD_COLS) {
+      if (cursorCol != charIndex) {
+        // Start of a changed run, so set position for display.
+        setRowNative(slot, charIndex);
+        cursorCol = charIndex;
+      } else {
+        char ch = buffer[charIndex];
         writeNative(ch);
-        bufferPointer++;
-      } else
-        writeNative(' ');
-
-      if (++charIndex >= MAX_LCD_COLS) {
-        // Screen slot completed, move to next slot on screen
-        slot++;
-        bufferPointer = 0;
-        if (!done) {
-          moveToNextRow();
-          skipBlankRows();
-        }
+        onScreen[charIndex] = ch;
+        charIndex++;
+        cursorCol++;
+      }
+      ops++;
+    }
+
+    if (charIndex >= MAX_LCD_COLS) {
+      // Screen slot completed, move to next slot on screen
+      slot++;
+      charIndex = -1;
+      if (!done) {
+        moveToNextRow();
+        skipBlankRows();
       }
 
-      if (slot >= lcdRows) {
+      // A display with more rows than are kept only shows the first MAX_LCD_ROWS
+      if (slot >= lcdRows || slot >= MAX_LCD_ROWS) {
         // Last slot finished, reset ready for next screen update.
 #if SCROLLMODE==2
         if (!done) {
@@ -141,7 +162,7 @@ LCDDisplay *LCDDisplay::loop2(bool force) {
         return NULL;
       }
     }
-  } while (force);
+  } while (force || (ops < LCD_LOOP_OPS && (micros() - startMicros) < LCD_LOOP_MICROS));
 
   return NULL;
 }
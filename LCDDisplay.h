@@ -20,6 +20,7 @@
 #define LCDDisplay_h
 #include <Arduino.h>
 #include "DisplayInterface.h"
+#include "BoardProfile.h"
 
 #if __has_include ( "config.h")
   #include "config.h"
@@ -35,11 +36,21 @@
 #define SCROLLMODE 1
 #endif
 
+// Bound the display work done in each loop() call (overridable in config.h).
+// A call stops after LCD_LOOP_OPS screen operations, or sooner once
+// LCD_LOOP_MICROS have been used; at least one operation is always sent.
+#if !defined(LCD_LOOP_OPS)
+#define LCD_LOOP_OPS 4
+#endif
+#if !defined(LCD_LOOP_MICROS)
+#define LCD_LOOP_MICROS 500
+#endif
+
 // This class is created in LCDisplay_Implementation.h
 
 class LCDDisplay : public DisplayInterface {
  public:
-  static const int MAX_LCD_ROWS = 8;
+  static const int MAX_LCD_ROWS = LCD_ROWS;  // set in BoardProfile.h
   static const int MAX_LCD_COLS = MAX_MSG_SIZE;
   static const long LCD_SCROLL_TIME = 3000;  // 3 seconds
 
@@ -61,7 +72,7 @@ protected:
 
   // Relay functions to the live driver in the subclass
   virtual void clearNative() = 0;
-  virtual void setRowNative(byte line) = 0;
+  virtual void setRowNative(byte line, byte column) = 0;
   virtual size_t writeNative(uint8_t b) = 0;
 
   unsigned long lastScrollTime = 0;
@@ -71,12 +82,14 @@ protected:
   int8_t slot = 0;
   int8_t rowFirst = -1;
   int8_t rowNext = 0;
-  int8_t charIndex = 0;
-  char buffer[MAX_LCD_COLS + 1];
-  char* bufferPointer = 0;
+  int8_t charIndex = -1;    // Next column to compare in slot, -1 if slot not started
+  int8_t cursorCol = -1;    // Column where the next writeNative lands, -1 if unknown
+  char buffer[MAX_LCD_COLS];
   bool done = false;
 
   char rowBuffer[MAX_LCD_ROWS][MAX_LCD_COLS + 1];
+  // Copy of what is on the screen in each slot; zero means not known.
+  char screenBuffer[MAX_LCD_ROWS][MAX_LCD_COLS] = {};
 };
 
 #endif
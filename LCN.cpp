@@ -20,11 +20,17 @@
 #include "LCN.h"
 #include "DIAG.h"
 #include "Turnouts.h"
+#include "CommandDistributor.h"
 #include "Sensors.h"
 
 int  LCN::id = 0;
+byte LCN::idDigits = 0;
 Stream * LCN::stream=NULL;
 bool LCN::firstLoop=true;
+LCN::TX_ENTRY LCN::txQueue[TX_QUEUE_SIZE];
+byte LCN::txHead=0;
+byte LCN::txCount=0;
+unsigned long LCN::txStallStart=0;
 
 void LCN::init(Stream & lcnstream) {
   stream=&lcnstream; 
@@ -40,35 +46,94 @@ void LCN::loop() {
     stream->println('X');
     return; 
   }
+
+  // Send what waits while there is room, the serial port must never block the loop.
+  // All the changes that fit go out together in one write.
+  // A stream that never reports room (no availableForWrite) still gets one per TX_STALL_MS.
+  if (txCount == 0) txStallStart = millis();
+  int room = stream->availableForWrite();
+  if (millis() - txStallStart > TX_STALL_MS && room < TX_ENTRY_MAX) room = TX_ENTRY_MAX;
+  byte frame[TX_FRAME_SIZE];
+  byte length = 0;
+  while (txCount && length + TX_ENTRY_MAX <= TX_FRAME_SIZE) {
+    byte entryLength = encode(frame + length, txQueue[txHead]);
+    if (length + entryLength > room) break;
+    length += entryLength;
+    txHead = (txHead + 1) % TX_QUEUE_SIZE;
+    txCount--;
+  }
+  if (length) {
+    stream->write(frame, length);
+    txStallStart = millis();
+  }
   
   while (stream->available()) {
     int ch = stream->read();
-    if (ch >= 0 && ch <= '9') {  // accumulate id value
-      id = 10 * id + ch - '0';
+    if (ch >= '0' && ch <= '9') {  // accumulate id value
+      // An id too long for an int means bytes were lost, it is ignored
+      if (idDigits < MAX_ID_DIGITS && id <= (MAX_ID - (ch - '0')) / 10) {
+        id = 10 * id + ch - '0';
+        idDigits++;
+      }
+      else idDigits = MAX_ID_DIGITS + 1;
+      continue;
     }
-    else if (ch == 't' || ch == 'T') { // Turnout opcodes
-      if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
-      Turnout * tt = Turnout::get(id);
-      if (!tt) Turnout::create(id, LCN_TURNOUT_ADDRESS, 0);
-      if (ch == 't') tt->data.tStatus |= STATUS_ACTIVE;
-      else   tt->data.tStatus &= ~STATUS_ACTIVE;
-      Turnout::turnoutlistHash++; // signals ED update of turnout data
-      id = 0;
+    bool valid = idDigits > 0 && idDigits <= MAX_ID_DIGITS;
+    if (ch == 't' || ch == 'T') { // Turnout opcodes
+      if (Diag::LCN) DIAG(F("LCN IN %d%c%S"),id,(char)ch, valid ? F("") : F(" ignored"));
+      Turnout * tt = valid ? Turnout::get(id) : NULL;
+      if (valid && !tt) tt = Turnout::create(id, LCN_TURNOUT_ADDRESS, 0);
+      if (tt) {
+        if (ch == 't') tt->data.tStatus |= STATUS_ACTIVE;
+        else   tt->data.tStatus &= ~STATUS_ACTIVE;
+        CommandDistributor::broadcast(EVENT_TURNOUT, id, ch == 't');
+      }
     }
     else if (ch == 'S' || ch == 's') {
-      if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
-      Sensor * ss = Sensor::get(id);
-      if (!ss) ss = Sensor::create(id, 255,0); // impossible pin
-      ss->active = ch == 'S';
-      id = 0;
+      if (Diag::LCN) DIAG(F("LCN IN %d%c%S"),id,(char)ch, valid ? F("") : F(" ignored"));
+      Sensor * ss = valid ? Sensor::get(id) : NULL;
+      if (valid && !ss) ss = Sensor::create(id, 255,0); // impossible pin, never scanned
+      if (ss && ss->active != (ch == 'S')) ss->report(ch == 'S');
     }
-    else  id = 0; // ignore any other garbage from LCN
+    // anything else is garbage from LCN, it ends the id too
+    id = 0;
+    idDigits = 0;
   }
 }
 
 void LCN::send(char opcode, int id, bool state) {
-   if (stream) {
-      StringFormatter::send(stream,F("%c/%d/%d"), opcode, id , state);
-      if (Diag::LCN) DIAG(F("LCN OUT %c/%d/%d"), opcode, id , state);
-   }
+  if (!stream) return;
+  if (Diag::LCN) DIAG(F("LCN OUT %c/%d/%d"), opcode, id , state);
+  // Replace a change to the same item that has not gone yet
+  for (byte i = 0; i < txCount; i++) {
+    TX_ENTRY & entry = txQueue[(txHead + i) % TX_QUEUE_SIZE];
+    if (entry.opcode == opcode && entry.id == id) {
+      entry.state = state;
+      return;
+    }
+  }
+  if (txCount == TX_QUEUE_SIZE) {
+    // Queue full, make room by waiting for the oldest to go
+    byte frame[TX_ENTRY_MAX];
+    stream->write(frame, encode(frame, txQueue[txHead]));
+    txHead = (txHead + 1) % TX_QUEUE_SIZE;
+    txCount--;
+  }
+  TX_ENTRY & entry = txQueue[(txHead + txCount) % TX_QUEUE_SIZE];
+  entry.opcode = opcode;
+  entry.id = id;
+  entry.state = state;
+  txCount++;
+}
+
+// Writes the entry as opcode/id/state, returns its length. There is no
+// terminator, the LCN master splits the stream at each opcode.
+byte LCN::encode(byte * buffer, TX_ENTRY & entry) {
+  buffer[0] = entry.opcode;
+  buffer[1] = '/';
+  itoa(entry.id, (char *)buffer + 2, 10);
+  byte length = 2 + strlen((char *)buffer + 2);
+  buffer[length++] = '/';
+  buffer[length++] = entry.state ? '1' : '0';
+  return length;
 }
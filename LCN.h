@@ -8,9 +8,29 @@ class LCN {
     static void loop();
     static void send(char opcode, int id, bool state);
   private :
+    // Outbound changes wait here and loop() sends as many as the serial
+    // transmit buffer takes without blocking, in one write of up to 
+    // TX_FRAME_SIZE. A newer change to the same item replaces one still waiting.
+    static const byte TX_QUEUE_SIZE=16;
+    static const byte TX_FRAME_SIZE=64;
+    static const byte TX_ENTRY_MAX=10;  // t/-32768/1
+    static const byte MAX_ID_DIGITS=5;
+    static const int MAX_ID=32767;
+    static const byte TX_STALL_MS=100;
+    struct TX_ENTRY {
+      char opcode;
+      bool state;
+      int id;
+    };
+    static byte encode(byte * buffer, TX_ENTRY & entry);
+    static TX_ENTRY txQueue[TX_QUEUE_SIZE];
+    static byte txHead;
+    static byte txCount;
+    static unsigned long txStallStart;  // millis, last time the queue moved
     static bool firstLoop; 
     static Stream * stream; 
     static int id;
+    static byte idDigits;   // more than MAX_ID_DIGITS (or above MAX_ID) means bytes were lost, skip to the next opcode
 };
 
 #endif
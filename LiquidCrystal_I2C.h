@@ -67,7 +67,7 @@ public:
   LiquidCrystal_I2C(uint8_t lcd_Addr,uint8_t lcd_cols,uint8_t lcd_rows);
   void begin();
   void clearNative();
-  void setRowNative(byte line);
+  void setRowNative(byte line, byte column);
   size_t writeNative(uint8_t c);
   
   void display();
@@ -21,13 +21,26 @@
 #include "DCCTimer.h"
 #include "DIAG.h"
 
+#if defined(ARDUINO_ARCH_RP2040)
+// The signal pins are written from the interrupt on the other core, which
+// noInterrupts() does not hold off, so use the atomic set and clear registers
+#include <hardware/structs/sio.h>
+#define setHIGH(fastpin)  sio_hw->gpio_set = fastpin.maskHIGH
+#define setLOW(fastpin)   sio_hw->gpio_clr = fastpin.maskHIGH
+#elif defined(ARDUINO_ARCH_SAMD)
+#define setHIGH(fastpin)  SAMD_OUTSET(fastpin) = fastpin.maskHIGH
+#define setLOW(fastpin)   SAMD_OUTCLR(fastpin) = fastpin.maskHIGH
+#else
 #define setHIGH(fastpin)  *fastpin.inout |= fastpin.maskHIGH
 #define setLOW(fastpin)   *fastpin.inout &= fastpin.maskLOW
+#endif
 #define isHIGH(fastpin)   (*fastpin.inout & fastpin.maskHIGH)
 #define isLOW(fastpin)    (!isHIGH(fastpin))
 
 bool MotorDriver::usePWM=false;
 bool MotorDriver::commonFaultPin=false;
+SIGNAL_PORT MotorDriver::signalPorts[MAX_SIGNAL_PORTS];
+byte MotorDriver::signalPortCount=0;
        
 MotorDriver::MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8_t brake_pin,
                          byte current_pin, float sense_factor, unsigned int trip_milliamps, byte fault_pin) {
@@ -110,6 +123,31 @@ void MotorDriver::setBrake(bool on) {
   else setLOW(fastBrakePin);
 }
 
+// setCutout opens (on == true) or closes a RailCom cutout, called in
+// interrupt time. The rails should be shorted together for the detector,
+// so the brake is used where there is one and a dual signal bridge has
+// both sides driven low. Otherwise power is switched off, which
+// leaves the rails floating and only suits detectors that cope with that.
+// Closing a cutout made by the power pin turns the power back on, so
+// the caller must only close it while the track is meant to be powered.
+// The next setSignal restores the signal pins.
+//
+void MotorDriver::setCutout(bool on) {
+  if (brakePin != UNUSED_PIN) setBrake(on);
+  else if (dualSignal) {
+    if (on) {
+      setLOW(fastSignalPin);
+      setLOW(fastSignalPin2);
+    }
+  }
+  else if (on) setLOW(fastPowerPin);
+  else setHIGH(fastPowerPin);
+}
+
+void MotorDriver::setSignalPeriod(byte period) {
+  DCCTimer::setPWMPeriod(signalPin, (DCC_PERIOD)period);
+}
+
 void MotorDriver::setSignal( bool high) {
    if (usePWM) {
     DCCTimer::setPWM(signalPin,high);
@@ -126,6 +164,45 @@ void MotorDriver::setSignal( bool high) {
    }
 }
 
+// Adds a signal pin to the entry for its port. The pin is set to match the
+// main or prog signal, or its inverse for the second pin of a dual signal bridge.
+bool MotorDriver::addSignalPin(FASTPIN & pin, bool isMain, bool inverted) {
+  byte p;
+  for (p=0; p<signalPortCount && signalPorts[p].port!=pin.inout; p++);
+  if (p==signalPortCount) {
+    if (signalPortCount>=MAX_SIGNAL_PORTS) return false;
+    signalPortCount++;
+    signalPorts[p].port=pin.inout;
+    signalPorts[p].keep=(portreg_t)~0;
+    for (byte i=0; i<4; i++) signalPorts[p].bits[i]=0;
+  }
+  SIGNAL_PORT & sp=signalPorts[p];
+  sp.keep &= pin.maskLOW;
+  for (byte i=0; i<4; i++) {
+    bool high = isMain ? (i & 2) : (i & 1);
+    if (high != inverted) sp.bits[i] |= pin.maskHIGH;
+  }
+  return true;
+}
+
+bool MotorDriver::buildSignalPorts(MotorDriver * mainDrivers[], byte mainCount, MotorDriver * progDriver) {
+  signalPortCount=0;
+  bool ok=!usePWM;
+#if defined(ARDUINO_ARCH_RP2040)
+  // All the pins are in one bank written from both cores, a store of the 
+  // whole bank from the interrupt could undo a pin the loop has just set
+  ok=false;
+#endif
+  for (byte d=0; ok && d<=mainCount; d++) {
+    bool isMain = d<mainCount;
+    MotorDriver * driver = isMain ? mainDrivers[d] : progDriver;
+    ok = driver->canPortSignal() && addSignalPin(driver->fastSignalPin, isMain, false)
+         && (!driver->dualSignal || addSignalPin(driver->fastSignalPin2, isMain, true));
+  }
+  if (!ok) signalPortCount=0;
+  return ok;
+}
+
 #if defined(ARDUINO_TEENSY32) || defined(ARDUINO_TEENSY35)|| defined(ARDUINO_TEENSY36)
 volatile unsigned int overflow_count=0;
 #endif
@@ -143,20 +220,25 @@ bool MotorDriver::canMeasureCurrent() {
  */
 int MotorDriver::getCurrentRaw() {
   if (currentPin==UNUSED_PIN) return 0; 
-  int current;
+  int current=DCCTimer::getADC(currentPin); // latest background sample if available
+  if (current>=0) current-=senseOffset;
 #if defined(ARDUINO_TEENSY40) || defined(ARDUINO_TEENSY41)
-  bool irq = disableInterrupts();
-  current = analogRead(currentPin)-senseOffset;
-  enableInterrupts(irq);
+  else {
+    bool irq = disableInterrupts();
+    current = analogRead(currentPin)-senseOffset;
+    enableInterrupts(irq);
+  }
 #elif defined(ARDUINO_TEENSY32) || defined(ARDUINO_TEENSY35)|| defined(ARDUINO_TEENSY36)
-  unsigned char sreg_backup;
-  sreg_backup = SREG;   /* save interrupt enable/disable state */
-  cli();
-  current = analogRead(currentPin)-senseOffset;
-  overflow_count = 0;
-  SREG = sreg_backup;    /* restore interrupt state */
+  else {
+    unsigned char sreg_backup;
+    sreg_backup = SREG;   /* save interrupt enable/disable state */
+    cli();
+    current = analogRead(currentPin)-senseOffset;
+    overflow_count = 0;
+    SREG = sreg_backup;    /* restore interrupt state */
+  }
 #else
-  current = analogRead(currentPin)-senseOffset;
+  else current = analogRead(currentPin)-senseOffset;
 #endif
   if (current<0) current=0-current;
   if ((faultPin != UNUSED_PIN)  && isLOW(fastFaultPin) && isHIGH(fastPowerPin))
@@ -164,7 +246,21 @@ int MotorDriver::getCurrentRaw() {
   return current;
   // IMPORTANT:  This function can be called in Interrupt() time within the 56uS timer
   //             The default analogRead takes ~100uS which is catastrphic
-  //             so DCCTimer has set the sample time to be much faster.  
+  //             so DCCTimer samples the current pins in the background where
+  //             it can, and otherwise has set the sample time to be much faster.  
+}
+
+/*
+ * Interrupt time fast path: the latest background sample with the offset
+ * removed, or -1 if the current pin is not being sampled in the background.
+ * Does not look at the fault pin.
+ */
+int MotorDriver::getCurrentSampled() {
+  if (currentPin==UNUSED_PIN) return -1;
+  int current=DCCTimer::getADC(currentPin);
+  if (current<0) return -1;
+  current-=senseOffset;
+  return current<0 ? -current : current;
 }
 
 unsigned int MotorDriver::raw2mA( int raw) {
@@ -177,6 +273,12 @@ int MotorDriver::mA2raw( unsigned int mA) {
 void  MotorDriver::getFastPin(const FSH* type,int pin, bool input, FASTPIN & result) {
     // DIAG(F("MotorDriver %S Pin=%d,"),type,pin);
     (void) type; // avoid compiler warning if diag not used above. 
+#if defined(ARDUINO_ARCH_RP2040)
+    result.inout = input ? (volatile portreg_t *)&sio_hw->gpio_in : &sio_hw->gpio_out;
+    result.maskHIGH = 1ul << pin;
+    result.maskLOW = ~result.maskHIGH;
+    return;
+#endif
     uint8_t port = digitalPinToPort(pin);
     if (input)
       result.inout = portInputRegister(port);
@@ -26,28 +26,50 @@
 #define UNUSED_PIN 127 // inside int8_t
 #endif
 
-#if defined(__IMXRT1062__)
-struct FASTPIN {
-  volatile uint32_t *inout;
-  uint32_t maskHIGH;  
-  uint32_t maskLOW;  
-};
+#if defined(__IMXRT1062__) || defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_RP2040)
+typedef uint32_t portreg_t;
 #else
+typedef uint8_t portreg_t;
+#endif
 struct FASTPIN {
-  volatile uint8_t *inout;
-  uint8_t maskHIGH;  
-  uint8_t maskLOW;  
+  volatile portreg_t *inout;
+  portreg_t maskHIGH;  
+  portreg_t maskLOW;  
 };
+
+#if defined(ARDUINO_ARCH_SAMD)
+// inout is the PORT group's OUT, followed by OUTCLR and OUTSET. In stream mode
+// the DMA toggles the signal pins through OUTTGL at any moment, so outputs are
+// written with a single store to OUTSET or OUTCLR, never a read-modify-write
+// of OUT that could undo a toggle.
+#define SAMD_OUTCLR(fastpin) ((fastpin).inout[1])
+#define SAMD_OUTSET(fastpin) ((fastpin).inout[2])
 #endif
 
+// Signal outputs grouped by port so the interrupt sets every signal pin
+// on a port with one store. bits is indexed by SIGNAL_PORT_INDEX.
+struct SIGNAL_PORT {
+  volatile portreg_t *port;
+  portreg_t keep;      // pins on this port that are not signal pins
+  portreg_t bits[4];
+};
+#define SIGNAL_PORT_INDEX(mainHigh, progHigh) (((mainHigh) ? 2 : 0) | ((progHigh) ? 1 : 0))
+const byte MAX_SIGNAL_PORTS=12;
+
 class MotorDriver {
   public:
     MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8_t brake_pin, 
                 byte current_pin, float senseFactor, unsigned int tripMilliamps, byte faultPin);
     virtual void setPower( bool on);
     virtual void setSignal( bool high);
+    void setSignalPeriod(byte period);  // a DCC_PERIOD, PWM bit mode only
+    // A subclass that overrides setSignal must return false here
+    // so that its signal is not written directly to the port.
+    virtual bool canPortSignal() { return true; }
     virtual void setBrake( bool on);
+    void setCutout( bool on);
     virtual int  getCurrentRaw();
+    int  getCurrentSampled();
     virtual unsigned int raw2mA( int raw);
     virtual int mA2raw( unsigned int mA);
     inline int getRawCurrentTripValue() {
@@ -57,14 +79,44 @@ class MotorDriver {
     bool canMeasureCurrent();
     static bool usePWM;
     static bool commonFaultPin; // This is a stupid motor shield which has only a common fault pin for both outputs
+    // Group the signal pins of the drivers carrying the main signal and of
+    // the prog driver by port. Returns false, leaving setSignal in use, if
+    // any driver cannot be written directly or PWM is in use.
+    static bool buildSignalPorts(MotorDriver * mainDrivers[], byte mainCount, MotorDriver * progDriver);
+    static inline bool hasSignalPorts() {
+      return signalPortCount!=0;
+    }
+    // The only signal port, or NULL if the pins are on several ports
+    static inline volatile portreg_t * getSignalPort() {
+      return signalPortCount==1 ? signalPorts[0].port : NULL;
+    }
+    // Signal pin states on the only signal port
+    static inline portreg_t getSignalPortBits(bool mainHigh, bool progHigh) {
+      return signalPorts[0].bits[SIGNAL_PORT_INDEX(mainHigh, progHigh)];
+    }
+    // Interrupt time: set all grouped signal pins, one store per port
+    static inline void setSignalPorts(bool mainHigh, bool progHigh) {
+      byte index=SIGNAL_PORT_INDEX(mainHigh, progHigh);
+      for (byte p=0; p<signalPortCount; p++) {
+        SIGNAL_PORT & sp=signalPorts[p];
+        *sp.port = (*sp.port & sp.keep) | sp.bits[index];
+      }
+    }
+    // Also used by Output for its pins
+    static void  getFastPin(const FSH* type,int pin, bool input, FASTPIN & result);
+    static void  getFastPin(const FSH* type,int pin, FASTPIN & result) {
+	getFastPin(type, pin, 0, result);
+    }
     inline byte getFaultPin() {
 	return faultPin;
     }
-  private:
-    void  getFastPin(const FSH* type,int pin, bool input, FASTPIN & result);
-    void  getFastPin(const FSH* type,int pin, FASTPIN & result) {
-	getFastPin(type, pin, 0, result);
+    inline byte getCurrentPin() {
+	return currentPin;
     }
+  private:
+    static SIGNAL_PORT signalPorts[MAX_SIGNAL_PORTS];
+    static byte signalPortCount;
+    static bool addSignalPin(FASTPIN & pin, bool isMain, bool inverted);
     byte powerPin, signalPin, signalPin2, currentPin, faultPin, brakePin;
     FASTPIN fastPowerPin,fastSignalPin, fastSignalPin2, fastBrakePin,fastFaultPin;
     bool dualSignal;       // true to use signalPin2
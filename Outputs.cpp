@@ -69,6 +69,9 @@ To change the state of outputs that have been defined use:
   <Z ID STATE>:                sets output ID to either ACTIVE or INACTIVE state
                                returns: <Y ID STATE>, or <X> if turnout ID does not exist
 
+  <Z GROUP ID STATE ...>:      sets up to 4 outputs at once, pins on the same port switching together
+                               returns: <Y ID STATE> for each, or <X> with none changed if an ID does not exist
+
 where
 
   ID: the numeric ID (0-32767) of the turnout to control
@@ -81,9 +84,11 @@ the state of any outputs being monitored or controlled by a separate interface o
 
 **********************************************************************/
 
+#include "BoardProfile.h"
 #include "Outputs.h"
 #include "EEStore.h"
 #include "StringFormatter.h"
+#include "CommandDistributor.h"
 
 // print all output states to stream
 void Output::printAll(Print *stream){
@@ -93,33 +98,113 @@ void Output::printAll(Print *stream){
 
 void  Output::activate(int s){
   data.oStatus=(s>0);                                               // if s>0, set status to active, else inactive
-  digitalWrite(data.pin,data.oStatus ^ bitRead(data.iFlag,0));      // set state of output pin to HIGH or LOW depending on whether bit zero of iFlag is set to 0 (ACTIVE=HIGH) or 1 (ACTIVE=LOW)
+  writePin();
+  published();
+}
+
+void Output::published(){
   if(num>0)
-    EEPROM.put(num,data.oStatus);
+    EEStore::writeState(num,data.oStatus);  // written later so as not to hold up the loop
+  CommandDistributor::broadcast(EVENT_OUTPUT, data.id, data.oStatus);
+}
+
+// Set state of output pin to HIGH or LOW depending on whether bit zero of iFlag 
+// is set to 0 (ACTIVE=HIGH) or 1 (ACTIVE=LOW). The port write is guarded as the
+// waveform interrupt writes the signal pins, which may be on the same port.
+void Output::writePin(){
+  bool high=data.oStatus ^ bitRead(data.iFlag,0);
+  if (fastPin.inout==NULL) {
+    digitalWrite(data.pin,high);
+    return;
+  }
+#if defined(ARDUINO_ARCH_SAMD)
+  if (high) SAMD_OUTSET(fastPin)=fastPin.maskHIGH;
+  else SAMD_OUTCLR(fastPin)=fastPin.maskHIGH;
+#else
+  noInterrupts();
+  if (high) *fastPin.inout |= fastPin.maskHIGH;
+  else *fastPin.inout &= fastPin.maskLOW;
+  interrupts();
+#endif
+}
+
+bool Output::activateGroup(int16_t pairs[], byte count){
+  if (count>MAX_GROUP) return false;
+  Output * outputs[MAX_GROUP];
+  for (byte i=0; i<count; i++) {
+    outputs[i]=get(pairs[2*i]);
+    if (outputs[i]==NULL) return false;
+  }
+
+  struct {
+    volatile portreg_t * inout;
+    portreg_t high;
+    portreg_t low;
+  } ports[MAX_GROUP];
+  byte portCount=0;
+  for (byte i=0; i<count; i++) {
+    Output * tt=outputs[i];
+    tt->data.oStatus=(pairs[2*i+1]>0);
+    if (tt->fastPin.inout==NULL) {
+      tt->writePin();
+      continue;
+    }
+    byte p;
+    for (p=0; p<portCount && ports[p].inout!=tt->fastPin.inout; p++);
+    if (p==portCount) {
+      ports[p].inout=tt->fastPin.inout;
+      ports[p].high=0;
+      ports[p].low=0;
+      portCount++;
+    }
+    // a later pair for the same output wins
+    portreg_t mask=tt->fastPin.maskHIGH;
+    if (tt->data.oStatus ^ bitRead(tt->data.iFlag,0)) {
+      ports[p].high |= mask;
+      ports[p].low &= ~mask;
+    }
+    else {
+      ports[p].low |= mask;
+      ports[p].high &= ~mask;
+    }
+  }
+  noInterrupts();
+  for (byte p=0; p<portCount; p++) {
+#if defined(ARDUINO_ARCH_SAMD)
+    // no read-modify-write of OUT, see MotorDriver.h
+    FASTPIN port={ports[p].inout, 0, 0};
+    SAMD_OUTSET(port)=ports[p].high;
+    SAMD_OUTCLR(port)=ports[p].low;
+#else
+    *ports[p].inout = (*ports[p].inout & ~ports[p].low) | ports[p].high;
+#endif
+  }
+  interrupts();
+
+  for (byte i=0; i<count; i++) outputs[i]->published();
+  return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 Output* Output::get(int n){
-  Output *tt;
-  for(tt=firstOutput;tt!=NULL && tt->data.id!=n;tt=tt->nextOutput);
-  return(tt);
+  return byId.get(n);
 }
 ///////////////////////////////////////////////////////////////////////////////
 
 bool Output::remove(int n){
-  Output *tt,*pp=NULL;
-
-  for(tt=firstOutput;tt!=NULL && tt->data.id!=n;pp=tt,tt=tt->nextOutput);
+  int pos=byId.find(n);
+  Output *tt=byId.at(pos);
 
-  if(tt==NULL) return false;
+  if(tt==NULL || tt->data.id!=n) return false;
   
-  if(tt==firstOutput)
+  if(pos==0)
     firstOutput=tt->nextOutput;
   else
-    pp->nextOutput=tt->nextOutput;
+    byId.at(pos-1)->nextOutput=tt->nextOutput;
 
-  free(tt);
+  byId.removeAt(pos);
+  pool.release(tt);
 
   return true;
   }
@@ -130,11 +215,15 @@ void Output::load(){
   struct OutputData data;
   Output *tt;
 
+  // stored in id order so each one is added to the end of the index
+  byId.reserve(EEStore::eeStore->data.nOutputs);
+  pool.reserve(EEStore::eeStore->data.nOutputs);
   for(int i=0;i<EEStore::eeStore->data.nOutputs;i++){
     EEPROM.get(EEStore::pointer(),data);
     tt=create(data.id,data.pin,data.iFlag);
+    if (tt==NULL) break; // out of memory
     tt->data.oStatus=bitRead(tt->data.iFlag,1)?bitRead(tt->data.iFlag,2):data.oStatus;      // restore status to EEPROM value is bit 1 of iFlag=0, otherwise set to value of bit 2 of iFlag
-    digitalWrite(tt->data.pin,tt->data.oStatus ^ bitRead(tt->data.iFlag,0));
+    tt->writePin();
     pinMode(tt->data.pin,OUTPUT);
     tt->num=EEStore::pointer();
     EEStore::advance(sizeof(tt->data));
@@ -159,31 +248,71 @@ void Output::store(){
 
 }
 ///////////////////////////////////////////////////////////////////////////////
+// Compacting the EEStore journal: from position pos of the index on, write
+// the first state that differs from its oStatus cell. Returns the position
+// to carry on from, -1 when all the cells are up to date.
+
+int Output::storeStateFrom(int pos){
+  for (Output *tt=byId.at(pos); tt!=NULL; tt=byId.at(++pos)) {
+    if (tt->num > 0 && EEPROM.read(tt->num)!=tt->data.oStatus) {
+      EEPROM.write(tt->num, tt->data.oStatus);
+      return pos+1;
+    }
+  }
+  return -1;
+}
 
-Output *Output::create(int id, int pin, int iFlag, int v){
-  Output *tt;
-
-  if(firstOutput==NULL){
-    firstOutput=(Output *)calloc(1,sizeof(Output));
-    tt=firstOutput;
-  } else if((tt=get(id))==NULL){
-    tt=firstOutput;
-    while(tt->nextOutput!=NULL)
-      tt=tt->nextOutput;
-    tt->nextOutput=(Output *)calloc(1,sizeof(Output));
-    tt=tt->nextOutput;
+// Apply a state from the EEStore journal, false if address is not an output
+bool Output::restoreState(int address, byte value){
+  for (Output *tt=firstOutput; tt!=NULL; tt=tt->nextOutput) {
+    if (tt->num != address) continue;
+    if (!bitRead(tt->data.iFlag,1)) {   // as in load, only if the state is restored at power up
+      tt->data.oStatus=value;
+      tt->writePin();
+    }
+    return true;
   }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
 
-  if(tt==NULL) return tt;
+Output *Output::create(int id, int pin, int iFlag, int v){
+  if(id<0 || id>255) return NULL;  // id is stored in a byte
+  int pos=byId.find(id);
+  Output *tt=byId.at(pos);
+
+  if(tt==NULL || tt->data.id!=id){
+    tt=pool.allocate();
+    if(tt==NULL) return tt;
+    if(!byId.insert(pos,tt)){
+      pool.release(tt);
+      return NULL;
+    }
+    // link in after the next lower id
+    tt->nextOutput=byId.at(pos+1);
+    if(pos==0) firstOutput=tt;
+    else byId.at(pos-1)->nextOutput=tt;
+  }
   
   tt->data.id=id;
   tt->data.pin=pin;
   tt->data.iFlag=iFlag;
   tt->data.oStatus=0;
+  // resolved once, writes are then a masked store to the port
+  tt->fastPin.inout=NULL;
+#if defined(ARDUINO_ARCH_AVR)
+  if (pin<NUM_DIGITAL_PINS && digitalPinToPort(pin)!=NOT_A_PIN) 
+#elif defined(ARDUINO_ARCH_RP2040)
+  if (false)  // digitalWrite is already a single atomic set or clear
+#else
+  if (pin<NUM_DIGITAL_PINS)
+#endif
+    MotorDriver::getFastPin(F("OUTPUT"),pin,tt->fastPin);
 
   if(v==1){
     tt->data.oStatus=bitRead(tt->data.iFlag,1)?bitRead(tt->data.iFlag,2):0;      // sets status to 0 (INACTIVE) is bit 1 of iFlag=0, otherwise set to value of bit 2 of iFlag
-    digitalWrite(tt->data.pin,tt->data.oStatus ^ bitRead(tt->data.iFlag,0));
+    tt->writePin();
     pinMode(tt->data.pin,OUTPUT);
   }
 
@@ -194,3 +323,9 @@ Output *Output::create(int id, int pin, int iFlag, int v){
 ///////////////////////////////////////////////////////////////////////////////
 
 Output *Output::firstOutput=NULL;
+IdIndex<Output> Output::byId;
+Pool<Output> Output::pool(OUTPUT_POOL);
+
+void Output::showPool(Print * stream) {
+  pool.show(stream, F("Output"));
+}
@@ -20,6 +20,9 @@
 #define Outputs_h
 
 #include <Arduino.h>
+#include "IdIndex.h"
+#include "Pool.h"
+#include "MotorDriver.h"
 
 struct OutputData {
   uint8_t oStatus;
@@ -31,16 +34,29 @@ struct OutputData {
 class Output{
   public:
   void activate(int s);
+  // <Z GROUP ID STATE ...> sets all the outputs or, if any id is unknown,
+  // none. The pins on one port change together with one write.
+  static bool activateGroup(int16_t pairs[], byte count);
+  static const byte MAX_GROUP=8;
   static Output* get(int);
   static bool remove(int);
   static void load();
   static void store();
+  static int storeStateFrom(int pos);
+  static bool restoreState(int address, byte value);
   static Output *create(int, int, int, int=0);
   static Output *firstOutput;
   struct OutputData data;
   Output *nextOutput;
   static void printAll(Print *);
+  static void showPool(Print *);
+  int getId() { return data.id; }
   private:
+  static IdIndex<Output> byId; // same order as the firstOutput list
+  static Pool<Output> pool;
+  void writePin();
+  void published();
+  FASTPIN fastPin;  // inout is NULL if the pin has no port, digitalWrite is used
   int num;  // Chris has no idea what this is all about!
   
 }; // Output
@@ -87,11 +87,120 @@ void PWMServoDriver::setServo(byte servoNum, uint16_t value) {
     uint8_t buffer[] = {(uint8_t)(PCA9685_FIRST_SERVO + 4 * pin), // 4 registers per pin
       0, 0, (uint8_t)(value & 0xff), (uint8_t)(value >> 8)};
     if (value == 4095) buffer[2] = 0x10;   // Full on
-    byte error=I2CManager.write(PCA9685_I2C_ADDRESS + board, buffer, sizeof(buffer));
-    if (error!=0) DIAG(F("SetServo error %d"),error); 
+    // sent by I2CManager.loop() so a route moving many servos does not wait for the bus
+    I2CManager.queueWrite(PCA9685_I2C_ADDRESS + board, buffer, sizeof(buffer), servoWritten);
   }
 }
 
+/*!
+ *  @brief  Motion engine. Each tick the position of every moving servo is
+ *          worked out from an ease in / ease out curve, then the changed
+ *          channels of each board are sent as runs of adjacent channels,
+ *          one auto-increment write per run.
+ */
+PWMServoDriver::MOVE PWMServoDriver::moves[MAX_MOVES];
+unsigned long PWMServoDriver::lastTick=0;
+
+static const uint16_t profileDuration[] = {0, 500, 1000, 2000};  // ms, by SERVO_PROFILE
+
+PWMServoDriver::MOVE * PWMServoDriver::findMove(byte servoNum) {
+  for (byte m=0; m<MAX_MOVES; m++) 
+    if (moves[m].callback && moves[m].servoNum==servoNum) return &moves[m];
+  return NULL;
+}
+
+bool PWMServoDriver::isMoving(byte servoNum) {
+  return findMove(servoNum)!=NULL;
+}
+
+bool PWMServoDriver::moveServo(byte servoNum, uint16_t from, uint16_t to, SERVO_PROFILE profile,
+                               int id, SERVO_CALLBACK callback) {
+  MOVE * move=findMove(servoNum);
+  if (move) from=move->position;   // change of mind in mid move
+  else if (profile!=SERVO_INSTANT && from!=to && callback && setup(servoNum/16)) {
+    for (byte m=0; m<MAX_MOVES && !move; m++) 
+      if (!moves[m].callback) move=&moves[m];
+  }
+  if (!move) {
+    // Instant, already there or no free slot
+    setServo(servoNum, to);
+    return false;
+  }
+  if (lastTick==0) lastTick=millis();
+  move->servoNum=servoNum;
+  move->from=from;
+  move->to=to;
+  move->position=from;
+  move->elapsed=0;
+  move->duration=profileDuration[profile>SERVO_SLOW ? SERVO_SLOW : profile];
+  move->id=id;
+  move->callback=callback;
+  return true;
+}
+
+void PWMServoDriver::loop() {
+  unsigned long now=millis();
+  if (now-lastTick < TICK_MS) return;
+  unsigned long step=now-lastTick;
+  lastTick=now;
+
+  for (int board=0; board<4; board++) {
+    uint16_t channels=0;    // bit per pin changed this tick
+    uint16_t values[16];
+    for (byte m=0; m<MAX_MOVES; m++) {
+      MOVE & move=moves[m];
+      if (!move.callback || move.servoNum/16!=board) continue;
+      move.elapsed = (move.elapsed+step >= move.duration) ? move.duration : move.elapsed+step;
+      // smoothstep 3t^2-2t^3 with t scaled to 0..256
+      long t=((long)move.elapsed<<8)/move.duration;
+      long eased=(t*t*(768-2*t))>>16;
+      uint16_t position=move.from + (((long)move.to-(long)move.from)*eased>>8);
+      if (move.elapsed>=move.duration) position=move.to;
+      if (position!=move.position) {
+        move.position=position;
+        channels|=1<<(move.servoNum%16);
+        values[move.servoNum%16]=position;
+      }
+    }
+    if (channels) writeServos(board, channels, values);
+  }
+
+  // Callbacks last, they may start new moves
+  for (byte m=0; m<MAX_MOVES; m++) {
+    MOVE & move=moves[m];
+    if (!move.callback || move.elapsed<move.duration) continue;
+    SERVO_CALLBACK callback=move.callback;
+    move.callback=NULL;   // slot free
+    callback(move.id);
+  }
+}
+
+void PWMServoDriver::writeServos(int board, uint16_t channels, const uint16_t values[16]) {
+  uint8_t buffer[1+4*MAX_RUN];
+  byte pin=0;
+  while (pin<16) {
+    if (!(channels & (1<<pin))) {
+      pin++;
+      continue;
+    }
+    buffer[0]=PCA9685_FIRST_SERVO + 4*pin;
+    byte size=1;
+    for (byte n=0; n<MAX_RUN && pin<16 && (channels & (1<<pin)); n++, pin++) {
+      uint16_t value=values[pin];
+      buffer[size++]=0;
+      buffer[size++]=(value==4095) ? 0x10 : 0;   // Full on
+      buffer[size++]=value & 0xff;
+      buffer[size++]=value >> 8;
+    }
+    // queued like setServo, a run still waiting from the last tick is replaced
+    I2CManager.queueWrite(PCA9685_I2C_ADDRESS + board, buffer, size, servoWritten);
+  }
+}
+
+void PWMServoDriver::servoWritten(uint8_t error) {
+  if (error!=0) DIAG(F("SetServo error %d"),error); 
+}
+
 void PWMServoDriver::writeRegister(uint8_t i2caddr,uint8_t hardwareRegister, uint8_t d) {
   I2CManager.write(i2caddr, 2, hardwareRegister, d);
 }
@@ -5,17 +5,53 @@
  */
 #ifndef PWMServoDriver_H
 #define PWMServoDriver_H
+#include <Arduino.h>
 
+// How a servo gets from one position to another. The timed profiles
+// ease in and out over the whole move, whatever its size.
+enum SERVO_PROFILE : byte {
+  SERVO_INSTANT=0,  // jump straight to the target
+  SERVO_FAST=1,     // 0.5 seconds
+  SERVO_MEDIUM=2,   // 1 second
+  SERVO_SLOW=3      // 2 seconds
+};
+
+// Called from loop() when a move has finished, with the id given to moveServo
+typedef void (*SERVO_CALLBACK)(int id);
 
 class PWMServoDriver {
 public:
     static void setServo(byte servoNum,  uint16_t pos);
+    // Start a move from 'from' (used if the servo is not already moving) to 'to'.
+    // Returns false if the servo was set at once, in which case there is no callback.
+    static bool moveServo(byte servoNum, uint16_t from, uint16_t to, SERVO_PROFILE profile,
+                          int id, SERVO_CALLBACK callback);
+    static bool isMoving(byte servoNum);
+    static void loop();
+    static const byte MAX_MOVES=8;     // servos that may be moving at once
     
 private:
+  static const byte TICK_MS=20;      // one servo frame at 50Hz
+  static const byte MAX_RUN=7;       // channels in one write, 4 bytes each within the 32 byte I2C buffer
+  struct MOVE {
+    byte servoNum;
+    uint16_t from;
+    uint16_t to;
+    uint16_t position;  // last value sent
+    uint16_t elapsed;   // ms since the move started
+    uint16_t duration;  // ms
+    int id;
+    SERVO_CALLBACK callback;  // NULL when the slot is free
+  };
+  static MOVE moves[MAX_MOVES];
+  static unsigned long lastTick;
   static byte setupFlags; 
   static byte failFlags; 
   static bool setup(int board);
+  static MOVE * findMove(byte servoNum);
+  static void writeServos(int board, uint16_t channels, const uint16_t values[16]);
   static void writeRegister(uint8_t i2caddr,uint8_t hardwareRegister, uint8_t d);
+  static void servoWritten(uint8_t error);
 };
 
 #endif
@@ -0,0 +1,92 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Pool_h
+#define Pool_h
+#include <Arduino.h>
+#include "StringFormatter.h"
+
+// Fixed size blocks for one class of object. Blocks are taken from the heap
+// in chunks and, once freed, go back on this pool's free list rather than to
+// the heap, so objects that come and go (a WiThrottle per client
+// connection, turnouts deleted and redefined) can not fragment the heap.
+// The first chunk is 'initial' blocks (from the board profile) or what
+// reserve() asks for, later chunks are GROWTH blocks.
+// Blocks are handed out zeroed, as calloc would.
+
+template <class T> class Pool {
+  public:
+    Pool(byte initial) : initial(initial) {}
+
+    T * allocate() {
+      if (freeList==NULL) grow(capacity==0 ? initial : GROWTH);
+      Block * block=freeList;
+      if (block==NULL) {
+        failed++;
+        return NULL;
+      }
+      freeList=block->next;
+      if (++used>peak) peak=used;
+      memset(block, 0, sizeof(Block));
+      return (T *)block;
+    }
+
+    void release(T * item) {
+      if (item==NULL) return;
+      Block * block=(Block *)item;
+      block->next=freeList;
+      freeList=block;
+      used--;
+    }
+
+    // Make sure there are n blocks in all, in one chunk if more are needed
+    void reserve(int n) {
+      if (n>capacity) grow(n-capacity);
+    }
+
+    void show(Print * stream, const FSH * name) {
+      StringFormatter::send(stream, F("%S pool used=%d/%d peak=%d failed=%d block=%d\n"),
+        name, used, capacity, peak, failed, (int)sizeof(Block));
+    }
+
+  private:
+    static const byte GROWTH=4;
+    union Block {
+      Block * next;
+      alignas(T) byte item[sizeof(T)];
+    };
+
+    void grow(int n) {
+      if (n<=0) return;
+      Block * chunk=(Block *)malloc(n*sizeof(Block));
+      if (chunk==NULL) return;
+      for (int i=0; i<n; i++) {
+        chunk[i].next=freeList;
+        freeList=&chunk[i];
+      }
+      capacity+=n;
+    }
+
+    Block * freeList=NULL;
+    byte initial;
+    int capacity=0;
+    int used=0;
+    int peak=0;
+    int failed=0;
+};
+#endif
@@ -0,0 +1,99 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "Profiler.h"
+#include "StringFormatter.h"
+
+Profiler::Counter Profiler::sections[PROFILE_SECTIONS];
+Profiler::Counter Profiler::loops;
+unsigned long Profiler::lastMark=0;
+unsigned long Profiler::loopStart=0;
+unsigned long Profiler::resetMillis=0;
+volatile byte Profiler::lastSection=PROFILE_SECTIONS;
+
+#if !defined(DISABLE_PROFILER)
+void Profiler::startLoop() {
+  unsigned long now=micros();
+  // The first loop after a reset has no start time to measure from
+  if (loopStart!=0) record(loops, now-loopStart);
+  loopStart=now;
+  lastMark=now;
+  lastSection=PROFILE_SECTIONS;
+}
+
+void Profiler::mark(PROFILE_SECTION section) {
+  unsigned long now=micros();
+  record(sections[section], now-lastMark);
+  lastMark=now;
+  lastSection=section;
+}
+#endif
+
+void Profiler::record(Counter & counter, unsigned long duration) {
+  uint16_t clipped= duration>0xFFFF ? 0xFFFF : duration;
+  if (counter.calls==0 || clipped<counter.minimum) counter.minimum=clipped;
+  if (clipped>counter.maximum) counter.maximum=clipped;
+  // Halve both totals before they can overflow; the mean is unchanged.
+  if (counter.total>=0x7FFFFFFFUL) {
+    counter.total/=2;
+    counter.calls/=2;
+  }
+  counter.total+=duration;
+  counter.calls++;
+}
+
+void Profiler::reset() {
+  memset(sections, 0, sizeof(sections));
+  memset(&loops, 0, sizeof(loops));
+  loopStart=0;
+  resetMillis=millis();
+}
+
+const __FlashStringHelper * Profiler::sectionName(byte section) {
+  switch (section) {
+    case PROFILE_DCC:         return F("DCC");
+    case PROFILE_SERIAL:      return F("Serial");
+    case PROFILE_WIFI:        return F("Wifi");
+    case PROFILE_ETHERNET:    return F("Ethernet");
+    case PROFILE_RMFT:        return F("RMFT");
+    case PROFILE_LCN:         return F("LCN");
+    case PROFILE_DISTRIBUTOR: return F("Distributor");
+    case PROFILE_LCD:         return F("LCD");
+    case PROFILE_I2C:         return F("I2C");
+    case PROFILE_SECTIONS:    return F("loop start");
+    default:                  return F("?");
+  }
+}
+
+void Profiler::show(Print * stream) {
+#if defined(DISABLE_PROFILER)
+  StringFormatter::send(stream, F("Profiler disabled\n"));
+#else
+  unsigned long seconds=(millis()-resetMillis)/1000;
+  StringFormatter::send(stream, F("Profile over %ls: loops=%l (%l/s) min=%lus mean=%lus max=%lus\n"),
+    seconds, loops.calls, seconds ? loops.calls/seconds : 0L, (long)loops.minimum,
+    loops.calls ? loops.total/loops.calls : 0L, (long)loops.maximum);
+  for (byte section=0; section<PROFILE_SECTIONS; section++) {
+    Counter & counter=sections[section];
+    if (counter.calls==0) continue;  // not built in
+    StringFormatter::send(stream, F("%S calls=%l min=%lus mean=%lus max=%lus\n"),
+      sectionName(section), counter.calls, (long)counter.minimum,
+      counter.total/counter.calls, (long)counter.maximum);
+  }
+#endif
+}
@@ -0,0 +1,70 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Profiler_h
+#define Profiler_h
+#include <Arduino.h>
+
+// Main loop timing. The .ino calls startLoop() at the top of loop() and
+// mark(section) after each subsystem, which charges the time since the
+// previous mark to that section. <D PROFILE> reports, <D PROFILE RESET> clears.
+// Define DISABLE_PROFILER in config.h to compile out the timing, the last
+// section marked is still kept for the stall watchdog.
+
+enum PROFILE_SECTION : byte {
+  PROFILE_DCC,
+  PROFILE_SERIAL,
+  PROFILE_WIFI,
+  PROFILE_ETHERNET,
+  PROFILE_RMFT,
+  PROFILE_LCN,
+  PROFILE_DISTRIBUTOR,
+  PROFILE_LCD,
+  PROFILE_I2C,
+  PROFILE_SECTIONS  // number of sections, must be last
+};
+
+class Profiler {
+  public:
+#if defined(DISABLE_PROFILER)
+    static inline void startLoop() { lastSection=PROFILE_SECTIONS; }
+    static inline void mark(PROFILE_SECTION section) { lastSection=section; }
+#else
+    static void startLoop();
+    static void mark(PROFILE_SECTION section);
+#endif
+    static void show(Print * stream);
+    static void reset();
+    static const __FlashStringHelper * sectionName(byte section);
+    static volatile byte lastSection;  // PROFILE_SECTIONS at the start of loop()
+
+  private:
+    struct Counter {
+      unsigned long calls;
+      unsigned long total;  // microseconds
+      uint16_t minimum;
+      uint16_t maximum;
+    };
+    static void record(Counter & counter, unsigned long duration);
+    static Counter sections[PROFILE_SECTIONS];
+    static Counter loops;
+    static unsigned long lastMark;
+    static unsigned long loopStart;
+    static unsigned long resetMillis;
+};
+#endif
@@ -20,16 +20,27 @@
 #include "RingStream.h"
 #include "DIAG.h"
 
+// A ring written on one core and read on the other, see CORE_SPLIT, needs
+// the bytes of a message stored before the position that shows them, read
+// after it, and read before the position that frees them for the writer.
+#if defined(ARDUINO_ARCH_RP2040)
+#define RING_BARRIER() __sync_synchronize()
+#else
+#define RING_BARRIER()
+#endif
+
 RingStream::RingStream( const uint16_t len)
 {
   _len=len;
   _buffer=new byte[len];
   _pos_write=0;
   _pos_read=0;
+  _pos_commit=0;
   _buffer[0]=0;
   _overflow=false;
   _mark=0;
   _count=0; 
+  _contiguous=false;
 }
 
 size_t RingStream::write(uint8_t b) {
@@ -45,26 +56,78 @@ size_t RingStream::write(uint8_t b) {
   return 1;
 }
 
+// Same result as writing the bytes one at a time, with at most two copies
+size_t RingStream::write(const uint8_t * buffer, size_t size) {
+  if (_overflow) return 0;
+  int space=_pos_read-_pos_write-1;  // the last free byte would meet the read position
+  if (space<0) space+=_len;
+  if ((int)size>space) {
+    _overflow=true;  // commit throws the message away
+    return 0;
+  }
+  int first=_len-_pos_write;
+  if ((int)size<first) first=size;
+  memcpy(_buffer+_pos_write, buffer, first);
+  memcpy(_buffer, buffer+first, size-first);
+  _pos_write+=size;
+  if (_pos_write>=_len) _pos_write-=_len;
+  _count+=size;
+  return size;
+}
+
+// Readers only see committed messages, never one still being written 
 int RingStream::read() {
-  if ((_pos_read==_pos_write) && !_overflow) return -1;  // empty  
-  byte b=_buffer[_pos_read];
-  _pos_read++;
-  if (_pos_read==_len) _pos_read=0;
-  _overflow=false;
+  int pos=_pos_read;
+  if (pos==_pos_commit) return -1;  // empty  
+  RING_BARRIER();
+  byte b=_buffer[pos];
+  RING_BARRIER();
+  _pos_read = (pos+1==_len) ? 0 : pos+1;
   return b;
 }
 
+// look ahead at unread data without consuming it, -1 if beyond the data committed
+int RingStream::peek(int offset) {
+  int available=_pos_commit-_pos_read;
+  RING_BARRIER();
+  if (available<0) available+=_len;
+  if (offset>=available) return -1;
+  int pos=_pos_read+offset;
+  if (pos>=_len) pos-=_len;
+  return _buffer[pos];
+}
+
+int RingStream::peekSpan(byte * & span) {
+  int committed=_pos_commit;
+  RING_BARRIER();
+  span=_buffer+_pos_read;
+  if (committed>=_pos_read) return committed-_pos_read;
+  return _len-_pos_read;
+}
+
+void RingStream::consume(int length) {
+  if (length<=0) return;
+  int pos=_pos_read+length;
+  if (pos>=_len) pos-=_len;
+  RING_BARRIER();
+  _pos_read=pos;
+}
 
 int RingStream::count() {
-  return (read()<<8) | read(); 
+  int high=read();  // the order matters
+  return (high<<8) | read(); 
   }
 
 int RingStream::freeSpace() {
   // allow space for client flag and length bytes
-  if (_pos_read>_pos_write) return _pos_read-_pos_write-3;
-  else return _len - _pos_write + _pos_read-3;  
+  int read=_pos_read;
+  if (read>_pos_write) return read-_pos_write-3;
+  else return _len - _pos_write + read-3;  
 }
 
+int RingStream::size() {
+  return _len;
+}
 
 // mark start of message with client id (0...9)
 void RingStream::mark(uint8_t b) {
@@ -75,6 +138,28 @@ void RingStream::mark(uint8_t b) {
     _count=0;
 }
 
+// mark start of a message of known length that must not wrap around the
+// end of the buffer, so that readSpan can hand it to the parser in place.
+// Space is reserved for the data and a null terminator added by commit.
+// Returns false if there is not enough contiguous space.
+bool RingStream::markContiguous(uint8_t b, int length) {
+  if (_overflow) return false;
+  int needed=3+length+1;
+  if (_pos_read==_pos_write) _pos_read=_pos_write=_pos_commit=0; // empty, start at the front 
+  if (_pos_write>=_pos_read) {
+    if (needed >= _len-_pos_write) {
+      // not enough room before the end, skip to the front
+      if (needed >= _pos_read) return false;
+      _buffer[_pos_write]=WRAP_MARK;
+      _pos_write=0;
+    }
+  } 
+  else if (needed >= _pos_read-_pos_write) return false;
+  mark(b);
+  _contiguous=true;
+  return true;
+}
+
 // peekTargetMark is used by the parser stash routines to know which client
 // to send a callback response to some time later. 
 uint8_t RingStream::peekTargetMark() {
@@ -82,6 +167,8 @@ uint8_t RingStream::peekTargetMark() {
 }
 
 bool RingStream::commit() {
+  bool contiguous=_contiguous;
+  _contiguous=false;
   if (_overflow) {
         DIAG(F("RingStream(%d) commit(%d) OVERFLOW"),_len, _count);
         // just throw it away 
@@ -101,5 +188,27 @@ bool RingStream::commit() {
   _mark++;
   if (_mark==_len) _mark=0;
   _buffer[_mark]=lowByte(_count);
+  // space for the terminator was reserved by markContiguous
+  if (contiguous) _buffer[_pos_write++]=0; 
+  RING_BARRIER();
+  _pos_commit=_pos_write;  // now the readers can see it
   return true; // commit worked
 }
+
+// Zero copy read of the next message written with markContiguous.
+// Returns the mark (client id) or -1 if empty. span is pointed at the
+// null terminated message of length bytes inside the buffer, which remains valid until
+// the ring is next written to.
+int RingStream::readSpan(byte * & span, int & length) {
+  if (_pos_read==_pos_commit) return -1;  // empty
+  if (_buffer[_pos_read]==WRAP_MARK) {
+    _pos_read=0;
+    if (_pos_read==_pos_commit) return -1;
+  }
+  byte b=_buffer[_pos_read];
+  length=(_buffer[_pos_read+1]<<8) | _buffer[_pos_read+2];
+  span=_buffer+_pos_read+3;
+  _pos_read+=3+length+1;
+  if (_pos_read==_len) _pos_read=0;
+  return b;
+}
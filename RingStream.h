@@ -27,21 +27,34 @@ class RingStream : public Print {
     RingStream( const uint16_t len);
   
     virtual size_t write(uint8_t b);
+    virtual size_t write(const uint8_t * buffer, size_t size);
     using Print::write;
     int read();
+    int peek(int offset);
+    // Zero copy draining: the unread bytes up to the end of the buffer, 
+    // then consume once they have been used.
+    int peekSpan(byte * & span);
+    void consume(int length);
     int count();
     int freeSpace();
+    int size();
     void mark(uint8_t b);
+    bool markContiguous(uint8_t b, int length);
     bool commit();
     uint8_t peekTargetMark();
+    int readSpan(byte * & span, int & length);
     
  private:
+   static const byte WRAP_MARK=0xFF; // rest of buffer skipped by markContiguous
    int _len;
    int _pos_write;
-   int _pos_read;
+   // the reader's and the writer's positions, each may be on another core
+   volatile int _pos_read;
+   volatile int _pos_commit;  // end of the committed messages, as far as readers see
    bool _overflow;
    int _mark;
    int _count;
+   bool _contiguous;
    byte * _buffer;
 };
 
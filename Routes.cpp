@@ -0,0 +1,257 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "Routes.h"
+#include "DCC.h"
+#include "DCCEXParser.h"
+#include "Turnouts.h"
+#include "Outputs.h"
+#include "Sensors.h"
+#include "StringFormatter.h"
+#include "DIAG.h"
+
+// Every operand is two bytes, low byte first
+#define ROUTE_INT(v)   lowByte(v), highByte(v)
+#define ROUTE(id)      OPCODE_ROUTE, ROUTE_INT(id),
+#define ENDROUTE       OPCODE_END,
+#define THROW(id)      OPCODE_THROW, ROUTE_INT(id),
+#define CLOSE(id)      OPCODE_CLOSE, ROUTE_INT(id),
+#define SPEED(cab,speed,direction) OPCODE_SPEED, ROUTE_INT(cab), ROUTE_INT(speed), ROUTE_INT(direction),
+#define MOMENTUM(cab,accel,decel)  OPCODE_MOMENTUM, ROUTE_INT(cab), ROUTE_INT(accel), ROUTE_INT(decel),
+#define FUNCTION(cab,fn,on)        OPCODE_FUNCTION, ROUTE_INT(cab), ROUTE_INT(fn), ROUTE_INT(on),
+#define ACCESSORY(address,subaddress,activate) OPCODE_ACCESSORY, ROUTE_INT(address), ROUTE_INT(subaddress), ROUTE_INT(activate),
+#define SETOUTPUT(id,state) OPCODE_OUTPUT, ROUTE_INT(id), ROUTE_INT(state),
+// A DELAY over 65535ms does not fit its operand and fails to compile here, use DELAYMINS
+#define DELAY(ms)      OPCODE_DELAY, ROUTE_INT((ms)+0*sizeof(char[(ms)>=0 && (ms)<=65535L ? 1 : -1])),
+#define DELAYMINS(mins) OPCODE_DELAYMINS, ROUTE_INT(mins),
+#define AT(sensor)     OPCODE_AT, ROUTE_INT(sensor),
+#define AFTER(sensor)  OPCODE_AFTER, ROUTE_INT(sensor),
+#define START(id)      OPCODE_START, ROUTE_INT(id),
+#define FOLLOW(id)     OPCODE_FOLLOW, ROUTE_INT(id),
+
+static const byte ROUTE_TABLE[] PROGMEM = {
+#if __has_include ( "myRoutes.h")
+  #include "myRoutes.h"
+#endif
+  OPCODE_LAST, 0, 0  // an operand's worth after it, so no read of one can pass the end
+};
+
+#undef ROUTE_INT
+#undef ROUTE
+#undef ENDROUTE
+#undef THROW
+#undef CLOSE
+#undef SPEED
+#undef MOMENTUM
+#undef FUNCTION
+#undef ACCESSORY
+#undef SETOUTPUT
+#undef DELAY
+#undef DELAYMINS
+#undef AT
+#undef AFTER
+#undef START
+#undef FOLLOW
+
+const int16_t HASH_KEYWORD_START = 23232;
+const int16_t HASH_KEYWORD_KILL = 5218;
+
+Routes::TASK Routes::tasks[MAX_TASKS];
+
+void Routes::begin() {
+  if (GETFLASH(ROUTE_TABLE)==OPCODE_LAST) return;  // no routes
+  DCCEXParser::setRMFTFilter(filter);
+}
+
+void Routes::filter(Print * stream, byte & opcode, byte & paramCount, int16_t p[]) {
+  if (opcode!='/') return;
+  if (paramCount==0) printAll(stream);
+  else if (paramCount==2 && p[0]==HASH_KEYWORD_START && start(p[1]))
+    StringFormatter::send(stream, F("<O>\n"));
+  else if (paramCount==2 && p[0]==HASH_KEYWORD_KILL) {
+    kill(p[1]);
+    StringFormatter::send(stream, F("<O>\n"));
+  }
+  else StringFormatter::send(stream, F("<X>\n"));
+  opcode=0;  // handled
+}
+
+byte Routes::operandCount(byte opcode) {
+  switch (opcode) {
+    case OPCODE_END:
+    case OPCODE_LAST:      return 0;
+    case OPCODE_OUTPUT:    return 2;
+    case OPCODE_SPEED:
+    case OPCODE_MOMENTUM:
+    case OPCODE_FUNCTION:
+    case OPCODE_ACCESSORY: return 3;
+    default:               return 1;
+  }
+}
+
+int16_t Routes::operand(uint16_t pc, byte n) {
+  uint16_t at=pc+1+2*n;
+  return GETFLASH(ROUTE_TABLE+at) | (GETFLASH(ROUTE_TABLE+at+1)<<8);
+}
+
+// Offset of the first step of the route, -1 if there is no such route
+int Routes::find(int route) {
+  uint16_t pc=0;
+  for (byte opcode; (opcode=GETFLASH(ROUTE_TABLE+pc))!=OPCODE_LAST; pc+=1+2*operandCount(opcode))
+    if (opcode==OPCODE_ROUTE && operand(pc,0)==route) return pc+3;
+  return -1;
+}
+
+bool Routes::start(int route) {
+  int pc=find(route);
+  if (pc<0) return false;
+  for (byte t=0; t<MAX_TASKS; t++) {
+    TASK * task=&tasks[t];
+    if (task->state!=TASK_FREE) continue;
+    task->state=TASK_RUNNING;
+    task->route=route;
+    task->pc=pc;
+    return true;
+  }
+  DIAG(F("Route %d not started, %d routes running"), route, MAX_TASKS);
+  return false;
+}
+
+void Routes::kill(int route) {
+  for (byte t=0; t<MAX_TASKS; t++)
+    if (tasks[t].route==route) tasks[t].state=TASK_FREE;
+}
+
+void Routes::printAll(Print * stream) {
+  for (byte t=0; t<MAX_TASKS; t++) {
+    TASK * task=&tasks[t];
+    if (task->state==TASK_FREE) continue;
+    StringFormatter::send(stream, F("<* Route %d step %d %S *>\n"), task->route, task->pc,
+      task->state==TASK_DELAY ? F("delay") : task->state==TASK_AT ? F("at") :
+      task->state==TASK_AFTER ? F("after") : F("running"));
+  }
+}
+
+// A missing sensor reads as not active, as LCN ones do until first heard of
+bool Routes::sensorActive(int16_t id) {
+  Sensor * sensor=Sensor::get(id);
+  return sensor && sensor->active;
+}
+
+// Each task runs until it has to wait, or for STEPS_PER_LOOP steps 
+void Routes::loop() {
+  for (byte t=0; t<MAX_TASKS; t++) {
+    TASK * task=&tasks[t];
+    switch (task->state) {
+      case TASK_FREE: continue;
+      case TASK_DELAY:
+        if (millis()-task->waitStart < task->waitMs) continue;
+        break;
+      case TASK_AT:
+        if (!sensorActive(task->sensor)) continue;
+        break;
+      case TASK_AFTER:
+        if (sensorActive(task->sensor)) continue;
+        break;
+      case TASK_RUNNING:
+        break;
+    }
+    task->state=TASK_RUNNING;
+    for (byte s=0; s<STEPS_PER_LOOP && step(task); s++);
+  }
+}
+
+// Do one step, false if the task is now waiting or finished
+bool Routes::step(TASK * task) {
+  uint16_t pc=task->pc;
+  byte opcode=GETFLASH(ROUTE_TABLE+pc);
+  byte operands=operandCount(opcode);
+  int16_t p0= operands ? operand(pc,0) : 0;
+  task->pc=pc+1+2*operands;
+  switch (opcode) {
+    case OPCODE_END:
+    case OPCODE_LAST:
+      task->state=TASK_FREE;
+      return false;
+    case OPCODE_ROUTE:  // run on into the next route
+      return true;
+    case OPCODE_THROW:
+    case OPCODE_CLOSE:
+      if (!Turnout::activate(p0, opcode==OPCODE_THROW)) DIAG(F("Route %d no turnout %d"), task->route, p0);
+      return true;
+    case OPCODE_SPEED:
+      {
+        // as <t>, -1 is an emergency stop and 1-126 are DCC 2-127
+        int16_t speed=operand(pc,1);
+        DCC::setThrottle(p0, speed<0 ? 1 : speed==0 ? 0 : speed>126 ? 127 : speed+1, operand(pc,2));
+      }
+      return true;
+    case OPCODE_MOMENTUM:
+      DCC::setMomentum(p0, operand(pc,1), operand(pc,2));
+      return true;
+    case OPCODE_FUNCTION:
+      DCC::setFn(p0, operand(pc,1), operand(pc,2));
+      return true;
+    case OPCODE_ACCESSORY:
+      DCC::setAccessory(p0, operand(pc,1), operand(pc,2));
+      return true;
+    case OPCODE_OUTPUT:
+      {
+        Output * output=Output::get(p0);
+        if (output) output->activate(operand(pc,1));
+        else DIAG(F("Route %d no output %d"), task->route, p0);
+      }
+      return true;
+    case OPCODE_DELAY:
+      task->state=TASK_DELAY;
+      task->waitStart=millis();
+      task->waitMs=(uint16_t)p0;
+      return false;
+    case OPCODE_DELAYMINS:
+      task->state=TASK_DELAY;
+      task->waitStart=millis();
+      task->waitMs=(uint16_t)p0*60000UL;
+      return false;
+    case OPCODE_AT:
+    case OPCODE_AFTER:
+      task->sensor=p0;
+      // checked now so a sensor already in the state does not cost a loop
+      if (sensorActive(p0)==(opcode==OPCODE_AT)) return true;
+      task->state= opcode==OPCODE_AT ? TASK_AT : TASK_AFTER;
+      return false;
+    case OPCODE_START:
+      start(p0);
+      return true;
+    case OPCODE_FOLLOW:
+      {
+        int next=find(p0);
+        if (next>=0) {
+          task->route=p0;
+          task->pc=next;
+          return false;  // a loop of FOLLOWs gives the rest of the loop a turn
+        }
+        DIAG(F("Route %d no route %d"), task->route, p0);
+        task->state=TASK_FREE;
+      }
+      return false;
+    default:
+      DIAG(F("Route %d bad step %d"), task->route, pc);
+      task->state=TASK_FREE;
+      return false;
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Routes_h
+#define Routes_h
+#include <Arduino.h>
+
+// Timed routes run by the command station itself. They are written in
+// myRoutes.h, next to config.h, and compiled into a table of steps in
+// flash, for example
+//
+//   ROUTE(1)            // </ START 1> runs this
+//     THROW(12)
+//     MOMENTUM(3,4,4)
+//     SPEED(3,40,1)     // cab, speed 0-126 or -1 to stop at once, direction
+//     AT(7)             // wait for sensor 7 to be active
+//     SPEED(3,0,1)
+//     DELAY(5000)       // ms, up to 65535
+//     CLOSE(12)
+//   ENDROUTE
+//
+// The other steps are FUNCTION(cab,fn,on), ACCESSORY(address,subaddress,on),
+// SETOUTPUT(id,state), DELAYMINS(mins) for waits too long for DELAY,
+// AFTER(sensor) waiting for it to be not active,
+// START(route) running another route alongside and FOLLOW(route) going on
+// with another route.
+//
+// Each running route is a task stepped from loop(), which waits without
+// holding up anything else. Speeds go through the momentum ramp and
+// accessories through the accessory queue exactly as the same commands 
+// from a throttle would. Commands, with the RMFT filter unless an RMFT
+// automation is built in:
+//   </>            list the running routes
+//   </ START ID>   start route ID, another copy if it is already running
+//   </ KILL ID>    stop every copy of route ID (locos keep their speed)
+
+enum ROUTE_OPCODE : byte {
+  OPCODE_END,       // the task finishes
+  OPCODE_ROUTE,     // ROUTE ID, start of a route
+  OPCODE_THROW,     // TURNOUT
+  OPCODE_CLOSE,     // TURNOUT
+  OPCODE_SPEED,     // CAB SPEED DIRECTION
+  OPCODE_MOMENTUM,  // CAB ACCEL DECEL
+  OPCODE_FUNCTION,  // CAB FUNCTION ON
+  OPCODE_ACCESSORY, // ADDRESS SUBADDRESS ACTIVATE
+  OPCODE_OUTPUT,    // OUTPUT STATE
+  OPCODE_DELAY,     // MS
+  OPCODE_AT,        // SENSOR, wait until active
+  OPCODE_AFTER,     // SENSOR, wait until not active
+  OPCODE_START,     // ROUTE, run it as another task
+  OPCODE_FOLLOW,    // ROUTE, carry on with it in this task
+  OPCODE_DELAYMINS, // MINUTES
+  OPCODE_LAST       // end of the table
+};
+
+class Routes {
+  public:
+    static void begin();
+    static void loop();
+    static bool start(int route);
+    static void kill(int route);
+    static void printAll(Print * stream);
+  private:
+    enum TASK_STATE : byte { TASK_FREE, TASK_RUNNING, TASK_DELAY, TASK_AT, TASK_AFTER };
+    struct TASK {
+      TASK_STATE state;
+      int16_t route;
+      uint16_t pc;          // offset in the table of the next step
+      unsigned long waitMs;
+      unsigned long waitStart;
+      int16_t sensor;
+    };
+    static const byte MAX_TASKS=8;
+    static const byte STEPS_PER_LOOP=8;  // then the rest of the loop runs
+    static void filter(Print * stream, byte & opcode, byte & paramCount, int16_t p[]);
+    static bool step(TASK * task);
+    static bool sensorActive(int16_t id);
+    static int16_t operand(uint16_t pc, byte n);
+    static byte operandCount(byte opcode);
+    static int find(int route);
+    static TASK tasks[MAX_TASKS];
+};
+#endif
@@ -122,7 +122,7 @@ SSD1306AsciiWire::SSD1306AsciiWire(int width, int height) {
 void SSD1306AsciiWire::clearNative() {
   const int maxBytes = sizeof(blankPixels);  // max number of bytes sendable over Wire
   for (uint8_t r = 0; r <= m_displayHeight/8 - 1; r++) {
-    setRowNative(r);   // Position at start of row to be erased
+    setRowNative(r, 0);   // Position at start of row to be erased
     for (uint8_t c = 0; c <= m_displayWidth - 1; c += maxBytes-1) {
       uint8_t len = min(m_displayWidth-c, maxBytes-1) + 1;
       I2CManager.write_P(m_i2cAddr, blankPixels, len);  // Write a number of blank columns
@@ -135,7 +135,12 @@ void SSD1306AsciiWire::begin(const DevType* dev, uint8_t i2cAddr) {
   m_i2cAddr = i2cAddr;
   m_col = 0;
   m_row = 0;
+#if defined(ARDUINO_ARCH_AVR)
   const uint8_t* table = (const uint8_t*)GETFLASHW(&dev->initcmds);
+#else
+  // Flash is read as memory, and a pointer is wider than a word
+  const uint8_t* table = dev->initcmds;
+#endif
   uint8_t size = GETFLASH(&dev->initSize);
   m_displayWidth = GETFLASH(&dev->lcdWidth);
   m_displayHeight = GETFLASH(&dev->lcdHeight);
@@ -149,13 +154,14 @@ void SSD1306AsciiWire::begin(const DevType* dev, uint8_t i2cAddr) {
 
 //------------------------------------------------------------------------------
 
-// Set cursor position (by text line)
-void SSD1306AsciiWire::setRowNative(uint8_t line) {
-  // Calculate pixel position from line number
+// Set cursor position (by text line and character column)
+void SSD1306AsciiWire::setRowNative(uint8_t line, uint8_t column) {
+  // Calculate pixel position from line and column numbers
   uint8_t row = line*8;
-  if (row < m_displayHeight) {
+  uint16_t col = column * (fontWidth + letterSpacing);
+  if (row < m_displayHeight && col < m_displayWidth) {
     m_row = row;
-    m_col = m_colOffset;
+    m_col = m_colOffset + col;
     // Build output buffer for I2C
     uint8_t len = 0;
     outputBuffer[len++] = 0x00;  // Set to command mode
@@ -58,8 +58,8 @@ class SSD1306AsciiWire : public LCDDisplay {
   // Clear the display and set the cursor to (0, 0).
   void clearNative();
 
-  // Set cursor to start of specified text line
-  void setRowNative(byte line);
+  // Set cursor to specified character column of a text line
+  void setRowNative(byte line, byte column);
 
   // Initialize the display controller.
   void init(const DevType* dev);
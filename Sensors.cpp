@@ -27,22 +27,27 @@ or be allowed to float HIGH if use of the Arduino Pin's internal pull-up resisto
 To ensure proper voltage levels, some part of the Sensor circuitry
 MUST be tied back to the same ground as used by the Arduino.
 
-The Sensor code below utilizes exponential smoothing to "de-bounce" spikes generated by
-mechanical switches and transistors.  This avoids the need to create smoothing circuitry
-for each sensor.  You may need to change these parameters through trial and error for your specific sensors.
+The Sensor code below scans all sensor pins every few milliseconds, reading a whole input port
+at a time where the processor allows, and only reports a change once it has been seen on several
+scans in a row. This "de-bounces" spikes generated by mechanical switches and transistors
+and avoids the need to create smoothing circuitry for each sensor. As all sensors are scanned together
+the time to report a change does not depend on how many sensors are defined.
 
 To have this sketch monitor one or more Arduino pins for sensor triggers, first define/edit/delete
 sensor definitions using the following variation of the "S" command:
 
-  <S ID PIN PULLUP>:           creates a new sensor ID, with specified PIN and PULLUP
+  <S ID PIN PULLUP [DEBOUNCE]>: creates a new sensor ID, with specified PIN and PULLUP
                                if sensor ID already exists, it is updated with specificed PIN and PULLUP
+                               DEBOUNCE is the time in ms (0-30000, default 0) a change must last
+                               before it is reported
                                returns: <O> if successful and <X> if unsuccessful (e.g. out of memory)
 
   <S ID>:                      deletes definition of sensor ID
                                returns: <O> if successful and <X> if unsuccessful (e.g. ID does not exist)
 
   <S>:                         lists all defined sensors
-                               returns: <Q ID PIN PULLUP> for each defined sensor or <X> if no sensors defined
+                               returns: <Q ID PIN PULLUP [DEBOUNCE]> for each defined sensor or <X> if no sensors defined
+                               (DEBOUNCE is only shown when not 0)
 
 where
 
@@ -63,49 +68,204 @@ If a Sensor Pin is found to have transitioned from one state to another, one of
 Depending on whether the physical sensor is acting as an "event-trigger" or a "detection-sensor," you may
 decide to ignore the <q ID> return and only react to <Q ID> triggers.
 
+All the changes found in one pass of the main loop are sent together. A client with many sensors may ask
+with <Q BITMAP ON> for them as <Qm FIRSTID HEX> lines instead, see Sensor::printChanges.
+
 **********************************************************************/
 
 #include "StringFormatter.h"
+#include "BoardProfile.h"
 #include "Sensors.h"
 #include "EEStore.h"
+#include "CommandDistributor.h"
 
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// checks one defined sensors and prints _changed_ sensor state
-// to stream unless stream is NULL in which case only internal
-// state is updated. Then advances to next sensor which will
-// be checked att next invocation.
+// Scans all defined sensors every SCAN_MS and broadcasts _changed_
+// sensor states. The pins of a port are debounced in parallel by 
+// vertical counters, one bit of each counter per pin, which count
+// the scans in a row where the pin disagrees with its debounced state.
+// The state only follows the pin after 4 scans so a spike is ignored,
+// then it has to stay that way for the sensor's debounce time.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-void Sensor::checkAll(Print *stream){
+void Sensor::checkAll(){
 
   if (firstSensor == NULL) return;
-  if (readingSensor == NULL) readingSensor=firstSensor;
+  if (anyChanged) CommandDistributor::broadcast(EVENT_SENSOR_SET, 0);  // queue was full
+  unsigned long now=millis();
+  if (now - lastScan < SCAN_MS) return;
+  lastScan=now;
+
+#if !defined(ARDUINO_ARCH_AVR)
+  for (byte p=0; p<portCount; p++) ports[p].sample=0;
+  for (Sensor * tt=firstSensor; tt!=NULL; tt=tt->nextSensor)
+    if (tt->port!=NO_PORT && digitalRead(tt->data.pin)) ports[tt->port].sample |= tt->mask;
+#endif
+
+  byte changed=0;
+  for (byte p=0; p<portCount; p++) {
+    SensorPort * sp=&ports[p];
+#if defined(ARDUINO_ARCH_AVR)
+    byte sample=*sp->reg;
+#else
+    byte sample=sp->sample;
+#endif
+    byte delta=(sample ^ sp->state) & sp->used;    // counting pins, others reset
+    sp->count1=(sp->count1 ^ sp->count0) & delta;
+    sp->count0=~sp->count0 & delta;
+    byte toggle=delta & ~(sp->count0 | sp->count1); // counter wrapped after 4 scans
+    sp->state ^= toggle;
+    changed |= toggle;
+  }
+  if (!changed && !anyPending) return;
+
+  // A change is only reported once it has lasted the sensor's debounce time,
+  // timed from millis so it does not depend on how busy the loop is.
+  anyPending=false;
+  for (Sensor * tt=firstSensor; tt!=NULL; tt=tt->nextSensor) {
+    if (tt->port==NO_PORT) continue;
+    bool active= (ports[tt->port].state & tt->mask)==0;  // active when pin is LOW
+    if (active==tt->active) {
+      tt->pending=false;  // changed back before debounce ended
+      continue;
+    }
+    if (!tt->pending) {
+      tt->pending=true;
+      tt->changeTime=(uint16_t)now;
+    }
+    if ((uint16_t)((uint16_t)now - tt->changeTime) < tt->data.debounce) {
+      anyPending=true;
+      continue;
+    }
+    tt->pending=false;
+    tt->report(active);
+  }
+} // Sensor::checkAll
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Adds a change to this loop's change set. A sensor that changes back
+// before the set has been sent is taken out of it and both changes are
+// queued on their own, so a client counting transitions still sees both.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void Sensor::report(bool newState){
+  if (changed) {
+    changed=false;
+    CommandDistributor::broadcast(EVENT_SENSOR, data.snum, active);
+    CommandDistributor::broadcast(EVENT_SENSOR, data.snum, newState);
+  }
+  else {
+    changed=true;
+    anyChanged=true;
+    CommandDistributor::broadcast(EVENT_SENSOR_SET, 0);
+  }
+  active=newState;
+}
 
-  bool sensorstate = digitalRead(readingSensor->data.pin);
+///////////////////////////////////////////////////////////////////////////////
+//
+// <Qm FIRSTID HEX> gives the states of sensors FIRSTID, FIRSTID+1, ... four 
+// to a hex digit, FIRSTID in bit 0 of the first digit, up to the last change
+// within BITMAP_IDS ids. Ids without a sensor read 0. A change further on 
+// starts another line.
+//
+///////////////////////////////////////////////////////////////////////////////
 
-  if (!sensorstate == readingSensor->active) { // active==true means sensorstate=0/false so sensor unchanged
-    // no change
-    if (readingSensor->latchdelay != 0) {
-      // enable if you want to debug contact jitter
-      //if (stream != NULL) StringFormatter::send(stream, F("JITTER %d %d\n"), 
-      //                                          readingSensor->latchdelay, readingSensor->data.snum);
-       readingSensor->latchdelay=0; // reset
+void Sensor::printChanges(Print *stream, bool bitmap){
+  char digits[BITMAP_IDS/4+1];
+  int firstId=0;
+  byte used=0;  // digits up to the last change, 0 when no line is open
+  for (Sensor * tt=firstSensor; tt!=NULL; tt=tt->nextSensor) {
+    int id=tt->data.snum;
+    if (!bitmap) {
+      if (tt->changed) StringFormatter::send(stream, F("<%c %d>\n"), tt->active ? 'Q' : 'q', id);
+      continue;
     }
-  } else if (readingSensor->latchdelay < 127) { // byte, max 255, good value unknown yet
-    // change but first increase anti-jitter counter
-    readingSensor->latchdelay++;
-  } else {
-    // make the change
-    readingSensor->active = !sensorstate;
-    readingSensor->latchdelay=0; // reset 
-    if (stream != NULL) StringFormatter::send(stream, F("<%c %d>\n"), readingSensor->active ? 'Q' : 'q', readingSensor->data.snum);
+    if (used && id-firstId >= BITMAP_IDS) {
+      printBitmap(stream, firstId, digits, used);
+      used=0;
+    }
+    if (!used) {
+      if (!tt->changed) continue;
+      firstId=id;
+      memset(digits, 0, sizeof(digits));
+    }
+    int offset=id-firstId;
+    if (tt->active) digits[offset/4] |= 1<<(offset%4);
+    if (tt->changed) used=offset/4+1;
   }
+  if (used) printBitmap(stream, firstId, digits, used);
+}
 
-  readingSensor=readingSensor->nextSensor;
-} // Sensor::checkAll
+void Sensor::printBitmap(Print * stream, int firstId, char * digits, byte used){
+  for (byte d=0; d<used; d++) digits[d]+= digits[d]<10 ? '0' : 'A'-10;
+  digits[used]='\0';
+  StringFormatter::send(stream, F("<Qm %d %s>\n"), firstId, digits);
+}
+
+void Sensor::clearChanges(){
+  if (!anyChanged) return;
+  for (Sensor * tt=firstSensor; tt!=NULL; tt=tt->nextSensor) tt->changed=false;
+  anyChanged=false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// finds or adds the port and bit for this sensor's pin
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void Sensor::assignPort(){
+  port=NO_PORT;
+  byte p;
+#if defined(ARDUINO_ARCH_AVR)
+  if (data.pin >= NUM_DIGITAL_PINS) return;      // e.g. LCN sensors
+  uint8_t hwPort=digitalPinToPort(data.pin);
+  if (hwPort==NOT_A_PIN) return;  
+  volatile uint8_t * reg=portInputRegister(hwPort);
+  mask=digitalPinToBitMask(data.pin);
+  for (p=0; p<portCount && ports[p].reg!=reg; p++);
+#else
+  if (data.pin >= NUM_DIGITAL_PINS) return;      // e.g. LCN sensors
+  for (p=0; p<portCount && ports[p].used==0xFF; p++);
+#endif
+  if (p==portCount) {
+    SensorPort * grown=(SensorPort *)realloc(ports, (portCount+1)*sizeof(SensorPort));
+    if (grown==NULL) return;  // sensor will not be scanned
+    ports=grown;
+    memset(&ports[p], 0, sizeof(SensorPort));
+#if defined(ARDUINO_ARCH_AVR)
+    ports[p].reg=reg;
+#endif
+    portCount++;
+  }
+#if !defined(ARDUINO_ARCH_AVR)
+  for (mask=1; ports[p].used & mask; mask<<=1);
+#endif
+  SensorPort * sp=&ports[p];
+  if (!(sp->used & mask)) {
+    // start as HIGH (not active) with the counter clear
+    sp->used |= mask;
+    sp->state |= mask;
+    sp->count0 &= ~mask;
+    sp->count1 &= ~mask;
+  }
+  port=p;
+}
+
+// stop scanning the pin unless another sensor is on it too
+void Sensor::releasePort(){
+  if (port==NO_PORT) return;
+  for (Sensor * tt=firstSensor; tt!=NULL; tt=tt->nextSensor)
+    if (tt!=this && tt->port==port && tt->mask==mask) return;
+  ports[port].used &= ~mask;
+  port=NO_PORT;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -123,29 +283,36 @@ void Sensor::printAll(Print *stream){
 
 ///////////////////////////////////////////////////////////////////////////////
 
-Sensor *Sensor::create(int snum, int pin, int pullUp){
-  Sensor *tt;
-
-  if(firstSensor==NULL){
-    firstSensor=(Sensor *)calloc(1,sizeof(Sensor));
-    tt=firstSensor;
-  } else if((tt=get(snum))==NULL){
-    tt=firstSensor;
-    while(tt->nextSensor!=NULL)
-      tt=tt->nextSensor;
-    tt->nextSensor=(Sensor *)calloc(1,sizeof(Sensor));
-    tt=tt->nextSensor;
+Sensor *Sensor::create(int snum, int pin, int pullUp, int debounce){
+  if (debounce<0 || (unsigned int)debounce>MAX_DEBOUNCE) return NULL;
+  int pos=byId.find(snum);
+  Sensor *tt=byId.at(pos);
+
+  if(tt==NULL || tt->data.snum!=snum){
+    tt=pool.allocate();
+    if(tt==NULL) return tt;       // problem allocating memory
+    if(!byId.insert(pos,tt)){
+      pool.release(tt);
+      return NULL;
+    }
+    // link in after the next lower id
+    tt->nextSensor=byId.at(pos+1);
+    if(pos==0) firstSensor=tt;
+    else byId.at(pos-1)->nextSensor=tt;
+    tt->port=NO_PORT;
   }
-
-  if(tt==NULL) return tt;       // problem allocating memory
+  else tt->releasePort();  // pin may be changing
 
   tt->data.snum=snum;
   tt->data.pin=pin;
   tt->data.pullUp=(pullUp==0?LOW:HIGH);
+  tt->data.debounce=debounce;
   tt->active=false;
-  tt->latchdelay=0;
+  tt->pending=false;
+  tt->changed=false;
   pinMode(pin,INPUT);         // set mode to input
   digitalWrite(pin,pullUp);   // don't use Arduino's internal pull-up resistors for external infrared sensors --- each sensor must have its own 1K external pull-up resistor
+  tt->assignPort();
 
   return tt;
 
@@ -154,40 +321,58 @@ Sensor *Sensor::create(int snum, int pin, int pullUp){
 ///////////////////////////////////////////////////////////////////////////////
 
 Sensor* Sensor::get(int n){
-  Sensor *tt;
-  for(tt=firstSensor;tt!=NULL && tt->data.snum!=n;tt=tt->nextSensor);
-  return tt ;
+  return byId.get(n);
 }
 ///////////////////////////////////////////////////////////////////////////////
 
 bool Sensor::remove(int n){
-  Sensor *tt,*pp=NULL;
-
-  for(tt=firstSensor;tt!=NULL && tt->data.snum!=n;pp=tt,tt=tt->nextSensor);
+  int pos=byId.find(n);
+  Sensor *tt=byId.at(pos);
 
-  if (tt==NULL)  return false;
+  if (tt==NULL || tt->data.snum!=n)  return false;
   
-  if(tt==firstSensor)
+  if(pos==0)
     firstSensor=tt->nextSensor;
   else
-    pp->nextSensor=tt->nextSensor;
+    byId.at(pos-1)->nextSensor=tt->nextSensor;
 
-  if (readingSensor==tt) readingSensor=tt->nextSensor;
-  free(tt);
+  tt->releasePort();
+  byId.removeAt(pos);
+  pool.release(tt);
 
   return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// SensorData as stored in the "DCC++" EEPROM layout, before the debounce time
+struct SensorDataDCCPP {
+  int snum;
+  uint8_t pin;
+  uint8_t pullUp;
+};
+
 void Sensor::load(){
   struct SensorData data;
-  Sensor *tt;
 
+  // stored in id order so each one is added to the end of the index
+  byId.reserve(EEStore::eeStore->data.nSensors);
+  pool.reserve(EEStore::eeStore->data.nSensors);
   for(int i=0;i<EEStore::eeStore->data.nSensors;i++){
-    EEPROM.get(EEStore::pointer(),data);
-    tt=create(data.snum,data.pin,data.pullUp);
-    EEStore::advance(sizeof(tt->data));
+    if (EEStore::layout==EEStore::LAYOUT_DCCPP) {
+      struct SensorDataDCCPP old;
+      EEPROM.get(EEStore::pointer(),old);
+      EEStore::advance(sizeof(old));
+      data.snum=old.snum;
+      data.pin=old.pin;
+      data.pullUp=old.pullUp;
+      data.debounce=0;
+    }
+    else {
+      EEPROM.get(EEStore::pointer(),data);
+      EEStore::advance(sizeof(data));
+    }
+    create(data.snum,data.pin,data.pullUp,data.debounce);
   }
 }
 
@@ -210,4 +395,14 @@ void Sensor::store(){
 ///////////////////////////////////////////////////////////////////////////////
 
 Sensor *Sensor::firstSensor=NULL;
-Sensor *Sensor::readingSensor=NULL;
+Sensor::SensorPort * Sensor::ports=NULL;
+byte Sensor::portCount=0;
+unsigned long Sensor::lastScan=0;
+bool Sensor::anyPending=false;
+bool Sensor::anyChanged=false;
+IdIndex<Sensor> Sensor::byId;
+Pool<Sensor> Sensor::pool(SENSOR_POOL);
+
+void Sensor::showPool(Print * stream) {
+  pool.show(stream, F("Sensor"));
+}
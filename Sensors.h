@@ -20,6 +20,8 @@
 #define Sensor_h
 
 #include "Arduino.h"
+#include "IdIndex.h"
+#include "Pool.h"
 
 #define  SENSOR_DECAY  0.03
 
@@ -27,22 +29,62 @@ struct SensorData {
   int snum;
   uint8_t pin;
   uint8_t pullUp;
+  uint16_t debounce;  // ms a change must last before it is reported
 };
 
 struct Sensor{
   static Sensor *firstSensor;
-  static Sensor *readingSensor;
   SensorData data;
   boolean active;
-  byte latchdelay;
+  boolean pending;  // pin has changed, waiting for debounce 
+  boolean changed;  // in the change set not yet sent to the clients
+  uint16_t changeTime; // low bits of millis when pending started
+  byte port;        // index into ports, or NO_PORT if the pin can not be scanned
+  byte mask;        // bit of this pin in the port
   Sensor *nextSensor;
   static void load();
   static void store();
-  static Sensor *create(int, int, int);
+  static Sensor *create(int snum, int pin, int pullUp, int debounce=0);
   static Sensor* get(int);  
   static bool remove(int);  
-  static void checkAll(Print *);
+  static void checkAll();
   static void printAll(Print *);
+  void report(bool newState);  // debounced change, from checkAll or LCN
+  // Each loop's changes go to every client in one EVENT_SENSOR_SET, as 
+  // <Q id>/<q id> lines or, for clients that asked with <Q BITMAP ON>, 
+  // as <Qm FIRSTID HEX> lines of up to BITMAP_IDS ids each.
+  static void printChanges(Print * stream, bool bitmap);
+  static void clearChanges();
+  static void showPool(Print *);
+  int getId() { return data.snum; }
+  static const byte NO_PORT=0xFF;
+  static const byte SCAN_MS=2;   // time between port scans, spikes are filtered over 4 scans 
+  static const uint16_t MAX_DEBOUNCE=30000;
+  static const byte BITMAP_IDS=128;
+private:
+  // 8 sensor pins scanned and debounced together. On AVR this is a hardware 
+  // input port, elsewhere the pins are read one by one into a virtual port.
+  struct SensorPort {
+#if defined(ARDUINO_ARCH_AVR)
+    volatile uint8_t * reg;
+#else
+    uint8_t sample;
+#endif
+    uint8_t used;     // bits with a sensor on them
+    uint8_t state;    // debounced pin levels
+    uint8_t count0;   // vertical 2 bit counter per pin of
+    uint8_t count1;   //   scans disagreeing with state
+  };
+  static SensorPort * ports;
+  static byte portCount;
+  static unsigned long lastScan;
+  static bool anyPending;
+  static bool anyChanged;
+  static void printBitmap(Print * stream, int firstId, char * digits, byte used);
+  void assignPort();
+  void releasePort();
+  static IdIndex<Sensor> byId; // same order as the firstSensor list
+  static Pool<Sensor> pool;
 }; // Sensor
 
 #endif
@@ -35,6 +35,7 @@ bool Diag::WIFI=false;
 bool Diag::WITHROTTLE=false;
 bool Diag::ETHERNET=false;
 bool Diag::LCN=false;
+bool Diag::RECORD=false;
 
  
 void StringFormatter::diag( const FSH* input...) {
@@ -73,15 +74,40 @@ void StringFormatter::send(Print & stream, const FSH* input...) {
   send2(&stream,input,args);
 }
 
-void StringFormatter::send2(Print * stream,const FSH* format, va_list args) {
+// Collects the output of one send on the stack so that the stream gets a
+// few write(buffer,length) calls instead of a virtual write per character.
+class FormatBuffer : public Print {
+  public:
+    FormatBuffer(Print * target) : stream(target), length(0) {}
+    ~FormatBuffer() { emit(); }
+    size_t write(uint8_t b) override {
+      if (length==sizeof(buffer)) emit();
+      buffer[length++]=b;
+      return 1;
+    }
+    using Print::write;
+    void emit() {
+      if (length) stream->write(buffer,length);
+      length=0;
+    }
+  private:
+    Print * stream;
+    byte length;
+    uint8_t buffer[32];
+};
+
+void StringFormatter::send2(Print * target,const FSH* format, va_list args) {
     
   // thanks to Jan Turoň  https://arduino.stackexchange.com/questions/56517/formatting-strings-in-arduino-for-output
 
+  if (!target) return;
+  FormatBuffer buffer(target);
+  Print * stream=&buffer;
   char* flash=(char*)format;
   for(int i=0; ; ++i) {
     char c=GETFLASH(flash+i);
-    if (c=='\0') return;
-    if(c!='%') { stream->print(c); continue; }
+    if (c=='\0') break;
+    if(c!='%') { stream->write(c); continue; }
 
     bool formatContinues=false;
     byte formatWidth=0;
@@ -92,8 +118,8 @@ void StringFormatter::send2(Print * stream,const FSH* format, va_list args) {
     i++;
     c=GETFLASH(flash+i);
     switch(c) {
-      case '%': stream->print('%'); break;
-      case 'c': stream->print((char) va_arg(args, int)); break;
+      case '%': stream->write('%'); break;
+      case 'c': stream->write((char) va_arg(args, int)); break;
       case 's': stream->print(va_arg(args, char*)); break;
       case 'e': printEscapes(stream,va_arg(args, char*)); break;
       case 'E': printEscapes(stream,(const FSH*)va_arg(args, char*)); break;
@@ -165,25 +191,25 @@ void StringFormatter::printEscape(Print * stream, char c) {
  }
 
  
+// Decimal digits are made here rather than by Print, which divides a long
+// for every digit whatever the value and writes them one at a time.
 void StringFormatter::printPadded(Print* stream, long value, byte width, bool formatLeft) {
-  if (width==0) {
-    stream->print(value, DEC);
-    return;
-  }
-  
-    int digits=(value <= 0)? 1: 0;  // zero and negative need extra digot
-    long v=value;
-    while (v) {
-        v /= 10;
-        digits++;
-    }
+    char text[12];  // sign and 10 digits, built backwards from the end
+    byte start=sizeof(text);
+    unsigned long v= (value<0) ? 0UL-(unsigned long)value : (unsigned long)value;
+    do {
+      text[--start]='0' + v % 10;
+      v /= 10;
+    } while (v);
+    if (value<0) text[--start]='-';
+    byte digits=sizeof(text)-start;
     
-    if (formatLeft) stream->print(value, DEC);
+    if (formatLeft) stream->write((uint8_t*)text+start, digits);
     while(digits<width) {
-      stream->print(' ');
+      stream->write(' ');
       digits++;
     }
-    if (!formatLeft) stream->print(value, DEC);    
+    if (!formatLeft) stream->write((uint8_t*)text+start, sizeof(text)-start);    
   }
 
  
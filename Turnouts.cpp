@@ -21,7 +21,13 @@
 #include "Turnouts.h"
 #include "EEStore.h"
 #include "PWMServoDriver.h"
+
+// How servo turnouts move, may be set in config.h (SERVO_INSTANT jumps straight there)
+#ifndef SERVO_TURNOUT_PROFILE
+#define SERVO_TURNOUT_PROFILE SERVO_FAST
+#endif
 #include "StringFormatter.h"
+#include "CommandDistributor.h"
 #ifdef EESTOREDEBUG
 #include "DIAG.h"
 #endif
@@ -39,10 +45,56 @@ bool Turnout::activate(int n,bool state){
   Turnout * tt=get(n);
   if (tt==NULL) return false;
   tt->activate(state);
-  turnoutlistHash++;
+  // A servo that is still moving tells the clients when it gets there
+  if ((tt->data.tStatus & STATUS_PWM) && PWMServoDriver::isMoving(tt->data.tStatus & STATUS_PWMPIN))
+    rememberOrigin(n);
+  else
+    CommandDistributor::broadcast(EVENT_TURNOUT, n, isActive(n));
   return true;
 }
 
+// The client that last changed each servo turnout still on its way. It had
+// its reply then, so it is left out when the servo gets there.
+struct SERVO_ORIGIN {
+  int id;
+  Print * stream;  // NULL when free
+  byte clientId;
+};
+static SERVO_ORIGIN servoOrigins[PWMServoDriver::MAX_MOVES];
+
+static SERVO_ORIGIN * findOrigin(int n) {
+  for (byte s=0; s<PWMServoDriver::MAX_MOVES; s++)
+    if (servoOrigins[s].stream && servoOrigins[s].id==n) return &servoOrigins[s];
+  return NULL;
+}
+
+void Turnout::rememberOrigin(int n) {
+  SERVO_ORIGIN * o=findOrigin(n);
+  Print * stream;
+  byte clientId;
+  if (!CommandDistributor::getOrigin(stream, clientId)) {
+    if (o) o->stream=NULL;  // everyone is told this time
+    return;
+  }
+  for (byte s=0; s<PWMServoDriver::MAX_MOVES && !o; s++)
+    if (!servoOrigins[s].stream) o=&servoOrigins[s];
+  if (!o) return;
+  o->id=n;
+  o->stream=stream;
+  o->clientId=clientId;
+}
+
+void Turnout::servoMoved(int n) {
+  SERVO_ORIGIN * o=findOrigin(n);
+  if (!o) {
+    CommandDistributor::broadcast(EVENT_TURNOUT, n, isActive(n));
+    return;
+  }
+  Print * stream=o->stream;
+  o->stream=NULL;
+  CommandDistributor::broadcastFrom(stream, o->clientId, EVENT_TURNOUT, n, isActive(n));
+}
+
 bool Turnout::isActive(int n){
   Turnout * tt=get(n);
   if (tt==NULL) return false;
@@ -64,36 +116,41 @@ void Turnout::activate(bool state) {
   else
     data.tStatus &= ~STATUS_ACTIVE;
   if (data.tStatus & STATUS_PWM)
-    PWMServoDriver::setServo(data.tStatus & STATUS_PWMPIN, (data.inactiveAngle+(state?data.moveAngle:0)));
+    PWMServoDriver::moveServo(data.tStatus & STATUS_PWMPIN, data.inactiveAngle+(state?0:data.moveAngle),
+                              data.inactiveAngle+(state?data.moveAngle:0), SERVO_TURNOUT_PROFILE, data.id, servoMoved);
   else
     DCC::setAccessory(data.address,data.subAddress, state);
-  // Save state if stored in EEPROM
+  // Save state if stored in EEPROM, written later so as not to hold up the loop
   if (EEStore::eeStore->data.nTurnouts > 0 && num > 0) 
-    EEPROM.put(num, data.tStatus);
+    EEStore::writeState(num, data.tStatus);
 }
 ///////////////////////////////////////////////////////////////////////////////
 
 Turnout* Turnout::get(int n){
-  Turnout *tt;
-  for(tt=firstTurnout;tt!=NULL && tt->data.id!=n;tt=tt->nextTurnout);
-  return(tt);
+  return byId.get(n);
+}
+
+// First turnout with an id of at least n, so that a list can be sent in parts
+Turnout* Turnout::getFrom(int n){
+  return byId.at(byId.find(n));
 }
 ///////////////////////////////////////////////////////////////////////////////
 
 bool Turnout::remove(int n){
-  Turnout *tt,*pp=NULL;
+  int pos=byId.find(n);
+  Turnout *tt=byId.at(pos);
 
-  for(tt=firstTurnout;tt!=NULL && tt->data.id!=n;pp=tt,tt=tt->nextTurnout);
-
-  if(tt==NULL) return false;
+  if(tt==NULL || tt->data.id!=n) return false;
   
-  if(tt==firstTurnout)
+  if(pos==0)
     firstTurnout=tt->nextTurnout;
   else
-    pp->nextTurnout=tt->nextTurnout;
+    byId.at(pos-1)->nextTurnout=tt->nextTurnout;
 
-  free(tt);
+  byId.removeAt(pos);
+  pool.release(tt);
   turnoutlistHash++;
+  CommandDistributor::broadcast(EVENT_TURNOUT_LIST, 0);
   return true; 
 }
 
@@ -103,10 +160,14 @@ void Turnout::load(){
   struct TurnoutData data;
   Turnout *tt;
 
+  // stored in id order so each one is added to the end of the index
+  byId.reserve(EEStore::eeStore->data.nTurnouts);
+  pool.reserve(EEStore::eeStore->data.nTurnouts);
   for(int i=0;i<EEStore::eeStore->data.nTurnouts;i++){
     EEPROM.get(EEStore::pointer(),data);
     if (data.tStatus & STATUS_PWM) tt=create(data.id,data.tStatus & STATUS_PWMPIN, data.inactiveAngle,data.moveAngle);
     else tt=create(data.id,data.address,data.subAddress);
+    if (tt==NULL) break; // out of memory
     tt->data.tStatus=data.tStatus;
     tt->num=EEStore::pointer()+offsetof(TurnoutData,tStatus); // Save pointer to status byte within EEPROM
     EEStore::advance(sizeof(tt->data));
@@ -136,10 +197,37 @@ void Turnout::store(){
   }
 
 }
+///////////////////////////////////////////////////////////////////////////////
+// Compacting the EEStore journal: from position pos of the index on, write
+// the first state that differs from its tStatus cell. Returns the position
+// to carry on from, -1 when all the cells are up to date. 
+
+int Turnout::storeStateFrom(int pos){
+  for (Turnout *tt=byId.at(pos); tt!=NULL; tt=byId.at(++pos)) {
+    if (tt->num > 0 && EEPROM.read(tt->num)!=tt->data.tStatus) {
+      EEPROM.write(tt->num, tt->data.tStatus);
+      return pos+1;
+    }
+  }
+  return -1;
+}
+
+// Apply a state from the EEStore journal, false if address is not a turnout
+bool Turnout::restoreState(int address, byte value){
+  for (Turnout *tt=firstTurnout; tt!=NULL; tt=tt->nextTurnout) {
+    if (tt->num == address) {
+      tt->data.tStatus=value;
+      return true;
+    }
+  }
+  return false;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 Turnout *Turnout::create(int id, int add, int subAdd){
   Turnout *tt=create(id);
+  if (tt==NULL) return tt;
   tt->data.address=add;
   tt->data.subAddress=subAdd;
   tt->data.tStatus=0;
@@ -148,6 +236,7 @@ Turnout *Turnout::create(int id, int add, int subAdd){
 
 Turnout *Turnout::create(int id, byte pin, int activeAngle, int inactiveAngle){
   Turnout *tt=create(id);
+  if (tt==NULL) return tt;
   tt->data.tStatus= STATUS_PWM | (pin &  STATUS_PWMPIN);
   tt->data.inactiveAngle=inactiveAngle;
   tt->data.moveAngle=activeAngle-inactiveAngle;
@@ -155,14 +244,23 @@ Turnout *Turnout::create(int id, byte pin, int activeAngle, int inactiveAngle){
 }
 
 Turnout *Turnout::create(int id){
-  Turnout *tt=get(id);
-  if (tt==NULL) { 
-     tt=(Turnout *)calloc(1,sizeof(Turnout));
-     tt->nextTurnout=firstTurnout;
-     firstTurnout=tt;
+  int pos=byId.find(id);
+  Turnout *tt=byId.at(pos);
+  if (tt==NULL || tt->data.id!=id) { 
+     tt=pool.allocate();
+     if (tt==NULL) return tt;
+     if (!byId.insert(pos,tt)) {
+       pool.release(tt);
+       return NULL;
+     }
+     // link in after the next lower id
+     tt->nextTurnout=byId.at(pos+1);
+     if (pos==0) firstTurnout=tt;
+     else byId.at(pos-1)->nextTurnout=tt;
      tt->data.id=id;
     }
   turnoutlistHash++;
+  CommandDistributor::broadcast(EVENT_TURNOUT_LIST, 0);
   return tt;
   }
 
@@ -180,4 +278,10 @@ void Turnout::print(Turnout *tt) {
 #endif
 
 Turnout *Turnout::firstTurnout=NULL;
+IdIndex<Turnout> Turnout::byId;
+Pool<Turnout> Turnout::pool(TURNOUT_POOL);
+
+void Turnout::showPool(Print * stream) {
+  pool.show(stream, F("Turnout"));
+}
 int Turnout::turnoutlistHash=0; //bump on every change so clients know when to refresh their lists
@@ -22,6 +22,8 @@
 #include <Arduino.h>
 #include "DCC.h"
 #include "LCN.h"
+#include "IdIndex.h"
+#include "Pool.h"
 
 const byte STATUS_ACTIVE=0x80; // Flag as activated
 const byte STATUS_PWM=0x40; // Flag as a PWM turnout
@@ -42,19 +44,28 @@ class Turnout {
   Turnout *nextTurnout;
   static  bool activate(int n, bool state);
   static Turnout* get(int);
+  static Turnout* getFrom(int);
   static bool remove(int);
   static bool isActive(int);
   static void load();
   static void store();
+  static int storeStateFrom(int pos);
+  static bool restoreState(int address, byte value);
   static Turnout *create(int id , int address , int subAddress);
   static Turnout *create(int id , byte pin , int activeAngle, int inactiveAngle);
   static Turnout *create(int id);
   void activate(bool state);
+  int getId() { return data.id; }
   static void printAll(Print *);
+  static void showPool(Print *);
 #ifdef EESTOREDEBUG
   void print(Turnout *tt);
 #endif
 private:
+  static void servoMoved(int id);
+  static void rememberOrigin(int id);
+  static IdIndex<Turnout> byId; // same order as the firstTurnout list
+  static Pool<Turnout> pool;
   int num;  // EEPROM address of tStatus in TurnoutData struct, or zero if not stored.
 }; // Turnout
   
@@ -0,0 +1,93 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "Watchdog.h"
+#include "Profiler.h"
+#include "freeMemory.h"
+#include "DIAG.h"
+
+#if defined(ARDUINO_ARCH_AVR) && defined(WDTCSR) && !defined(DISABLE_WATCHDOG)
+#include <avr/wdt.h>
+
+// Survives the watchdog reset, but not a power cycle
+static Watchdog::StallRecord stallRecord __attribute__((section(".noinit")));
+
+volatile unsigned long Watchdog::lastKick=0;
+bool Watchdog::held=false;
+
+// The watchdog stays enabled at its shortest timeout after it resets the
+// board, so turn it off before setup() gets as far as its long waits.
+void watchdogOff(void) __attribute__((naked, used, section(".init3")));
+void watchdogOff(void) {
+  MCUSR=0;
+  wdt_disable();
+}
+
+void Watchdog::begin() {
+  if (stallRecord.magic==STALL_MAGIC) {
+    DIAG(F("Loop stalled %lms after %S at uptime %lms, free memory %d, stalls %d"),
+      stallRecord.stalledMillis, Profiler::sectionName(stallRecord.section),
+      stallRecord.uptime, stallRecord.freeMemory, stallRecord.stalls);
+    stallRecord.magic=0;  // reported, but keep the count
+  }
+  else stallRecord.stalls=0;  // garbage after power up
+  arm();
+}
+
+void Watchdog::arm() {
+  byte timeout= LOOP_STALL_MS<=1000 ? WDTO_1S : LOOP_STALL_MS<=2000 ? WDTO_2S
+              : LOOP_STALL_MS<=4000 ? WDTO_4S : WDTO_8S;
+  lastKick=millis();
+  noInterrupts();
+  wdt_reset();
+  // Interrupt and reset mode: the first timeout runs the interrupt, which
+  // saves the record, and the reset follows even if it can't run
+  WDTCSR=_BV(WDCE) | _BV(WDE);
+  WDTCSR=_BV(WDIE) | _BV(WDE) | (timeout & 0x07) | ((timeout & 0x08) ? _BV(WDP3) : 0);
+  interrupts();
+  held=false;
+}
+
+void Watchdog::kick() {
+  if (held) {
+    arm();
+    return;
+  }
+  wdt_reset();
+  lastKick=millis();
+}
+
+void Watchdog::hold() {
+  if (held) return;
+  wdt_disable();
+  held=true;
+}
+
+ISR(WDT_vect) {
+  stallRecord.section=Profiler::lastSection;
+  stallRecord.stalledMillis=millis()-Watchdog::lastKick;
+  stallRecord.uptime=millis();
+  stallRecord.freeMemory=minimumFreeMemory();
+  stallRecord.stalls++;
+  stallRecord.magic=Watchdog::STALL_MAGIC;
+  wdt_enable(WDTO_15MS);
+}
+
+#else
+void Watchdog::begin() {}
+#endif
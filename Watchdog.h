@@ -0,0 +1,69 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Watchdog_h
+#define Watchdog_h
+#if __has_include ( "config.h")
+  #include "config.h"
+#else
+  #warning config.h not found. Using defaults from config.example.h 
+  #include "config.example.h"
+#endif
+#include <Arduino.h>
+
+// Main loop stall watchdog, AVR only. loop() calls kick() once per pass.
+// If a pass takes longer than LOOP_STALL_MS the watchdog interrupt saves
+// the last profiler section marked, how long the loop had been stuck and
+// the uptime in RAM the C runtime leaves alone, then lets the watchdog
+// reset the board. The board restarts with the track off, as after power
+// up, rather than repeating the last packets with nothing in control.
+// begin() reports a record left by the previous run through DIAG.
+// Library calls that can block for longer than LOOP_STALL_MS and cannot
+// kick from inside (Ethernet.begin, Ethernet.maintain) call hold() first
+// and kick() as soon as they return, which arms the watchdog again.
+// Define DISABLE_WATCHDOG in config.h to compile it out.
+
+#ifndef LOOP_STALL_MS
+#define LOOP_STALL_MS 2000
+#endif
+
+class Watchdog {
+  public:
+    static void begin();
+#if defined(ARDUINO_ARCH_AVR) && defined(WDTCSR) && !defined(DISABLE_WATCHDOG)
+    static void kick();
+    static void hold();
+    struct StallRecord {
+      uint16_t magic;
+      byte section;                // last section marked, PROFILE_SECTIONS if none
+      unsigned long stalledMillis; // since the last kick
+      unsigned long uptime;
+      int freeMemory;              // lowest free RAM seen
+      uint16_t stalls;             // since power up
+    };
+    static const uint16_t STALL_MAGIC=0x57A1;
+    static volatile unsigned long lastKick;
+  private:
+    static void arm();
+    static bool held;
+#else
+    static inline void kick() {}
+    static inline void hold() {}
+#endif
+};
+#endif
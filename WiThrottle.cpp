@@ -31,15 +31,13 @@
  *  Some shortcuts have been taken and there are some things that are yet to be included:
  *  e.g. Full response to adding a loco.
  *  What to do about unknown turnouts.
- *  Broadcasting to other WiThrottles when things change.  
- *    -  Bear in mind that changes may have taken place due to  
- *      other WiThrottles, OR JMRI commands received OR TPL automation. 
- *    - I suggest that at the end of parse(), then anything that has changed and is of interest could  
- *       be notified then.  (e.g loco speeds, directions or functions, turnout states.
+ *  Changes made by other WiThrottles, JMRI commands or TPL automation (loco speeds, directions
+ *    or functions, turnout and power states) are pushed to each client by the CommandDistributor.
  *       
- *  WiThrottle.h sets the max locos per client at 10, this is ok to increase but requires just an extra 3 bytes per loco per client.      
+ *  WITHROTTLE_LOCOS in BoardProfile.h sets the max locos per client, this is ok to increase but requires just an extra 3 bytes per loco per client.
 */
 #include <Arduino.h>
+#include "BoardProfile.h"
 #include "WiThrottle.h"
 #include "DCC.h"
 #include "DCCWaveform.h"
@@ -52,51 +50,128 @@
 #define LOOPLOCOS(THROTTLECHAR, CAB)  for (int loco=0;loco<MAX_MY_LOCO;loco++) \
       if ((myLocos[loco].throttle==THROTTLECHAR || '*'==THROTTLECHAR) && (CAB<0 || myLocos[loco].cab==CAB))
 
-WiThrottle * WiThrottle::firstThrottle=NULL;
+WiThrottle * WiThrottle::clients[MAX_CLIENTS];
+WiThrottle::LOCO_OWNERS WiThrottle::owners[OWNER_INDEX_SIZE];
+byte WiThrottle::ownerCount=0;
+bool WiThrottle::ownersOverflow=false;
 bool WiThrottle::annotateLeftRight=false;
+unsigned long WiThrottle::nextHeartbeatCheck=0;
+bool WiThrottle::turnoutListWork=false;
 
+Pool<WiThrottle> WiThrottle::pool(WITHROTTLE_POOL);
+
+void * WiThrottle::operator new(size_t size) noexcept {
+  (void)size;  // always sizeof(WiThrottle)
+  return pool.allocate();
+}
+
+void WiThrottle::operator delete(void * p) {
+  pool.release((WiThrottle *)p);
+}
+
+void WiThrottle::showPool(Print * stream) {
+  pool.show(stream, F("WiThrottle"));
+}
+
+// NULL if there is no room for another client
 WiThrottle* WiThrottle::getThrottle( int wifiClient) {
-  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle)  
-     if (wt->clientid==wifiClient) return wt; 
+  if (wifiClient<0 || wifiClient>=MAX_CLIENTS) return NULL;
+  if (clients[wifiClient]) return clients[wifiClient]; 
   return new WiThrottle( wifiClient);
 }
 
 bool WiThrottle::isThrottleInUse(int cab) {
-  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle)  
-     if (wt->areYouUsingThrottle(cab)) return true;
-  return false;
+  return getOwners(cab)!=0;
 }
 
 bool WiThrottle::areYouUsingThrottle(int cab) {
+  if (!ownersOverflow) return (getOwners(cab) & (1<<clientid))!=0;
   LOOPLOCOS('*', cab) { // see if I have this cab in use
       return true;
   }
   return false;
 }
+
+// The owners entry for cab, or the empty one where it belongs.
+// There is always an empty entry so this terminates.
+int WiThrottle::ownerPosition(int cab) {
+  const int mask=OWNER_INDEX_SIZE-1;
+  int pos=cab & mask;
+  while (owners[pos].cab!=0 && owners[pos].cab!=cab) pos=(pos+1) & mask;
+  return pos;
+}
+
+// Clients holding cab, as bits by client id. When the table has 
+// overflowed this is every client, for them to check themselves.
+uint16_t WiThrottle::getOwners(int cab) {
+  if (ownersOverflow) {
+    uint16_t all=0;
+    for (byte c=0; c<MAX_CLIENTS; c++) if (clients[c] && clients[c]->areYouUsingThrottle(cab)) all |= 1<<c;
+    return all;
+  }
+  return owners[ownerPosition(cab)].clients;
+}
+
+void WiThrottle::addOwner(int cab) {
+  if (ownersOverflow) return;
+  int pos=ownerPosition(cab);
+  if (owners[pos].cab==0) {
+    if (ownerCount>=OWNER_INDEX_SIZE-1) {  // keep one empty entry
+      ownersOverflow=true;
+      return;
+    }
+    owners[pos].cab=cab;
+    ownerCount++;
+  }
+  owners[pos].clients |= 1<<clientid;
+}
+
+// Called when a throttle letter lets go of cab, the client may still hold it on another
+void WiThrottle::dropOwner(int cab) {
+  if (ownersOverflow) return;
+  LOOPLOCOS('*', cab) { 
+     return; 
+  }
+  const int mask=OWNER_INDEX_SIZE-1;
+  int pos=ownerPosition(cab);
+  if (owners[pos].cab==0) return;
+  owners[pos].clients &= ~(1<<clientid);
+  if (owners[pos].clients) return;
+  // Close the gap by shifting back any entries that probed past it, as DCC::removeLoco
+  ownerCount--;
+  int gap=pos;
+  for (int next=(gap+1) & mask; owners[next].cab!=0; next=(next+1) & mask) {
+    int home=owners[next].cab & mask;
+    if (((next-home) & mask) >= ((next-gap) & mask)) {
+      owners[gap]=owners[next];
+      gap=next;
+    }
+  }
+  owners[gap].cab=0;
+  owners[gap].clients=0;
+}
  // One instance of WiThrottle per connected client, so we know what the locos are 
  
 WiThrottle::WiThrottle( int wificlientid) {
    if (Diag::WITHROTTLE) DIAG(F("%l Creating new WiThrottle for client %d"),millis(),wificlientid); 
-   nextThrottle=firstThrottle;
-   firstThrottle= this;
+   clients[wificlientid]=this;
    clientid=wificlientid;
    initSent=false; // prevent sending heartbeats before connection completed
    heartBeatEnable=false; // until client turns it on
    turnoutListHash = -1;  // make sure turnout list is sent once
+   listNext = -1;
+   listStream = NULL;
+   deferredCount = 0;
    for (int loco=0;loco<MAX_MY_LOCO; loco++) myLocos[loco].throttle='\0';
 }
 
 WiThrottle::~WiThrottle() {
-  if (firstThrottle== this) {
-    firstThrottle=this->nextThrottle;
-    return;
-  }
-  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle) {
-    if (wt->nextThrottle==this) {
-      wt->nextThrottle=this->nextThrottle;
-      return;  
-     }
+  for (int loco=0;loco<MAX_MY_LOCO; loco++) {
+    if (myLocos[loco].throttle=='\0') continue;
+    myLocos[loco].throttle='\0';
+    dropOwner(myLocos[loco].cab);
   }
+  clients[clientid]=NULL;
 }
 
 void WiThrottle::parse(RingStream * stream, byte * cmdx) {
@@ -106,23 +181,12 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
   heartBeat=millis();
   if (Diag::WITHROTTLE) DIAG(F("%l WiThrottle(%d)<-[%e]"),millis(),clientid,cmd);
 
-  if (initSent) {
-    // Send power state if different than last sent
-    bool currentPowerState = (DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON);
-    if (lastPowerState != currentPowerState) {
-      StringFormatter::send(stream,F("PPA%x\n"),currentPowerState);
-      lastPowerState = currentPowerState;  
-    }
-    // Send turnout list if changed since last sent (will replace list on client)
-    if (turnoutListHash != Turnout::turnoutlistHash) {
-      StringFormatter::send(stream,F("PTL"));
-      for(Turnout *tt=Turnout::firstTurnout;tt!=NULL;tt=tt->nextTurnout){
-          StringFormatter::send(stream,F("]\\[%d}|{%d}|{%c"), tt->data.id, tt->data.id, Turnout::isActive(tt->data.id)?'4':'2');
-      }
-      StringFormatter::send(stream,F("\n"));
-      turnoutListHash = Turnout::turnoutlistHash; // keep a copy of hash for later comparison
-    }
-  }
+  // The first turnout list follows the connection, later ones are pushed when 
+  // turnouts are created or removed, as are power and turnout state changes.
+  // Nothing else may be written inside a list still being sent, but the
+  // heartbeats that arrive while it is have no reply and leave it alone.
+  if (cmd[0]!='*') abandonTurnoutList(stream);
+  listStream=stream;
 
    while (cmd[0]) {
    switch (cmd[0]) {
@@ -136,7 +200,6 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
 	      if (MotorDriver::commonFaultPin) // commonFaultPin prevents individual track handling
 		DCCWaveform::progTrack.setPowerMode(cmd[3]=='1'?POWERMODE::ON:POWERMODE::OFF);
               StringFormatter::send(stream,F("PPA%x\n"),DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON);
-              lastPowerState = (DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON); //remember power state sent for comparison later
             }
             else if (cmd[1]=='T' && cmd[2]=='A') { // PTA accessory toggle 
                 int id=getInt(cmd+4); 
@@ -173,9 +236,9 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
               if (annotateLeftRight) StringFormatter::send(stream,F("PTT]\\[Turnouts}|{Turnout]\\[Left}|{2]\\[Right}|{4\n"));
               else                   StringFormatter::send(stream,F("PTT]\\[Turnouts}|{Turnout]\\[Closed}|{2]\\[Thrown}|{4\n"));
               StringFormatter::send(stream,F("PPA%x\n"),DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON);
-              lastPowerState = (DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON); //remember power state sent for comparison later
               StringFormatter::send(stream,F("*%d\n"),HEARTBEAT_SECONDS);
               initSent = true;
+              turnoutListWork = true;  // loop sends the list
             }
             break;           
       case 'Q': // 
@@ -244,6 +307,7 @@ void WiThrottle::multithrottle(RingStream * stream, byte * cmd){
                   if (myLocos[loco].throttle=='\0') { 
                     myLocos[loco].throttle=throttleChar;
                     myLocos[loco].cab=locoid;
+                    addOwner(locoid);
                     StringFormatter::send(stream, F("M%c+%c%d<;>\n"), throttleChar, cmd[3] ,locoid); //tell client to add loco
                     //Get known Fn states from DCC 
                     for(int fKey=0; fKey<=28; fKey++) { 
@@ -261,6 +325,7 @@ void WiThrottle::multithrottle(RingStream * stream, byte * cmd){
           case '-': // remove loco(s) from this client (leave in DCC registration)
                  LOOPLOCOS(throttleChar, locoid) {
                      myLocos[loco].throttle='\0';
+                     dropOwner(myLocos[loco].cab);
                      StringFormatter::send(stream, F("M%c-%c%d<;>\n"), throttleChar, LorS(myLocos[loco].cab), myLocos[loco].cab);
                   }
             
@@ -349,20 +414,152 @@ int WiThrottle::WiTToDCCSpeed(int WiTSpeed) {
 }
 
 void WiThrottle::loop(RingStream * stream) {
-  // for each WiThrottle, check the heartbeat
-  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle) 
-     wt->checkHeartbeat();
+  turnoutListLoop();
+  if ((long)(millis() - nextHeartbeatCheck) < 0) return;
+  // something may have expired, check each WiThrottle and find the next deadline 
+  nextHeartbeatCheck=millis() + ESTOP_SECONDS*1000UL;
+  for (byte c=0; c<MAX_CLIENTS; c++) {
+     WiThrottle * wt=clients[c];
+     if (wt==NULL) continue;
+     wt->checkHeartbeat();   // may delete wt
+     if (clients[c] && wt->heartBeatEnable && (long)(wt->heartBeat + ESTOP_SECONDS*1000UL + 1 - nextHeartbeatCheck) < 0)
+       nextHeartbeatCheck=wt->heartBeat + ESTOP_SECONDS*1000UL + 1;
+  }
 
-   // TODO... any broadcasts to be done 
+   // broadcasts are sent by the CommandDistributor through sendEvent
    (void)stream; 
-   /* MUST follow this model in  this loop. 
-    *   stream->mark();
-    *   send 1 digit client id, and any data 
-    *   stream->commit() 
-     */
+}
+
+// Send a change made by another client, JMRI or the command station itself.
+// The CommandDistributor has already marked the stream for this client.
+void WiThrottle::sendEvent(Print * stream, int clientId, CHANGE_EVENT type, int16_t id, int16_t value) {
+  if (clientId<0 || clientId>=MAX_CLIENTS) return;
+  WiThrottle * wt=clients[clientId];
+  if (wt==NULL || !wt->initSent) return;
+  if (type==EVENT_TURNOUT_LIST) {
+    turnoutListWork=true;  // the loop sends it
+    return;
+  }
+  // Most speed and function changes are for locos this client does not hold
+  if ((type==EVENT_SPEED || type==EVENT_FUNCTION) && !wt->areYouUsingThrottle(id)) return;
+  if (wt->listNext>=0 && wt->deferEvent(type,id,value)) return;
+  wt->abandonTurnoutList(stream);
+  wt->writeEvent(stream,type,id,value);
+}
+
+// Keep a change until the list being sent is finished, a later change 
+// to the same thing replaces it. false if there is no room left.
+bool WiThrottle::deferEvent(CHANGE_EVENT type, int16_t id, int16_t value) {
+  for (byte d=0; d<deferredCount; d++) {
+    if (deferred[d].type!=type || deferred[d].id!=id) continue;
+    if (type==EVENT_FUNCTION && deferred[d].value!=value) continue;
+    deferred[d].value=value;
+    return true;
+  }
+  if (deferredCount>=DEFERRED_MAX) return false;
+  deferred[deferredCount].type=type;
+  deferred[deferredCount].id=id;
+  deferred[deferredCount].value=value;
+  deferredCount++;
+  return true;
+}
+
+void WiThrottle::writeEvent(Print * stream, CHANGE_EVENT type, int16_t id, int16_t value) {
+  switch (type) {
+    case EVENT_POWER:
+      StringFormatter::send(stream,F("PPA%x\n"),value);
+      break;
+    case EVENT_TURNOUT:
+      StringFormatter::send(stream, F("PTA%c%d\n"),value?'4':'2',id);
+      break;
+    case EVENT_SPEED:
+      for (int loco=0;loco<MAX_MY_LOCO;loco++) {
+        if (myLocos[loco].throttle=='\0' || myLocos[loco].cab!=id) continue;
+        StringFormatter::send(stream,F("M%cA%c%d<;>V%d\n"), myLocos[loco].throttle, LorS(id), id, DCCToWiTSpeed(DCC::getThrottleSpeed(id)));
+        StringFormatter::send(stream,F("M%cA%c%d<;>R%d\n"), myLocos[loco].throttle, LorS(id), id, DCC::getThrottleDirection(id));
+      }
+      break;
+    case EVENT_FUNCTION:
+      for (int loco=0;loco<MAX_MY_LOCO;loco++) {
+        if (myLocos[loco].throttle=='\0' || myLocos[loco].cab!=id) continue;
+        StringFormatter::send(stream,F("M%cA%c%d<;>F%d%d\n"), myLocos[loco].throttle, LorS(id), id, DCC::getFn(id,value), value);
+      }
+      break;
+    default: // sensors and outputs have no WiThrottle equivalent
+      break;
+  }
+}
+
+// Send turnout list to each client whose turnouts have been created or removed 
+// since last sent (will replace list on client), continuing any already started.
+void WiThrottle::turnoutListLoop() {
+  if (!turnoutListWork) return;
+  turnoutListWork=false;
+  for (byte c=0; c<MAX_CLIENTS; c++) {
+    WiThrottle * wt=clients[c];
+    if (wt==NULL || !wt->initSent) continue;
+    RingStream * ring=wt->listStream;
+    if (wt->listNext<0 && wt->turnoutListHash==Turnout::turnoutlistHash) continue;
+    if (!listRoom(ring)) {  // try again when the ring empties
+      turnoutListWork=true;
+      continue;
+    }
+    ring->mark(c);
+    bool done=(wt->listNext<0) ? wt->startTurnoutList(ring) : wt->continueTurnoutList(ring);
+    if (done) {
+      // what changed while the list was sent, in the same message
+      for (byte d=0; d<wt->deferredCount; d++)
+        wt->writeEvent(ring, wt->deferred[d].type, wt->deferred[d].id, wt->deferred[d].value);
+      wt->deferredCount=0;
+    }
+    ring->commit();
+    if (!done || wt->turnoutListHash!=Turnout::turnoutlistHash) turnoutListWork=true;
+  }
+}
+
+bool WiThrottle::startTurnoutList(RingStream * stream) {
+  turnoutListHash = Turnout::turnoutlistHash; // keep a copy of hash for later comparison
+  listNext=0;
+  StringFormatter::send(stream,F("PTL"));
+  return continueTurnoutList(stream);
+}
+
+// Room for another entry without taking the second half of the ring
+bool WiThrottle::listRoom(RingStream * stream) {
+  return stream->freeSpace() - stream->size()/2 > PTL_ENTRY_MAX;
+}
+
+// Write the turnouts that fit in the ring, true when the list is complete
+bool WiThrottle::continueTurnoutList(RingStream * stream) {
+  for(Turnout *tt=Turnout::getFrom(listNext);tt!=NULL;tt=tt->nextTurnout){
+      if (!listRoom(stream)) {
+        listNext=tt->data.id;
+        return false;
+      }
+      StringFormatter::send(stream,F("]\\[%d}|{%d}|{%c"), tt->data.id, tt->data.id, (tt->data.tStatus & STATUS_ACTIVE)?'4':'2');
+  }
+  StringFormatter::send(stream,F("\n"));
+  listNext=-1;
+  return true;
+}
 
+// Before a reply is written to a client being sent a list, end the list
+// where it is and send what was held back. The client shows the turnouts
+// so far until the loop sends the whole list again, a PTL line replaces
+// the list on the client so it can not be carried on from listNext.
+void WiThrottle::abandonTurnoutList(Print * stream) {
+  if (listNext<0) return;
+  StringFormatter::send(stream,F("\n"));
+  listNext=-1;
+  turnoutListHash=-1;
+  turnoutListWork=true;
+  for (byte d=0; d<deferredCount; d++) writeEvent(stream, deferred[d].type, deferred[d].id, deferred[d].value);
+  deferredCount=0;
 }
 
+// Heartbeat deadlines only move later, when a message arrives, so 
+// nextHeartbeatCheck is never after the earliest real deadline. Until then
+// the loop costs one comparison however many clients there are.
 void WiThrottle::checkHeartbeat() {
   // if eStop time passed... eStop any locos still assigned to this client and then drop the connection
   if(heartBeatEnable && (millis()-heartBeat > ESTOP_SECONDS*1000)) {
@@ -20,6 +20,9 @@
 #define WiThrottle_h
 
 #include "RingStream.h"
+#include "CommandDistributor.h"
+#include "Pool.h"
+#include "BoardProfile.h"
 
 struct MYLOCO {
     char throttle; //indicates which throttle letter on client, often '0','1' or '2'
@@ -31,22 +34,46 @@ class WiThrottle {
     static void loop(RingStream * stream);
     void parse(RingStream * stream, byte * cmd);
     static WiThrottle* getThrottle( int wifiClient); 
+    static void sendEvent(Print * stream, int clientId, CHANGE_EVENT type, int16_t id, int16_t value);
     static bool annotateLeftRight;
+    static void showPool(Print * stream);
   private: 
     WiThrottle( int wifiClientId);
     ~WiThrottle();
+    // Instances come and go with client connections, so they live in a pool
+    static Pool<WiThrottle> pool;
+    static void * operator new(size_t size) noexcept;
+    static void operator delete(void * p);
    
-      static const int MAX_MY_LOCO=10;      // maximum number of locos assigned to a single client
+      static const int MAX_MY_LOCO=WITHROTTLE_LOCOS;  // maximum number of locos assigned to a single client
+      static const byte MAX_CLIENTS=10;     // client ids 0-9, as for the CommandDistributor
       static const int HEARTBEAT_SECONDS=4; // heartbeat at 4secs to provide messaging transport
       static const int ESTOP_SECONDS=8;     // eStop if no incoming messages for more than 8secs
-      static WiThrottle* firstThrottle;
+      static WiThrottle* clients[MAX_CLIENTS];  // by client id
+      // Which clients hold each loco, one bit per client id. Open addressing 
+      // with linear probing, sized for the first pool chunk of clients all 
+      // holding different locos. If it ever fills, loco lookups fall back 
+      // to asking each client.
+      struct LOCO_OWNERS {
+        int cab;            // 0 for an empty entry
+        uint16_t clients;
+      };
+      static const int OWNER_INDEX_SIZE=
+        WITHROTTLE_POOL*MAX_MY_LOCO*3/2 <= 8 ? 8 : WITHROTTLE_POOL*MAX_MY_LOCO*3/2 <= 16 ? 16 :
+        WITHROTTLE_POOL*MAX_MY_LOCO*3/2 <= 32 ? 32 : WITHROTTLE_POOL*MAX_MY_LOCO*3/2 <= 64 ? 64 : 128;
+      static LOCO_OWNERS owners[OWNER_INDEX_SIZE];
+      static byte ownerCount;
+      static bool ownersOverflow;
+      static int ownerPosition(int cab);
+      static uint16_t getOwners(int cab);
+      void addOwner(int cab);
+      void dropOwner(int cab);
       static int getInt(byte * cmd);
       static int getLocoId(byte * cmd);
       static char LorS(int cab); 
       static bool isThrottleInUse(int cab);
       static void setSendTurnoutList();
       bool areYouUsingThrottle(int cab);
-      WiThrottle* nextThrottle;
       int clientid;
        
       MYLOCO myLocos[MAX_MY_LOCO];   
@@ -54,13 +81,36 @@ class WiThrottle {
       unsigned long heartBeat;
       bool initSent; // valid connection established
       int turnoutListHash;  // used to check for changes to turnout list
-      bool lastPowerState;  // last power state sent to this client
       int DCCToWiTSpeed(int DCCSpeed);
       int WiTToDCCSpeed(int WiTSpeed);
       void multithrottle(RingStream * stream, byte * cmd);
       void locoAction(RingStream * stream, byte* aval, char throttleChar, int cab);
       void accessory(RingStream *, byte* cmd);
       void checkHeartbeat(); 
+      // The PTL turnout list is one line that may be bigger than the ring, so 
+      // the loop writes it a message at a time while more than half the 
+      // ring, which other clients share, is free. Changes for the client 
+      // meanwhile are held back until the line is finished.
+      static const byte PTL_ENTRY_MAX=24;  // longest "]\[id}|{id}|{state" and the end of line
+      static const byte DEFERRED_MAX=4;    // changes held back during a list
+      struct DEFERRED_EVENT {
+        CHANGE_EVENT type;
+        int16_t id;
+        int16_t value;
+      };
+      static bool turnoutListWork;  // some client may need a list or is being sent one
+      RingStream * listStream;      // ring the list is being written to
+      int listNext;                 // id of the next turnout to send, -1 if no list is being sent
+      DEFERRED_EVENT deferred[DEFERRED_MAX];
+      byte deferredCount;
+      static void turnoutListLoop();
+      static bool listRoom(RingStream * stream);
+      bool startTurnoutList(RingStream * stream);
+      bool continueTurnoutList(RingStream * stream);
+      void abandonTurnoutList(Print * stream);
+      bool deferEvent(CHANGE_EVENT type, int16_t id, int16_t value);
+      void writeEvent(Print * stream, CHANGE_EVENT type, int16_t id, int16_t value);
+      static unsigned long nextHeartbeatCheck;  // millis, no heartbeat expires before this
 
        // callback stuff to support prog track acquire
        static RingStream * stashStream;
@@ -34,6 +34,19 @@ void WifiInboundHandler::loop() {
   singleton->loop1();
 }
 
+// Forget any half processed ES output after WifiInterface has set up the ES again 
+void WifiInboundHandler::reset() {
+  if (singleton->clientPendingCIPSEND>=0) singleton->purgeCurrentCIPSEND();
+  singleton->loopState=ANYTHING;
+  singleton->linkDown=false;
+  CommandDistributor::forget(singleton->outboundRing); // ES restart dropped all clients
+}
+
+// true if the ES has reported its link to the network down for longer than timeout
+bool WifiInboundHandler::linkLost(unsigned long timeout) {
+  return singleton->linkDown && (millis() - singleton->linkDownTime > timeout);
+}
+
 
 WifiInboundHandler::WifiInboundHandler(Stream * ESStream) {
   wifiStream=ESStream;
@@ -51,13 +64,13 @@ void WifiInboundHandler::loop1() {
    // First handle all inbound traffic events because they will block the sending 
    if (loop2()!=INBOUND_IDLE) return;
 
-   WiThrottle::loop(outboundRing);
-   
     // if nothing is already CIPSEND pending, we can CIPSEND one reply
     if (clientPendingCIPSEND<0) {
        clientPendingCIPSEND=outboundRing->read();
        if (clientPendingCIPSEND>=0) {
          currentReplySize=outboundRing->count();
+         currentPartSize=currentReplySize;
+         coalesceCIPSEND();
          pendingCipsend=true;
        }
      }
@@ -72,20 +85,16 @@ void WifiInboundHandler::loop1() {
     
     
     // if something waiting to execute, we can call it 
-      int clientId=inboundRing->read();
+      // The command is parsed in place in the inbound ring, nothing writes
+      // to the ring until loop2 is called again. 
+      byte * cmd;
+      int count;
+      int clientId=inboundRing->readSpan(cmd,count);
       if (clientId>=0) {
-         int count=inboundRing->count();
-         if (Diag::WIFI) DIAG(F("Wifi EXEC: %d %d:"),clientId,count); 
-         byte cmd[count+1];
-         for (int i=0;i<count;i++) cmd[i]=inboundRing->read();   
-         cmd[count]=0;
-         if (Diag::WIFI) DIAG(F("%e"),cmd); 
+         if (Diag::WIFI) DIAG(F("Wifi EXEC: %d:%e"),clientId,cmd); 
          
-         outboundRing->mark(clientId);  // remember start of outbound data 
-         CommandDistributor::parse(clientId,cmd,outboundRing);
-         // The commit call will either write the lenbgth bytes 
-         // OR rollback to the mark because the reply is empty or commend generated more than fits the buffer 
-         outboundRing->commit();
+         // the reply goes to the outbound ring, marked with the client id
+         CommandDistributor::receive(clientId,cmd,count,outboundRing);
          return;
       }
    }
@@ -114,10 +123,14 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
         
         if (ch=='>') { 
            if (Diag::WIFI) DIAG(F("[XMIT %d]"),currentReplySize); 
-           for (int i=0;i<currentReplySize;i++) {
-             int cout=outboundRing->read();
-             wifiStream->write(cout);
-             if (Diag::WIFI) StringFormatter::printEscape(cout); // DIAG in disguise
+           for (int remaining=currentReplySize; remaining>0;) {
+             byte * span;
+             int length=nextReplySpan(span, remaining);
+             wifiStream->write(span,length);
+             if (Diag::WIFI) for (int i=0;i<length;i++) StringFormatter::printEscape(span[i]); // DIAG in disguise
+             outboundRing->consume(length);
+             currentPartSize-=length;
+             remaining-=length;
            }
            clientPendingCIPSEND=-1;
            pendingCipsend=false;
@@ -141,6 +154,11 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
            break; 
         }
         
+        if (ch=='W') { // WIFI status change 
+          loopState=WIFI_STATUS;
+          break;
+        }
+        
         if (ch>='0' && ch<='9') { 
               runningClientId=ch-'0';
               loopState=GOT_CLIENT_ID;
@@ -194,13 +212,12 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
             break;
           }
           if (Diag::WIFI) DIAG(F("Wifi inbound data(%d:%d):"),runningClientId,dataLength); 
-          if (inboundRing->freeSpace()<=(dataLength+1)) {
+          if (!inboundRing->markContiguous(runningClientId,dataLength)) {
             // This input would overflow the inbound ring, ignore it  
             loopState=IPD_IGNORE_DATA;
             if (Diag::WIFI) DIAG(F("Wifi OVERFLOW IGNORING:"));    
             break;
           }
-          inboundRing->mark(runningClientId);
           loopState=IPD_DATA;
           break; 
         }
@@ -229,10 +246,25 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
         if (ch=='C') {
          // got "x C" before CLOSE or CONNECTED, or CONNECT FAILED
          if (runningClientId==clientPendingCIPSEND) purgeCurrentCIPSEND();
+         CommandDistributor::forget(outboundRing, runningClientId);
         }
         loopState=SKIPTOEND;   
         break;
          
+      case WIFI_STATUS: // skipping IFI 
+        if (ch==' ') loopState=WIFI_STATUS2;
+        else if (ch=='\n') loopState=ANYTHING;
+        break;
+        
+      case WIFI_STATUS2: // got "WIFI " 
+        if (ch=='D') {  // WIFI DISCONNECT, ES will try to rejoin by itself
+          if (!linkDown) linkDownTime=millis(); 
+          linkDown=true;
+        }
+        else if (ch=='G') linkDown=false; // WIFI GOT IP 
+        loopState=SKIPTOEND;
+        break;
+        
       case SKIPTOEND: // skipping for /n
         if (ch=='\n') loopState=ANYTHING;
         break;
@@ -244,9 +276,41 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
 void WifiInboundHandler::purgeCurrentCIPSEND() {
          // A CIPSEND was sent but errored... or the client closed just toss it away
          if (Diag::WIFI) DIAG(F("Wifi: DROPPING CIPSEND=%d,%d"),clientPendingCIPSEND,currentReplySize);
-         for (int i=0;i<=currentReplySize;i++) outboundRing->read();
+         for (int remaining=currentReplySize; remaining>0;) {
+           byte * span;
+           int length=nextReplySpan(span, remaining);
+           outboundRing->consume(length);
+           currentPartSize-=length;
+           remaining-=length;
+         }
          pendingCipsend=false;  
          clientPendingCIPSEND=-1;
 }
 
+// Add any further replies for the same client that are already committed 
+// to the outbound ring into the same CIPSEND. A WiThrottle acquire
+// or a list of turnouts then takes one AT handshake instead of one per line.  
+void WifiInboundHandler::coalesceCIPSEND() {
+  int offset=currentReplySize;  // ring offset of next reply header
+  while (outboundRing->peek(offset)==clientPendingCIPSEND) {
+    int size=(outboundRing->peek(offset+1)<<8) | outboundRing->peek(offset+2);
+    if (currentReplySize+size > MAX_CIPSEND) break;
+    currentReplySize+=size;
+    offset+=3+size;
+  }
+}
+
+// Point span at the next data bytes of the current CIPSEND that are together 
+// in the ring, skipping the client id and length of coalesced replies. 
+// The caller consumes them.
+int WifiInboundHandler::nextReplySpan(byte * & span, int remaining) {
+  if (currentPartSize==0) {
+    outboundRing->read(); // client id, same as clientPendingCIPSEND
+    currentPartSize=outboundRing->count();
+  }
+  int length=outboundRing->peekSpan(span);
+  if (length>currentPartSize) length=currentPartSize;
+  if (length>remaining) length=remaining;
+  return length;
+}
 #endif
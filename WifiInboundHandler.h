@@ -1,6 +1,7 @@
 #ifndef WifiInboundHandler_h
 #define WifiInboundHandler_h
 
+#include "BoardProfile.h"
 #include "RingStream.h"
 #include "WiThrottle.h"
 #include "DIAG.h"
@@ -9,6 +10,8 @@ class WifiInboundHandler {
  public:  
    static void setup(Stream * ESStream);
    static void loop();
+   static void reset();
+   static bool linkLost(unsigned long timeout);
    
    private:
 
@@ -36,7 +39,12 @@ class WifiInboundHandler {
           IPD_IGNORE_DATA, // got +IPD,c,ll,: ignoring the data that won't fit inblound Ring
 
           GOT_CLIENT_ID,  // clientid prefix to CONNECTED / CLOSED
-          GOT_CLIENT_ID2  // clientid prefix to CONNECTED / CLOSED
+          GOT_CLIENT_ID2,  // clientid prefix to CONNECTED / CLOSED
+
+          // WIFI DISCONNECT, WIFI CONNECTED, WIFI GOT IP
+          WIFI_STATUS,     // got W
+          WIFI_STATUS2     // got W... 
+
   };
 
   
@@ -44,10 +52,13 @@ class WifiInboundHandler {
    void loop1();
    INBOUND_STATE loop2();
    void purgeCurrentCIPSEND();
+   void coalesceCIPSEND();
+   int nextReplySpan(byte * & span, int remaining);
    Stream * wifiStream;
    
-   static const int INBOUND_RING = 512;
-   static const int OUTBOUND_RING = 2048;
+   static const int INBOUND_RING = WIFI_INBOUND_RING;
+   static const int OUTBOUND_RING = WIFI_OUTBOUND_RING;
+   static const int MAX_CIPSEND = 2048;  // ES AT firmware limit per CIPSEND
  
    RingStream * inboundRing;
    RingStream * outboundRing;
@@ -56,7 +67,10 @@ class WifiInboundHandler {
   int runningClientId;   // latest client inbound processing data or CLOSE
   int dataLength; // dataLength of +IPD
   int clientPendingCIPSEND=-1;
-  int currentReplySize;
+  int currentReplySize;   // total bytes in current CIPSEND
+  int currentPartSize;    // bytes left of the reply being transmitted
   bool pendingCipsend;
+  bool linkDown=false;        // ES reported WIFI DISCONNECT 
+  unsigned long linkDownTime; // millis
 };
 #endif
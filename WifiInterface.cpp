@@ -25,6 +25,7 @@
 #include "StringFormatter.h"
 
 #include "WifiInboundHandler.h"
+#include "Watchdog.h"
 
 
 
@@ -32,6 +33,27 @@
 const unsigned long LOOP_TIMEOUT = 2000;
 bool WifiInterface::connected = false;
 Stream * WifiInterface::wifiStream;
+long WifiInterface::linkSpeed;
+const FSH * WifiInterface::wifiSSid;
+const FSH * WifiInterface::wifiPassword;
+const FSH * WifiInterface::wifiHostname;
+int WifiInterface::wifiPort;
+byte WifiInterface::wifiChannel;
+WifiInterface::SETUP_STATE WifiInterface::setupState=SETUP_IDLE;
+bool WifiInterface::waiting=false;
+bool WifiInterface::atFound=false;
+byte WifiInterface::serialNumber=0;
+byte WifiInterface::retries=0;
+bool WifiInterface::oldCmd=false;
+bool WifiInterface::rejoining=false;
+byte WifiInterface::charCount=0;
+char WifiInterface::collected[18];
+unsigned long WifiInterface::startTime;
+unsigned int WifiInterface::waitTimeout;
+const FSH * WifiInterface::waitFor;
+const char * WifiInterface::locator;
+bool WifiInterface::waitEcho;
+bool WifiInterface::waitEscapeEcho;
 
 #ifndef WIFI_CONNECT_TIMEOUT
 // Tested how long it takes to FAIL an unknown SSID on firmware 1.7.4.
@@ -40,6 +62,12 @@ Stream * WifiInterface::wifiStream;
 #define WIFI_CONNECT_TIMEOUT 16000
 #endif
 
+#ifndef WIFI_RETRY_DELAY
+// How long to wait before trying the setup again after it failed
+// or after the ES reported that the link to the network went down.
+#define WIFI_RETRY_DELAY 30000
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Figure out number of serial ports depending on hardware
@@ -56,263 +84,440 @@ Stream * WifiInterface::wifiStream;
 #define NUM_SERIAL 1
 #endif
 
+static const char * const yourNetwork = "Your network ";
+
+// setup only starts the state machine, the ES is brought up by loop()
+// so DCC is not held up. Returns true once connected, so always false here.  
 bool WifiInterface::setup(long serial_link_speed, 
                           const FSH *wifiESSID,
                           const FSH *wifiPassword,
                           const FSH *hostname,
                           const int port,
                           const byte channel) {
+  linkSpeed=serial_link_speed;
+  wifiSSid=wifiESSID;
+  WifiInterface::wifiPassword=wifiPassword;
+  wifiHostname=hostname;
+  wifiPort=port;
+  wifiChannel=channel;
+
+  // Serials are tried in turn, depending on hardware.
+  serialNumber=1;
+  wifiStream=beginSerial(serialNumber);
+  if (!wifiStream) return false;
+  DIAG(F("++ Wifi Setup Try %d ++"), serialNumber);
+  setState(SETUP_PROBE);
+  return connected; 
+}
 
-  wifiSerialState wifiUp = WIFI_NOAT;
-
-#if NUM_SERIAL == 0
-  // no warning about unused parameters. 
-  (void) serial_link_speed;
-  (void) wifiESSID;
-  (void) wifiPassword;
-  (void) hostname;
-  (void) port;
-  (void) channel;
-#endif  
-  
+Stream * WifiInterface::beginSerial(byte number) {
+  switch (number) {
 #if NUM_SERIAL > 0
-  Serial1.begin(serial_link_speed);
-  wifiUp = setup(Serial1, wifiESSID, wifiPassword, hostname, port, channel);
+    case 1:
+      Serial1.begin(linkSpeed);
+      return &Serial1;
 #endif
-
-// Other serials are tried, depending on hardware.
 #if NUM_SERIAL > 1
-  if (wifiUp == WIFI_NOAT)
-  {
-    Serial2.begin(serial_link_speed);
-    wifiUp = setup(Serial2, wifiESSID, wifiPassword, hostname, port, channel);
-  }
+    case 2:
+      Serial2.begin(linkSpeed);
+      return &Serial2;
 #endif
-  
 #if NUM_SERIAL > 2
-  if (wifiUp == WIFI_NOAT)
-  {
-    Serial3.begin(serial_link_speed);
-    wifiUp = setup(Serial3, wifiESSID, wifiPassword, hostname, port, channel);
-  }
+    case 3:
+      Serial3.begin(linkSpeed);
+      return &Serial3;
 #endif
-
-  if (wifiUp == WIFI_NOAT) // here and still not AT commands found
-      return false;
-
-  DCCEXParser::setAtCommandCallback(ATCommand);
-  // CAUTION... ONLY CALL THIS ONCE 
-  WifiInboundHandler::setup(wifiStream);
-  if (wifiUp == WIFI_CONNECTED)
-      connected = true;
-  else
-      connected = false;
-  return connected; 
+    default:
+      return NULL;
+  }
 }
 
-wifiSerialState WifiInterface::setup(Stream & setupStream,  const FSH* SSid, const FSH* password,
-				     const FSH* hostname,  int port, byte channel) {
-  wifiSerialState wifiState;
-  static uint8_t ntry = 0;
-  ntry++;
-
-  wifiStream = &setupStream;
-
-  DIAG(F("++ Wifi Setup Try %d ++"), ntry);
-
-  wifiState = setup2( SSid, password, hostname,  port, channel);
+void WifiInterface::setState(SETUP_STATE state) {
+  setupState=state;
+  waiting=false;
+  retries=0;
+  charCount=0;
+  startTime=millis();
+}
 
+void WifiInterface::setupFinished(wifiSerialState wifiState) {
   if (wifiState == WIFI_NOAT) {
-      DIAG(F("++ Wifi Setup NO AT ++"));
-      return wifiState;
+    DIAG(F("++ Wifi Setup NO AT ++"));
+    setState(SETUP_IDLE);
+    return;
   }
- 
-  if (wifiState == WIFI_CONNECTED) {
-    StringFormatter::send(wifiStream, F("ATE0\r\n")); // turn off the echo 
-    checkForOK(200, true);      
+
+  static bool handlerStarted=false;
+  if (!handlerStarted) {
+    DCCEXParser::setAtCommandCallback(ATCommand);
+    // CAUTION... ONLY CALL THIS ONCE 
+    WifiInboundHandler::setup(wifiStream);
+    handlerStarted=true;		 
   }
+  else WifiInboundHandler::reset();
 
-    
-  DIAG(F("++ Wifi Setup %S ++"), wifiState == WIFI_CONNECTED ? F("CONNECTED") : F("DISCONNECTED"));
-  return wifiState;
+  connected = (wifiState == WIFI_CONNECTED);
+  if (connected) rejoining=false;
+  DIAG(F("++ Wifi Setup %S ++"), connected ? F("CONNECTED") : F("DISCONNECTED"));
+  setState(connected ? SETUP_IDLE : SETUP_RETRY_WAIT);
 }
 
+// false if the source still has the example SSID, then the ES may have
+// been configured as a station by the user
+bool WifiInterface::stationConfigured() {
 #ifdef DONT_TOUCH_WIFI_CONF
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-variable"
-#pragma GCC diagnostic ignored "-Wunused-parameter"
+  return false;
+#else
+  return !(strncmp_P(yourNetwork, (const char*)wifiSSid, 13) == 0 || strncmp_P("", (const char*)wifiSSid, 13) == 0);
 #endif
-wifiSerialState WifiInterface::setup2(const FSH* SSid, const FSH* password,
-				      const FSH* hostname, int port, byte channel) {
-  bool ipOK = false;
-  bool oldCmd = false;
-
-  char macAddress[17];  //  mac address extraction   
- 
-  // First check... Restarting the Arduino does not restart the ES. 
-  //  There may alrerady be a connection with data in the pipeline.
-  // If there is, just shortcut the setup and continue to read the data as normal.
-  if (checkForOK(200,F("+IPD"), true)) {
-    DIAG(F("Preconfigured Wifi already running with data waiting"));
-    return WIFI_CONNECTED; 
-  }
-
-  StringFormatter::send(wifiStream, F("AT\r\n"));   // Is something here that understands AT?
-  if(!checkForOK(200, true))
-    return WIFI_NOAT;                               // No AT compatible WiFi module here
+}
 
-  StringFormatter::send(wifiStream, F("ATE1\r\n")); // Turn on the echo, se we can see what's happening
-  checkForOK(2000, true);                // Makes this visible on the console
+// After the station has lost its network the server and mode are still
+// set up in the ES, so only join again (or let a preconfigured ES rejoin
+// by itself) and check the address.
+WifiInterface::SETUP_STATE WifiInterface::rejoinState() {
+  return stationConfigured() ? SETUP_CWJAP : SETUP_PRECONFIG_WAIT;
+}
 
-  // Display the AT version information
-  StringFormatter::send(wifiStream, F("AT+GMR\r\n")); 
-  checkForOK(2000, true, false);      // Makes this visible on the console
+// Each step sends its AT command and then waits for the response
+// without blocking. When a step is entered result is WAIT_PENDING,
+// when the response has arrived or timed out it is WAIT_FOUND or WAIT_TIMEOUT.
+void WifiInterface::setupLoop() {
+  WAIT_RESULT result=WAIT_PENDING;
+  if (waiting) {
+    result=pollWait();
+    if (result==WAIT_PENDING) return;
+  }
 
+  switch (setupState) {
+  case SETUP_IDLE:
+    return;
+    
+  case SETUP_PROBE:
+    // First check... Restarting the Arduino does not restart the ES. 
+    //  There may alrerady be a connection with data in the pipeline.
+    // If there is, just shortcut the setup and continue to read the data as normal.
+    if (result==WAIT_PENDING) {
+      startWait(200,F("+IPD"), true);
+      return;
+    }
+    if (result==WAIT_FOUND) {
+      DIAG(F("Preconfigured Wifi already running with data waiting"));
+      atFound=true;
+      setState(SETUP_ATE0);
+    }
+    else setState(SETUP_AT);
+    return;
+
+  case SETUP_AT:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT\r\n"));   // Is something here that understands AT?
+      startWait(200, true);
+      return;
+    }
+    if (result==WAIT_FOUND) {
+      atFound=true;
+      setState(SETUP_ATE1);
+      return;
+    }
+    if (atFound) {
+      // The ES was here before, try again later
+      setupFinished(WIFI_DISCONNECTED);
+      return;
+    }
+    // No AT compatible WiFi module here, try the next serial
+    DIAG(F("++ Wifi Setup NO AT ++"));
+    wifiStream=beginSerial(++serialNumber);
+    if (!wifiStream) {
+      setupFinished(WIFI_NOAT);
+      return;
+    }
+    DIAG(F("++ Wifi Setup Try %d ++"), serialNumber);
+    setState(SETUP_PROBE);
+    return;
+
+  case SETUP_ATE1:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("ATE1\r\n")); // Turn on the echo, se we can see what's happening
+      startWait(2000, true);                // Makes this visible on the console
+      return;
+    }
+    setState(SETUP_GMR);
+    return;
+
+  case SETUP_GMR:
+    if (result==WAIT_PENDING) {
+      // Display the AT version information
+      StringFormatter::send(wifiStream, F("AT+GMR\r\n")); 
+      startWait(2000, true, false);      // Makes this visible on the console
+      return;
+    }
 #ifdef DONT_TOUCH_WIFI_CONF
-  DIAG(F("DONT_TOUCH_WIFI_CONF was set: Using existing config"));
+    DIAG(F("DONT_TOUCH_WIFI_CONF was set: Using existing config"));
+    setState(SETUP_CIFSR);
 #else
-  // Older ES versions have AT+CWJAP, newer ones have AT+CWJAP_CUR and AT+CWHOSTNAME
-  StringFormatter::send(wifiStream, F("AT+CWJAP_CUR?\r\n"));
-  if (!(checkForOK(2000, true))) {
-      oldCmd=true;
+    setState(SETUP_CWJAP_QUERY);
+#endif
+    return;
+
+  case SETUP_CWJAP_QUERY:
+    // Older ES versions have AT+CWJAP, newer ones have AT+CWJAP_CUR and AT+CWHOSTNAME
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CWJAP_CUR?\r\n"));
+      startWait(2000, true);
+      return;
+    }
+    oldCmd= (result==WAIT_TIMEOUT);
+    if (oldCmd) {
       while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
-  }
-
-  StringFormatter::send(wifiStream, F("AT+CWMODE%s=1\r\n"), oldCmd ? "" : "_CUR"); // configure as "station" = WiFi client
-  checkForOK(1000, true);                       // Not always OK, sometimes "no change"
-
-  const char *yourNetwork = "Your network ";
-  if (strncmp_P(yourNetwork, (const char*)SSid, 13) == 0 || strncmp_P("", (const char*)SSid, 13) == 0) {
-    if (strncmp_P(yourNetwork, (const char*)password, 13) == 0) {
+    }
+    setState(SETUP_CWMODE1);
+    return;
+
+  case SETUP_CWMODE1:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CWMODE%s=1\r\n"), oldCmd ? "" : "_CUR"); // configure as "station" = WiFi client
+      startWait(1000, true);                       // Not always OK, sometimes "no change"
+      return;
+    }
+    if (!stationConfigured()) {
       // If the source code looks unconfigured, check if the
       // ESP8266 is preconfigured in station mode.
       // We check the first 13 chars of the SSid and the password
-
-      // give a preconfigured ES8266 a chance to connect to a router
-      // typical connect time approx 7 seconds
-      delay(8000);
+      if (strncmp_P(yourNetwork, (const char*)wifiPassword, 13) == 0) setState(SETUP_PRECONFIG_WAIT);
+      else setState(SETUP_CWMODE2);
+    }
+    // SSID was configured, so we assume station (client) mode.
+    else setState(oldCmd ? SETUP_CWJAP : SETUP_CWHOSTNAME);
+    return;
+
+  case SETUP_PRECONFIG_WAIT:
+    // give a preconfigured ES8266 a chance to connect to a router
+    // typical connect time approx 7 seconds
+    if (millis() - startTime < 8000) return;
+    setState(SETUP_STA_CIFSR);
+    return;
+
+  case SETUP_CWHOSTNAME:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CWHOSTNAME=\"%S\"\r\n"), wifiHostname); // Set Host name for Wifi Client
+      startWait(2000, true); // dont care if not supported
+      return;
+    }
+    setState(SETUP_CWJAP);
+    return;
+
+  case SETUP_CWJAP:
+    if (result==WAIT_PENDING) {
+      // AT command early version supports CWJAP/CWSAP, later version supports CWJAP_CUR
+      StringFormatter::send(wifiStream, F("AT+CWJAP%s=\"%S\",\"%S\"\r\n"), oldCmd ? "" : "_CUR", wifiSSid, wifiPassword);
+      startWait(WIFI_CONNECT_TIMEOUT, true);
+      return;
+    }
+    // But we really only have the ESSID and password correct
+    // Let's check for IP (via DHCP)
+    if (result==WAIT_FOUND) setState(SETUP_STA_CIFSR);
+    else if (rejoining) setupFinished(WIFI_DISCONNECTED);
+    else setState(SETUP_CWMODE2);
+    return;
+
+  case SETUP_STA_CIFSR:
+    if (result==WAIT_PENDING) {
       StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
-      if (checkForOK(5000, F("+CIFSR:STAIP"), true,false))
-	  if (!checkForOK(1000, F("0.0.0.0"), true,false))
-	      ipOK = true;
-    }
-  } else {
-      // SSID was configured, so we assume station (client) mode.
-      if (oldCmd) {
-	      // AT command early version supports CWJAP/CWSAP
-	      StringFormatter::send(wifiStream, F("AT+CWJAP=\"%S\",\"%S\"\r\n"), SSid, password);
-	      ipOK = checkForOK(WIFI_CONNECT_TIMEOUT, true);
-      } else {
-      // later version supports CWJAP_CUR
-        StringFormatter::send(wifiStream, F("AT+CWHOSTNAME=\"%S\"\r\n"), hostname); // Set Host name for Wifi Client
-      	checkForOK(2000, true); // dont care if not supported
-      
-        StringFormatter::send(wifiStream, F("AT+CWJAP_CUR=\"%S\",\"%S\"\r\n"), SSid, password);
-        ipOK = checkForOK(WIFI_CONNECT_TIMEOUT, true);
-      }
-
-      if (ipOK) {
-	      // But we really only have the ESSID and password correct
-        // Let's check for IP (via DHCP)
-        ipOK = false;
-        StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
-        if (checkForOK(5000, F("+CIFSR:STAIP"), true,false))
-        if (!checkForOK(1000, F("0.0.0.0"), true,false))
-        ipOK = true;
-      }
-  }
-
-  if (!ipOK) {
+      startWait(5000, F("+CIFSR:STAIP"), true,false);
+      return;
+    }
+    if (result==WAIT_FOUND) setState(SETUP_STA_CHECKIP);
+    else if (rejoining) setupFinished(WIFI_DISCONNECTED);
+    else setState(SETUP_CWMODE2);
+    return;
+
+  case SETUP_STA_CHECKIP:
+    if (result==WAIT_PENDING) {
+      startWait(1000, F("0.0.0.0"), true,false);
+      return;
+    }
     // If we have not managed to get this going in station mode, go for AP mode
+    // unless the station was running before, then keep trying to rejoin
+    if (rejoining) {
+      if (result==WAIT_FOUND) setupFinished(WIFI_DISCONNECTED);
+      else setState(SETUP_CIFSR);
+    }
+    else setState(result==WAIT_FOUND ? SETUP_CWMODE2 : SETUP_CIPSERVER0);
+    return;
 
-  //    StringFormatter::send(wifiStream, F("AT+RST\r\n"));
-  //    checkForOK(1000, true); // Not always OK, sometimes "no change"
-
-    int i=0;
-    do {
+  case SETUP_CWMODE2:
+    if (result==WAIT_PENDING) {
       // configure as AccessPoint. Try really hard as this is the
       // last way out to get any Wifi connectivity. 
       StringFormatter::send(wifiStream, F("AT+CWMODE%s=2\r\n"), oldCmd ? "" : "_CUR"); 
-    } while (!checkForOK(1000+i*500, true) && i++<10);
-
+      startWait(1000+retries*500, true);
+      return;
+    }
+    if (result==WAIT_TIMEOUT && retries++<10) return; // send again 
     while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
+    setState(SETUP_AP_CIFSR);
+    return;
+
+  case SETUP_AP_CIFSR:
+    if (result==WAIT_PENDING) {
+      // Figure out MAC addr
+      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // not TOMATO
+      // looking fpr mac addr eg +CIFSR:APMAC,"be:dd:c2:5c:6b:b7"
+      startWait(5000, F("+CIFSR:APMAC,\""), true,false);
+      return;
+    }
+    if (result==WAIT_FOUND) setState(SETUP_AP_MAC);
+    else {
+      memset(collected,'f',17);
+      setState(SETUP_AP_CIFSR_END);
+    }
+    return;
+
+  case SETUP_AP_MAC:
+    // Copy 17 byte mac address
+    while (wifiStream->available() && charCount<17) {
+      collected[charCount]=wifiStream->read();
+      StringFormatter::printEscape(collected[charCount]);
+      charCount++;
+    }
+    if (charCount<17) {
+      if (millis() - startTime < 1000) return;
+      memset(collected+charCount,'f',17-charCount);
+    }
+    setState(SETUP_AP_CIFSR_END);
+    return;
 
-    // Figure out MAC addr
-    StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // not TOMATO
-    // looking fpr mac addr eg +CIFSR:APMAC,"be:dd:c2:5c:6b:b7"
-    if (checkForOK(5000, F("+CIFSR:APMAC,\""), true,false)) {
-      // Copy 17 byte mac address
-      for (int i=0; i<17;i++) {
-        while(!wifiStream->available());
-	macAddress[i]=wifiStream->read();
-	StringFormatter::printEscape(macAddress[i]);
-      }
-    } else {
-	memset(macAddress,'f',sizeof(macAddress));
+  case SETUP_AP_CIFSR_END:
+    if (result==WAIT_PENDING) {
+      startWait(1000, true, false);  // suck up remainder of AT+CIFSR
+      return;
     }
-    char macTail[]={macAddress[9],macAddress[10],macAddress[12],macAddress[13],macAddress[15],macAddress[16],'\0'};
+    setState(SETUP_CWSAP);
+    return;
 
-    checkForOK(1000, true, false);  // suck up remainder of AT+CIFSR
-  
-    i=0;
-    do {
-      if (strncmp_P(yourNetwork, (const char*)password, 13) == 0) {
+  case SETUP_CWSAP:
+    if (result==WAIT_PENDING) {
+      char macTail[]={collected[9],collected[10],collected[12],collected[13],collected[15],collected[16],'\0'};
+      if (strncmp_P(yourNetwork, (const char*)wifiPassword, 13) == 0) {
 	// unconfigured
         StringFormatter::send(wifiStream, F("AT+CWSAP%s=\"DCCEX_%s\",\"PASS_%s\",%d,4\r\n"),
-                                          oldCmd ? "" : "_CUR", macTail, macTail, channel);
+                                          oldCmd ? "" : "_CUR", macTail, macTail, wifiChannel);
       } else {
         // password configured by user
        StringFormatter::send(wifiStream, F("AT+CWSAP%s=\"DCCEX_%s\",\"%S\",%d,4\r\n"), oldCmd ? "" : "_CUR",
-	                                       macTail, password, channel);
+	                                       macTail, wifiPassword, wifiChannel);
       }
-    } while (!checkForOK(WIFI_CONNECT_TIMEOUT, true) && i++<2); // do twice if necessary but ignore failure as AP mode may still be ok
-    if (i >= 2)
-	DIAG(F("Warning: Setting AP SSID and password failed"));       // but issue warning
-
-    if (!oldCmd) {
-      StringFormatter::send(wifiStream, F("AT+CIPRECVMODE=0\r\n"), port); // make sure transfer mode is correct
-      checkForOK(2000, true);
+      startWait(WIFI_CONNECT_TIMEOUT, true);
+      return;
     }
-  }
-
-  StringFormatter::send(wifiStream, F("AT+CIPSERVER=0\r\n")); // turn off tcp server (to clean connections before CIPMUX=1)
-  checkForOK(1000, true); // ignore result in case it already was off
-   
-  StringFormatter::send(wifiStream, F("AT+CIPMUX=1\r\n")); // configure for multiple connections
-  if (!checkForOK(1000, true)) return WIFI_DISCONNECTED;
-
-  StringFormatter::send(wifiStream, F("AT+CIPSERVER=1,%d\r\n"), port); // turn on server on port
-  if (!checkForOK(1000, true)) return WIFI_DISCONNECTED;
-#endif //DONT_TOUCH_WIFI_CONF
- 
-  StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // Display  ip addresses to the DIAG 
-  if (!checkForOK(1000, F("IP,\"") , true, false)) return WIFI_DISCONNECTED;
-  // Copy the IP address
-  {
-    const byte MAX_IP_LENGTH=15;
-    char ipString[MAX_IP_LENGTH+1];
-    ipString[MAX_IP_LENGTH]='\0'; // protection against missing " character on end. 
-    for(byte ipLen=0;ipLen<MAX_IP_LENGTH;ipLen++) {
-      while(!wifiStream->available());
-      int ipChar=wifiStream->read();
-      StringFormatter::printEscape(ipChar);
-      if (ipChar=='"') {
-        ipString[ipLen]='\0';
-        break;
+    if (result==WAIT_TIMEOUT) {
+      // do twice if necessary but ignore failure as AP mode may still be ok
+      if (retries++<2) return;
+      DIAG(F("Warning: Setting AP SSID and password failed"));       // but issue warning
+    }
+    setState(oldCmd ? SETUP_CIPSERVER0 : SETUP_CIPRECVMODE);
+    return;
+
+  case SETUP_CIPRECVMODE:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CIPRECVMODE=0\r\n")); // make sure transfer mode is correct
+      startWait(2000, true);
+      return;
+    }
+    setState(SETUP_CIPSERVER0);
+    return;
+
+  case SETUP_CIPSERVER0:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CIPSERVER=0\r\n")); // turn off tcp server (to clean connections before CIPMUX=1)
+      startWait(1000, true); // ignore result in case it already was off
+      return;
+    }
+    setState(SETUP_CIPMUX);
+    return;
+
+  case SETUP_CIPMUX:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CIPMUX=1\r\n")); // configure for multiple connections
+      startWait(1000, true);
+      return;
+    }
+    if (result==WAIT_TIMEOUT) setupFinished(WIFI_DISCONNECTED);
+    else setState(SETUP_CIPSERVER1);
+    return;
+
+  case SETUP_CIPSERVER1:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CIPSERVER=1,%d\r\n"), wifiPort); // turn on server on port
+      startWait(1000, true);
+      return;
+    }
+    if (result==WAIT_TIMEOUT) setupFinished(WIFI_DISCONNECTED);
+    else setState(SETUP_CIFSR);
+    return;
+
+  case SETUP_CIFSR:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // Display  ip addresses to the DIAG 
+      startWait(1000, F("IP,\"") , true, false);
+      return;
+    }
+    if (result==WAIT_TIMEOUT) setupFinished(WIFI_DISCONNECTED);
+    else setState(SETUP_IP);
+    return;
+
+  case SETUP_IP:
+    // Copy the IP address
+    {
+      const byte MAX_IP_LENGTH=15;
+      bool complete=false;
+      while (wifiStream->available() && !complete) {
+        int ipChar=wifiStream->read();
+        StringFormatter::printEscape(ipChar);
+        if (ipChar=='"') complete=true;
+        else collected[charCount++]=ipChar;
+        if (charCount==MAX_IP_LENGTH) complete=true; // protection against missing " character on end.
+      }
+      if (!complete) {
+        if (millis() - startTime >= 1000) setupFinished(WIFI_DISCONNECTED);
+        return;
       }
-      ipString[ipLen]=ipChar;
+      collected[charCount]='\0';
+      LCD(4,F("%s"),collected);  // There is not enough room on some LCDs to put a title to this      
     }
-    LCD(4,F("%s"),ipString);  // There is not enough room on some LCDs to put a title to this      
+    setState(SETUP_IP_END);
+    return;
+
+  case SETUP_IP_END:
+    if (result==WAIT_PENDING) {
+      startWait(1000, true, false); // suck up anything after the IP. 
+      return;
+    }
+    if (result==WAIT_TIMEOUT) {
+      setupFinished(WIFI_DISCONNECTED);
+      return;
+    }
+    LCD(5,F("PORT=%d"),wifiPort);
+    setState(SETUP_ATE0);
+    return;
+
+  case SETUP_ATE0:
+    if (result==WAIT_PENDING) {
+      StringFormatter::send(wifiStream, F("ATE0\r\n")); // turn off the echo 
+      startWait(200, true);      
+      return;
+    }
+    setupFinished(WIFI_CONNECTED);
+    return;
+
+  case SETUP_RETRY_WAIT:
+    if (millis() - startTime < WIFI_RETRY_DELAY) return;
+    DIAG(F("++ Wifi Setup Retry ++"));
+    setState(rejoining ? rejoinState() : SETUP_AT);
+    return;
   }
-  // suck up anything after the IP. 
-  if (!checkForOK(1000, true, false)) return WIFI_DISCONNECTED;
-  LCD(5,F("PORT=%d"),port);
-   
-  return WIFI_CONNECTED;
 }
-#ifdef DONT_TOUCH_WIFI_CONF
-#pragma GCC diagnostic pop
-#endif
 
 
 // This function is used to allow users to enter <+ commands> through the DCCEXParser
@@ -338,36 +543,69 @@ bool WifiInterface::checkForOK( const unsigned int timeout,  bool echo, bool esc
   return checkForOK(timeout,F("\r\nOK\r\n"),echo,escapeEcho);
 }
 
+// Blocking wait, only used for user typed <+ commands>
 bool WifiInterface::checkForOK( const unsigned int timeout, const FSH * waitfor, bool echo, bool escapeEcho) {
-  unsigned long  startTime = millis();
-  char *locator = (char *)waitfor;
+  startWait(timeout, waitfor, echo, escapeEcho);
+  WAIT_RESULT result;
+  do {
+    Watchdog::kick();
+    result=pollWait();
+  } while (result==WAIT_PENDING);
+  return result==WAIT_FOUND;
+}
+
+void WifiInterface::startWait( const unsigned int timeout,  bool echo, bool escapeEcho) {
+  startWait(timeout,F("\r\nOK\r\n"),echo,escapeEcho);
+}
+
+void WifiInterface::startWait( const unsigned int timeout, const FSH * waitfor, bool echo, bool escapeEcho) {
+  startTime = millis();
+  waitTimeout = timeout;
+  waitFor = waitfor;
+  locator = (const char *)waitfor;
+  waitEcho = echo;
+  waitEscapeEcho = escapeEcho;
+  waiting = true;
   DIAG(F("Wifi Check: [%E]"), waitfor);
-  while ( millis() - startTime < timeout) {
-    while (wifiStream->available()) {
-      int ch = wifiStream->read();
-      if (echo) {
-        if (escapeEcho) StringFormatter::printEscape( ch); /// THIS IS A DIAG IN DISGUISE
-        else StringFormatter::diagSerial->print((char)ch); 
-      }
-      if (ch != GETFLASH(locator)) locator = (char *)waitfor;
-      if (ch == GETFLASH(locator)) {
-        locator++;
-        if (!GETFLASH(locator)) {
-          DIAG(F("Found in %dms"), millis() - startTime);
-          return true;
-        }
+}
+
+// Consume whatever the ES has sent so far, looking for the awaited text
+WifiInterface::WAIT_RESULT WifiInterface::pollWait() {
+  while (wifiStream->available()) {
+    int ch = wifiStream->read();
+    if (waitEcho) {
+      if (waitEscapeEcho) StringFormatter::printEscape( ch); /// THIS IS A DIAG IN DISGUISE
+      else StringFormatter::diagSerial->print((char)ch); 
+    }
+    if (ch != GETFLASH(locator)) locator = (const char *)waitFor;
+    if (ch == GETFLASH(locator)) {
+      locator++;
+      if (!GETFLASH(locator)) {
+        DIAG(F("Found in %dms"), millis() - startTime);
+        waiting = false;
+        return WAIT_FOUND;
       }
     }
   }
-  DIAG(F("TIMEOUT after %dms"), timeout);
-  return false;
+  if (millis() - startTime < waitTimeout) return WAIT_PENDING;
+  DIAG(F("TIMEOUT after %dms"), waitTimeout);
+  waiting = false;
+  return WAIT_TIMEOUT;
 }
 
 
 void WifiInterface::loop() {
   if (connected) {
     WifiInboundHandler::loop(); 
+    if (WifiInboundHandler::linkLost(WIFI_RETRY_DELAY)) {
+      // The ES has not rejoined the network by itself, join it again
+      DIAG(F("++ Wifi link lost ++"));
+      connected = false;
+      rejoining = true;
+      setState(rejoinState());
+    }
   }
+  else setupLoop();
 }
 
 #endif
@@ -40,14 +40,76 @@ public:
   static void ATCommand(const byte *command);
   
 private:
-  static wifiSerialState setup(Stream &setupStream, const FSH *SSSid, const FSH *password,
-                    const FSH *hostname, int port, byte channel);
-  static Stream *wifiStream;
-  static DCCEXParser parser;
-  static wifiSerialState setup2(const FSH *SSSid, const FSH *password,
-                     const FSH *hostname, int port, byte channel);
+  // The ES is set up by a state machine driven from loop() so that
+  // the DCC engine can run while the ES connects. 
+  enum SETUP_STATE : byte {
+    SETUP_IDLE,          // no AT processor found, nothing to do
+    SETUP_PROBE,         // is there a running ES with data waiting?
+    SETUP_AT,
+    SETUP_ATE1,
+    SETUP_GMR,
+    SETUP_CWJAP_QUERY,
+    SETUP_CWMODE1,
+    SETUP_PRECONFIG_WAIT, // give a preconfigured ES time to join 
+    SETUP_CWHOSTNAME,
+    SETUP_CWJAP,
+    SETUP_STA_CIFSR,
+    SETUP_STA_CHECKIP,
+    SETUP_CWMODE2,
+    SETUP_AP_CIFSR,
+    SETUP_AP_MAC,
+    SETUP_AP_CIFSR_END,
+    SETUP_CWSAP,
+    SETUP_CIPRECVMODE,
+    SETUP_CIPSERVER0,
+    SETUP_CIPMUX,
+    SETUP_CIPSERVER1,
+    SETUP_CIFSR,
+    SETUP_IP,
+    SETUP_IP_END,
+    SETUP_ATE0,
+    SETUP_RETRY_WAIT     // failed, start again later 
+  };
+  enum WAIT_RESULT : byte { WAIT_PENDING, WAIT_FOUND, WAIT_TIMEOUT };
+
+  static Stream * beginSerial(byte serialNumber);
+  static void setupLoop();
+  static void setState(SETUP_STATE state);
+  static void setupFinished(wifiSerialState wifiState);
+  static bool stationConfigured();
+  static SETUP_STATE rejoinState();
+  static void startWait(const unsigned int timeout, bool echo, bool escapeEcho = true);
+  static void startWait(const unsigned int timeout, const FSH *waitfor, bool echo, bool escapeEcho = true);
+  static WAIT_RESULT pollWait();
   static bool checkForOK(const unsigned int timeout, bool echo, bool escapeEcho = true);
   static bool checkForOK(const unsigned int timeout, const FSH *waitfor, bool echo, bool escapeEcho = true);
+
+  static Stream *wifiStream;
+  static DCCEXParser parser;
   static bool connected;
+
+  // setup parameters kept for the state machine and reconnects
+  static long linkSpeed;
+  static const FSH *wifiSSid;
+  static const FSH *wifiPassword;
+  static const FSH *wifiHostname;
+  static int wifiPort;
+  static byte wifiChannel;
+
+  static SETUP_STATE setupState;
+  static bool waiting;          // command sent, waiting for its response 
+  static bool atFound;          // an AT processor has answered on wifiStream
+  static byte serialNumber;     // which SerialN is being tried
+  static byte retries;
+  static bool oldCmd;           // ES firmware without the _CUR commands
+  static bool rejoining;        // station lost its network, only join it again
+  static byte charCount;        // chars collected for mac or ip address
+  static char collected[18];    // mac or ip address
+  static unsigned long startTime;
+  static unsigned int waitTimeout;
+  static const FSH *waitFor;
+  static const char *locator;
+  static bool waitEcho;
+  static bool waitEscapeEcho;
 };
 #endif
@@ -77,6 +77,12 @@ The configuration file for DCC-EX Command Station
 // this line exists or not. If you need to use an alternate channel (we recommend
 // using only 1,6, or 11) you may change it here.
 #define WIFI_CHANNEL 1
+//
+// WIFI_RETRY_DELAY: WiFi is set up in the background while DCC is already running.
+// If setup fails it is started again after this many milliseconds. If the
+// link to your network stays down this long the station joins it again,
+// retrying at this interval, without falling back to access point mode.
+//#define WIFI_RETRY_DELAY 30000
 
 /////////////////////////////////////////////////////////////////////////////////////
 //
@@ -111,4 +117,84 @@ The configuration file for DCC-EX Command Station
 // #define OLED_DRIVER 128,32
 
 /////////////////////////////////////////////////////////////////////////////////////
+//
+// LOCO_TABLE_SIZE: The number of locos the command station remembers speed and
+// functions for (and keeps reminding). Each one costs about 11 bytes of RAM.
+// The default is 20 on an UNO, 50 on a Mega, 120 on SAMD and 250 on a Teensy.
+// Up to 250 on a Mega or Teensy.
+//
+// #define LOCO_TABLE_SIZE 120
+//
+// The defaults for this and the other table and buffer sizes are set per
+// board in BoardProfile.h, any of them may be overridden here.
+// <D MEMORY> (also printed at startup) shows how the RAM is used.
+//
+// BACKGROUND_REMINDER_MS: Changed speeds and functions are always sent first.
+// Unchanged locos are refreshed in the background with one packet every
+// BACKGROUND_REMINDER_MS milliseconds (default 0, whenever the track is idle).
+// Raising this leaves the track idle more and lets new commands out sooner.
+//
+// #define BACKGROUND_REMINDER_MS 20
+//
+// MOMENTUM_MS: Locos given momentum with <m CAB ACCEL DECEL [VMAX]> are 
+// ramped to the speed their throttle set by the command station, one step 
+// every MOMENTUM_MS milliseconds (default 50), a packet only being sent 
+// when the speed step the decoder sees changes.
+//
+// #define MOMENTUM_MS 50
+//
+// ACCESSORY_PULSE_MS: Accessory commands (<a>, DCC turnouts) are queued and
+// sent between the loco packets. With this set, each accessory output is sent
+// an "off" packet this many milliseconds after it was switched on, for
+// decoders that do not time their own coil pulse (default 0, no off packet).
+//
+// #define ACCESSORY_PULSE_MS 100
+//
+// DISTRICT_DRIVERS: Up to 4 more motor drivers (boosters) that carry the main
+// track signal as separate power districts. Each one has its own overload
+// trip and retry, so a short in one district leaves the others running.
+// They are switched with the main track and reported by <c>.
+//
+// #define DISTRICT_DRIVERS new MotorDriver(5, 22, UNUSED_PIN, UNUSED_PIN, A2, 2.99, 2000, UNUSED_PIN), new MotorDriver(6, 23, UNUSED_PIN, UNUSED_PIN, A3, 2.99, 2000, UNUSED_PIN)
+//
+// RAILCOM_CUTOUT: Open a RailCom cutout on the main track after every packet
+// so that RailCom detectors can read the decoders. The motor shield brake pin
+// is used if there is one, otherwise the track power is switched off for the
+// cutout. 15 preamble bits follow each cutout. With <1 JOIN> the prog track
+// has the cutouts as well. <D RAILCOM OFF> stops the cutouts until <D RAILCOM ON>.
+//
+// #define RAILCOM_CUTOUT
+//
+// DCC_TIMER_BITS: On an UNO or Mega with both signal pins on Timer1 (the
+// "high accuracy waveform" at startup) let the timer make the DCC edges and
+// interrupt once per 116uS instead of every 58uS, leaving more time for the
+// network. Not used with DISTRICT_DRIVERS or RAILCOM_CUTOUT.
+//
+// #define DCC_TIMER_BITS
+//
+// DCC_TIMER_DMA: On a SAMD21 with all the signal pins on one port, stream the
+// signal to the pins by DMA so that the CPU only has to prepare the next 16
+// half bits every 928uS. Not used with RAILCOM_CUTOUT.
+//
+// #define DCC_TIMER_DMA
+//
+// PACKET_TRACE: Keep the last 16 packets each track sent, exactly as they
+// were shifted out, and decode them again for <D TRACE>. Costs about 130
+// bytes of RAM per track.
+//
+// #define PACKET_TRACE
+//
+// BENCHMARKS: Build <D BENCH>, which times the parser, turnout and loco
+// lookups, StringFormatter and RingStream and reports operations per second.
+//
+// #define BENCHMARKS
+//
+// LOOP_STALL_MS: On AVR boards, a pass of the main loop taking longer than
+// LOOP_STALL_MS (default 2000, rounded up to 1, 2, 4 or 8 seconds) resets
+// the board with the track off. The section of the loop that stalled is
+// reported when it starts again. DISABLE_WATCHDOG leaves it out.
+//
+// #define LOOP_STALL_MS 2000
+// #define DISABLE_WATCHDOG
 
+/////////////////////////////////////////////////////////////////////////////////////
@@ -27,6 +27,9 @@ extern "C" char* sbrk(int);
 #elif defined(__AVR__)
 extern char *__brkval;
 extern char *__malloc_heap_start;
+#elif defined(HOST_BUILD)
+// the host has no shortage, report the free RAM of a Mega after start up
+const int HOST_FREE_MEMORY=4096;
 #else
 #error Unsupported board type
 #endif
@@ -41,6 +44,9 @@ static inline int freeMemory() {
   return &top - reinterpret_cast<char*>(sbrk(0));
 #elif defined(__AVR__)
   return __brkval ? &top - __brkval : &top - __malloc_heap_start;
+#elif defined(HOST_BUILD)
+  (void)top;
+  return HOST_FREE_MEMORY;
 #else
 #error bailed out already above
 #endif
@@ -0,0 +1,175 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(HOST_BUILD)
+// Mock Arduino core for the host build, see Arduino.h
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <Wire.h>
+
+volatile uint8_t hostPorts[NUM_DIGITAL_PINS/8+1];
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+TwoWire Wire;
+
+static unsigned long long clockMicros=0;
+static HOST_TICK_CALLBACK tickCallback=NULL;
+static HOST_TICK_CALLBACK tickObserver=NULL;
+static unsigned int tickMicros=0;
+static unsigned long long nextTick=0;
+static bool interruptsOff=false;
+HostSREG SREG;
+static int analogValues[NUM_DIGITAL_PINS];
+
+unsigned long micros() { return (unsigned long)clockMicros; }
+unsigned long millis() { return (unsigned long)(clockMicros/1000); }
+
+void hostSetTick(HOST_TICK_CALLBACK callback, unsigned int microseconds) {
+  tickCallback=callback;
+  tickMicros=microseconds;
+  nextTick=clockMicros+microseconds;
+}
+
+void hostSetTickObserver(HOST_TICK_CALLBACK observer) {
+  tickObserver=observer;
+}
+
+// A tick held off by noInterrupts() runs as soon as they are allowed again
+void hostAdvance(unsigned long microseconds) {
+  unsigned long long end=clockMicros+microseconds;
+  while (tickCallback && nextTick<=end) {
+    clockMicros=nextTick;
+    if (interruptsOff) break;
+    nextTick+=tickMicros;
+    interruptsOff=true;  // as in a real interrupt
+    tickCallback();
+    interruptsOff=false;
+    if (tickObserver) tickObserver();
+  }
+  if (end>clockMicros) clockMicros=end;
+}
+
+void delay(unsigned long ms) { hostAdvance(ms*1000UL); }
+void delayMicroseconds(unsigned int us) { hostAdvance(us); }
+
+void noInterrupts() { interruptsOff=true; }
+void interrupts() {
+  interruptsOff=false;
+  if (tickCallback && nextTick<=clockMicros) hostAdvance(0);
+}
+
+HostSREG::operator uint8_t() const { return interruptsOff ? 0 : 0x80; }
+HostSREG & HostSREG::operator=(uint8_t value) {
+  if (value & 0x80) interrupts();
+  else noInterrupts();
+  return *this;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin>=NUM_DIGITAL_PINS) return;
+  if (value) hostPorts[pin/8] |= digitalPinToBitMask(pin);
+  else hostPorts[pin/8] &= ~digitalPinToBitMask(pin);
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin>=NUM_DIGITAL_PINS) return LOW;
+  return (hostPorts[pin/8] & digitalPinToBitMask(pin)) ? HIGH : LOW;
+}
+
+void hostSetAnalog(uint8_t pin, int value) { if (pin<NUM_DIGITAL_PINS) analogValues[pin]=value; }
+int analogRead(uint8_t pin) { return pin<NUM_DIGITAL_PINS ? analogValues[pin] : 0; }
+void analogWrite(uint8_t pin, int value) { digitalWrite(pin, value>=128); }
+
+char * itoa(int value, char * buffer, int base) {
+  if (base==16) sprintf(buffer, "%x", value);
+  else if (base==8) sprintf(buffer, "%o", value);
+  else sprintf(buffer, "%d", value);
+  return buffer;
+}
+
+size_t Print::write(const uint8_t * buffer, size_t size) {
+  size_t n=0;
+  while (size--) n+=write(*buffer++);
+  return n;
+}
+
+size_t Print::print(long n, int base) {
+  if (base==DEC) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%ld", n);
+    return write(buffer);
+  }
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char buffer[8*sizeof(long)+1];
+  char * p=&buffer[sizeof(buffer)-1];
+  *p='\0';
+  if (base<2) base=DEC;
+  do {
+    int digit=n%base;
+    *--p=digit<10 ? '0'+digit : 'A'+digit-10;
+    n/=base;
+  } while (n);
+  return write(p);
+}
+
+size_t Print::print(double n, int digits) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+  return write(buffer);
+}
+
+size_t Stream::readBytes(char * buffer, size_t length) {
+  size_t n=0;
+  while (n<length && available()) buffer[n++]=read();
+  return n;
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+  if (!silent) putchar(b);
+  return 1;
+}
+
+int HardwareSerial::available() { return (int)((head+INPUT_SIZE-tail)%INPUT_SIZE); }
+
+int HardwareSerial::read() {
+  if (head==tail) return -1;
+  int c=(uint8_t)input[tail];
+  tail=(tail+1)%INPUT_SIZE;
+  bytesRead++;
+  return c;
+}
+
+int HardwareSerial::peek() { return head==tail ? -1 : (uint8_t)input[tail]; }
+
+// As much as fits in the receive buffer
+size_t HardwareSerial::feed(const char * text, size_t length) {
+  size_t taken=0;
+  while (taken<length) {
+    size_t next=(head+1)%INPUT_SIZE;
+    if (next==tail) break;
+    input[head]=text[taken++];
+    head=next;
+  }
+  return taken;
+}
+#endif
@@ -0,0 +1,176 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Arduino_h
+#define Arduino_h
+
+// Mock Arduino core for the host build, see host/build.sh. Time is
+// simulated: micros() only moves when the host harness (or delay) moves
+// it, and the DCC timer interrupt is called by the clock as each tick is
+// passed, between loop() passes rather than in the middle of them.
+// Pins are bits in the fake port registers below, numbered as on an
+// Uno/Mega board with 8 pins to a port, so FASTPIN writes can be watched.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <math.h>
+#include "avr/pgmspace.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+#define CHANGE 1
+
+#define NUM_DIGITAL_PINS 70
+#define A0 54
+#define A1 55
+#define A2 56
+#define A3 57
+#define A4 58
+#define A5 59
+#define NOT_A_PIN 0
+#define NOT_A_PORT 0xFF
+#define F_CPU 16000000L
+
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define bitRead(v,b) (((v) >> (b)) & 0x01)
+#define bitSet(v,b) ((v) |= (1UL << (b)))
+#define bitClear(v,b) ((v) &= ~(1UL << (b)))
+#define bitWrite(v,b,on) ((on) ? bitSet(v,b) : bitClear(v,b))
+#define _BV(b) (1<<(b))
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+#define constrain(a,l,h) ((a)<(l)?(l):((a)>(h)?(h):(a)))
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper*)(s))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void noInterrupts();
+void interrupts();
+inline void cli() { noInterrupts(); }
+inline void sei() { interrupts(); }
+// The status register only holds the interrupt enable bit, as saved 
+// and restored around critical sections
+struct HostSREG {
+  operator uint8_t() const;
+  HostSREG & operator=(uint8_t value);
+};
+extern HostSREG SREG;
+
+extern volatile uint8_t hostPorts[NUM_DIGITAL_PINS/8+1];
+inline uint8_t digitalPinToPort(uint8_t pin) { return pin<NUM_DIGITAL_PINS ? pin/8 : NOT_A_PORT; }
+inline uint8_t digitalPinToBitMask(uint8_t pin) { return 1<<(pin%8); }
+inline volatile uint8_t * portOutputRegister(uint8_t port) { return &hostPorts[port]; }
+inline volatile uint8_t * portInputRegister(uint8_t port) { return &hostPorts[port]; }
+inline volatile uint8_t * portModeRegister(uint8_t port) { static volatile uint8_t modes[NUM_DIGITAL_PINS/8+1]; return &modes[port]; }
+
+char * itoa(int value, char * buffer, int base);
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b)=0;
+    virtual size_t write(const uint8_t * buffer, size_t size);
+    size_t write(const char * s) { return write((const uint8_t *)s, strlen(s)); }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+    size_t print(const __FlashStringHelper * s) { return print((const char *)s); }
+    size_t print(const char * s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n, int base=DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base=DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base=DEC);
+    size_t print(unsigned long n, int base=DEC);
+    size_t print(double n, int digits=2);
+    size_t println() { return write("\r\n"); }
+    size_t println(const char * s) { return print(s)+println(); }
+    size_t println(char c) { return print(c)+println(); }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available()=0;
+    virtual int read()=0;
+    virtual int peek()=0;
+    size_t readBytes(char * buffer, size_t length);
+    size_t readBytes(uint8_t * buffer, size_t length) { return readBytes((char *)buffer, length); }
+};
+
+// Input comes from feed(), output goes to stdout unless silenced
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long speed) { (void)speed; }
+    size_t write(uint8_t b);
+    using Print::write;
+    int available();
+    int read();
+    int peek();
+    operator bool() { return true; }
+    size_t feed(const char * text, size_t length);  // returns the bytes taken
+    bool silent=false;
+    unsigned long long bytesRead=0;  // by the sketch, since the start
+  private:
+    static const size_t INPUT_SIZE=4096;
+    char input[INPUT_SIZE];
+    size_t head=0;
+    size_t tail=0;
+};
+extern HardwareSerial Serial;
+
+// The sketch
+void setup();
+void loop();
+#if defined(CORE_SPLIT)
+void loop1();  // the second core's loop, run after loop() in each pass
+#endif
+
+// Host harness controls, not part of the Arduino API
+typedef void (*HOST_TICK_CALLBACK)();
+void hostSetTick(HOST_TICK_CALLBACK callback, unsigned int microseconds);
+void hostSetTickObserver(HOST_TICK_CALLBACK observer);  // called after each tick
+void hostAdvance(unsigned long microseconds);  // runs the ticks passed on the way
+void hostSetAnalog(uint8_t pin, int value);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef EEPROM_h
+#define EEPROM_h
+// Host build: the EEPROM of a Mega in RAM, erased (0xFF) at start
+#include <Arduino.h>
+
+class EEPROMClass {
+  public:
+    EEPROMClass() { memset(cells, 0xFF, sizeof(cells)); }
+    uint8_t read(int address) { return inRange(address) ? cells[address] : 0xFF; }
+    void write(int address, uint8_t value) { if (inRange(address)) { cells[address]=value; writes++; } }
+    void update(int address, uint8_t value) { if (read(address)!=value) write(address, value); }
+    template <typename T> T & get(int address, T & t) {
+      for (size_t i=0; i<sizeof(T); i++) ((uint8_t *)&t)[i]=read(address+i);
+      return t;
+    }
+    template <typename T> const T & put(int address, const T & t) {
+      for (size_t i=0; i<sizeof(T); i++) update(address+i, ((const uint8_t *)&t)[i]);
+      return t;
+    }
+    uint16_t length() { return SIZE; }
+    unsigned long writes=0;  // cells actually written, for wear figures
+  private:
+    static const uint16_t SIZE=4096;
+    bool inRange(int address) { return address>=0 && address<SIZE; }
+    uint8_t cells[SIZE];
+};
+extern EEPROMClass EEPROM;
+#endif
@@ -0,0 +1,231 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(HOST_BUILD)
+// Host build: dccex-host bench [-n clients] [-t ms] [-l us] [workload...]
+// Fixed workloads through the paths the wishlist wants to speed up.
+// Simulated time makes the track side reproducible run to run; host CPU
+// times vary with the machine, so only compare them on the same one.
+//   throttles   N DCC-EX clients sending <t> through CommandDistributor
+//   withrottle  N WiThrottle clients sending MT speed changes
+//   reminders   50 locos in the DCC reminder cycle
+//   turnouts    Turnout::get and <T> throws with 300 turnouts
+//   ring        RingStream messages written and drained
+// Each reports ops/s of host CPU for the code under test and, where the
+// work ends up on the rails, the simulated time the packet took to get
+// there.
+
+#include "HostHarness.h"
+#include "../DCC.h"
+#include "../Turnouts.h"
+#include "../BoardProfile.h"
+#include <unistd.h>
+
+static unsigned int clients=8;
+static unsigned long runMs=5000;
+static const unsigned long THINK_MS=100;   // between a client's commands
+static const unsigned long GIVE_UP_MS=2000; // for a packet that never comes
+static const int REMINDER_LOCOS=50;
+static const int TURNOUTS=300;
+
+static void run(unsigned long ms, HostNetwork * network=NULL) {
+  unsigned long start=micros();
+  while (micros()-start < ms*1000UL) hostStep(network);
+}
+
+static void reportOps(const char * name, const char * what, unsigned long ops, unsigned long long hostMicros) {
+  if (hostMicros==0) hostMicros=1;
+  printf("<* BENCH %s %s ops/s=%llu ops=%lu *>\n", name, what, ops*1000000ULL/hostMicros, ops);
+}
+
+// Closed loop throttles: each client changes the speed of its own loco,
+// waits for the change to reach the rails, thinks for THINK_MS, repeats.
+static void benchThrottles(const char * name, bool withrottle) {
+  HostNetwork network(WIFI_OUTBOUND_RING);
+  Latencies track;
+  const int firstCab = withrottle ? 60 : 10;
+  std::vector<unsigned long> due(clients);
+  std::vector<bool> fast(clients, false);
+  char command[40];
+  for (unsigned int c=0; c<clients; c++) {
+    if (withrottle) {
+      snprintf(command, sizeof(command), "HUbench%u", c);
+      network.arrive(c, command);
+      snprintf(command, sizeof(command), "MT+S%u<;>S%u", firstCab+c, firstCab+c);
+      network.arrive(c, command);
+    }
+    due[c]=micros() + c*THINK_MS*1000UL/clients;
+  }
+  unsigned long start=micros();
+  while (micros()-start < runMs*1000UL) {
+    for (unsigned int c=0; c<clients; c++) {
+      int cab=firstCab+c;
+      if (TrackWatch::waiting(cab) || (long)(micros()-due[c])<0) continue;
+      fast[c]=!fast[c];
+      int speed = fast[c] ? 40 : 20;
+      if (withrottle) snprintf(command, sizeof(command), "MTAS%d<;>V%d", cab, speed);
+      else snprintf(command, sizeof(command), "<t 1 %d %d 1>", cab, speed);
+      TrackWatch::expect(cab, &track);
+      network.arrive(c, command);
+      due[c]=micros()+THINK_MS*1000UL;
+    }
+    hostStep(&network);
+  }
+  reportOps(name, "CommandDistributor::parse", network.parsed, network.parseMicros);
+  network.replies.report(name, "arrival to reply");
+  track.report(name, "command to rails");
+  TrackWatch::clear();
+  network.forget();
+  DCC::forgetAllLocos();
+}
+
+static void benchReminders() {
+  const char * name="reminders";
+  Latencies refresh;
+  Latencies track;
+  for (int cab=1; cab<=REMINDER_LOCOS; cab++) DCC::setThrottle(cab, 10, true);
+  run(1000);  // every loco on the rails at least once
+  TrackWatch::refresh=&refresh;
+  unsigned long long loopMicros=0;
+  unsigned long passes=0;
+  unsigned long start=micros();
+  while (micros()-start < runMs*1000UL) {
+    unsigned long long started=hostRealMicros();
+    loop();
+    loopMicros+=hostRealMicros()-started;
+    passes++;
+    hostAdvance(hostLoopMicros);
+  }
+  reportOps(name, "loop()", passes, loopMicros);
+  refresh.report(name, "between speed packets of a loco");
+  TrackWatch::refresh=NULL;
+  for (int cab=1; cab<=REMINDER_LOCOS; cab++) {
+    TrackWatch::expect(cab, &track);
+    DCC::setThrottle(cab, 30, true);
+    unsigned long sent=micros();
+    while (TrackWatch::waiting(cab) && micros()-sent < GIVE_UP_MS*1000UL) hostStep();
+  }
+  track.report(name, "setThrottle to rails");
+  TrackWatch::clear();
+  DCC::forgetAllLocos();
+}
+
+static void benchTurnouts() {
+  const char * name="turnouts";
+  for (int id=1; id<=TURNOUTS; id++) Turnout::create(id, 1+id/4, id%4);
+  // ids in a fixed pseudo random order, 1 in 8 of them not defined
+  const unsigned long lookups=200000;
+  unsigned long seed=12345;
+  unsigned long found=0;
+  unsigned long long started=hostRealMicros();
+  for (unsigned long i=0; i<lookups; i++) {
+    seed=seed*1103515245UL+12345UL;
+    if (Turnout::get(1+(seed>>16)%(TURNOUTS+TURNOUTS/8))) found++;
+  }
+  reportOps(name, "Turnout::get", lookups, hostRealMicros()-started);
+  if (found==0) printf("<* BENCH %s no turnouts found *>\n", name);
+
+  HostNetwork network(WIFI_OUTBOUND_RING);
+  Latencies track;
+  char command[20];
+  for (int throw_=0; throw_<50; throw_++) {
+    snprintf(command, sizeof(command), "<T %d %d>", 1+(throw_*37)%TURNOUTS, throw_%2);
+    TrackWatch::expectAccessory(&track);
+    network.arrive(0, command);
+    unsigned long sent=micros();
+    while (TrackWatch::waitingAccessory() && micros()-sent < GIVE_UP_MS*1000UL) hostStep(&network);
+    run(THINK_MS, &network);
+  }
+  reportOps(name, "<T> parse", network.parsed, network.parseMicros);
+  track.report(name, "<T> to rails");
+  TrackWatch::clear();
+  network.forget();
+  for (int id=1; id<=TURNOUTS; id++) Turnout::remove(id);
+}
+
+// Replies from every client, then drained, as WifiInboundHandler does
+static void benchRing() {
+  const char * name="ring";
+  RingStream ring(WIFI_OUTBOUND_RING);
+  byte message[24];
+  memset(message, 'x', sizeof(message));
+  const unsigned long batches=50000;
+  unsigned long messages=0;
+  unsigned long long started=hostRealMicros();
+  for (unsigned long b=0; b<batches; b++) {
+    for (unsigned int c=0; c<clients; c++) {
+      ring.mark(c);
+      ring.write(message, sizeof(message));
+      if (ring.commit()) messages++;
+    }
+    while (ring.read()>=0) {
+      int length=ring.count();
+      while (length>0) {
+        byte * span;
+        int bytes=ring.peekSpan(span);
+        if (bytes>length) bytes=length;
+        ring.consume(bytes);
+        length-=bytes;
+      }
+    }
+  }
+  reportOps(name, "message", messages, hostRealMicros()-started);
+}
+
+int hostBench(int argc, char ** argv) {
+  int opt;
+  optind=1;
+  while ((opt=getopt(argc, argv, "n:t:l:"))!=-1) {
+    switch (opt) {
+      case 'n': clients=strtoul(optarg, NULL, 10); break;
+      case 't': runMs=strtoul(optarg, NULL, 10); break;
+      case 'l': hostLoopMicros=strtoul(optarg, NULL, 10); break;
+      default: return 2;
+    }
+  }
+  if (clients<1 || clients>10 || hostLoopMicros==0) {
+    fprintf(stderr, "bench: 1 to 10 clients\n");
+    return 2;
+  }
+  const char * all[]={"throttles", "withrottle", "reminders", "turnouts", "ring"};
+  std::vector<const char *> workloads(argv+optind, argv+argc);
+  if (workloads.empty()) workloads.assign(all, all+5);
+
+  Serial.silent=true;
+  hostStart();
+  printf("<* BENCH clients=%u run=%lums loop=%luus *>\n", clients, runMs, hostLoopMicros);
+  // without track power nothing reaches the rails
+  HostNetwork console(64);
+  console.arrive(0, "<1 MAIN>");
+  run(100, &console);
+  console.forget();
+  for (const char * w : workloads) {
+    if (!strcmp(w, "throttles")) benchThrottles(w, false);
+    else if (!strcmp(w, "withrottle")) benchThrottles(w, true);
+    else if (!strcmp(w, "reminders")) benchReminders();
+    else if (!strcmp(w, "turnouts")) benchTurnouts();
+    else if (!strcmp(w, "ring")) benchRing();
+    else {
+      fprintf(stderr, "bench: no workload %s\n", w);
+      return 2;
+    }
+    fflush(stdout);
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,184 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(HOST_BUILD)
+#include "HostHarness.h"
+#include "../CommandDistributor.h"
+#include <time.h>
+
+// Signal pins of STANDARD_MOTOR_SHIELD, the config.example.h default
+TrackDecoder mainDecoder("main", 12);
+TrackDecoder progDecoder("prog", 13);
+unsigned long hostLoopMicros=100;
+bool hostPrintPackets=false;
+
+static void sampleTracks() {
+  mainDecoder.sample();
+  progDecoder.sample();
+}
+
+static void onPacket(const char * track, unsigned long at, const byte packet[], byte length, bool checksumOK) {
+  if (checksumOK && track==mainDecoder.name) TrackWatch::packet(at, packet, length);
+  if (!hostPrintPackets) return;
+  if (checksumOK && length==3 && packet[0]==0xFF && packet[1]==0x00) return;  // idle
+  printf("%s %lu.%03lums", track, at/1000, at%1000);
+  for (byte i=0; i<length; i++) printf(" %02X", packet[i]);
+  printf("%s\n", checksumOK ? "" : " BAD");
+}
+
+void hostStart() {
+  hostSetTickObserver(sampleTracks);
+  TrackDecoder::onPacket=onPacket;
+  setup();
+}
+
+void hostStep(HostNetwork * network) {
+  if (network) network->loop();
+  loop();
+#if defined(CORE_SPLIT)
+  loop1();
+#endif
+  hostAdvance(hostLoopMicros);
+}
+
+unsigned long long hostRealMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec*1000000ULL + now.tv_nsec/1000;
+}
+
+void Latencies::report(const char * name, const char * what) {
+  if (samples.empty()) {
+    printf("<* BENCH %s %s none *>\n", name, what);
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  size_t n=samples.size();
+  unsigned long long total=0;
+  for (unsigned long s : samples) total+=s;
+  printf("<* BENCH %s %s p50=%luus p95=%luus p99=%luus max=%luus mean=%lluus samples=%zu *>\n",
+    name, what, samples[n*50/100], samples[n*95/100], samples[n*99/100], samples[n-1], total/n, n);
+}
+
+std::vector<TrackWatch::WAIT> TrackWatch::waits;
+unsigned long TrackWatch::lastSeen[MAX_CAB+1];
+byte TrackWatch::lastByte[MAX_CAB+1];
+Latencies * TrackWatch::refresh=NULL;
+Latencies * TrackWatch::accessoryInto=NULL;
+unsigned long TrackWatch::accessorySince=0;
+
+void TrackWatch::expect(int cab, Latencies * into) {
+  if (cab<1 || cab>MAX_CAB) return;
+  int old=lastSeen[cab] ? lastByte[cab] : -1;
+  waits.push_back({cab, old, micros(), into});
+}
+
+void TrackWatch::expectAccessory(Latencies * into) {
+  accessoryInto=into;
+  accessorySince=micros();
+}
+
+bool TrackWatch::waiting(int cab) {
+  for (WAIT & w : waits) if (w.cab==cab) return true;
+  return false;
+}
+
+void TrackWatch::clear() {
+  waits.clear();
+  memset(lastSeen, 0, sizeof(lastSeen));
+  refresh=NULL;
+  accessoryInto=NULL;
+}
+
+// Speeds are 128 step packets: address, 0x3F, speed and direction
+void TrackWatch::packet(unsigned long at, const byte packet[], byte length) {
+  if (packet[0]>=0x80 && packet[0]<=0xBF && length==3) {  // basic accessory
+    if (accessoryInto) accessoryInto->add(at-accessorySince);
+    accessoryInto=NULL;
+    return;
+  }
+  int cab;
+  byte i;
+  if (packet[0]>=1 && packet[0]<=127) {
+    cab=packet[0];
+    i=1;
+  }
+  else if (packet[0]>=0xC0 && packet[0]<=0xE7 && length>1) {
+    cab=((packet[0]&0x3F)<<8) | packet[1];
+    i=2;
+  }
+  else return;
+  if (length!=i+3 || packet[i]!=0x3F || cab>MAX_CAB) return;
+  byte speed=packet[i+1];
+  if (refresh && lastSeen[cab]) refresh->add(at-lastSeen[cab]);
+  lastSeen[cab]=at;
+  lastByte[cab]=speed;
+  for (size_t w=0; w<waits.size(); w++) {
+    if (waits[w].cab!=cab || waits[w].oldByte==speed) continue;
+    waits[w].into->add(at-waits[w].since);
+    waits.erase(waits.begin()+w);
+    return;
+  }
+}
+
+HostNetwork::HostNetwork(int ringSize) {
+  ring=new RingStream(ringSize);
+}
+
+void HostNetwork::arrive(byte clientId, const std::string & command) {
+  inbound.push_back({clientId, command, micros()});
+}
+
+void HostNetwork::loop() {
+  if (!inbound.empty()) {
+    INBOUND & in=inbound.front();
+    std::vector<byte> buffer(in.command.begin(), in.command.end());
+    buffer.push_back(0);
+    unsigned long long started=hostRealMicros();
+    CommandDistributor::receive(in.clientId, buffer.data(), in.command.size(), ring);
+    unsigned long long took=hostRealMicros()-started;
+    handling.add(took);
+    parseMicros+=took;
+    parsed++;
+    replies.add(micros()-in.arrived+hostLoopMicros);  // sent as this pass ends
+    inbound.pop_front();
+  }
+  drain();
+}
+
+// Replies and broadcasts go out as fast as they are written
+void HostNetwork::drain() {
+  while (ring->read()>=0) {  // the client id mark
+    int length=ring->count();
+    replyBytes+=length;
+    while (length>0) {
+      byte * span;
+      int bytes=ring->peekSpan(span);
+      if (bytes>length) bytes=length;
+      ring->consume(bytes);
+      length-=bytes;
+    }
+  }
+}
+
+void HostNetwork::forget() {
+  inbound.clear();
+  drain();
+  CommandDistributor::forget(ring);
+}
+#endif
@@ -0,0 +1,103 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef HostHarness_h
+#define HostHarness_h
+// Host build: what the run, bench and replay modes of dccex-host share.
+// A loop pass is the sketch's loop() plus a network interface, taking
+// hostLoopMicros of simulated time. The main track is watched so that
+// the time from a command to its packet on the rails can be measured.
+
+// The C++ library headers go first, before Arduino.h defines min and max
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <Arduino.h>
+#include "../RingStream.h"
+#include "TrackDecoder.h"
+
+extern TrackDecoder mainDecoder;
+extern TrackDecoder progDecoder;
+extern unsigned long hostLoopMicros;
+extern bool hostPrintPackets;
+
+class HostNetwork;
+void hostStart();  // setup() with the decoders watching
+void hostStep(HostNetwork * network=NULL);  // one loop pass
+unsigned long long hostRealMicros();  // wall clock, for host CPU time
+
+// Samples in microseconds, reported as percentiles
+class Latencies {
+  public:
+    void add(unsigned long us) { samples.push_back(us); }
+    size_t count() { return samples.size(); }
+    void report(const char * name, const char * what);
+  private:
+    std::vector<unsigned long> samples;
+};
+
+// Packets on the main track. expect starts a measurement for a cab
+// whose speed is about to change, it ends when a speed packet for the
+// cab carries a byte other than the last one seen. expectAccessory ends
+// with the next accessory packet.
+class TrackWatch {
+  public:
+    static void expect(int cab, Latencies * into);
+    static void expectAccessory(Latencies * into);
+    static bool waiting(int cab);
+    static bool waitingAccessory() { return accessoryInto!=NULL; }
+    static void clear();
+    static void packet(unsigned long micros, const byte packet[], byte length);
+    static const int MAX_CAB=10239;
+    static Latencies * refresh;  // time between speed packets of a cab, if set
+  private:
+    struct WAIT { int cab; int oldByte; unsigned long since; Latencies * into; };
+    static std::vector<WAIT> waits;
+    static unsigned long lastSeen[MAX_CAB+1];  // micros of the latest speed packet
+    static byte lastByte[MAX_CAB+1];
+    static Latencies * accessoryInto;
+    static unsigned long accessorySince;
+};
+
+// A network interface as WifiInboundHandler and EthernetInterface drive
+// it: commands queue as they arrive, one is handled per loop pass with
+// its reply written to the shared ring, then the ring is drained.
+// The sketch's loop, through CommandDistributor, writes the broadcasts.
+class HostNetwork {
+  public:
+    HostNetwork(int ringSize);
+    void arrive(byte clientId, const std::string & command);
+    void loop();
+    bool idle() { return inbound.empty(); }
+    void forget();
+    RingStream * ring;
+    Latencies replies;  // simulated arrival to reply
+    Latencies handling; // host CPU time of CommandDistributor::parse
+    unsigned long parsed=0;
+    unsigned long long parseMicros=0;  // host CPU, total
+    unsigned long replyBytes=0;
+  private:
+    struct INBOUND { byte clientId; std::string command; unsigned long arrived; };
+    std::deque<INBOUND> inbound;
+    void drain();
+};
+
+int hostBench(int argc, char ** argv);
+int hostReplay(int argc, char ** argv);
+#endif
@@ -0,0 +1,95 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(HOST_BUILD)
+// Host build entry point, see host/build.sh. Runs the command station
+// sketch against the mock core in simulated time, feeding commands to
+// Serial and decoding the signal of both tracks.
+//   dccex-host [-c commands] [-t ms] [-l us] [-p] [-q]
+//   dccex-host bench ...   see HostBench.cpp
+//   dccex-host replay ...  see HostReplay.cpp
+
+#include <unistd.h>
+#include "HostHarness.h"
+#include "../CommandStation-EX.ino"
+
+static void report(TrackDecoder & d, unsigned long ms) {
+  printf("<* HOST %s: %lu packets, %lu idle, %lu bad, %lu framing, %lu packets/s *>\n",
+    d.name, d.packets, d.idlePackets, d.badPackets, d.framing, ms ? d.packets*1000UL/ms : 0);
+}
+
+static int usage() {
+  fprintf(stderr,
+    "usage: dccex-host [-c commands] [-t ms] [-l us] [-p] [-q]\n"
+    "       dccex-host bench [-n clients] [-t ms] [-l us] [workload...]\n"
+    "       dccex-host replay [-x speedup] [-l us] [-v] LOG\n"
+    "  -c  commands to send on Serial, otherwise they are read from stdin\n"
+    "  -t  simulated time to run for after setup, default 2000ms\n"
+    "  -l  simulated time each loop() pass takes, default 100us\n"
+    "  -p  print every packet other than idles\n"
+    "  -q  do not print what the command station writes to Serial\n");
+  return 2;
+}
+
+int main(int argc, char ** argv) {
+  if (argc>1 && !strcmp(argv[1], "bench")) {
+    int result=hostBench(argc-1, argv+1);
+    return result==2 ? usage() : result;
+  }
+  if (argc>1 && !strcmp(argv[1], "replay")) {
+    int result=hostReplay(argc-1, argv+1);
+    return result==2 ? usage() : result;
+  }
+
+  std::string input;
+  bool haveInput=false;
+  unsigned long runMs=2000;
+  int opt;
+  while ((opt=getopt(argc, argv, "c:t:l:pq"))!=-1) {
+    switch (opt) {
+      case 'c': input=optarg; haveInput=true; break;
+      case 't': runMs=strtoul(optarg, NULL, 10); break;
+      case 'l': hostLoopMicros=strtoul(optarg, NULL, 10); break;
+      case 'p': hostPrintPackets=true; break;
+      case 'q': Serial.silent=true; break;
+      default: return usage();
+    }
+  }
+  if (optind<argc || hostLoopMicros==0) return usage();
+  if (!haveInput) {
+    char buffer[1024];
+    size_t n;
+    while ((n=fread(buffer, 1, sizeof(buffer), stdin))>0) input.append(buffer, n);
+  }
+
+  hostStart();
+  size_t fed=0;
+  unsigned long started=micros();
+  unsigned long passes=0;
+  while (micros()-started < runMs*1000UL) {
+    if (fed<input.size()) fed+=Serial.feed(input.data()+fed, input.size()-fed);
+    hostStep();
+    passes++;
+  }
+  fflush(stdout);
+  report(mainDecoder, runMs);
+  report(progDecoder, runMs);
+  printf("<* HOST %lu loop passes in %lums *>\n", passes, runMs);
+  return 0;
+}
+#endif
@@ -0,0 +1,212 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(HOST_BUILD)
+// Host build: dccex-host replay [-x speedup] [-l us] [-v] LOG
+// Feeds the traffic recorded with <D RECORD ON> back into the command
+// station at its original pace, or speedup times faster. LOG is the
+// console output of the board, other lines in it are skipped, - reads
+// stdin. Serial commands go to Serial, the rest arrive at a network
+// interface by their client id.
+// Reported per source, serial and network, as percentiles:
+//   arrival to reply: simulated time from a command arriving to its
+//     reply being written, the queueing of a busy loop included
+//   handled on host: host CPU time of CommandDistributor::parse
+//   recorded on board: the handling time in the log, for comparison
+
+#include "HostHarness.h"
+#include "../BoardProfile.h"
+#include <unistd.h>
+
+struct RECORD {
+  unsigned long delta;  // ms since the previous command
+  int source;           // client id, -1 serial
+  unsigned long micros; // handling time on the board
+  std::string command;
+};
+
+static int hexValue(char c) {
+  if (c>='0' && c<='9') return c-'0';
+  if (c>='A' && c<='F') return c-'A'+10;
+  if (c>='a' && c<='f') return c-'a'+10;
+  return -1;
+}
+
+// Binary frames are logged as hex bytes with a space after each, the
+// first with the frame flag set
+static bool unhex(const std::string & text, std::string & bytes) {
+  bytes.clear();
+  size_t i=0;
+  while (i<text.size()) {
+    int high=hexValue(text[i]);
+    if (high<0) return false;
+    int value=high;
+    i++;
+    if (i<text.size() && hexValue(text[i])>=0) value=value*16+hexValue(text[i++]);
+    if (i>=text.size() || text[i]!=' ') return false;
+    i++;
+    bytes.push_back((char)value);
+  }
+  return !bytes.empty() && (bytes[0] & 0x80);
+}
+
+// As written by StringFormatter::printEscape
+static std::string unescape(const std::string & text) {
+  std::string out;
+  for (size_t i=0; i<text.size(); i++) {
+    if (text[i]!='\\' || i+1==text.size()) {
+      out.push_back(text[i]);
+      continue;
+    }
+    switch (text[++i]) {
+      case 'n': out.push_back('\n'); break;
+      case 'r': out.push_back('\r'); break;
+      case 't': out.push_back('\t'); break;
+      case '0': out.push_back('\0'); break;
+      default: out.push_back('\\'); out.push_back(text[i]);
+    }
+  }
+  return out;
+}
+
+// <* R +ms source us command *>
+static bool parseRecord(const std::string & line, RECORD & record) {
+  const char * prefix="<* R +";
+  const char * suffix=" *>";
+  size_t end=line.size();
+  while (end && (line[end-1]=='\r' || line[end-1]=='\n')) end--;
+  if (line.compare(0, strlen(prefix), prefix)!=0 || end<strlen(prefix)+strlen(suffix)) return false;
+  if (line.compare(end-strlen(suffix), strlen(suffix), suffix)!=0) return false;
+  const char * p=line.c_str()+strlen(prefix);
+  char * next;
+  record.delta=strtoul(p, &next, 10);
+  if (next==p || *next!=' ') return false;
+  p=next+1;
+  if (*p=='S') {
+    record.source=-1;
+    next=(char *)p+1;
+  }
+  else {
+    record.source=strtol(p, &next, 10);
+    if (next==p || record.source<0 || record.source>255) return false;
+  }
+  if (*next!=' ') return false;
+  p=next+1;
+  record.micros=strtoul(p, &next, 10);
+  if (next==p || strncmp(next, "us ", 3)!=0) return false;
+  size_t start=(next+3)-line.c_str();
+  if (start>end-strlen(suffix)) return false;
+  std::string text=line.substr(start, end-strlen(suffix)-start);
+  if (!unhex(text, record.command)) record.command=unescape(text);
+  return !record.command.empty();
+}
+
+static bool readLog(const char * file, std::vector<RECORD> & records) {
+  FILE * in = strcmp(file, "-") ? fopen(file, "r") : stdin;
+  if (!in) {
+    perror(file);
+    return false;
+  }
+  char buffer[1024];
+  std::string line;
+  RECORD record;
+  while (fgets(buffer, sizeof(buffer), in)) {
+    line+=buffer;
+    if (line.back()!='\n' && !feof(in)) continue;  // longer than the buffer
+    if (parseRecord(line, record)) records.push_back(record);
+    line.clear();
+  }
+  if (in!=stdin) fclose(in);
+  return true;
+}
+
+int hostReplay(int argc, char ** argv) {
+  unsigned long speedup=1;
+  bool quiet=true;
+  int opt;
+  optind=1;
+  while ((opt=getopt(argc, argv, "x:l:v"))!=-1) {
+    switch (opt) {
+      case 'x': speedup=strtoul(optarg, NULL, 10); break;
+      case 'l': hostLoopMicros=strtoul(optarg, NULL, 10); break;
+      case 'v': quiet=false; break;
+      default: return 2;
+    }
+  }
+  if (optind!=argc-1 || speedup==0 || hostLoopMicros==0) return 2;
+  std::vector<RECORD> records;
+  if (!readLog(argv[optind], records)) return 1;
+  if (records.empty()) {
+    fprintf(stderr, "replay: no <* R ... *> records in %s\n", argv[optind]);
+    return 1;
+  }
+
+  Serial.silent=quiet;
+  hostStart();
+  HostNetwork network(WIFI_OUTBOUND_RING);
+  Latencies serialReplies;
+  Latencies serialRecorded;
+  Latencies networkRecorded;
+  // serial commands wait in the receive buffer, done once the sketch has read them
+  struct SERIAL_WAIT { unsigned long long end; unsigned long arrived; };
+  std::deque<SERIAL_WAIT> serialWaits;
+  std::string serialBacklog;
+  unsigned long long serialFed=0;
+
+  unsigned long start=micros();
+  unsigned long long due=0;  // simulated micros after start
+  size_t next=0;
+  while (next<records.size() || !network.idle() || !serialWaits.empty() || !serialBacklog.empty()) {
+    while (next<records.size()) {
+      unsigned long long at=due+records[next].delta*1000ULL/speedup;
+      if (micros()-start < at) break;
+      due=at;
+      RECORD & r=records[next++];
+      if (r.source<0) {
+        serialBacklog+=r.command;
+        serialWaits.push_back({serialFed+serialBacklog.size(), micros()});
+        serialRecorded.add(r.micros);
+      }
+      else {
+        network.arrive(r.source, r.command);
+        networkRecorded.add(r.micros);
+      }
+    }
+    if (!serialBacklog.empty()) {
+      size_t taken=Serial.feed(serialBacklog.data(), serialBacklog.size());
+      serialBacklog.erase(0, taken);
+      serialFed+=taken;
+    }
+    hostStep(&network);
+    while (!serialWaits.empty() && Serial.bytesRead>=serialWaits.front().end) {
+      serialReplies.add(micros()-serialWaits.front().arrived);
+      serialWaits.pop_front();
+    }
+  }
+  fflush(stdout);
+  unsigned long long ran=micros()-start;
+  printf("<* BENCH replay records=%zu speedup=%lu loop=%luus ran=%llums *>\n",
+    records.size(), speedup, hostLoopMicros, ran/1000);
+  serialReplies.report("serial", "arrival to reply");
+  serialRecorded.report("serial", "recorded on board");
+  network.replies.report("network", "arrival to reply");
+  network.handling.report("network", "handled on host");
+  networkRecorded.report("network", "recorded on board");
+  return 0;
+}
+#endif
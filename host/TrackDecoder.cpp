@@ -0,0 +1,101 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(HOST_BUILD)
+#include "TrackDecoder.h"
+
+PACKET_CALLBACK TrackDecoder::onPacket=NULL;
+
+TrackDecoder::TrackDecoder(const char * name, byte pin) : name(name), pin(pin) {}
+
+void TrackDecoder::sample() {
+  bool now=digitalRead(pin);
+  if (now==level) {
+    if (run<255) run++;
+    return;
+  }
+  halfBit(run);
+  level=now;
+  run=1;
+}
+
+void TrackDecoder::halfBit(byte ticks) {
+  if (ticks<1 || ticks>2) {
+    if (state!=PREAMBLE || ones) framing++;
+    pendingHalf=0;
+    state=PREAMBLE;
+    ones=0;
+    return;
+  }
+  if (pendingHalf==0) {
+    pendingHalf=ticks;
+    return;
+  }
+  if (pendingHalf!=ticks) {  // out of step, this half starts the next bit
+    pendingHalf=ticks;
+    return;
+  }
+  pendingHalf=0;
+  bit(ticks==1);
+}
+
+void TrackDecoder::bit(bool one) {
+  switch (state) {
+    case PREAMBLE:
+      if (one) {
+        if (ones<255) ones++;
+      }
+      else {
+        if (ones>=MIN_PREAMBLE) {
+          state=BYTES;
+          length=0;
+          bits=0;
+        }
+        ones=0;
+      }
+      return;
+    case BYTES:
+      if (length==MAX_PACKET) {  // too long for DCC, look for a preamble
+        state=PREAMBLE;
+        return;
+      }
+      packet[length]=(packet[length]<<1) | one;
+      if (++bits<8) return;
+      bits=0;
+      length++;
+      state=SEPARATOR;
+      return;
+    case SEPARATOR:
+      if (!one) {
+        state=BYTES;
+        return;
+      }
+      {
+        byte check=0;
+        for (byte i=0; i<length; i++) check^=packet[i];
+        packets++;
+        if (check) badPackets++;
+        else if (length==3 && packet[0]==0xFF && packet[1]==0x00) idlePackets++;
+        if (onPacket) onPacket(name, micros(), packet, length, check==0);
+      }
+      state=PREAMBLE;
+      ones=1;  // the end bit is the first of the next preamble
+      return;
+  }
+}
+#endif
@@ -0,0 +1,55 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TrackDecoder_h
+#define TrackDecoder_h
+#include <Arduino.h>
+
+// Host build: turns the level of a signal pin, sampled after every 58uS
+// tick, back into DCC packets as a decoder on the track would. A level 
+// held for one tick is half of a 1 bit, two ticks half of a 0 bit. Any
+// longer (power off, a cutout) starts the search for a preamble again.
+
+typedef void (*PACKET_CALLBACK)(const char * track, unsigned long micros, const byte packet[], byte length, bool checksumOK);
+
+class TrackDecoder {
+  public:
+    TrackDecoder(const char * name, byte pin);
+    void sample();
+    static PACKET_CALLBACK onPacket;  // NULL for counting only
+    const char * name;
+    unsigned long packets=0;
+    unsigned long idlePackets=0;
+    unsigned long badPackets=0;   // wrong checksum
+    unsigned long framing=0;      // half bits of a length no bit has
+  private:
+    static const byte MIN_PREAMBLE=10;
+    static const byte MAX_PACKET=8;
+    void halfBit(byte ticks);
+    void bit(bool one);
+    byte pin;
+    bool level=false;
+    byte run=0;          // ticks at the current level
+    byte pendingHalf=0;  // length of the first half of a bit, 0 if none
+    enum : byte { PREAMBLE, BYTES, SEPARATOR } state=PREAMBLE;
+    byte ones=0;
+    byte bits=0;
+    byte length=0;
+    byte packet[MAX_PACKET];
+};
+#endif
@@ -0,0 +1,39 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef TwoWire_h
+#define TwoWire_h
+// Host build: an I2C bus with nothing on it, every transmission is 
+// answered with a NACK on the address (status 2)
+#include <Arduino.h>
+
+class TwoWire : public Stream {
+  public:
+    void begin() {}
+    void setClock(uint32_t speed) { (void)speed; }
+    void beginTransmission(uint8_t address) { (void)address; }
+    uint8_t endTransmission(bool stop=true) { (void)stop; return 2; }
+    uint8_t requestFrom(uint8_t address, uint8_t quantity, uint8_t stop=1) { (void)address; (void)quantity; (void)stop; return 0; }
+    size_t write(uint8_t b) { (void)b; return 1; }
+    using Print::write;
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+};
+extern TwoWire Wire;
+#endif
@@ -0,0 +1,39 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef pgmspace_h
+#define pgmspace_h
+// Host build: flash is ordinary memory
+#include <string.h>
+#include <stdint.h>
+#define PROGMEM
+#define PSTR(s) (s)
+// Copied rather than read through a cast pointer, which breaks the
+// aliasing rules for a word and lets g++ check the bounds of the table
+inline uint8_t hostReadByte(const void * address) { uint8_t value; memcpy(&value, address, sizeof(value)); return value; }
+inline uint16_t hostReadWord(const void * address) { uint16_t value; memcpy(&value, address, sizeof(value)); return value; }
+#define pgm_read_byte(a) hostReadByte((const void *)(a))
+#define pgm_read_word(a) hostReadWord((const void *)(a))
+#define pgm_read_byte_near(a) pgm_read_byte(a)
+#define pgm_read_word_near(a) pgm_read_word(a)
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+#endif
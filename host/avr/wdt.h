@@ -0,0 +1,32 @@
+/*
+ *  © 2021, DCC-EX contributors. All rights reserved.
+ *
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef wdt_h
+#define wdt_h
+// Host build: <D RESET> ends the simulation, the harness may start again
+#include <stdio.h>
+#include <stdlib.h>
+#define WDTO_15MS 0
+inline void wdt_enable(int timeout) {
+  (void)timeout;
+  fflush(stdout);
+  exit(0);
+}
+inline void wdt_reset() {}
+inline void wdt_disable() {}
+#endif
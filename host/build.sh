@@ -0,0 +1,24 @@
+#!/bin/bash
+#
+#  © 2021, DCC-EX contributors. All rights reserved.
+#
+#  This file is part of CommandStation-EX, GPL v3 or later, see LICENSE.
+#
+# Host (x86/Linux) build of the command station with the mock Arduino
+# core in this directory, for measuring and checking the logic without a
+# board. The DCC timer runs in simulated time and the signal pins of
+# both tracks are decoded back into packets.
+#
+#   host/build.sh                 builds host/dccex-host
+#   host/dccex-host -p -c '<1><t 1 3 50 1>'
+#   host/dccex-host bench -n 8    see host/HostBench.cpp
+#   host/dccex-host replay LOG    see host/HostReplay.cpp
+#
+# Wifi needs the second serial port of a board and is left out. Extra
+# arguments are passed to g++, e.g. host/build.sh -DISR_TIMING, or
+# -DCORE_SPLIT to run the dual core loops one after the other.
+
+cd "$(dirname "$0")/.." || exit 1
+SOURCES=$(ls *.cpp host/*.cpp | grep -v -e '^WifiInterface.cpp$' -e '^WifiInboundHandler.cpp$')
+exec g++ -std=gnu++17 -O2 -g -Wall -Wno-unused-parameter -DHOST_BUILD -Ihost -I. "$@" \
+  $SOURCES -o host/dccex-host